@@ -0,0 +1,338 @@
+/*
+ASYNCIO.CPP
+NICK WILSON
+2019
+*/
+
+#include "AsyncIo.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define ASYNCIO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+/* I/O threads for BACKEND_THREADS, more than this only queue up on the disk */
+static const unsigned IO_THREADS_MAX = 4;
+
+/* One attempt at a positioned request, retrying only on signals */
+static int64_t transfer(bool write, int fd, const struct iovec *iov, int count, uint64_t offset) {
+	ssize_t n;
+
+	do {
+		n = write ? pwritev(fd, iov, count, offset) : preadv(fd, iov, count, offset);
+	} while (n < 0 && errno == EINTR);
+
+	return (n < 0) ? -errno : n;
+}
+
+/* Backends */
+
+/* Each request is carried out as it is made */
+class SyncIo : public AsyncIo{
+private:
+	std::deque<std::pair<uint64_t, int64_t>> results;
+
+public:
+	bool read(int fd, const struct iovec *iov, int count, uint64_t offset, uint64_t tag) override {
+		results.emplace_back(tag, transfer(false, fd, iov, count, offset));
+		return true;
+	}
+
+	bool write(int fd, const struct iovec *iov, int count, uint64_t offset, uint64_t tag) override {
+		results.emplace_back(tag, transfer(true, fd, iov, count, offset));
+		return true;
+	}
+
+	bool complete(uint64_t &tag, int64_t &result, bool wait) override {
+		if (results.empty()) return false;
+
+		tag = results.front().first;
+		result = results.front().second;
+		results.pop_front();
+		return true;
+	}
+};
+
+/* Requests are queued for a few threads making ordinary blocking calls */
+class ThreadedIo : public AsyncIo{
+private:
+	struct Request {
+		bool write;
+		int fd;
+		const struct iovec *iov;
+		int count;
+		uint64_t offset;
+		uint64_t tag;
+	};
+
+	std::mutex lock;
+	std::condition_variable work;
+	std::condition_variable done;
+	std::deque<Request> requests;
+	std::deque<std::pair<uint64_t, int64_t>> results;
+	bool stopping = false;
+	std::vector<std::thread> threads;
+
+	void worker() {
+		std::unique_lock<std::mutex> guard(lock);
+
+		for (;;) {
+			work.wait(guard, [this] { return stopping || !requests.empty(); });
+			if (requests.empty()) return;
+
+			Request request = requests.front();
+			requests.pop_front();
+
+			guard.unlock();
+			int64_t result = transfer(request.write, request.fd, request.iov, request.count, request.offset);
+			guard.lock();
+
+			results.emplace_back(request.tag, result);
+			done.notify_one();
+		}
+	}
+
+	bool queue(const Request &request) {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			requests.push_back(request);
+		}
+		work.notify_one();
+		return true;
+	}
+
+public:
+	explicit ThreadedIo(unsigned depth) {
+		unsigned count = (depth < IO_THREADS_MAX) ? depth : IO_THREADS_MAX;
+		if (!count) count = 1;
+
+		for (unsigned i = 0; i < count; i++) threads.emplace_back(&ThreadedIo::worker, this);
+	}
+
+	~ThreadedIo() {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stopping = true;
+		}
+		work.notify_all();
+		for (std::thread &t : threads) t.join();
+	}
+
+	bool read(int fd, const struct iovec *iov, int count, uint64_t offset, uint64_t tag) override {
+		return queue({false, fd, iov, count, offset, tag});
+	}
+
+	bool write(int fd, const struct iovec *iov, int count, uint64_t offset, uint64_t tag) override {
+		return queue({true, fd, iov, count, offset, tag});
+	}
+
+	bool complete(uint64_t &tag, int64_t &result, bool wait) override {
+		std::unique_lock<std::mutex> guard(lock);
+
+		if (wait) done.wait(guard, [this] { return !results.empty(); });
+		if (results.empty()) return false;
+
+		tag = results.front().first;
+		result = results.front().second;
+		results.pop_front();
+		return true;
+	}
+};
+
+#ifdef ASYNCIO_URING
+/* io_uring through the raw system calls, so there is no liburing dependency */
+class UringIo : public AsyncIo{
+private:
+	int ring_fd = -1;
+
+	void *sq_ptr = MAP_FAILED;
+	void *cq_ptr = MAP_FAILED;
+	size_t sq_size = 0;
+	size_t cq_size = 0;
+	struct io_uring_sqe *sqes = static_cast<struct io_uring_sqe *>(MAP_FAILED);
+	size_t sqes_size = 0;
+
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_entries, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/* Queued in the ring but not yet passed to the kernel */
+	unsigned unsubmitted = 0;
+
+	int enter(unsigned submit, unsigned wait_for) {
+		long n;
+
+		do {
+			n = syscall(__NR_io_uring_enter, ring_fd, submit, wait_for, wait_for ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+		} while (n < 0 && errno == EINTR);
+
+		if (n < 0) return -errno;
+
+		unsubmitted -= (n < (long) unsubmitted) ? n : unsubmitted;
+		return 0;
+	}
+
+	bool queue(uint8_t opcode, int fd, const struct iovec *iov, int count, uint64_t offset, uint64_t tag) {
+		unsigned tail = *sq_tail;
+
+		/* Ring is full, hand what's there to the kernel first */
+		if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= *sq_entries) {
+			if (enter(unsubmitted, 0) < 0) return false;
+			if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= *sq_entries) return false;
+		}
+
+		unsigned index = tail & *sq_mask;
+		struct io_uring_sqe *sqe = &sqes[index];
+
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = opcode;
+		sqe->fd = fd;
+		sqe->addr = reinterpret_cast<uint64_t>(iov);
+		sqe->len = count;
+		sqe->off = offset;
+		sqe->user_data = tag;
+
+		sq_array[index] = index;
+		__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+		unsubmitted++;
+
+		return true;
+	}
+
+public:
+	bool setup(unsigned depth) {
+		struct io_uring_params params;
+		memset(&params, 0, sizeof(params));
+
+		ring_fd = syscall(__NR_io_uring_setup, depth ? depth : 1, &params);
+		if (ring_fd < 0) return false;
+
+		sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+		/* Newer kernels map both rings at once */
+		bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+		if (single_mmap) {
+			if (cq_size > sq_size) sq_size = cq_size;
+			cq_size = sq_size;
+		}
+
+		sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+		if (sq_ptr == MAP_FAILED) return false;
+
+		cq_ptr = single_mmap ? sq_ptr : mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+		if (cq_ptr == MAP_FAILED) return false;
+
+		sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+		sqes = static_cast<struct io_uring_sqe *>(mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES));
+		if (sqes == MAP_FAILED) return false;
+
+		uint8_t *sq = static_cast<uint8_t *>(sq_ptr);
+		sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+		sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+		sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+		sq_entries = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_entries);
+		sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+
+		uint8_t *cq = static_cast<uint8_t *>(cq_ptr);
+		cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+		cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+		cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+		cqes = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+
+		return true;
+	}
+
+	~UringIo() {
+		if (sqes != MAP_FAILED) munmap(sqes, sqes_size);
+		if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) munmap(cq_ptr, cq_size);
+		if (sq_ptr != MAP_FAILED) munmap(sq_ptr, sq_size);
+		if (ring_fd >= 0) close(ring_fd);
+	}
+
+	bool read(int fd, const struct iovec *iov, int count, uint64_t offset, uint64_t tag) override {
+		return queue(IORING_OP_READV, fd, iov, count, offset, tag);
+	}
+
+	bool write(int fd, const struct iovec *iov, int count, uint64_t offset, uint64_t tag) override {
+		return queue(IORING_OP_WRITEV, fd, iov, count, offset, tag);
+	}
+
+	bool complete(uint64_t &tag, int64_t &result, bool wait) override {
+		for (;;) {
+			unsigned head = *cq_head;
+
+			if (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+				struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+				tag = cqe->user_data;
+				result = cqe->res;
+				__atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+				return true;
+			}
+
+			if (!wait && !unsubmitted) return false;
+
+			/* Submit anything queued, and sleep for a completion if asked to */
+			if (enter(unsubmitted, wait ? 1 : 0) < 0) return false;
+			if (!wait && head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) return false;
+		}
+	}
+};
+#endif
+
+/* Public */
+std::unique_ptr<AsyncIo> AsyncIo::create(Backend backend, unsigned depth) {
+	if (backend == BACKEND_SYNC) return std::unique_ptr<AsyncIo>(new SyncIo);
+
+#ifdef ASYNCIO_URING
+	if (backend == BACKEND_URING) {
+		std::unique_ptr<UringIo> uring(new UringIo);
+		if (uring->setup(depth)) return std::move(uring);
+	}
+#endif
+
+	return std::unique_ptr<AsyncIo>(new ThreadedIo(depth));
+}
+
+bool AsyncIo::available(Backend backend) {
+	switch (backend) {
+		case BACKEND_SYNC:
+		case BACKEND_THREADS:
+			return true;
+#ifdef ASYNCIO_URING
+		case BACKEND_URING: {
+			/* Kernels can lack io_uring, or have it switched off */
+			static const bool works = UringIo().setup(1);
+			return works;
+		}
+#endif
+		default:
+			return false;
+	}
+}
+
+const char *AsyncIo::backend_name(Backend backend) {
+	switch (backend) {
+		case BACKEND_SYNC: return "sync";
+		case BACKEND_THREADS: return "threads";
+		case BACKEND_URING: return "uring";
+		default: return "unknown";
+	}
+}
+
+AsyncIo::Backend AsyncIo::preferred() {
+	return available(BACKEND_URING) ? BACKEND_URING : BACKEND_THREADS;
+}
@@ -0,0 +1,48 @@
+/*
+ASYNCIO.HPP
+NICK WILSON
+2019
+*/
+
+#ifndef OBJ_ASYNCIO
+#define OBJ_ASYNCIO
+
+#include <memory>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/* Positioned reads and writes that complete in the background */
+/* Requests may complete in any order and may be short, the caller resubmits the rest */
+class AsyncIo{
+public:
+	enum Backend {
+		BACKEND_SYNC = 0,	/* Done on the calling thread as each request is made */
+		BACKEND_THREADS,	/* Handed to a few blocking I/O threads */
+		BACKEND_URING,		/* Linux io_uring */
+		BACKEND_COUNT
+	};
+
+	virtual ~AsyncIo() {}
+
+	/* The iovecs and their buffers must stay valid until the request completes */
+	virtual bool read(int fd, const struct iovec *iov, int count, uint64_t offset, uint64_t tag) = 0;
+	virtual bool write(int fd, const struct iovec *iov, int count, uint64_t offset, uint64_t tag) = 0;
+
+	/* Next completion, giving bytes transferred or -errno as the result */
+	/* Without wait, returns false if nothing has completed yet */
+	virtual bool complete(uint64_t &tag, int64_t &result, bool wait) = 0;
+
+	/* Falls back to BACKEND_THREADS if the backend can't be set up */
+	/* depth is the most requests that will be outstanding at once */
+	static std::unique_ptr<AsyncIo> create(Backend backend, unsigned depth);
+
+	static bool available(Backend backend);
+	static const char *backend_name(Backend backend);
+
+	/* Best backend this kernel supports */
+	static Backend preferred();
+};
+
+#endif
@@ -0,0 +1,112 @@
+/*
+BLOCKHASH.CPP
+NICK WILSON
+2019
+*/
+
+#include "BlockHash.hpp"
+
+#include <string.h>
+
+static inline uint64_t load64_le(const uint8_t *p) {
+	uint64_t x;
+	memcpy(&x, p, sizeof(uint64_t));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	x = __builtin_bswap64(x);
+#endif
+	return x;
+}
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k) {
+	k ^= k >> 33;
+	k *= 0xFF51AFD7ED558CCDULL;
+	k ^= k >> 33;
+	k *= 0xC4CEB9FE1A85EC53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+static BlockHash::Digest murmur3_128(const uint8_t *data, size_t length) {
+	const uint64_t c1 = 0x87C37B91114253D5ULL;
+	const uint64_t c2 = 0x4CF5AD432745937FULL;
+	uint64_t h1 = 0;
+	uint64_t h2 = 0;
+
+	/* Body, 16 bytes at a time */
+	size_t blocks = length / 16;
+	for (size_t i = 0; i < blocks; i++) {
+		uint64_t k1 = load64_le(data + i * 16);
+		uint64_t k2 = load64_le(data + i * 16 + 8);
+
+		k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+		h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52DCE729;
+
+		k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+		h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495AB5;
+	}
+
+	/* Tail, up to 15 bytes */
+	const uint8_t *tail = data + blocks * 16;
+	uint64_t k1 = 0;
+	uint64_t k2 = 0;
+
+	switch (length & 15) {
+		case 15: k2 ^= (uint64_t) tail[14] << 48;
+		case 14: k2 ^= (uint64_t) tail[13] << 40;
+		case 13: k2 ^= (uint64_t) tail[12] << 32;
+		case 12: k2 ^= (uint64_t) tail[11] << 24;
+		case 11: k2 ^= (uint64_t) tail[10] << 16;
+		case 10: k2 ^= (uint64_t) tail[9] << 8;
+		case 9:  k2 ^= (uint64_t) tail[8];
+			k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+		case 8:  k1 ^= (uint64_t) tail[7] << 56;
+		case 7:  k1 ^= (uint64_t) tail[6] << 48;
+		case 6:  k1 ^= (uint64_t) tail[5] << 40;
+		case 5:  k1 ^= (uint64_t) tail[4] << 32;
+		case 4:  k1 ^= (uint64_t) tail[3] << 24;
+		case 3:  k1 ^= (uint64_t) tail[2] << 16;
+		case 2:  k1 ^= (uint64_t) tail[1] << 8;
+		case 1:  k1 ^= (uint64_t) tail[0];
+			k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+	}
+
+	/* Finalisation */
+	h1 ^= length;
+	h2 ^= length;
+
+	h1 += h2;
+	h2 += h1;
+
+	h1 = fmix64(h1);
+	h2 = fmix64(h2);
+
+	h1 += h2;
+	h2 += h1;
+
+	BlockHash::Digest digest;
+	digest.low = h1;
+	digest.high = h2;
+	return digest;
+}
+
+/* Public */
+BlockHash::Digest BlockHash::hash(Type type, const uint8_t *data, size_t length) {
+	switch (type) {
+		case HASH_MURMUR3_128:
+			return murmur3_128(data, length);
+		default:
+			return Digest();
+	}
+}
+
+const char *BlockHash::name(Type type) {
+	switch (type) {
+		case HASH_NONE: return "none";
+		case HASH_MURMUR3_128: return "murmur3-128";
+		default: return "unknown";
+	}
+}
@@ -0,0 +1,36 @@
+/*
+BLOCKHASH.HPP
+NICK WILSON
+2019
+*/
+
+#ifndef OBJ_BLOCKHASH
+#define OBJ_BLOCKHASH
+
+#include <cstddef>
+#include <cstdint>
+
+/* Content hashes of payload blocks, to tell which changed between versions */
+/* Not cryptographic: they find identical blocks, CRCs still guard against damage */
+class BlockHash{
+public:
+	enum Type {
+		HASH_NONE = 0,
+		HASH_MURMUR3_128,	/* MurmurHash3, x64 128 bit variant, seed 0 */
+		HASH_COUNT
+	};
+
+	struct Digest {
+		uint64_t low = 0;
+		uint64_t high = 0;
+
+		bool operator==(const Digest &other) const { return low == other.low && high == other.high; }
+		bool operator!=(const Digest &other) const { return !(*this == other); }
+	};
+
+	static Digest hash(Type type, const uint8_t *data, size_t length);
+
+	static const char *name(Type type);
+};
+
+#endif
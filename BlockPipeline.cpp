@@ -0,0 +1,231 @@
+/*
+BLOCKPIPELINE.CPP
+NICK WILSON
+2019
+*/
+
+#include "BlockPipeline.hpp"
+#include "Stats.hpp"
+
+#include <algorithm>
+#include <memory>
+
+enum SlotState {
+	SLOT_FREE = 0,
+	SLOT_READING,
+	SLOT_READY,
+	SLOT_WRITING
+};
+
+struct Slot {
+	PipelineBlock block;
+	SlotState state = SLOT_FREE;
+
+	/* What is left of the current request */
+	struct iovec iov[3];
+	int iov_count = 0;
+	uint64_t offset = 0;
+	uint64_t remaining = 0;
+};
+
+/* Step past n bytes of a partly completed request */
+static void advance(Slot &slot, uint64_t n) {
+	slot.offset += n;
+	slot.remaining -= n;
+
+	int i = 0;
+	while (i < slot.iov_count && n >= slot.iov[i].iov_len) n -= slot.iov[i++].iov_len;
+
+	/* Drop finished buffers, and trim the one it stopped partway into */
+	std::copy(slot.iov + i, slot.iov + slot.iov_count, slot.iov);
+	slot.iov_count -= i;
+	if (slot.iov_count) {
+		slot.iov[0].iov_base = static_cast<uint8_t *>(slot.iov[0].iov_base) + n;
+		slot.iov[0].iov_len -= n;
+	}
+}
+
+BlockPipeline::BlockPipeline(AsyncIo::Backend backend, unsigned depth, ThreadPool &pool) : backend(backend), depth(depth ? depth : 1), pool(pool) {}
+
+bool BlockPipeline::run(int in_fd, int out_fd, size_t count, const Setup &setup, const Process &process, const Failure &failure, std::string &error) {
+	std::unique_ptr<AsyncIo> io = AsyncIo::create(backend, depth);
+	std::vector<Slot> slots(depth);
+	std::vector<size_t> ready;
+	std::vector<size_t> waiting;
+	size_t next = 0;
+	size_t placed = 0;
+	size_t finished = 0;
+	size_t outstanding = 0;
+	bool failed = false;
+
+	auto fail = [&](const std::string &message) {
+		if (!failed) error = message;
+		failed = true;
+	};
+
+	auto submit = [&](size_t s) {
+		Slot &slot = slots[s];
+
+		/* The sync backend does the whole request here, the others only queue it */
+		Stats::Scope timing((slot.state == SLOT_READING) ? Stats::PHASE_READ : Stats::PHASE_WRITE);
+		bool ok = (slot.state == SLOT_READING)
+			? io->read(in_fd, slot.iov, slot.iov_count, slot.offset, s)
+			: io->write(out_fd, slot.iov, slot.iov_count, slot.offset, s);
+
+		if (ok) outstanding++;
+		else fail((slot.state == SLOT_READING) ? read_error : write_error);
+	};
+
+	auto start_read = [&](size_t s) {
+		Slot &slot = slots[s];
+		PipelineBlock &block = slot.block;
+
+		block.index = next++;
+		block.head_length = 0;
+		block.tail_length = 0;
+		setup(block);
+
+		/* Buffers are counted as part of reading the payload */
+		{
+			Stats::Scope timing(Stats::PHASE_READ);
+			block.data.resize(block.read_length);
+		}
+
+		slot.iov[0] = {block.data.data(), block.read_length};
+		slot.iov_count = 1;
+		slot.offset = block.read_offset;
+		slot.remaining = block.read_length;
+		slot.state = SLOT_READING;
+
+		if (slot.remaining) {
+			submit(s);
+		}
+		else {
+			slot.state = SLOT_READY;
+			ready.push_back(s);
+		}
+	};
+
+	auto start_write = [&](size_t s) {
+		Slot &slot = slots[s];
+		PipelineBlock &block = slot.block;
+
+		slot.iov_count = 0;
+		if (block.head_length) slot.iov[slot.iov_count++] = {block.head, block.head_length};
+		if (block.write_length) slot.iov[slot.iov_count++] = {block.data.data(), block.write_length};
+		if (block.tail_length) slot.iov[slot.iov_count++] = {block.tail, block.tail_length};
+
+		slot.offset = block.write_offset;
+		slot.remaining = (uint64_t) block.head_length + block.write_length + block.tail_length;
+		slot.state = SLOT_WRITING;
+
+		if (slot.remaining) {
+			submit(s);
+		}
+		else {
+			slot.state = SLOT_FREE;
+			finished++;
+		}
+	};
+
+	/* Short requests are resubmitted for the rest */
+	auto completed = [&](size_t s, int64_t result) {
+		Slot &slot = slots[s];
+		bool reading = slot.state == SLOT_READING;
+
+		outstanding--;
+		if (failed) return;
+
+		if (result <= 0) {
+			fail(reading ? read_error : write_error);
+			return;
+		}
+
+		Stats::count(reading ? Stats::PHASE_READ : Stats::PHASE_WRITE, result);
+		advance(slot, result);
+
+		if (slot.remaining) {
+			submit(s);
+		}
+		else if (reading) {
+			slot.state = SLOT_READY;
+			ready.push_back(s);
+		}
+		else {
+			slot.state = SLOT_FREE;
+			finished++;
+		}
+	};
+
+	while (!failed && finished < count) {
+		for (size_t s = 0; s < slots.size() && next < count && !failed; s++) {
+			if (slots[s].state == SLOT_FREE) start_read(s);
+		}
+
+		/* Sleep only when there is nothing to process */
+		uint64_t tag;
+		int64_t result;
+		bool wait = ready.empty();
+
+		while (outstanding) {
+			/* Time spent blocked goes to whichever kind of request woke it */
+			{
+				Stats::Scope timing(Stats::PHASE_READ);
+				if (!io->complete(tag, result, wait)) break;
+				if (slots[tag].state == SLOT_WRITING) timing.move_to(Stats::PHASE_WRITE);
+			}
+
+			completed(tag, result);
+			wait = false;
+		}
+
+		if (failed || ready.empty()) continue;
+
+		/* Blocks are processed while the others' reads and writes carry on */
+		std::vector<uint8_t> ok(ready.size());
+		pool.parallel_for(ready.size(), [&](size_t i) {
+			ok[i] = process(slots[ready[i]].block);
+		});
+
+		/* Report the earliest failing block, whichever order they arrived in */
+		size_t first_failure = ready.size();
+		for (size_t i = 0; i < ready.size(); i++) {
+			if (!ok[i] && (first_failure == ready.size() || slots[ready[i]].block.index < slots[ready[first_failure]].block.index)) first_failure = i;
+		}
+
+		if (first_failure != ready.size()) {
+			fail(failure(slots[ready[first_failure]].block));
+		}
+		else if (!place) {
+			for (size_t s : ready) start_write(s);
+		}
+		else {
+			/* Blocks are read in order, so the next one to place is always in a slot */
+			waiting.insert(waiting.end(), ready.begin(), ready.end());
+
+			auto it = waiting.begin();
+			while (it != waiting.end()) {
+				if (slots[*it].block.index != placed) {
+					it++;
+					continue;
+				}
+
+				place(slots[*it].block);
+				start_write(*it);
+				placed++;
+
+				waiting.erase(it);
+				it = waiting.begin();
+			}
+		}
+
+		ready.clear();
+	}
+
+	/* Buffers can't be freed while the kernel may still be using them */
+	uint64_t tag;
+	int64_t result;
+	while (outstanding && io->complete(tag, result, true)) outstanding--;
+
+	return !failed;
+}
@@ -0,0 +1,75 @@
+/*
+BLOCKPIPELINE.HPP
+NICK WILSON
+2019
+*/
+
+#ifndef OBJ_BLOCKPIPELINE
+#define OBJ_BLOCKPIPELINE
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "AsyncIo.hpp"
+#include "ThreadPool.hpp"
+
+/* One block moving through the pipeline */
+/* Written out as head, then the first write_length bytes of data, then tail */
+struct PipelineBlock {
+	size_t index = 0;
+
+	uint64_t read_offset = 0;
+	uint32_t read_length = 0;
+	std::vector<uint8_t> data;
+
+	uint64_t write_offset = 0;
+	uint32_t write_length = 0;
+	uint8_t head[8];
+	uint8_t head_length = 0;
+	uint8_t tail[4];
+	uint8_t tail_length = 0;
+};
+
+/* Reads blocks, processes them on the thread pool and writes them back out, */
+/* keeping depth blocks in flight so reading block N + 1, processing block N */
+/* and writing block N - 1 all overlap. Every offset is explicit, so blocks */
+/* may finish in any order */
+class BlockPipeline{
+public:
+	/* Fill in index, read_offset, read_length and write_offset for block index */
+	typedef std::function<void(PipelineBlock &block)> Setup;
+
+	/* Fill in what to write once data holds read_length bytes, false to fail */
+	/* Runs on the thread pool, several blocks at a time */
+	typedef std::function<bool(PipelineBlock &block)> Process;
+
+	/* Message for a block that failed to process */
+	typedef std::function<std::string(const PipelineBlock &block)> Failure;
+
+	/* Fill in write_offset once every earlier block has been placed */
+	typedef std::function<void(PipelineBlock &block)> Place;
+
+	/* Reported when a read or write fails or runs short */
+	std::string read_error = "Could not read input file!";
+	std::string write_error = "Could not write output file!";
+
+	/* Optional, for output whose layout depends on processed sizes */
+	/* Processed blocks then wait for the ones before them ahead of being written */
+	Place place;
+
+	BlockPipeline(AsyncIo::Backend backend, unsigned depth, ThreadPool &pool);
+
+	bool run(int in_fd, int out_fd, size_t count, const Setup &setup, const Process &process, const Failure &failure, std::string &error);
+
+private:
+	AsyncIo::Backend backend;
+	unsigned depth;
+	ThreadPool &pool;
+};
+
+#endif
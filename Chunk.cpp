@@ -5,47 +5,15 @@ NICK WILSON
 */
 
 #include "Chunk.hpp"
+#include "Crc32.hpp"
+#include "FileCopy.hpp"
+#include "Stats.hpp"
 
 /* Private */
-/* CRC code adapted from reference CRC implementation */
-/* See: https://tools.ietf.org/html/rfc2083#section-15 */
-void Chunk::make_crc_table() {
-	uint64_t c;
-
-	for (uint64_t n = 0; n < 256; n++) {
-		c = n;
-		for (uint8_t k = 0; k < 8; k++) {
-			if (c & 1)
-				c = 0xedb88320L ^ (c >> 1);
-			else
-				c = c >> 1;
-		}
-		crc_table[n] = c;
-	}
-	crc_table_computed = true;
-}
-
-uint64_t Chunk::update_crc(uint64_t crc, uint8_t *buf, uint32_t len) {
-	uint64_t c = crc;
-	if (! crc_table_computed) make_crc_table();
-	for (uint32_t n = 0; n < len; n++) c = crc_table[(c ^ buf[n]) & 0xff] ^ (c >> 8);
-	return c;
-}
-
-uint64_t Chunk::calc_crc(uint8_t *buf, uint32_t len) {
-	return update_crc(0xffffffffL, buf, len) ^ 0xffffffffL;
-}
-
-uint64_t Chunk::get_crc() {
-	/* Problem: CRC runs over TYPE which is not present in my data vector */
-	/* Solution: Append a copy of the vector data to a new vector starting with TYPE */
-	std::vector<uint8_t> data_temp;
-	data_temp.resize(sizeof(uint32_t) + data.size());
-	/* Copy TYPE over */
-	memcpy(data_temp.data(), &type, sizeof(uint32_t));
-	/* Copy data over */
-	memcpy(data_temp.data() + sizeof(uint32_t), data.data(), data.size());
-	return calc_crc(data_temp.data(), data_temp.size());
+uint32_t Chunk::get_crc() {
+	/* CRC runs over TYPE followed by DATA, which the engine can take in two steps */
+	uint32_t c = Crc32::update(0, reinterpret_cast<const uint8_t *>(&type), sizeof(uint32_t));
+	return Crc32::update(c, data.data(), data.size());
 }
 
 /* Public */
@@ -53,14 +21,14 @@ uint64_t Chunk::get_crc() {
 Chunk::Chunk(uint32_t length, uint32_t type, std::vector<uint8_t> data, uint32_t crc) {
 	this->length = length;
 	this->type = type;
-	this->data = data;
+	this->data = std::move(data);
 	this->crc = crc;
 }
 
 Chunk::Chunk(uint32_t length, uint32_t type, std::vector<uint8_t> data) {
 	this->length = length;
 	this->type = type;
-	this->data = data;
+	this->data = std::move(data);
 	this->crc = get_crc();
 }
 
@@ -68,16 +36,28 @@ Chunk::~Chunk() {
 	//nothing to do here yet
 }
 
-std::vector<uint8_t> Chunk::pack() {
+/* Write out directly, without building a packed copy */
+void Chunk::write(std::ostream &output) {
+	Stats::Scope timing(Stats::PHASE_WRITE, 3 * sizeof(uint32_t) + data.size());
+
 	uint32_t l = htonl(data.size());
 	uint32_t c = htonl(crc);
-	std::vector<uint8_t> data_temp;
-	data_temp.resize(sizeof(uint32_t) + sizeof(uint32_t) + data.size() + sizeof(uint32_t));
-	memcpy(data_temp.data(), &l, sizeof(uint32_t));
-	memcpy(data_temp.data() + sizeof(uint32_t), &type, sizeof(uint32_t));
-	memcpy(data_temp.data() + 2 * sizeof(uint32_t), data.data(), data.size());
-	memcpy(data_temp.data() + 2 * sizeof(uint32_t) + data.size(), &c, sizeof(uint32_t));
-	return data_temp;
+	output.write(reinterpret_cast<const char *>(&l), sizeof(uint32_t));
+	output.write(reinterpret_cast<const char *>(&type), sizeof(uint32_t));
+	output.write(reinterpret_cast<const char *>(data.data()), data.size());
+	output.write(reinterpret_cast<const char *>(&c), sizeof(uint32_t));
+}
+
+/* Write out with a single gathered write, straight from where each part is held */
+bool Chunk::write(int fd) {
+	uint32_t header[2] = {htonl(data.size()), type};
+	uint32_t c = htonl(crc);
+	struct iovec iov[3] = {
+		{header, sizeof(header)},
+		{data.data(), data.size()},
+		{&c, sizeof(uint32_t)}
+	};
+	return write_all(fd, iov, 3);
 }
 
 /* Force the stored CRC to be recalculated */
@@ -87,6 +67,7 @@ void Chunk::force_crc_update() {
 
 /* Validate CRC */
 bool Chunk::validate() {
+	Stats::Scope timing(Stats::PHASE_VALIDATE, data.size());
 	return crc == get_crc();
 }
 
@@ -10,19 +10,14 @@ NICK WILSON
 #include <string>
 #include <cmath>
 #include <vector>
+#include <ostream>
 
 #include <string.h>
 #include <arpa/inet.h>
 
 class Chunk{
 private:
-	uint64_t crc_table[256];
-	bool crc_table_computed = false;
-
-	void make_crc_table();
-	uint64_t update_crc(uint64_t crc, uint8_t *buf, uint32_t len);
-	uint64_t calc_crc(uint8_t *buf, uint32_t len);
-	uint64_t get_crc();
+	uint32_t get_crc();
 
 public:
 
@@ -36,7 +31,14 @@ public:
 	Chunk(uint32_t length, uint32_t type, std::vector<uint8_t> data);
 	~Chunk();
 
-	std::vector<uint8_t> pack();
+	/* Chunks own their data, so they are moved rather than copied */
+	Chunk(const Chunk &) = delete;
+	Chunk &operator=(const Chunk &) = delete;
+	Chunk(Chunk &&) = default;
+	Chunk &operator=(Chunk &&) = default;
+
+	void write(std::ostream &output);
+	bool write(int fd);
 
 	void force_crc_update();
 	bool validate();
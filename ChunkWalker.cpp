@@ -0,0 +1,145 @@
+/*
+CHUNKWALKER.CPP
+NICK WILSON
+2019
+*/
+
+#include "ChunkWalker.hpp"
+#include "PngPack.hpp"
+#include "Stats.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <errno.h>
+
+/* PNGs MUST have this as their leading bytes by RFC 2083 */
+static const uint8_t SIGNATURE[] = {0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A};
+
+static const uint32_t TYPE_END = as_type("IEND");
+
+ChunkWalker::~ChunkWalker() {
+	close();
+}
+
+bool ChunkWalker::open(const std::string &filename) {
+	Stats::Scope timing(Stats::PHASE_OPEN);
+	struct stat st;
+
+	close();
+
+	fd = ::open(filename.c_str(), O_RDONLY);
+	if (fd < 0) return false;
+
+	if (fstat(fd, &st)) {
+		close();
+		return false;
+	}
+
+	file_size = st.st_size;
+
+#ifdef POSIX_FADV_RANDOM
+	/* Readahead would pull in the chunk data we are trying to skip */
+	posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+#endif
+
+	return true;
+}
+
+void ChunkWalker::close() {
+	if (fd >= 0) ::close(fd);
+	fd = -1;
+	file_size = 0;
+	pos = 0;
+	overrun = false;
+	ended = false;
+	window_pos = 0;
+	window_len = 0;
+}
+
+bool ChunkWalker::check_signature() {
+	Stats::Scope timing(Stats::PHASE_SIGNATURE, sizeof(SIGNATURE));
+	const uint8_t *signature = peek(0, sizeof(SIGNATURE));
+
+	if (!signature || memcmp(signature, SIGNATURE, sizeof(SIGNATURE))) return false;
+
+	pos = sizeof(SIGNATURE);
+	overrun = false;
+	ended = false;
+	return true;
+}
+
+bool ChunkWalker::next(ChunkHeader &header) {
+	const uint8_t *raw;
+	uint32_t length;
+
+	if (ended || pos >= file_size) return false;
+
+	Stats::Scope timing(Stats::PHASE_PARSE);
+
+	/* LENGTH, TYPE and CRC must all fit */
+	if (pos + 3 * sizeof(uint32_t) > file_size || !(raw = peek(pos, 2 * sizeof(uint32_t)))) {
+		overrun = true;
+		return false;
+	}
+
+	memcpy(&length, raw, sizeof(uint32_t));
+	memcpy(&header.type, raw + sizeof(uint32_t), sizeof(uint32_t));
+	header.offset = pos;
+	header.length = ntohl(length);
+
+	/* Confirm it doesn't run past the end of the file */
+	if (pos + 3 * sizeof(uint32_t) + header.length > file_size) {
+		overrun = true;
+		return false;
+	}
+
+	pos += 3 * sizeof(uint32_t) + header.length;
+	ended = header.type == TYPE_END;
+	timing.add(3 * sizeof(uint32_t));
+	return true;
+}
+
+const uint8_t *ChunkWalker::peek(uint64_t offset, size_t length) {
+	if (length > WINDOW_SIZE || offset + length > file_size) return nullptr;
+
+	if (offset < window_pos || offset + length > window_pos + window_len) {
+		uint64_t n = file_size - offset;
+		if (n > WINDOW_SIZE) n = WINDOW_SIZE;
+
+		window_len = 0;
+		if (!read_at(offset, window, n)) return nullptr;
+		window_pos = offset;
+		window_len = n;
+	}
+
+	return window + (offset - window_pos);
+}
+
+bool ChunkWalker::load(const ChunkHeader &header, std::vector<uint8_t> &data, uint32_t &crc) const {
+	data.resize(header.length);
+
+	if (!read_at(header.offset + 2 * sizeof(uint32_t), data.data(), header.length)) return false;
+	if (!read_at(header.offset + 2 * sizeof(uint32_t) + header.length, &crc, sizeof(uint32_t))) return false;
+
+	crc = ntohl(crc);
+	return true;
+}
+
+bool ChunkWalker::read_at(uint64_t offset, void *buffer, size_t length) const {
+	Stats::Scope timing(Stats::PHASE_READ, length);
+	uint8_t *p = static_cast<uint8_t *>(buffer);
+
+	while (length) {
+		ssize_t n = pread(fd, p, length, offset);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return false;
+		p += n;
+		offset += n;
+		length -= n;
+	}
+
+	return true;
+}
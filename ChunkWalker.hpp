@@ -0,0 +1,69 @@
+/*
+CHUNKWALKER.HPP
+NICK WILSON
+2019
+*/
+
+#ifndef OBJ_CHUNKWALKER
+#define OBJ_CHUNKWALKER
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+/* Position and header of a chunk, without its data */
+struct ChunkHeader {
+	uint64_t offset;	/* Position of the LENGTH field within the file */
+	uint32_t length;
+	uint32_t type;
+};
+
+/* Steps from one chunk header to the next using the LENGTH field */
+/* Chunk data is only read on request, so skipped chunks are never touched */
+class ChunkWalker{
+private:
+	int fd = -1;
+	uint64_t file_size = 0;
+	uint64_t pos = 0;
+	bool overrun = false;
+	bool ended = false;
+
+	/* Headers are served from a small window so runs of small chunks cost one read */
+	static const size_t WINDOW_SIZE = 0x4000;
+	uint8_t window[WINDOW_SIZE];
+	uint64_t window_pos = 0;
+	size_t window_len = 0;
+
+public:
+	ChunkWalker() {}
+	ChunkWalker(const ChunkWalker &) = delete;
+	ChunkWalker &operator=(const ChunkWalker &) = delete;
+	~ChunkWalker();
+
+	bool open(const std::string &filename);
+	void close();
+
+	/* Check the signature and move to the first chunk */
+	bool check_signature();
+
+	/* Read the header at the current position and step past the chunk */
+	/* Returns false at the end of the file, after IEND, or if the chunk runs past the end (see truncated()) */
+	/* Anything after IEND is not part of the image and is never read */
+	bool next(ChunkHeader &header);
+	bool truncated() const { return overrun; }
+
+	/* Bytes at offset through the header window, nullptr if they can't be read */
+	/* Only valid until the next call to peek() or next() */
+	const uint8_t *peek(uint64_t offset, size_t length);
+
+	/* Positioned reads, safe to call from several threads at once */
+	bool load(const ChunkHeader &header, std::vector<uint8_t> &data, uint32_t &crc) const;
+	bool read_at(uint64_t offset, void *buffer, size_t length) const;
+
+	uint64_t size() const { return file_size; }
+	uint64_t position() const { return pos; }
+	int descriptor() const { return fd; }
+};
+
+#endif
@@ -0,0 +1,1102 @@
+/*
+CIPHER.CPP
+NICK WILSON
+2019
+*/
+
+#include "Cipher.hpp"
+#include "Stats.hpp"
+
+#include <algorithm>
+#include <vector>
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CIPHER_X86
+#include <immintrin.h>
+#endif
+
+static inline uint32_t load32_be(const uint8_t *p) {
+	return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | (uint32_t) p[3];
+}
+
+static inline uint64_t load64_be(const uint8_t *p) {
+	return (uint64_t) load32_be(p) << 32 | load32_be(p + 4);
+}
+
+static inline void store32_be(uint8_t *p, uint32_t x) {
+	p[0] = x >> 24;
+	p[1] = x >> 16;
+	p[2] = x >> 8;
+	p[3] = x;
+}
+
+static inline void store64_be(uint8_t *p, uint64_t x) {
+	store32_be(p, x >> 32);
+	store32_be(p + 4, x);
+}
+
+static inline uint32_t load32_le(const uint8_t *p) {
+	return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static inline uint64_t load64_le(const uint8_t *p) {
+	return (uint64_t) load32_le(p) | (uint64_t) load32_le(p + 4) << 32;
+}
+
+static inline void store32_le(uint8_t *p, uint32_t x) {
+	p[0] = x;
+	p[1] = x >> 8;
+	p[2] = x >> 16;
+	p[3] = x >> 24;
+}
+
+static inline void store64_le(uint8_t *p, uint64_t x) {
+	store32_le(p, x);
+	store32_le(p + 4, x >> 32);
+}
+
+static inline uint32_t rotl(uint32_t x, int n) {
+	return (x << n) | (x >> (32 - n));
+}
+
+static inline uint32_t rotr(uint32_t x, int n) {
+	return (x >> n) | (x << (32 - n));
+}
+
+/* Tags are compared without stopping at the first difference */
+static bool tags_match(const uint8_t *a, const uint8_t *b) {
+	uint8_t difference = 0;
+	for (size_t i = 0; i < Cipher::TAG_SIZE; i++) difference |= a[i] ^ b[i];
+	return !difference;
+}
+
+/* SHA-256, FIPS 180-4, only for PBKDF2 */
+
+static const uint32_t SHA256_IV[8] = {0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19};
+
+static const uint32_t SHA256_K[64] = {
+	0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+	0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+	0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+	0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+	0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+	0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+	0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+	0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+};
+
+static void sha256_compress(uint32_t state[8], const uint8_t block[64]) {
+	uint32_t w[64];
+
+	for (int i = 0; i < 16; i++) w[i] = load32_be(block + 4 * i);
+	for (int i = 16; i < 64; i++) {
+		uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+	uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+	for (int i = 0; i < 64; i++) {
+		uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i];
+		uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+	state[5] += f;
+	state[6] += g;
+	state[7] += h;
+}
+
+/* Digest of prefix_length bytes already compressed into state, then data */
+static void sha256_finish(uint32_t state[8], uint64_t prefix_length, const uint8_t *data, size_t length, uint8_t digest[32]) {
+	uint8_t block[64];
+	uint64_t total = prefix_length + length;
+
+	for (; length >= 64; data += 64, length -= 64) sha256_compress(state, data);
+
+	memset(block, 0, sizeof(block));
+	memcpy(block, data, length);
+	block[length] = 0x80;
+
+	if (length >= 56) {
+		sha256_compress(state, block);
+		memset(block, 0, sizeof(block));
+	}
+
+	store64_be(block + 56, total * 8);
+	sha256_compress(state, block);
+
+	for (int i = 0; i < 8; i++) store32_be(digest + 4 * i, state[i]);
+}
+
+/* HMAC-SHA-256's inner and outer states once the padded key has gone through them */
+static void hmac_states(const std::string &key, uint32_t inner[8], uint32_t outer[8]) {
+	uint8_t padded[64] = {};
+
+	if (key.length() > 64) {
+		uint32_t state[8];
+		memcpy(state, SHA256_IV, sizeof(state));
+		sha256_finish(state, 0, reinterpret_cast<const uint8_t *>(key.data()), key.length(), padded);
+	}
+	else memcpy(padded, key.data(), key.length());
+
+	uint8_t block[64];
+
+	for (int i = 0; i < 64; i++) block[i] = padded[i] ^ 0x36;
+	memcpy(inner, SHA256_IV, 8 * sizeof(uint32_t));
+	sha256_compress(inner, block);
+
+	for (int i = 0; i < 64; i++) block[i] = padded[i] ^ 0x5C;
+	memcpy(outer, SHA256_IV, 8 * sizeof(uint32_t));
+	sha256_compress(outer, block);
+}
+
+static void hmac_finish(const uint32_t inner[8], const uint32_t outer[8], const uint8_t *data, size_t length, uint8_t mac[32]) {
+	uint32_t state[8];
+
+	memcpy(state, inner, sizeof(state));
+	sha256_finish(state, 64, data, length, mac);
+
+	memcpy(state, outer, sizeof(state));
+	sha256_finish(state, 64, mac, 32, mac);
+}
+
+/* AES-256, FIPS 197 */
+
+/* S-box, generated by the compiler from inverses in GF(2^8) and the affine map */
+/* p steps through the field by multiplying by 3, and q = 1 / p by dividing by 3 */
+struct AesTables {
+	uint8_t sbox[256];
+
+	constexpr AesTables() : sbox() {
+		uint8_t p = 1, q = 1;
+
+		do {
+			p = p ^ (uint8_t) (p << 1) ^ ((p & 0x80) ? 0x1B : 0);
+
+			q ^= q << 1;
+			q ^= q << 2;
+			q ^= q << 4;
+			if (q & 0x80) q ^= 0x09;
+
+			uint8_t x = q ^ (uint8_t) (q << 1 | q >> 7) ^ (uint8_t) (q << 2 | q >> 6) ^ (uint8_t) (q << 3 | q >> 5) ^ (uint8_t) (q << 4 | q >> 4);
+			sbox[p] = x ^ 0x63;
+		} while (p != 1);
+
+		sbox[0] = 0x63;
+	}
+};
+
+static constexpr AesTables AES;
+
+/* Spot check against FIPS 197, evaluated by the compiler */
+static_assert(AES.sbox[0x00] == 0x63 && AES.sbox[0x01] == 0x7C && AES.sbox[0x53] == 0xED, "AES S-box generation is broken");
+static_assert(AES.sbox[0xC9] == 0xDD && AES.sbox[0xFF] == 0x16, "AES S-box generation is broken");
+
+static const int AES_ROUNDS = 14;
+
+static void aes_expand(const uint8_t *key, uint8_t *round_keys) {
+	static const uint8_t RCON[8] = {0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40};
+
+	memcpy(round_keys, key, Cipher::KEY_SIZE);
+
+	for (int i = 8; i < 4 * (AES_ROUNDS + 1); i++) {
+		uint8_t t[4];
+		memcpy(t, round_keys + 4 * (i - 1), 4);
+
+		if (i % 8 == 0) {
+			uint8_t first = t[0];
+			t[0] = AES.sbox[t[1]] ^ RCON[i / 8];
+			t[1] = AES.sbox[t[2]];
+			t[2] = AES.sbox[t[3]];
+			t[3] = AES.sbox[first];
+		}
+		else if (i % 8 == 4) {
+			for (int j = 0; j < 4; j++) t[j] = AES.sbox[t[j]];
+		}
+
+		for (int j = 0; j < 4; j++) round_keys[4 * i + j] = round_keys[4 * (i - 8) + j] ^ t[j];
+	}
+}
+
+static inline uint8_t xtime(uint8_t x) {
+	return (x << 1) ^ ((x & 0x80) ? 0x1B : 0);
+}
+
+/* One block, a byte at a time. Table lookups depend on the data, so this is only the fallback */
+static void aes_encrypt_portable(const uint8_t *round_keys, const uint8_t in[16], uint8_t out[16]) {
+	uint8_t s[16];
+
+	for (int i = 0; i < 16; i++) s[i] = in[i] ^ round_keys[i];
+
+	for (int round = 1; round <= AES_ROUNDS; round++) {
+		uint8_t t[16];
+
+		/* SubBytes and ShiftRows together, column c of row r coming from column c + r */
+		for (int c = 0; c < 4; c++) {
+			for (int r = 0; r < 4; r++) t[4 * c + r] = AES.sbox[s[4 * ((c + r) % 4) + r]];
+		}
+
+		if (round < AES_ROUNDS) {
+			for (int c = 0; c < 4; c++) {
+				uint8_t *a = t + 4 * c;
+				uint8_t all = a[0] ^ a[1] ^ a[2] ^ a[3];
+				uint8_t first = a[0];
+
+				a[0] ^= all ^ xtime(a[0] ^ a[1]);
+				a[1] ^= all ^ xtime(a[1] ^ a[2]);
+				a[2] ^= all ^ xtime(a[2] ^ a[3]);
+				a[3] ^= all ^ xtime(a[3] ^ first);
+			}
+		}
+
+		for (int i = 0; i < 16; i++) s[i] = t[i] ^ round_keys[16 * round + i];
+	}
+
+	memcpy(out, s, 16);
+}
+
+/* GHASH, NIST SP 800-38D */
+/* The portable multiply keeps H times every 4 bit value, as high and low halves, and */
+/* takes the product 4 bits at a time from the last byte back (Shoup's method) */
+
+static const uint64_t GHASH_REDUCE[16] = {
+	0x0000, 0x1C20, 0x3840, 0x2460, 0x7080, 0x6CA0, 0x48C0, 0x54E0,
+	0xE100, 0xFD20, 0xD940, 0xC560, 0x9180, 0x8DA0, 0xA9C0, 0xB5E0
+};
+
+static void ghash_table(const uint8_t h[16], uint64_t high[16], uint64_t low[16]) {
+	uint64_t vh = load64_be(h), vl = load64_be(h + 8);
+
+	high[0] = low[0] = 0;
+	high[8] = vh;
+	low[8] = vl;
+
+	for (int i = 4; i > 0; i >>= 1) {
+		uint64_t carry = (vl & 1) ? 0xE100000000000000ULL : 0;
+		vl = (vh << 63) | (vl >> 1);
+		vh = (vh >> 1) ^ carry;
+		high[i] = vh;
+		low[i] = vl;
+	}
+
+	for (int i = 2; i <= 8; i *= 2) {
+		for (int j = 1; j < i; j++) {
+			high[i + j] = high[i] ^ high[j];
+			low[i + j] = low[i] ^ low[j];
+		}
+	}
+}
+
+/* x = x * H */
+static void ghash_multiply_portable(const uint64_t high[16], const uint64_t low[16], uint8_t x[16]) {
+	uint64_t zh = 0, zl = 0;
+
+	for (int i = 15; i >= 0; i--) {
+		for (int nibble = 0; nibble < 2; nibble++) {
+			uint8_t n = nibble ? x[i] >> 4 : x[i] & 0x0F;
+
+			if (i != 15 || nibble) {
+				uint8_t rem = zl & 0x0F;
+				zl = (zh << 60) | (zl >> 4);
+				zh = (zh >> 4) ^ (GHASH_REDUCE[rem] << 48);
+			}
+
+			zh ^= high[n];
+			zl ^= low[n];
+		}
+	}
+
+	store64_be(x, zh);
+	store64_be(x + 8, zl);
+}
+
+/* Counter block i of a 12 byte nonce */
+static inline void gcm_counter(const uint8_t *nonce, uint32_t i, uint8_t block[16]) {
+	memcpy(block, nonce, Cipher::NONCE_SIZE);
+	store32_be(block + Cipher::NONCE_SIZE, i);
+}
+
+/* GHASH's final block, the bit lengths of the AAD and the ciphertext */
+static inline void gcm_lengths(size_t aad_length, size_t length, uint8_t block[16]) {
+	store64_be(block, (uint64_t) aad_length * 8);
+	store64_be(block + 8, (uint64_t) length * 8);
+}
+
+static void gcm_portable(const uint8_t *round_keys, const uint8_t *table, const uint8_t *nonce, const uint8_t *aad, size_t aad_length, uint8_t *data, size_t length, bool sealing, uint8_t *tag) {
+	uint64_t high[16], low[16];
+	memcpy(high, table, sizeof(high));
+	memcpy(low, table + sizeof(high), sizeof(low));
+
+	uint8_t x[16] = {};
+	uint8_t block[16], stream[16];
+
+	for (size_t i = 0; i < aad_length; i += 16) {
+		size_t n = std::min<size_t>(16, aad_length - i);
+		for (size_t k = 0; k < n; k++) x[k] ^= aad[i + k];
+		ghash_multiply_portable(high, low, x);
+	}
+
+	/* Counter 1 is kept for the tag, so the data starts at 2 */
+	for (size_t i = 0; i < length; i += 16) {
+		size_t n = std::min<size_t>(16, length - i);
+
+		gcm_counter(nonce, i / 16 + 2, block);
+		aes_encrypt_portable(round_keys, block, stream);
+
+		for (size_t k = 0; k < n; k++) {
+			if (!sealing) x[k] ^= data[i + k];
+			data[i + k] ^= stream[k];
+			if (sealing) x[k] ^= data[i + k];
+		}
+
+		ghash_multiply_portable(high, low, x);
+	}
+
+	gcm_lengths(aad_length, length, block);
+	for (int k = 0; k < 16; k++) x[k] ^= block[k];
+	ghash_multiply_portable(high, low, x);
+
+	gcm_counter(nonce, 1, block);
+	aes_encrypt_portable(round_keys, block, stream);
+	for (int k = 0; k < 16; k++) tag[k] = x[k] ^ stream[k];
+}
+
+/* ChaCha20 and Poly1305, RFC 8439 */
+
+static const uint32_t CHACHA_CONSTANTS[4] = {0x61707865, 0x3320646E, 0x79622D32, 0x6B206574};
+
+/* Key, counter and nonce laid out as the state's 16 words */
+static void chacha_state(const uint8_t *key, uint32_t counter, const uint8_t *nonce, uint32_t state[16]) {
+	memcpy(state, CHACHA_CONSTANTS, sizeof(CHACHA_CONSTANTS));
+	for (int i = 0; i < 8; i++) state[4 + i] = load32_le(key + 4 * i);
+	state[12] = counter;
+	for (int i = 0; i < 3; i++) state[13 + i] = load32_le(nonce + 4 * i);
+}
+
+static inline void quarter_round(uint32_t *x, int a, int b, int c, int d) {
+	x[a] += x[b]; x[d] = rotl(x[d] ^ x[a], 16);
+	x[c] += x[d]; x[b] = rotl(x[b] ^ x[c], 12);
+	x[a] += x[b]; x[d] = rotl(x[d] ^ x[a], 8);
+	x[c] += x[d]; x[b] = rotl(x[b] ^ x[c], 7);
+}
+
+static void chacha_block(const uint32_t state[16], uint8_t out[64]) {
+	uint32_t x[16];
+	memcpy(x, state, sizeof(x));
+
+	for (int i = 0; i < 10; i++) {
+		quarter_round(x, 0, 4, 8, 12);
+		quarter_round(x, 1, 5, 9, 13);
+		quarter_round(x, 2, 6, 10, 14);
+		quarter_round(x, 3, 7, 11, 15);
+		quarter_round(x, 0, 5, 10, 15);
+		quarter_round(x, 1, 6, 11, 12);
+		quarter_round(x, 2, 7, 8, 13);
+		quarter_round(x, 3, 4, 9, 14);
+	}
+
+	for (int i = 0; i < 16; i++) store32_le(out + 4 * i, x[i] + state[i]);
+}
+
+/* XOR the key stream into data, from the state's block counter on, which is moved past it */
+typedef void (*chacha_fn)(uint32_t state[16], uint8_t *data, size_t length);
+
+static void chacha_portable(uint32_t state[16], uint8_t *data, size_t length) {
+	uint8_t stream[64];
+
+	for (size_t i = 0; i < length; i += 64) {
+		chacha_block(state, stream);
+		state[12]++;
+
+		size_t n = std::min<size_t>(64, length - i);
+		for (size_t k = 0; k < n; k++) data[i + k] ^= stream[k];
+	}
+}
+
+/* 26 bit limbs would suit SIMD, but 44 bit limbs in 64 bit words need just nine multiplies a block */
+struct Poly1305 {
+	uint64_t r[3], s[2], h[3] = {0, 0, 0}, pad[2];
+
+	explicit Poly1305(const uint8_t key[32]) {
+		uint64_t t0 = load64_le(key), t1 = load64_le(key + 8);
+
+		/* r is clamped as it is split into limbs */
+		r[0] = t0 & 0xFFC0FFFFFFF;
+		r[1] = ((t0 >> 44) | (t1 << 20)) & 0xFFFFFC0FFFF;
+		r[2] = (t1 >> 24) & 0x00FFFFFFC0F;
+		s[0] = r[1] * (5 << 2);
+		s[1] = r[2] * (5 << 2);
+		pad[0] = load64_le(key + 16);
+		pad[1] = load64_le(key + 24);
+	}
+
+	/* Whole 16 byte blocks, all with the high bit set */
+	void blocks(const uint8_t *m, size_t length) {
+		const uint64_t mask = 0xFFFFFFFFFFF;
+		uint64_t h0 = h[0], h1 = h[1], h2 = h[2];
+
+		for (; length >= 16; m += 16, length -= 16) {
+			uint64_t t0 = load64_le(m), t1 = load64_le(m + 8);
+
+			h0 += t0 & mask;
+			h1 += ((t0 >> 44) | (t1 << 20)) & mask;
+			h2 += ((t1 >> 24) & 0x3FFFFFFFFFF) | (1ULL << 40);
+
+			unsigned __int128 d0 = (unsigned __int128) h0 * r[0] + (unsigned __int128) h1 * s[1] + (unsigned __int128) h2 * s[0];
+			unsigned __int128 d1 = (unsigned __int128) h0 * r[1] + (unsigned __int128) h1 * r[0] + (unsigned __int128) h2 * s[1];
+			unsigned __int128 d2 = (unsigned __int128) h0 * r[2] + (unsigned __int128) h1 * r[1] + (unsigned __int128) h2 * r[0];
+
+			uint64_t c = (uint64_t) (d0 >> 44);
+			h0 = (uint64_t) d0 & mask;
+			d1 += c;
+			c = (uint64_t) (d1 >> 44);
+			h1 = (uint64_t) d1 & mask;
+			d2 += c;
+			c = (uint64_t) (d2 >> 42);
+			h2 = (uint64_t) d2 & 0x3FFFFFFFFFF;
+			h0 += c * 5;
+			c = h0 >> 44;
+			h0 &= mask;
+			h1 += c;
+		}
+
+		h[0] = h0;
+		h[1] = h1;
+		h[2] = h2;
+	}
+
+	/* The last bytes, zero padded to a block as the AEAD construction pads them */
+	void padded(const uint8_t *m, size_t length) {
+		blocks(m, length & ~(size_t) 15);
+
+		if (length & 15) {
+			uint8_t block[16] = {};
+			memcpy(block, m + (length & ~(size_t) 15), length & 15);
+			blocks(block, 16);
+		}
+	}
+
+	void finish(uint8_t tag[16]) {
+		const uint64_t mask = 0xFFFFFFFFFFF;
+		uint64_t h0 = h[0], h1 = h[1], h2 = h[2], c;
+
+		/* Fully carry h */
+		c = h1 >> 44; h1 &= mask;
+		h2 += c; c = h2 >> 42; h2 &= 0x3FFFFFFFFFF;
+		h0 += c * 5; c = h0 >> 44; h0 &= mask;
+		h1 += c; c = h1 >> 44; h1 &= mask;
+		h2 += c; c = h2 >> 42; h2 &= 0x3FFFFFFFFFF;
+		h0 += c * 5; c = h0 >> 44; h0 &= mask;
+		h1 += c;
+
+		/* h - p, taken in place of h if it didn't go negative */
+		uint64_t g0 = h0 + 5; c = g0 >> 44; g0 &= mask;
+		uint64_t g1 = h1 + c; c = g1 >> 44; g1 &= mask;
+		uint64_t g2 = h2 + c - (1ULL << 42);
+
+		c = (g2 >> 63) - 1;
+		h0 = (h0 & ~c) | (g0 & c);
+		h1 = (h1 & ~c) | (g1 & c);
+		h2 = (h2 & ~c) | (g2 & c);
+
+		/* Plus the pad, modulo 2^128 */
+		h0 += pad[0] & mask; c = h0 >> 44; h0 &= mask;
+		h1 += (((pad[0] >> 44) | (pad[1] << 20)) & mask) + c; c = h1 >> 44; h1 &= mask;
+		h2 += ((pad[1] >> 24) & 0x3FFFFFFFFFF) + c; h2 &= 0x3FFFFFFFFFF;
+
+		store64_le(tag, h0 | (h1 << 44));
+		store64_le(tag + 8, (h1 >> 20) | (h2 << 24));
+	}
+};
+
+/* Key stream is XOR'd in this much at a time, ahead of or behind the MAC, while it's in cache */
+static const size_t CHACHA_STRIDE = 4096;
+
+static void chacha_poly(chacha_fn chacha, const uint8_t *key, const uint8_t *nonce, const uint8_t *aad, size_t aad_length, uint8_t *data, size_t length, bool sealing, uint8_t *tag) {
+	uint32_t state[16];
+	uint8_t poly_key[64];
+
+	/* Block 0 makes the one time Poly1305 key, so the data starts at block 1 */
+	chacha_state(key, 0, nonce, state);
+	chacha_block(state, poly_key);
+	state[12] = 1;
+
+	Poly1305 mac(poly_key);
+	mac.padded(aad, aad_length);
+
+	for (size_t i = 0; i < length; i += CHACHA_STRIDE) {
+		size_t n = std::min(CHACHA_STRIDE, length - i);
+
+		if (!sealing) mac.padded(data + i, n);
+		chacha(state, data + i, n);
+		if (sealing) mac.padded(data + i, n);
+	}
+
+	uint8_t lengths[16];
+	store64_le(lengths, aad_length);
+	store64_le(lengths + 8, length);
+	mac.blocks(lengths, 16);
+
+	mac.finish(tag);
+}
+
+#if defined(CIPHER_X86)
+
+#define CIPHER_TARGET_AESNI __attribute__((target("aes,pclmul,ssse3")))
+#define CIPHER_TARGET_VAES __attribute__((target("vaes,vpclmulqdq,avx2,aes,pclmul,ssse3")))
+
+/* GHASH works on bits in the reverse of their order in each byte, which PCLMULQDQ takes */
+/* as it is once the bytes are reversed, the product then being one bit short of aligned */
+/* See: Gueron and Kounavis, "Intel Carry-Less Multiplication Instruction and its Usage */
+/* for Computing the GCM Mode" */
+
+CIPHER_TARGET_AESNI
+static inline __m128i reverse_bytes(__m128i x) {
+	return _mm_shuffle_epi8(x, _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+}
+
+/* a * b, added unreduced to lo, mid and hi, so several products can share one reduction */
+CIPHER_TARGET_AESNI
+static inline void clmul_add(__m128i a, __m128i b, __m128i &lo, __m128i &mid, __m128i &hi) {
+	lo = _mm_xor_si128(lo, _mm_clmulepi64_si128(a, b, 0x00));
+	hi = _mm_xor_si128(hi, _mm_clmulepi64_si128(a, b, 0x11));
+	mid = _mm_xor_si128(mid, _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10), _mm_clmulepi64_si128(a, b, 0x01)));
+}
+
+/* Shift the 256 bit sum left a bit, then reduce it modulo x^128 + x^7 + x^2 + x + 1 */
+CIPHER_TARGET_AESNI
+static inline __m128i ghash_reduce(__m128i lo, __m128i mid, __m128i hi) {
+	lo = _mm_xor_si128(lo, _mm_slli_si128(mid, 8));
+	hi = _mm_xor_si128(hi, _mm_srli_si128(mid, 8));
+
+	__m128i lo_carry = _mm_srli_epi32(lo, 31);
+	__m128i hi_carry = _mm_srli_epi32(hi, 31);
+	lo = _mm_or_si128(_mm_slli_epi32(lo, 1), _mm_slli_si128(lo_carry, 4));
+	hi = _mm_or_si128(_mm_or_si128(_mm_slli_epi32(hi, 1), _mm_slli_si128(hi_carry, 4)), _mm_srli_si128(lo_carry, 12));
+
+	__m128i a = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(lo, 31), _mm_slli_epi32(lo, 30)), _mm_slli_epi32(lo, 25));
+	__m128i b = _mm_srli_si128(a, 4);
+	lo = _mm_xor_si128(lo, _mm_slli_si128(a, 12));
+
+	__m128i c = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(lo, 1), _mm_srli_epi32(lo, 2)), _mm_srli_epi32(lo, 7));
+	return _mm_xor_si128(hi, _mm_xor_si128(lo, _mm_xor_si128(c, b)));
+}
+
+CIPHER_TARGET_AESNI
+static inline __m128i ghash_multiply(__m128i a, __m128i b) {
+	__m128i lo = _mm_setzero_si128(), mid = _mm_setzero_si128(), hi = _mm_setzero_si128();
+	clmul_add(a, b, lo, mid, hi);
+	return ghash_reduce(lo, mid, hi);
+}
+
+CIPHER_TARGET_AESNI
+static inline __m128i aes_encrypt(const __m128i *rk, __m128i x) {
+	x = _mm_xor_si128(x, rk[0]);
+	for (int r = 1; r < AES_ROUNDS; r++) x = _mm_aesenc_si128(x, rk[r]);
+	return _mm_aesenclast_si128(x, rk[AES_ROUNDS]);
+}
+
+/* H and its powers, byte reversed, H^(i + 1) at i */
+CIPHER_TARGET_AESNI
+static void ghash_powers(const uint8_t *round_keys, uint8_t *powers, int count) {
+	__m128i rk[AES_ROUNDS + 1];
+	for (int r = 0; r <= AES_ROUNDS; r++) rk[r] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(round_keys + 16 * r));
+
+	__m128i h = reverse_bytes(aes_encrypt(rk, _mm_setzero_si128()));
+	__m128i power = h;
+
+	for (int i = 0; i < count; i++) {
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(powers + 16 * i), power);
+		power = ghash_multiply(power, h);
+	}
+}
+
+/* Up to 16 bytes, zero padded, into the hash */
+CIPHER_TARGET_AESNI
+static inline __m128i ghash_partial(__m128i x, __m128i h, const uint8_t *data, size_t length) {
+	uint8_t block[16] = {};
+	memcpy(block, data, length);
+	return ghash_multiply(_mm_xor_si128(x, reverse_bytes(_mm_loadu_si128(reinterpret_cast<const __m128i *>(block)))), h);
+}
+
+/* CTR and GHASH over length bytes, from counter block counter on, 8 blocks a step */
+/* ctr is the counter block with its counter zeroed, byte reversed, so the counter is its low lane */
+CIPHER_TARGET_AESNI
+static __m128i gcm_blocks_aesni(const __m128i *rk, const __m128i *h, __m128i ctr, uint32_t counter, __m128i x, uint8_t *data, size_t length, bool sealing) {
+	size_t i = 0;
+
+	for (; i + 128 <= length; i += 128) {
+		__m128i b[8];
+
+		for (int k = 0; k < 8; k++) b[k] = _mm_xor_si128(reverse_bytes(_mm_add_epi32(ctr, _mm_set_epi32(0, 0, 0, counter + k))), rk[0]);
+		counter += 8;
+
+		for (int r = 1; r < AES_ROUNDS; r++) {
+			for (int k = 0; k < 8; k++) b[k] = _mm_aesenc_si128(b[k], rk[r]);
+		}
+
+		__m128i lo = _mm_setzero_si128(), mid = _mm_setzero_si128(), hi = _mm_setzero_si128();
+
+		for (int k = 0; k < 8; k++) {
+			__m128i *p = reinterpret_cast<__m128i *>(data + i + 16 * k);
+			__m128i in = _mm_loadu_si128(p);
+			__m128i out = _mm_xor_si128(in, _mm_aesenclast_si128(b[k], rk[AES_ROUNDS]));
+			_mm_storeu_si128(p, out);
+
+			/* Eight blocks hashed as (((x + c0) H + c1) H ...) H, spread out as sum of c_k H^(8 - k) */
+			__m128i c = reverse_bytes(sealing ? out : in);
+			if (!k) c = _mm_xor_si128(c, x);
+			clmul_add(c, h[7 - k], lo, mid, hi);
+		}
+
+		x = ghash_reduce(lo, mid, hi);
+	}
+
+	for (; i < length; i += 16) {
+		size_t n = std::min<size_t>(16, length - i);
+		uint8_t block[16] = {};
+
+		memcpy(block, data + i, n);
+		if (!sealing) x = ghash_partial(x, h[0], block, n);
+
+		__m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i *>(block));
+		__m128i out = _mm_xor_si128(in, aes_encrypt(rk, reverse_bytes(_mm_add_epi32(ctr, _mm_set_epi32(0, 0, 0, counter++)))));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(block), out);
+		memcpy(data + i, block, n);
+
+		if (sealing) x = ghash_partial(x, h[0], data + i, n);
+	}
+
+	return x;
+}
+
+CIPHER_TARGET_AESNI
+static void gcm_finish_aesni(const __m128i *rk, const __m128i *h, __m128i ctr, __m128i x, size_t aad_length, size_t length, uint8_t *tag) {
+	uint8_t lengths[16];
+	gcm_lengths(aad_length, length, lengths);
+	x = ghash_partial(x, h[0], lengths, 16);
+
+	__m128i mask = aes_encrypt(rk, reverse_bytes(_mm_add_epi32(ctr, _mm_set_epi32(0, 0, 0, 1))));
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(tag), _mm_xor_si128(reverse_bytes(x), mask));
+}
+
+CIPHER_TARGET_AESNI
+static void gcm_aesni(const uint8_t *round_keys, const uint8_t *powers, const uint8_t *nonce, const uint8_t *aad, size_t aad_length, uint8_t *data, size_t length, bool sealing, uint8_t *tag) {
+	__m128i rk[AES_ROUNDS + 1], h[8];
+	for (int r = 0; r <= AES_ROUNDS; r++) rk[r] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(round_keys + 16 * r));
+	for (int k = 0; k < 8; k++) h[k] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(powers + 16 * k));
+
+	uint8_t block[16];
+	gcm_counter(nonce, 0, block);
+	__m128i ctr = reverse_bytes(_mm_loadu_si128(reinterpret_cast<const __m128i *>(block)));
+
+	__m128i x = _mm_setzero_si128();
+	for (size_t i = 0; i < aad_length; i += 16) x = ghash_partial(x, h[0], aad + i, std::min<size_t>(16, aad_length - i));
+
+	x = gcm_blocks_aesni(rk, h, ctr, 2, x, data, length, sealing);
+	gcm_finish_aesni(rk, h, ctr, x, aad_length, length, tag);
+}
+
+/* The same, two blocks to a vector with VAES, and 16 blocks hashed to a reduction */
+CIPHER_TARGET_VAES
+static void gcm_vaes(const uint8_t *round_keys, const uint8_t *powers, const uint8_t *nonce, const uint8_t *aad, size_t aad_length, uint8_t *data, size_t length, bool sealing, uint8_t *tag) {
+	__m128i rk[AES_ROUNDS + 1], h[16];
+	__m256i rk2[AES_ROUNDS + 1], h2[8];
+
+	for (int r = 0; r <= AES_ROUNDS; r++) {
+		rk[r] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(round_keys + 16 * r));
+		rk2[r] = _mm256_broadcastsi128_si256(rk[r]);
+	}
+
+	/* Block 2k of a step takes H^(16 - 2k) and block 2k + 1 takes H^(15 - 2k) */
+	for (int k = 0; k < 16; k++) h[k] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(powers + 16 * k));
+	for (int k = 0; k < 8; k++) h2[k] = _mm256_set_m128i(h[14 - 2 * k], h[15 - 2 * k]);
+
+	const __m256i reverse = _mm256_broadcastsi128_si256(_mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+
+	uint8_t block[16];
+	gcm_counter(nonce, 0, block);
+	__m128i ctr = reverse_bytes(_mm_loadu_si128(reinterpret_cast<const __m128i *>(block)));
+	__m256i ctr2 = _mm256_broadcastsi128_si256(ctr);
+
+	__m128i x = _mm_setzero_si128();
+	for (size_t i = 0; i < aad_length; i += 16) x = ghash_partial(x, h[0], aad + i, std::min<size_t>(16, aad_length - i));
+
+	uint32_t counter = 2;
+	size_t i = 0;
+
+	for (; i + 256 <= length; i += 256) {
+		__m256i b[8];
+
+		for (int k = 0; k < 8; k++) {
+			__m256i n = _mm256_set_epi32(0, 0, 0, counter + 2 * k + 1, 0, 0, 0, counter + 2 * k);
+			b[k] = _mm256_xor_si256(_mm256_shuffle_epi8(_mm256_add_epi32(ctr2, n), reverse), rk2[0]);
+		}
+		counter += 16;
+
+		for (int r = 1; r < AES_ROUNDS; r++) {
+			for (int k = 0; k < 8; k++) b[k] = _mm256_aesenc_epi128(b[k], rk2[r]);
+		}
+
+		__m256i lo = _mm256_setzero_si256(), mid = _mm256_setzero_si256(), hi = _mm256_setzero_si256();
+
+		for (int k = 0; k < 8; k++) {
+			__m256i *p = reinterpret_cast<__m256i *>(data + i + 32 * k);
+			__m256i in = _mm256_loadu_si256(p);
+			__m256i out = _mm256_xor_si256(in, _mm256_aesenclast_epi128(b[k], rk2[AES_ROUNDS]));
+			_mm256_storeu_si256(p, out);
+
+			__m256i c = _mm256_shuffle_epi8(sealing ? out : in, reverse);
+			if (!k) c = _mm256_xor_si256(c, _mm256_set_m128i(_mm_setzero_si128(), x));
+
+			lo = _mm256_xor_si256(lo, _mm256_clmulepi64_epi128(c, h2[k], 0x00));
+			hi = _mm256_xor_si256(hi, _mm256_clmulepi64_epi128(c, h2[k], 0x11));
+			mid = _mm256_xor_si256(mid, _mm256_xor_si256(_mm256_clmulepi64_epi128(c, h2[k], 0x10), _mm256_clmulepi64_epi128(c, h2[k], 0x01)));
+		}
+
+		/* Both halves go to the one reduction */
+		x = ghash_reduce(_mm_xor_si128(_mm256_castsi256_si128(lo), _mm256_extracti128_si256(lo, 1)),
+			_mm_xor_si128(_mm256_castsi256_si128(mid), _mm256_extracti128_si256(mid, 1)),
+			_mm_xor_si128(_mm256_castsi256_si128(hi), _mm256_extracti128_si256(hi, 1)));
+	}
+
+	x = gcm_blocks_aesni(rk, h, ctr, counter, x, data + i, length - i, sealing);
+	gcm_finish_aesni(rk, h, ctr, x, aad_length, length, tag);
+}
+
+/* Each of the 16 state words of 8 blocks in a vector, block b in lane b */
+/* Rotations by 16 and 8 are byte shuffles, the others shifts */
+__attribute__((target("avx2")))
+static void chacha_avx2(uint32_t state[16], uint8_t *data, size_t length) {
+	const __m256i rot16 = _mm256_broadcastsi128_si256(_mm_set_epi8(13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2));
+	const __m256i rot8 = _mm256_broadcastsi128_si256(_mm_set_epi8(14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3));
+	size_t i = 0;
+
+#define CHACHA_QR(a, b, c, d) \
+	x[a] = _mm256_add_epi32(x[a], x[b]); x[d] = _mm256_shuffle_epi8(_mm256_xor_si256(x[d], x[a]), rot16); \
+	x[c] = _mm256_add_epi32(x[c], x[d]); x[b] = _mm256_xor_si256(x[b], x[c]); x[b] = _mm256_or_si256(_mm256_slli_epi32(x[b], 12), _mm256_srli_epi32(x[b], 20)); \
+	x[a] = _mm256_add_epi32(x[a], x[b]); x[d] = _mm256_shuffle_epi8(_mm256_xor_si256(x[d], x[a]), rot8); \
+	x[c] = _mm256_add_epi32(x[c], x[d]); x[b] = _mm256_xor_si256(x[b], x[c]); x[b] = _mm256_or_si256(_mm256_slli_epi32(x[b], 7), _mm256_srli_epi32(x[b], 25));
+
+	for (; i + 512 <= length; i += 512) {
+		__m256i start[16], x[16];
+
+		for (int w = 0; w < 16; w++) start[w] = _mm256_set1_epi32(state[w]);
+		start[12] = _mm256_add_epi32(start[12], _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+		for (int w = 0; w < 16; w++) x[w] = start[w];
+
+		for (int r = 0; r < 10; r++) {
+			CHACHA_QR(0, 4, 8, 12)
+			CHACHA_QR(1, 5, 9, 13)
+			CHACHA_QR(2, 6, 10, 14)
+			CHACHA_QR(3, 7, 11, 15)
+			CHACHA_QR(0, 5, 10, 15)
+			CHACHA_QR(1, 6, 11, 12)
+			CHACHA_QR(2, 7, 8, 13)
+			CHACHA_QR(3, 4, 9, 14)
+		}
+
+		for (int w = 0; w < 16; w++) x[w] = _mm256_add_epi32(x[w], start[w]);
+
+		/* Transpose each group of four words so that y[j] holds 16 bytes of block j in its */
+		/* low half and of block j + 4 in its high half, then pair the halves up */
+		__m256i y[4][4];
+
+		for (int g = 0; g < 4; g++) {
+			__m256i t0 = _mm256_unpacklo_epi32(x[4 * g], x[4 * g + 1]);
+			__m256i t1 = _mm256_unpackhi_epi32(x[4 * g], x[4 * g + 1]);
+			__m256i t2 = _mm256_unpacklo_epi32(x[4 * g + 2], x[4 * g + 3]);
+			__m256i t3 = _mm256_unpackhi_epi32(x[4 * g + 2], x[4 * g + 3]);
+
+			y[g][0] = _mm256_unpacklo_epi64(t0, t2);
+			y[g][1] = _mm256_unpackhi_epi64(t0, t2);
+			y[g][2] = _mm256_unpacklo_epi64(t1, t3);
+			y[g][3] = _mm256_unpackhi_epi64(t1, t3);
+		}
+
+		for (int j = 0; j < 4; j++) {
+			__m256i *low = reinterpret_cast<__m256i *>(data + i + 64 * j);
+			__m256i *high = reinterpret_cast<__m256i *>(data + i + 64 * (j + 4));
+
+			_mm256_storeu_si256(low, _mm256_xor_si256(_mm256_loadu_si256(low), _mm256_permute2x128_si256(y[0][j], y[1][j], 0x20)));
+			_mm256_storeu_si256(low + 1, _mm256_xor_si256(_mm256_loadu_si256(low + 1), _mm256_permute2x128_si256(y[2][j], y[3][j], 0x20)));
+			_mm256_storeu_si256(high, _mm256_xor_si256(_mm256_loadu_si256(high), _mm256_permute2x128_si256(y[0][j], y[1][j], 0x31)));
+			_mm256_storeu_si256(high + 1, _mm256_xor_si256(_mm256_loadu_si256(high + 1), _mm256_permute2x128_si256(y[2][j], y[3][j], 0x31)));
+		}
+
+		state[12] += 8;
+	}
+
+#undef CHACHA_QR
+
+	chacha_portable(state, data + i, length - i);
+}
+
+static bool aesni_supported() {
+	return __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3");
+}
+
+static bool vaes_supported() {
+	return aesni_supported() && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("vaes") && __builtin_cpu_supports("vpclmulqdq");
+}
+
+static bool avx2_supported() {
+	return __builtin_cpu_supports("avx2");
+}
+
+#else
+
+static void ghash_powers(const uint8_t *round_keys, uint8_t *powers, int count) {}
+
+static void gcm_aesni(const uint8_t *round_keys, const uint8_t *powers, const uint8_t *nonce, const uint8_t *aad, size_t aad_length, uint8_t *data, size_t length, bool sealing, uint8_t *tag) {}
+
+static void gcm_vaes(const uint8_t *round_keys, const uint8_t *powers, const uint8_t *nonce, const uint8_t *aad, size_t aad_length, uint8_t *data, size_t length, bool sealing, uint8_t *tag) {}
+
+static void chacha_avx2(uint32_t state[16], uint8_t *data, size_t length) {
+	chacha_portable(state, data, length);
+}
+
+static bool aesni_supported() {
+	return false;
+}
+
+static bool vaes_supported() {
+	return false;
+}
+
+static bool avx2_supported() {
+	return false;
+}
+
+#endif
+
+/* Public */
+Cipher::Cipher(Type type, const uint8_t *key) : Cipher(type, key, active(type)) {}
+
+Cipher::Cipher(Type type, const uint8_t *key, Engine engine) : cipher(type), kernel(engine) {
+	memcpy(key_bytes, key, KEY_SIZE);
+
+	if (type != CIPHER_AES_256_GCM) return;
+
+	aes_expand(key, round_keys);
+
+	if (engine == ENGINE_PORTABLE) {
+		uint8_t h[16] = {};
+		uint64_t high[16], low[16];
+
+		aes_encrypt_portable(round_keys, h, h);
+		ghash_table(h, high, low);
+		memcpy(h_powers, high, sizeof(high));
+		memcpy(h_powers + sizeof(high), low, sizeof(low));
+	}
+	else ghash_powers(round_keys, h_powers, (engine == ENGINE_VAES) ? 16 : 8);
+}
+
+void Cipher::crypt(const uint8_t *nonce, const uint8_t *aad, size_t aad_length, uint8_t *data, size_t length, bool sealing, uint8_t *tag) const {
+	Stats::Scope timing(Stats::PHASE_CRYPT, length);
+
+	if (cipher == CIPHER_AES_256_GCM) {
+		if (kernel == ENGINE_VAES) gcm_vaes(round_keys, h_powers, nonce, aad, aad_length, data, length, sealing, tag);
+		else if (kernel == ENGINE_AESNI) gcm_aesni(round_keys, h_powers, nonce, aad, aad_length, data, length, sealing, tag);
+		else gcm_portable(round_keys, h_powers, nonce, aad, aad_length, data, length, sealing, tag);
+	}
+	else chacha_poly((kernel == ENGINE_AVX2) ? chacha_avx2 : chacha_portable, key_bytes, nonce, aad, aad_length, data, length, sealing, tag);
+}
+
+/* Nonces are the number, big endian, after four zero bytes */
+static void nonce_bytes(uint64_t nonce, uint8_t bytes[Cipher::NONCE_SIZE]) {
+	memset(bytes, 0, Cipher::NONCE_SIZE);
+	store64_be(bytes + 4, nonce);
+}
+
+void Cipher::seal(uint64_t nonce, const uint8_t *aad, size_t aad_length, uint8_t *data, size_t length) const {
+	uint8_t bytes[NONCE_SIZE];
+	nonce_bytes(nonce, bytes);
+	crypt(bytes, aad, aad_length, data, length, true, data + length);
+}
+
+bool Cipher::open(uint64_t nonce, const uint8_t *aad, size_t aad_length, uint8_t *data, size_t length) const {
+	uint8_t bytes[NONCE_SIZE], tag[TAG_SIZE];
+	nonce_bytes(nonce, bytes);
+	crypt(bytes, aad, aad_length, data, length, false, tag);
+	return tags_match(tag, data + length);
+}
+
+/* Only one block of output is ever needed, so this is PBKDF2's F(P, S, c, 1) */
+void Cipher::derive(Kdf kdf, const std::string &passphrase, const uint8_t *salt, size_t salt_length, uint32_t iterations, uint8_t *key) {
+	Stats::Scope timing(Stats::PHASE_CRYPT);
+
+	uint32_t inner[8], outer[8];
+	hmac_states(passphrase, inner, outer);
+
+	std::vector<uint8_t> first(salt, salt + salt_length);
+	first.insert(first.end(), {0, 0, 0, 1});
+
+	uint8_t u[32];
+	hmac_finish(inner, outer, first.data(), first.size(), u);
+	memcpy(key, u, KEY_SIZE);
+
+	for (uint32_t i = 1; i < iterations; i++) {
+		hmac_finish(inner, outer, u, sizeof(u), u);
+		for (size_t k = 0; k < KEY_SIZE; k++) key[k] ^= u[k];
+	}
+}
+
+Cipher::Type Cipher::preferred() {
+	return available(ENGINE_AESNI) ? CIPHER_AES_256_GCM : CIPHER_CHACHA20_POLY1305;
+}
+
+const char *Cipher::name(Type type) {
+	switch (type) {
+		case CIPHER_NONE:
+			return "none";
+		case CIPHER_AES_256_GCM:
+			return "aes-256-gcm";
+		case CIPHER_CHACHA20_POLY1305:
+			return "chacha20-poly1305";
+		default:
+			return "unknown";
+	}
+}
+
+const char *Cipher::kdf_name(Kdf kdf) {
+	switch (kdf) {
+		case KDF_NONE:
+			return "none";
+		case KDF_PBKDF2_SHA256:
+			return "pbkdf2-sha256";
+		default:
+			return "unknown";
+	}
+}
+
+bool Cipher::available(Engine engine) {
+	if (engine == ENGINE_AESNI) return aesni_supported();
+	if (engine == ENGINE_VAES) return vaes_supported();
+	if (engine == ENGINE_AVX2) return avx2_supported();
+	return engine < ENGINE_COUNT;
+}
+
+Cipher::Engine Cipher::active(Type type) {
+	static const Engine aes = available(ENGINE_VAES) ? ENGINE_VAES : (available(ENGINE_AESNI) ? ENGINE_AESNI : ENGINE_PORTABLE);
+	static const Engine chacha = available(ENGINE_AVX2) ? ENGINE_AVX2 : ENGINE_PORTABLE;
+
+	return (type == CIPHER_AES_256_GCM) ? aes : chacha;
+}
+
+const char *Cipher::engine_name(Engine engine) {
+	switch (engine) {
+		case ENGINE_PORTABLE:
+			return "portable";
+		case ENGINE_AESNI:
+			return "aes-ni";
+		case ENGINE_VAES:
+			return "vaes";
+		case ENGINE_AVX2:
+			return "avx2";
+		default:
+			return "unknown";
+	}
+}
+
+static std::vector<uint8_t> from_hex(const char *hex) {
+	std::vector<uint8_t> bytes;
+	for (; hex[0] && hex[1]; hex += 2) bytes.push_back(strtoul(std::string(hex, 2).c_str(), nullptr, 16));
+	return bytes;
+}
+
+bool Cipher::self_test() {
+	/* Test case 16 of McGrew and Viega's GCM specification, and RFC 8439 section 2.8.2 */
+	static const struct {
+		Type type;
+		const char *key, *nonce, *aad, *plain, *sealed;
+	} VECTORS[] = {
+		{CIPHER_AES_256_GCM,
+			"feffe9928665731c6d6a8f9467308308feffe9928665731c6d6a8f9467308308",
+			"cafebabefacedbaddecaf888",
+			"feedfacedeadbeeffeedfacedeadbeefabaddad2",
+			"d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a721c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39",
+			"522dc1f099567d07f47f37a32a84427d643a8cdcbfe5c0c97598a2bd2555d1aa8cb08e48590dbb3da7b08b1056828838c5f61e6393ba7a0abcc9f662"
+			"76fc6ece0f4e1768cddf8853bb2d551b"},
+		{CIPHER_CHACHA20_POLY1305,
+			"808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f",
+			"070000004041424344454647",
+			"50515253c0c1c2c3c4c5c6c7",
+			"4c616469657320616e642047656e746c656d656e206f662074686520636c617373206f66202739393a204966204920636f756c64206f6666657220796f75206f6e6c79206f6e652074697020666f7220746865206675747572652c2073756e73637265656e20776f756c642062652069742e",
+			"d31a8d34648e60db7b86afbc53ef7ec2a4aded51296e08fea9e2b5a736ee62d63dbea45e8ca9671282fafb69da92728b1a71de0a9e060b2905d6a5b67ecd3b3692ddbd7f2d778b8c9803aee328091b58fab324e4fad675945585808b4831d7bc3ff4def08e4b7a9de576d26586cec64b6116"
+			"1ae10b594f09e26a7e902ecbd0600691"}
+	};
+
+	for (const auto &vector : VECTORS) {
+		std::vector<uint8_t> key = from_hex(vector.key), nonce = from_hex(vector.nonce), aad = from_hex(vector.aad);
+		std::vector<uint8_t> plain = from_hex(vector.plain), sealed = from_hex(vector.sealed);
+
+		for (int e = 0; e < ENGINE_COUNT; e++) {
+			Engine engine = (Engine) e;
+			if (!available(engine) || (engine != ENGINE_PORTABLE && engine != active(vector.type))) continue;
+
+			Cipher cipher(vector.type, key.data(), engine);
+			std::vector<uint8_t> data = plain;
+			uint8_t tag[TAG_SIZE];
+
+			data.resize(plain.size() + TAG_SIZE);
+			cipher.crypt(nonce.data(), aad.data(), aad.size(), data.data(), plain.size(), true, tag);
+			memcpy(data.data() + plain.size(), tag, TAG_SIZE);
+			if (data != sealed) return false;
+
+			cipher.crypt(nonce.data(), aad.data(), aad.size(), data.data(), plain.size(), false, tag);
+			if (!tags_match(tag, sealed.data() + plain.size()) || !std::equal(plain.begin(), plain.end(), data.begin())) return false;
+		}
+	}
+
+	/* RFC 7914 section 11 */
+	uint8_t key[KEY_SIZE];
+	std::vector<uint8_t> expected = from_hex("55ac046e56e3089fec1691c22544b605f94185216dde0465e68b9d57c20dacbc");
+	derive(KDF_PBKDF2_SHA256, "passwd", reinterpret_cast<const uint8_t *>("salt"), 4, 1, key);
+	if (!std::equal(expected.begin(), expected.end(), key)) return false;
+
+	/* Every engine must agree with the portable one, at lengths either side of each one's step */
+	std::vector<uint8_t> pattern(3 * 256 + 100);
+	for (size_t i = 0; i < pattern.size(); i++) pattern[i] = i * 7 + 3;
+
+	for (int t = CIPHER_AES_256_GCM; t < CIPHER_COUNT; t++) {
+		Type type = (Type) t;
+		Cipher reference(type, pattern.data(), ENGINE_PORTABLE);
+		Cipher fastest(type, pattern.data());
+
+		for (size_t length : {0, 1, 15, 16, 17, 127, 128, 129, 255, 256, 257, 511, 512, 513, 700}) {
+			std::vector<uint8_t> a(pattern.begin(), pattern.begin() + length + TAG_SIZE), b = a;
+
+			reference.seal(length * 31, pattern.data() + 40, length % 23, a.data(), length);
+			fastest.seal(length * 31, pattern.data() + 40, length % 23, b.data(), length);
+			if (a != b) return false;
+
+			if (!fastest.open(length * 31, pattern.data() + 40, length % 23, b.data(), length)) return false;
+			if (!std::equal(b.begin(), b.begin() + length, pattern.begin())) return false;
+
+			/* Any change must be caught */
+			a[length / 2] ^= 1;
+			if (reference.open(length * 31, pattern.data() + 40, length % 23, a.data(), length)) return false;
+		}
+	}
+
+	return true;
+}
@@ -0,0 +1,101 @@
+/*
+CIPHER.HPP
+NICK WILSON
+2019
+*/
+
+#ifndef OBJ_CIPHER
+#define OBJ_CIPHER
+
+#include <string>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Authenticated encryption for file chunks, AES-256-GCM or ChaCha20-Poly1305 */
+/* Each chunk is sealed on its own under one key, with a 64 bit number as its nonce, so chunks */
+/* can be sealed and opened in any order on any thread. A sealed chunk is its ciphertext */
+/* followed by a TAG_SIZE byte tag. The fastest engine the CPU supports is picked once */
+class Cipher{
+public:
+	enum Type {
+		CIPHER_NONE = 0,
+		CIPHER_AES_256_GCM,			/* NIST SP 800-38D, 96 bit nonce */
+		CIPHER_CHACHA20_POLY1305,	/* RFC 8439 */
+		CIPHER_COUNT
+	};
+
+	enum Kdf {
+		KDF_NONE = 0,
+		KDF_PBKDF2_SHA256,	/* PBKDF2 with HMAC-SHA-256, RFC 8018 */
+		KDF_COUNT
+	};
+
+	enum Engine {
+		ENGINE_PORTABLE = 0,	/* Byte at a time AES and 4 bit table GHASH, one ChaCha20 block at a time */
+		ENGINE_AESNI,			/* AES-GCM with AES-NI and PCLMULQDQ, 8 blocks at a time */
+		ENGINE_VAES,			/* AES-GCM with VAES and VPCLMULQDQ on 256 bit vectors, 16 blocks at a time */
+		ENGINE_AVX2,			/* ChaCha20 across AVX2 lanes, 8 blocks at a time */
+		ENGINE_COUNT
+	};
+
+	static const size_t KEY_SIZE = 32;
+	static const size_t TAG_SIZE = 16;
+	static const size_t NONCE_SIZE = 12;
+	static const size_t SALT_SIZE = 16;
+
+	/* Key derivation work for new passphrases, about half a second on one core */
+	static const uint32_t KDF_ITERATIONS = 600000;
+
+	/* Most a stored key derivation may ask for, so a crafted index can't stall a reader for hours */
+	static const uint32_t KDF_ITERATIONS_MAX = 10 * KDF_ITERATIONS;
+
+	/* Neither seals nor opens anything until given a key */
+	Cipher() {}
+
+	/* On the fastest engine available for type */
+	Cipher(Type type, const uint8_t *key);
+	Cipher(Type type, const uint8_t *key, Engine engine);
+
+	Type type() const { return cipher; }
+	Engine engine() const { return kernel; }
+
+	/* Encrypt length bytes in place, then write the tag after them, which there must be room for */
+	/* aad is authenticated along with them but not encrypted */
+	void seal(uint64_t nonce, const uint8_t *aad, size_t aad_length, uint8_t *data, size_t length) const;
+
+	/* Check the tag after length bytes, then decrypt them in place */
+	/* False if the tag doesn't match, and the bytes are then left as neither */
+	bool open(uint64_t nonce, const uint8_t *aad, size_t aad_length, uint8_t *data, size_t length) const;
+
+	/* A key from a passphrase */
+	static void derive(Kdf kdf, const std::string &passphrase, const uint8_t *salt, size_t salt_length, uint32_t iterations, uint8_t *key);
+
+	/* AES-GCM where the CPU has AES instructions, ChaCha20-Poly1305 where it doesn't */
+	static Type preferred();
+
+	static const char *name(Type type);
+	static const char *kdf_name(Kdf kdf);
+
+	static bool available(Engine engine);
+	static Engine active(Type type);
+	static const char *engine_name(Engine engine);
+
+	/* Check every available engine against the published test vectors, and against each other */
+	static bool self_test();
+
+private:
+	Type cipher = CIPHER_NONE;
+	Engine kernel = ENGINE_PORTABLE;
+
+	uint8_t key_bytes[KEY_SIZE] = {};
+
+	/* AES-256 round keys, and GHASH's H with its powers, byte reversed, for the engines that use them */
+	uint8_t round_keys[15 * 16] = {};
+	uint8_t h_powers[16 * 16] = {};
+
+	/* Seal or open with the whole 12 byte nonce, returning the tag */
+	void crypt(const uint8_t *nonce, const uint8_t *aad, size_t aad_length, uint8_t *data, size_t length, bool sealing, uint8_t *tag) const;
+};
+
+#endif
@@ -0,0 +1,245 @@
+/*
+CODEC.CPP
+NICK WILSON
+2019
+*/
+
+#include "Codec.hpp"
+#include "Stats.hpp"
+
+#include <vector>
+
+#include <string.h>
+
+/* LZ4 block format */
+/*
+Sequences of:
+	1 byte token: literal count in the high 4 bits, match length - 4 in the low 4
+	Literal count over 14 carries on in bytes of 255 and a final byte under 255
+	N byte literals
+	2 byte little endian match offset, back from the current output position
+	Match length over 18 carries on the same way
+The last sequence is literals only, and the last 5 bytes are always literals
+*/
+static const size_t LZ4_MIN_MATCH = 4;
+static const size_t LZ4_LAST_LITERALS = 5;
+static const size_t LZ4_MATCH_FIND_LIMIT = 12;
+static const size_t LZ4_MAX_OFFSET = 0xFFFF;
+static const int LZ4_HASH_LOG = 16;
+
+static uint32_t read32(const uint8_t *p) {
+	uint32_t x;
+	memcpy(&x, p, sizeof(uint32_t));
+	return x;
+}
+
+static uint32_t hash32(uint32_t x) {
+	return (x * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+/* Write a length's overflow bytes past the 15 held in the token */
+static uint8_t *put_length(uint8_t *op, size_t length) {
+	for (; length >= 0xFF; length -= 0xFF) *op++ = 0xFF;
+	*op++ = static_cast<uint8_t>(length);
+	return op;
+}
+
+static size_t lz4_compress(const uint8_t *in, size_t length, uint8_t *out, size_t capacity) {
+	const uint8_t *ip = in;
+	const uint8_t *anchor = in;
+	const uint8_t *iend = in + length;
+	uint8_t *op = out;
+	uint8_t *oend = out + capacity;
+
+	/* Positions of recent 4 byte strings, one table per thread so blocks compress in parallel */
+	static thread_local std::vector<uint32_t> table;
+	table.assign(1 << LZ4_HASH_LOG, 0);
+
+	/* Literal run from anchor to ip, then a match if match_length is set */
+	auto emit = [&](size_t offset, size_t match_length) {
+		size_t literals = ip - anchor;
+
+		/* Token, both length tails, the literals and the offset */
+		if ((size_t) (oend - op) < 1 + literals / 0xFF + 1 + literals + 2 + match_length / 0xFF + 1) return false;
+
+		uint8_t *token = op++;
+		*token = (literals >= 15) ? 0xF0 : static_cast<uint8_t>(literals << 4);
+		if (literals >= 15) op = put_length(op, literals - 15);
+
+		memcpy(op, anchor, literals);
+		op += literals;
+
+		if (!match_length) return true;
+
+		*op++ = static_cast<uint8_t>(offset);
+		*op++ = static_cast<uint8_t>(offset >> 8);
+
+		size_t extra = match_length - LZ4_MIN_MATCH;
+		*token |= (extra >= 15) ? 0x0F : static_cast<uint8_t>(extra);
+		if (extra >= 15) op = put_length(op, extra - 15);
+
+		return true;
+	};
+
+	if (length > LZ4_MATCH_FIND_LIMIT) {
+		const uint8_t *match_start_limit = iend - LZ4_MATCH_FIND_LIMIT;
+		const uint8_t *match_end_limit = iend - LZ4_LAST_LITERALS;
+
+		table[hash32(read32(ip))] = 0;
+		ip++;
+
+		while (ip < match_start_limit) {
+			/* Look for a match, stepping further the longer nothing turns up */
+			const uint8_t *match = nullptr;
+			unsigned misses = 1 << 6;
+
+			while (ip < match_start_limit) {
+				uint32_t h = hash32(read32(ip));
+				const uint8_t *candidate = in + table[h];
+				table[h] = ip - in;
+
+				if (candidate < ip && (size_t) (ip - candidate) <= LZ4_MAX_OFFSET && read32(candidate) == read32(ip)) {
+					match = candidate;
+					break;
+				}
+
+				ip += misses++ >> 6;
+			}
+
+			if (!match) break;
+
+			/* Extend backwards over literals that also match */
+			while (ip > anchor && match > in && ip[-1] == match[-1]) {
+				ip--;
+				match--;
+			}
+
+			/* Then forwards, stopping short of the last literals */
+			const uint8_t *end = ip + LZ4_MIN_MATCH;
+			const uint8_t *ref = match + LZ4_MIN_MATCH;
+			while (end < match_end_limit && *end == *ref) {
+				end++;
+				ref++;
+			}
+
+			if (!emit(ip - match, end - ip)) return 0;
+
+			ip = end;
+			anchor = ip;
+
+			if (ip < match_start_limit) table[hash32(read32(ip - 2))] = ip - 2 - in;
+		}
+	}
+
+	ip = iend;
+	if (!emit(0, 0)) return 0;
+
+	return op - out;
+}
+
+/* Read a length's overflow bytes, false if they run off the input */
+static bool get_length(const uint8_t *&ip, const uint8_t *iend, size_t &length) {
+	uint8_t b;
+
+	do {
+		if (ip >= iend) return false;
+		b = *ip++;
+		length += b;
+	} while (b == 0xFF);
+
+	return true;
+}
+
+static bool lz4_decompress(const uint8_t *in, size_t length, uint8_t *out, size_t out_length) {
+	const uint8_t *ip = in;
+	const uint8_t *iend = in + length;
+	uint8_t *op = out;
+	uint8_t *oend = out + out_length;
+
+	while (ip < iend) {
+		uint8_t token = *ip++;
+
+		size_t literals = token >> 4;
+		if (literals == 15 && !get_length(ip, iend, literals)) return false;
+		if (literals > (size_t) (iend - ip) || literals > (size_t) (oend - op)) return false;
+
+		memcpy(op, ip, literals);
+		op += literals;
+		ip += literals;
+
+		/* Last sequence has no match */
+		if (ip == iend) break;
+
+		if (iend - ip < 2) return false;
+		size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+
+		if (!offset || offset > (size_t) (op - out)) return false;
+
+		size_t match_length = token & 0x0F;
+		if (match_length == 15 && !get_length(ip, iend, match_length)) return false;
+		match_length += LZ4_MIN_MATCH;
+
+		if (match_length > (size_t) (oend - op)) return false;
+
+		/* Matches may overlap the bytes they produce, repeating a short run */
+		const uint8_t *match = op - offset;
+		if (offset >= match_length) {
+			memcpy(op, match, match_length);
+		}
+		else if (offset >= 8) {
+			size_t i = 0;
+			for (; i + 8 <= match_length; i += 8) memcpy(op + i, match + i, 8);
+			for (; i < match_length; i++) op[i] = match[i];
+		}
+		else {
+			for (size_t i = 0; i < match_length; i++) op[i] = match[i];
+		}
+		op += match_length;
+	}
+
+	return op == oend;
+}
+
+/* Public */
+size_t Codec::bound(size_t length) {
+	return length + length / 0xFF + 16;
+}
+
+size_t Codec::compress(Type type, const uint8_t *in, size_t length, uint8_t *out, size_t capacity) {
+	Stats::Scope timing(Stats::PHASE_COMPRESS, length);
+
+	switch (type) {
+		case CODEC_LZ4:
+			return lz4_compress(in, length, out, capacity);
+		case CODEC_NONE:
+			if (length > capacity) return 0;
+			memcpy(out, in, length);
+			return length;
+		default:
+			return 0;
+	}
+}
+
+bool Codec::decompress(Type type, const uint8_t *in, size_t length, uint8_t *out, size_t out_length) {
+	Stats::Scope timing(Stats::PHASE_COMPRESS, out_length);
+
+	switch (type) {
+		case CODEC_LZ4:
+			return lz4_decompress(in, length, out, out_length);
+		case CODEC_NONE:
+			if (length != out_length) return false;
+			memcpy(out, in, length);
+			return true;
+		default:
+			return false;
+	}
+}
+
+const char *Codec::name(Type type) {
+	switch (type) {
+		case CODEC_NONE: return "none";
+		case CODEC_LZ4: return "lz4";
+		default: return "unknown";
+	}
+}
@@ -0,0 +1,35 @@
+/*
+CODEC.HPP
+NICK WILSON
+2019
+*/
+
+#ifndef OBJ_CODEC
+#define OBJ_CODEC
+
+#include <cstddef>
+#include <cstdint>
+
+/* Block compression for payload data */
+/* Every block is compressed on its own, so blocks can be done in parallel either way */
+class Codec{
+public:
+	enum Type {
+		CODEC_NONE = 0,	/* Stored as is */
+		CODEC_LZ4,		/* LZ4 block format, built in */
+		CODEC_COUNT
+	};
+
+	/* Most bytes compress() can need for length bytes of input */
+	static size_t bound(size_t length);
+
+	/* Compressed size, or 0 if it doesn't fit in capacity */
+	static size_t compress(Type type, const uint8_t *in, size_t length, uint8_t *out, size_t capacity);
+
+	/* False unless the input decodes to exactly out_length bytes */
+	static bool decompress(Type type, const uint8_t *in, size_t length, uint8_t *out, size_t out_length);
+
+	static const char *name(Type type);
+};
+
+#endif
@@ -0,0 +1,150 @@
+/*
+CONTENTCHUNKER.CPP
+NICK WILSON
+2019
+*/
+
+#include "ContentChunker.hpp"
+#include "Stats.hpp"
+
+#include <algorithm>
+
+#include <string.h>
+#include <unistd.h>
+
+/* Gear hash table, one random 64 bit value per byte, generated by the compiler from SplitMix64 */
+struct GearTable {
+	uint64_t table[256];
+
+	constexpr GearTable() : table() {
+		uint64_t state = 0;
+
+		for (int n = 0; n < 256; n++) {
+			state += 0x9E3779B97F4A7C15ULL;
+
+			uint64_t z = state;
+			z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+			z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+			table[n] = z ^ (z >> 31);
+		}
+	}
+};
+
+static constexpr GearTable GEAR_TABLE;
+
+/* Spot check against the SplitMix64 reference output, evaluated by the compiler */
+static_assert(GEAR_TABLE.table[0] == 0xE220A8397B1DCDAFULL, "Gear table generation is broken");
+static_assert(GEAR_TABLE.table[255] == 0x5A5832BB47BCF19EULL, "Gear table generation is broken");
+
+/* Blocks are read in this many bytes at a time, cut, then hashed together */
+static const uint64_t SPLIT_BUFFER_SIZE = 4 * (uint64_t) ContentChunker::MAX_SIZE;
+
+/* Ends of every 64 byte window in data[start, end) that hashes to a boundary, in order */
+/* Each byte shifts the last out of the top bits, so those only depend on the last 64 bytes */
+/* and any stretch can be scanned on its own. Windows that would start before data are skipped */
+static void scan(const uint8_t *data, uint64_t start, uint64_t end, std::vector<uint64_t> &found) {
+	const int shift = 64 - ContentChunker::AVERAGE_BITS;
+	uint64_t h = 0;
+
+	if (start < 63) start = 63;
+	if (start >= end) return;
+
+	uint64_t i = (start < 64) ? 0 : start - 64;
+
+	for (; i < start; i++) h = (h << 1) + GEAR_TABLE.table[data[i]];
+
+	/* Two bytes a step halves the chain of dependent adds, and one test covers both */
+	for (; i + 1 < end; i += 2) {
+		uint64_t g = GEAR_TABLE.table[data[i]];
+		uint64_t first = (h << 1) + g;
+		h = (h << 2) + ((g << 1) + GEAR_TABLE.table[data[i + 1]]);
+
+		if (!(std::min(first, h) >> shift)) {
+			if (!(first >> shift)) found.push_back(i + 1);
+			if (!(h >> shift)) found.push_back(i + 2);
+		}
+	}
+
+	for (; i < end; i++) {
+		h = (h << 1) + GEAR_TABLE.table[data[i]];
+		if (!(h >> shift)) found.push_back(i + 1);
+	}
+}
+
+bool ContentChunker::split(int fd, uint64_t offset, uint64_t length, BlockHash::Type hash, TreeHash *digest, ThreadPool &pool, std::vector<IndexEntry> &blocks, std::string &error) {
+	Stats::Scope timing(Stats::PHASE_INDEX, length);
+
+	std::vector<uint8_t> buffer(length < SPLIT_BUFFER_SIZE ? length : SPLIT_BUFFER_SIZE);
+	std::vector<uint64_t> ends;
+	uint64_t done = 0;
+	uint64_t held = 0;
+
+	blocks.clear();
+
+	while (done < length) {
+		/* Top the buffer up behind whatever was left from last time */
+		uint64_t n = buffer.size() - held;
+		if (n > length - done - held) n = length - done - held;
+
+		{
+			Stats::Scope reading(Stats::PHASE_READ, n);
+			uint64_t got = 0;
+
+			while (got < n) {
+				ssize_t r = pread(fd, buffer.data() + held + got, n - got, offset + done + held + got);
+				if (r <= 0) {
+					error = "Target file ended early. Was it modified?";
+					return false;
+				}
+				got += r;
+			}
+		}
+
+		/* Boundaries in the new data are found across the pool, then blocks are cut between them in order */
+		size_t parts = pool.size();
+		std::vector<std::vector<uint64_t>> found(parts);
+
+		pool.parallel_for(parts, [&](size_t p) {
+			scan(buffer.data(), held + n * p / parts, held + n * (p + 1) / parts, found[p]);
+		});
+
+		held += n;
+		for (const std::vector<uint64_t> &part : found) ends.insert(ends.end(), part.begin(), part.end());
+
+		/* Cut every block that can't be affected by data still to come */
+		bool last = done + held == length;
+		size_t first = blocks.size();
+		uint64_t used = 0;
+		auto next = ends.begin();
+
+		while (used < held && (last || held - used >= MAX_SIZE)) {
+			uint64_t limit = (held - used < MAX_SIZE) ? held - used : MAX_SIZE;
+			uint64_t size = limit;
+
+			/* The first boundary at least MIN_SIZE bytes in, if there is one before limit */
+			if (limit > MIN_SIZE) {
+				next = std::upper_bound(next, ends.end(), used + MIN_SIZE);
+				if (next != ends.end() && *next - used <= limit) size = *next - used;
+			}
+
+			blocks.push_back({done + used, 0, (uint32_t) size, BlockHash::Digest()});
+			used += size;
+		}
+
+		pool.parallel_for(blocks.size() - first, [&](size_t i) {
+			IndexEntry &block = blocks[first + i];
+			block.hash = BlockHash::hash(hash, buffer.data() + (block.offset - done), block.stored);
+			if (digest) digest->update(block.offset, buffer.data() + (block.offset - done), block.stored);
+		});
+
+		/* What is left moves to the front, along with the boundaries found in it */
+		memmove(buffer.data(), buffer.data() + used, held - used);
+		held -= used;
+		done += used;
+
+		ends.erase(ends.begin(), std::upper_bound(ends.begin(), ends.end(), used));
+		for (uint64_t &end : ends) end -= used;
+	}
+
+	return true;
+}
@@ -0,0 +1,39 @@
+/*
+CONTENTCHUNKER.HPP
+NICK WILSON
+2019
+*/
+
+#ifndef OBJ_CONTENTCHUNKER
+#define OBJ_CONTENTCHUNKER
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#include "BlockHash.hpp"
+#include "FileIndex.hpp"
+#include "PngPack.hpp"
+#include "ThreadPool.hpp"
+#include "TreeHash.hpp"
+
+/* Splits a payload into blocks at content-defined boundaries */
+/* A boundary falls wherever the last 64 bytes hash to a chosen pattern, so an insertion */
+/* or deletion only moves the boundaries around it and every other block stays the same */
+class ContentChunker{
+public:
+	/* Blocks are between MIN_SIZE and MAX_SIZE bytes, bar the last, about 1.25 MiB on average */
+	static const uint32_t MIN_SIZE = 0x40000;
+	static const uint32_t MAX_SIZE = CHUNK_SIZE_DATA_MAX;
+
+	/* Past MIN_SIZE, each byte ends a block with a chance of 1 in 2^AVERAGE_BITS */
+	static const int AVERAGE_BITS = 20;
+
+	/* Split length bytes of fd from offset into blocks, with offsets counted from there */
+	/* Each block's stored length is its size. Boundaries are found and blocks hashed in parallel */
+	/* Each block is also added to digest, if there is one, while it is still in memory */
+	static bool split(int fd, uint64_t offset, uint64_t length, BlockHash::Type hash, TreeHash *digest, ThreadPool &pool, std::vector<IndexEntry> &blocks, std::string &error);
+};
+
+#endif
@@ -0,0 +1,434 @@
+/*
+CRC32.CPP
+NICK WILSON
+2019
+*/
+
+#include "Crc32.hpp"
+#include "Stats.hpp"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CRC32_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define CRC32_ARM
+#include <arm_neon.h>
+#if defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
+/* All engines work on the raw CRC register (pre and post inversion done by the caller) */
+typedef uint32_t (*crc_fn)(uint32_t c, const uint8_t *buf, size_t len);
+
+/* Tables */
+/* table[0] is the reference table from RFC 2083 section 15 */
+/* table[k][n] is the CRC of byte n followed by k zero bytes, used by slice-by-16 */
+/* Generated at compile time, so there is one read-only copy and nothing to build at startup */
+struct CrcTables {
+	uint32_t table[16][256] = {};
+
+	constexpr CrcTables() {
+		for (uint32_t n = 0; n < 256; n++) {
+			uint32_t c = n;
+			for (uint8_t k = 0; k < 8; k++) {
+				if (c & 1)
+					c = 0xedb88320L ^ (c >> 1);
+				else
+					c = c >> 1;
+			}
+			table[0][n] = c;
+		}
+		for (uint32_t n = 0; n < 256; n++) {
+			for (uint8_t k = 1; k < 16; k++) {
+				table[k][n] = (table[k - 1][n] >> 8) ^ table[0][table[k - 1][n] & 0xff];
+			}
+		}
+	}
+};
+
+static constexpr CrcTables CRC_TABLES;
+
+/* Spot check against RFC 2083, evaluated by the compiler */
+static_assert(CRC_TABLES.table[0][1] == 0x77073096, "CRC table generation is broken");
+static_assert(CRC_TABLES.table[0][255] == 0x2d02ef8d, "CRC table generation is broken");
+
+static constexpr const CrcTables &crc_tables() {
+	return CRC_TABLES;
+}
+
+static inline uint32_t load32_le(const uint8_t *p) {
+	uint32_t x;
+	memcpy(&x, p, sizeof(uint32_t));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	x = __builtin_bswap32(x);
+#endif
+	return x;
+}
+
+/* Engines */
+static uint32_t crc_table(uint32_t c, const uint8_t *buf, size_t len) {
+	const uint32_t *t = crc_tables().table[0];
+	for (size_t n = 0; n < len; n++) c = t[(c ^ buf[n]) & 0xff] ^ (c >> 8);
+	return c;
+}
+
+static uint32_t crc_slice(uint32_t c, const uint8_t *buf, size_t len) {
+	const uint32_t (*t)[256] = crc_tables().table;
+
+	while (len >= 16) {
+		uint32_t a = load32_le(buf) ^ c;
+		uint32_t b = load32_le(buf + 4);
+		uint32_t d = load32_le(buf + 8);
+		uint32_t e = load32_le(buf + 12);
+
+		c = t[15][a & 0xff] ^ t[14][(a >> 8) & 0xff] ^ t[13][(a >> 16) & 0xff] ^ t[12][a >> 24] ^
+			t[11][b & 0xff] ^ t[10][(b >> 8) & 0xff] ^ t[9][(b >> 16) & 0xff] ^ t[8][b >> 24] ^
+			t[7][d & 0xff] ^ t[6][(d >> 8) & 0xff] ^ t[5][(d >> 16) & 0xff] ^ t[4][d >> 24] ^
+			t[3][e & 0xff] ^ t[2][(e >> 8) & 0xff] ^ t[1][(e >> 16) & 0xff] ^ t[0][e >> 24];
+
+		buf += 16;
+		len -= 16;
+	}
+
+	return crc_table(c, buf, len);
+}
+
+/* Carry-less multiply folding */
+/* See: Intel, "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction" */
+/* Constants are the bit-reflected fold multipliers and Barrett constants for 0x04C11DB7 */
+static const uint64_t CLMUL_K1K2[] = {0x0154442bd4, 0x01c6e41596};
+static const uint64_t CLMUL_K3K4[] = {0x01751997d0, 0x00ccaa009e};
+static const uint64_t CLMUL_K5K0[] = {0x0163cd6124, 0x0000000000};
+static const uint64_t CLMUL_POLY[] = {0x01db710641, 0x01f7011641};
+
+#if defined(CRC32_X86)
+
+/* len must be at least 64 and a multiple of 16 */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc_clmul_fold(uint32_t c, const uint8_t *buf, size_t len) {
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+	x1 = _mm_loadu_si128((const __m128i *) (buf + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *) (buf + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *) (buf + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *) (buf + 0x30));
+
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(c));
+	x0 = _mm_loadu_si128((const __m128i *) CLMUL_K1K2);
+
+	buf += 64;
+	len -= 64;
+
+	/* Fold four lanes of 128 bits in parallel */
+	while (len >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+		y5 = _mm_loadu_si128((const __m128i *) (buf + 0x00));
+		y6 = _mm_loadu_si128((const __m128i *) (buf + 0x10));
+		y7 = _mm_loadu_si128((const __m128i *) (buf + 0x20));
+		y8 = _mm_loadu_si128((const __m128i *) (buf + 0x30));
+
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+
+		buf += 64;
+		len -= 64;
+	}
+
+	/* Fold the four lanes into one */
+	x0 = _mm_loadu_si128((const __m128i *) CLMUL_K3K4);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	/* Remaining 16 byte blocks */
+	while (len >= 16) {
+		x2 = _mm_loadu_si128((const __m128i *) buf);
+
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+		buf += 16;
+		len -= 16;
+	}
+
+	/* Fold 128 bits down to 64 */
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+
+	x0 = _mm_loadl_epi64((const __m128i *) CLMUL_K5K0);
+
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction down to 32 bits */
+	x0 = _mm_loadu_si128((const __m128i *) CLMUL_POLY);
+
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return _mm_extract_epi32(x1, 1);
+}
+
+static bool clmul_supported() {
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+	return (ecx & bit_PCLMUL) && (ecx & bit_SSE4_1);
+}
+
+#elif defined(CRC32_ARM)
+
+#if defined(__clang__)
+#define CRC32_TARGET_PMULL __attribute__((target("aes")))
+#else
+#define CRC32_TARGET_PMULL __attribute__((target("+crypto")))
+#endif
+
+/* Equivalents of _mm_clmulepi64_si128 with immediates 0x00, 0x11 and 0x10 */
+CRC32_TARGET_PMULL
+static inline uint64x2_t pmull_00(uint64x2_t a, uint64x2_t b) {
+	return vreinterpretq_u64_p128(vmull_p64((poly64_t) vgetq_lane_u64(a, 0), (poly64_t) vgetq_lane_u64(b, 0)));
+}
+
+CRC32_TARGET_PMULL
+static inline uint64x2_t pmull_11(uint64x2_t a, uint64x2_t b) {
+	return vreinterpretq_u64_p128(vmull_p64((poly64_t) vgetq_lane_u64(a, 1), (poly64_t) vgetq_lane_u64(b, 1)));
+}
+
+CRC32_TARGET_PMULL
+static inline uint64x2_t pmull_10(uint64x2_t a, uint64x2_t b) {
+	return vreinterpretq_u64_p128(vmull_p64((poly64_t) vgetq_lane_u64(a, 0), (poly64_t) vgetq_lane_u64(b, 1)));
+}
+
+static inline uint64x2_t shift_bytes_right(uint64x2_t x, const int n) {
+	const uint8x16_t zero = vdupq_n_u8(0);
+	if (n == 8) return vreinterpretq_u64_u8(vextq_u8(vreinterpretq_u8_u64(x), zero, 8));
+	return vreinterpretq_u64_u8(vextq_u8(vreinterpretq_u8_u64(x), zero, 4));
+}
+
+/* len must be at least 64 and a multiple of 16 */
+CRC32_TARGET_PMULL
+static uint32_t crc_clmul_fold(uint32_t c, const uint8_t *buf, size_t len) {
+	uint64x2_t x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+	x1 = vld1q_u64((const uint64_t *) (buf + 0x00));
+	x2 = vld1q_u64((const uint64_t *) (buf + 0x10));
+	x3 = vld1q_u64((const uint64_t *) (buf + 0x20));
+	x4 = vld1q_u64((const uint64_t *) (buf + 0x30));
+
+	x1 = veorq_u64(x1, vsetq_lane_u64((uint64_t) c, vdupq_n_u64(0), 0));
+	x0 = vld1q_u64(CLMUL_K1K2);
+
+	buf += 64;
+	len -= 64;
+
+	while (len >= 64) {
+		x5 = pmull_00(x1, x0);
+		x6 = pmull_00(x2, x0);
+		x7 = pmull_00(x3, x0);
+		x8 = pmull_00(x4, x0);
+
+		x1 = pmull_11(x1, x0);
+		x2 = pmull_11(x2, x0);
+		x3 = pmull_11(x3, x0);
+		x4 = pmull_11(x4, x0);
+
+		x1 = veorq_u64(veorq_u64(x1, x5), vld1q_u64((const uint64_t *) (buf + 0x00)));
+		x2 = veorq_u64(veorq_u64(x2, x6), vld1q_u64((const uint64_t *) (buf + 0x10)));
+		x3 = veorq_u64(veorq_u64(x3, x7), vld1q_u64((const uint64_t *) (buf + 0x20)));
+		x4 = veorq_u64(veorq_u64(x4, x8), vld1q_u64((const uint64_t *) (buf + 0x30)));
+
+		buf += 64;
+		len -= 64;
+	}
+
+	x0 = vld1q_u64(CLMUL_K3K4);
+
+	x5 = pmull_00(x1, x0);
+	x1 = veorq_u64(veorq_u64(pmull_11(x1, x0), x2), x5);
+	x5 = pmull_00(x1, x0);
+	x1 = veorq_u64(veorq_u64(pmull_11(x1, x0), x3), x5);
+	x5 = pmull_00(x1, x0);
+	x1 = veorq_u64(veorq_u64(pmull_11(x1, x0), x4), x5);
+
+	while (len >= 16) {
+		x2 = vld1q_u64((const uint64_t *) buf);
+		x5 = pmull_00(x1, x0);
+		x1 = veorq_u64(veorq_u64(pmull_11(x1, x0), x2), x5);
+
+		buf += 16;
+		len -= 16;
+	}
+
+	x2 = pmull_10(x1, x0);
+	x3 = vreinterpretq_u64_u32((uint32x4_t) {~0u, 0, ~0u, 0});
+	x1 = shift_bytes_right(x1, 8);
+	x1 = veorq_u64(x1, x2);
+
+	x0 = vld1q_u64(CLMUL_K5K0);
+
+	x2 = shift_bytes_right(x1, 4);
+	x1 = vandq_u64(x1, x3);
+	x1 = pmull_00(x1, x0);
+	x1 = veorq_u64(x1, x2);
+
+	x0 = vld1q_u64(CLMUL_POLY);
+
+	x2 = vandq_u64(x1, x3);
+	x2 = pmull_10(x2, x0);
+	x2 = vandq_u64(x2, x3);
+	x2 = pmull_00(x2, x0);
+	x1 = veorq_u64(x1, x2);
+
+	return vgetq_lane_u32(vreinterpretq_u32_u64(x1), 1);
+}
+
+static bool clmul_supported() {
+#if defined(__linux__) && defined(HWCAP_PMULL)
+	return getauxval(AT_HWCAP) & HWCAP_PMULL;
+#elif defined(__APPLE__)
+	return true;
+#else
+	return false;
+#endif
+}
+
+#endif
+
+#if defined(CRC32_X86) || defined(CRC32_ARM)
+static uint32_t crc_clmul(uint32_t c, const uint8_t *buf, size_t len) {
+	if (len >= 64) {
+		size_t n = len & ~(size_t) 15;
+		c = crc_clmul_fold(c, buf, n);
+		buf += n;
+		len -= n;
+	}
+	return crc_slice(c, buf, len);
+}
+#else
+static bool clmul_supported() {
+	return false;
+}
+
+static uint32_t crc_clmul(uint32_t c, const uint8_t *buf, size_t len) {
+	return crc_slice(c, buf, len);
+}
+#endif
+
+static const crc_fn CRC_ENGINES[Crc32::ENGINE_COUNT] = {crc_table, crc_slice, crc_clmul};
+
+static Crc32::Engine detect_engine() {
+	if (clmul_supported()) return Crc32::ENGINE_CLMUL;
+	return Crc32::ENGINE_SLICE;
+}
+
+/* Public */
+Crc32::Engine Crc32::active() {
+	static const Engine engine = detect_engine();
+	return engine;
+}
+
+bool Crc32::available(Engine engine) {
+	if (engine == ENGINE_CLMUL) return clmul_supported();
+	return engine < ENGINE_COUNT;
+}
+
+const char *Crc32::engine_name(Engine engine) {
+	switch (engine) {
+		case ENGINE_TABLE:
+			return "table";
+		case ENGINE_SLICE:
+			return "slice-by-16";
+		case ENGINE_CLMUL:
+#if defined(CRC32_ARM)
+			return "pmull";
+#else
+			return "pclmulqdq";
+#endif
+		default:
+			return "unknown";
+	}
+}
+
+uint32_t Crc32::update(uint32_t crc, const uint8_t *buf, size_t len) {
+	static const crc_fn fn = CRC_ENGINES[active()];
+	Stats::Scope timing(Stats::PHASE_CRC, len);
+
+	return fn(crc ^ 0xffffffffL, buf, len) ^ 0xffffffffL;
+}
+
+uint32_t Crc32::calc(const uint8_t *buf, size_t len) {
+	return update(0, buf, len);
+}
+
+uint32_t Crc32::update_with(Engine engine, uint32_t crc, const uint8_t *buf, size_t len) {
+	return CRC_ENGINES[engine](crc ^ 0xffffffffL, buf, len) ^ 0xffffffffL;
+}
+
+bool Crc32::self_test() {
+	const uint8_t check[] = {'1', '2', '3', '4', '5', '6', '7', '8', '9'};
+	const size_t SIZE = 4096 + 16;
+	uint8_t buf[SIZE];
+
+	/* Cheap LCG, the content only needs to be irregular */
+	uint32_t seed = 0x2083;
+	for (size_t i = 0; i < SIZE; i++) {
+		seed = seed * 1103515245 + 12345;
+		buf[i] = seed >> 16;
+	}
+
+	for (int e = 0; e < ENGINE_COUNT; e++) {
+		Engine engine = (Engine) e;
+		if (!available(engine)) continue;
+
+		/* Standard check value for this polynomial */
+		if (update_with(engine, 0, check, sizeof(check)) != 0xCBF43926) return false;
+
+		/* Every length around the fold thresholds, at every alignment */
+		for (size_t offset = 0; offset < 16; offset++) {
+			for (size_t len = 0; len + offset <= SIZE; len += (len < 320) ? 1 : 61) {
+				uint32_t expected = update_with(ENGINE_TABLE, 0, buf + offset, len);
+				if (update_with(engine, 0, buf + offset, len) != expected) return false;
+
+				/* Incremental updates must match a single pass */
+				size_t split = len / 3;
+				uint32_t c = update_with(engine, 0, buf + offset, split);
+				if (update_with(engine, c, buf + offset + split, len - split) != expected) return false;
+			}
+		}
+	}
+
+	return true;
+}
@@ -0,0 +1,39 @@
+/*
+CRC32.HPP
+NICK WILSON
+2019
+*/
+
+#ifndef OBJ_CRC32
+#define OBJ_CRC32
+
+#include <cstddef>
+#include <cstdint>
+
+/* CRC-32 engine (ISO-HDLC/PNG polynomial, reflected 0xEDB88320) */
+/* The fastest variant supported by the CPU is picked once, on first use */
+class Crc32{
+public:
+	enum Engine {
+		ENGINE_TABLE = 0,	/* One byte per step, reference implementation from RFC 2083 */
+		ENGINE_SLICE,		/* Slice-by-16, portable */
+		ENGINE_CLMUL,		/* Carry-less multiply folding (x86 PCLMULQDQ / ARMv8 PMULL) */
+		ENGINE_COUNT
+	};
+
+	/* Update a finished CRC with more data. Start from 0 for a new CRC */
+	static uint32_t update(uint32_t crc, const uint8_t *buf, size_t len);
+	static uint32_t calc(const uint8_t *buf, size_t len);
+
+	/* As above, but forcing a specific engine (must be available) */
+	static uint32_t update_with(Engine engine, uint32_t crc, const uint8_t *buf, size_t len);
+
+	static bool available(Engine engine);
+	static Engine active();
+	static const char *engine_name(Engine engine);
+
+	/* Check every available engine against the reference and the RFC check value */
+	static bool self_test();
+};
+
+#endif
@@ -0,0 +1,192 @@
+/*
+FILECOPY.CPP
+NICK WILSON
+2019
+*/
+
+#include "FileCopy.hpp"
+#include "Stats.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <utime.h>
+#include <vector>
+#include <sys/stat.h>
+
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
+
+/* Largest single request, kept under the 2 GiB limit of the Linux calls */
+static const size_t COPY_STEP = 0x40000000;
+
+/* Buffer size for the plain read/write fallback */
+static const size_t COPY_BUFFER_SIZE = 0x100000;
+
+bool copy_range(int in_fd, uint64_t offset, uint64_t length, int out_fd) {
+	Stats::Scope timing(Stats::PHASE_WRITE, length);
+
+#ifdef POSIX_FADV_SEQUENTIAL
+	/* Readers may have asked for no readahead, which only slows a straight copy */
+	posix_fadvise(in_fd, offset, length, POSIX_FADV_SEQUENTIAL);
+#endif
+
+#if defined(__linux__)
+	/* copy_file_range can share extents or copy inside the filesystem */
+	/* Unsupported kernels, filesystems or cross-device copies fall back */
+	bool try_copy_file_range = true;
+	bool try_sendfile = true;
+
+	while (length) {
+		size_t step = (length > COPY_STEP) ? COPY_STEP : length;
+		ssize_t n = -1;
+
+		/* Some kernels report 0 rather than an error for files they can't handle */
+		/* so that falls back too, and the final copy finds any real early end */
+		if (try_copy_file_range) {
+			loff_t in_off = offset;
+			n = copy_file_range(in_fd, &in_off, out_fd, nullptr, step, 0);
+			if (!n || (n < 0 && errno != EINTR)) try_copy_file_range = false;
+		}
+		else if (try_sendfile) {
+			off_t in_off = offset;
+			n = sendfile(out_fd, in_fd, &in_off, step);
+			if (!n || (n < 0 && errno != EINTR)) try_sendfile = false;
+		}
+		else {
+			break;
+		}
+
+		if (n <= 0) continue;
+
+		offset += n;
+		length -= n;
+	}
+#endif
+
+	/* Anything left goes through user space */
+	if (!length) return true;
+
+	std::vector<uint8_t> buffer(COPY_BUFFER_SIZE < length ? COPY_BUFFER_SIZE : length);
+
+	while (length) {
+		size_t step = (length > buffer.size()) ? buffer.size() : length;
+		ssize_t n = pread(in_fd, buffer.data(), step, offset);
+
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return false;
+		if (!write_all(out_fd, buffer.data(), n)) return false;
+
+		offset += n;
+		length -= n;
+	}
+
+	return true;
+}
+
+bool write_all(int fd, struct iovec *iov, int count) {
+	Stats::Scope timing(Stats::PHASE_WRITE);
+
+	for (;;) {
+		while (count && !iov->iov_len) {
+			iov++;
+			count--;
+		}
+		if (!count) break;
+
+		ssize_t n = writev(fd, iov, (count > IOV_MAX) ? IOV_MAX : count);
+
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return false;
+		timing.add(n);
+
+		/* Skip whatever was written, which may end partway into a buffer */
+		while (count && (size_t) n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count) {
+			iov->iov_base = static_cast<uint8_t *>(iov->iov_base) + n;
+			iov->iov_len -= n;
+		}
+	}
+
+	return true;
+}
+
+bool write_all(int fd, const void *buffer, size_t length) {
+	struct iovec iov = {const_cast<void *>(buffer), length};
+	return write_all(fd, &iov, 1);
+}
+
+bool write_all_at(int fd, const void *buffer, size_t length, uint64_t offset) {
+	Stats::Scope timing(Stats::PHASE_WRITE, length);
+	const uint8_t *p = static_cast<const uint8_t *>(buffer);
+
+	while (length) {
+		ssize_t n = pwrite(fd, p, length, offset);
+
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return false;
+
+		p += n;
+		length -= n;
+		offset += n;
+	}
+
+	return true;
+}
+
+bool read_all(int fd, void *buffer, size_t length) {
+	Stats::Scope timing(Stats::PHASE_READ, length);
+	uint8_t *p = static_cast<uint8_t *>(buffer);
+
+	while (length) {
+		ssize_t n = read(fd, p, length);
+
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return false;
+
+		p += n;
+		length -= n;
+	}
+
+	return true;
+}
+
+bool read_up_to(int fd, void *buffer, size_t length, size_t &got) {
+	Stats::Scope timing(Stats::PHASE_READ);
+	uint8_t *p = static_cast<uint8_t *>(buffer);
+
+	got = 0;
+
+	while (got < length) {
+		ssize_t n = read(fd, p + got, length - got);
+
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0) return false;
+		if (!n) break;
+
+		got += n;
+	}
+
+	timing.add(got);
+	return true;
+}
+
+void make_parents(const std::string &path) {
+	for (size_t slash = path.find('/', 1); slash != std::string::npos; slash = path.find('/', slash + 1)) {
+		mkdir(path.substr(0, slash).c_str(), 0777);
+	}
+}
+
+bool restore_times(const std::string &path, uint32_t time_cr, uint32_t time_mod) {
+	struct utimbuf out_time;
+	out_time.actime = time_cr;
+	out_time.modtime = time_mod;
+
+	return !utime(path.c_str(), &out_time);
+}
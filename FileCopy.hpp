@@ -0,0 +1,42 @@
+/*
+FILECOPY.HPP
+NICK WILSON
+2019
+*/
+
+#ifndef OBJ_FILECOPY
+#define OBJ_FILECOPY
+
+#include <string>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/* Copy length bytes of in_fd from offset to the current position of out_fd */
+/* The kernel moves the data where it can (copy_file_range, then sendfile), */
+/* so on filesystems with reflinks the bytes may never be read at all */
+bool copy_range(int in_fd, uint64_t offset, uint64_t length, int out_fd);
+
+/* Write all of the buffers, carrying on after short writes */
+/* The iovec array is used as scratch space */
+bool write_all(int fd, struct iovec *iov, int count);
+bool write_all(int fd, const void *buffer, size_t length);
+
+/* Write all of the buffer at offset, leaving the file position as it was */
+bool write_all_at(int fd, const void *buffer, size_t length, uint64_t offset);
+
+/* Read exactly length bytes, false on error or end of file */
+bool read_all(int fd, void *buffer, size_t length);
+
+/* Read length bytes, or fewer if the file ends first, as pipes give them */
+/* got is how many came, false only on error */
+bool read_up_to(int fd, void *buffer, size_t length, size_t &got);
+
+/* Create the directories leading up to a file */
+void make_parents(const std::string &path);
+
+/* Set a file's times to those stored for it */
+bool restore_times(const std::string &path, uint32_t time_cr, uint32_t time_mod);
+
+#endif
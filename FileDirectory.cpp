@@ -0,0 +1,226 @@
+/*
+FILEDIRECTORY.CPP
+NICK WILSON
+2019
+*/
+
+#include "FileDirectory.hpp"
+#include "Stats.hpp"
+
+#include <string.h>
+
+/* Counts ahead of the buckets */
+static const uint32_t DIRECTORY_HEADER_SIZE = 2 * sizeof(uint32_t);
+static const uint32_t BUCKET_SIZE = sizeof(uint32_t);
+static const uint32_t ENTRY_SIZE = 2 * sizeof(uint64_t) + 6 * sizeof(uint32_t);
+
+/* 64 bit FNV-1a */
+static uint64_t hash_name(const char *name, size_t length) {
+	uint64_t hash = 0xCBF29CE484222325ULL;
+
+	for (size_t i = 0; i < length; i++) {
+		hash ^= static_cast<uint8_t>(name[i]);
+		hash *= 0x100000001B3ULL;
+	}
+
+	return hash;
+}
+
+static uint32_t get32(const uint8_t *data) {
+	uint32_t x;
+	memcpy(&x, data, sizeof(uint32_t));
+	return x;
+}
+
+static uint64_t get64(const uint8_t *data) {
+	uint64_t x;
+	memcpy(&x, data, sizeof(uint64_t));
+	return x;
+}
+
+/* Where each part starts, once the counts are known to fit the data */
+struct Layout {
+	uint32_t entry_count;
+	uint32_t bucket_count;
+	const uint8_t *buckets;
+	const uint8_t *entries;
+	const uint8_t *names;
+	uint32_t names_length;
+};
+
+static bool read_layout(const uint8_t *data, uint32_t length, Layout &layout) {
+	if (length < DIRECTORY_HEADER_SIZE) return false;
+
+	layout.entry_count = get32(data);
+	layout.bucket_count = get32(data + sizeof(uint32_t));
+
+	/* Buckets must be a power of two with room to spare */
+	if (!layout.bucket_count || (layout.bucket_count & (layout.bucket_count - 1))) return false;
+	if (layout.entry_count >= layout.bucket_count) return false;
+
+	uint64_t fixed = DIRECTORY_HEADER_SIZE + (uint64_t) layout.bucket_count * BUCKET_SIZE + (uint64_t) layout.entry_count * ENTRY_SIZE;
+	if (fixed > length) return false;
+
+	layout.buckets = data + DIRECTORY_HEADER_SIZE;
+	layout.entries = layout.buckets + (uint64_t) layout.bucket_count * BUCKET_SIZE;
+	layout.names = data + fixed;
+	layout.names_length = length - fixed;
+
+	return true;
+}
+
+/* Entry number n, false if its name runs outside the pool */
+static bool read_entry(const Layout &layout, uint32_t n, DirectoryEntry &entry, const char *&name, uint32_t &name_length) {
+	const uint8_t *e = layout.entries + (uint64_t) n * ENTRY_SIZE;
+
+	entry.offset = get64(e);
+	entry.size = get64(e + sizeof(uint64_t));
+	entry.time_cr = get32(e + 2 * sizeof(uint64_t));
+	entry.time_mod = get32(e + 2 * sizeof(uint64_t) + sizeof(uint32_t));
+	entry.first_chunk = get32(e + 2 * sizeof(uint64_t) + 2 * sizeof(uint32_t));
+	entry.chunk_count = get32(e + 2 * sizeof(uint64_t) + 3 * sizeof(uint32_t));
+
+	uint32_t position = get32(e + 2 * sizeof(uint64_t) + 4 * sizeof(uint32_t));
+	name_length = get32(e + 2 * sizeof(uint64_t) + 5 * sizeof(uint32_t));
+
+	if ((uint64_t) position + name_length > layout.names_length) return false;
+
+	name = reinterpret_cast<const char *>(layout.names) + position;
+	return true;
+}
+
+static void put32(std::vector<uint8_t> &data, uint32_t x) {
+	data.insert(data.end(), reinterpret_cast<const uint8_t *>(&x), reinterpret_cast<const uint8_t *>(&x) + sizeof(uint32_t));
+}
+
+static void put64(std::vector<uint8_t> &data, uint64_t x) {
+	data.insert(data.end(), reinterpret_cast<const uint8_t *>(&x), reinterpret_cast<const uint8_t *>(&x) + sizeof(uint64_t));
+}
+
+bool FileDirectory::pack(std::vector<uint8_t> &data, std::string &error) const {
+	Stats::Scope timing(Stats::PHASE_INDEX);
+
+	if (entries.size() >= 0x40000000) {
+		error = "Too many files for the archive directory!";
+		return false;
+	}
+
+	/* At most half full, so probe runs stay short */
+	uint32_t bucket_count = 1;
+	while (bucket_count < 2 * entries.size() + 1) bucket_count <<= 1;
+
+	std::vector<uint32_t> buckets(bucket_count, 0);
+
+	for (size_t n = 0; n < entries.size(); n++) {
+		const std::string &name = entries[n].name;
+
+		if (!safe_name(name)) {
+			error = "Invalid filename in archive: \"" + name + "\"";
+			return false;
+		}
+
+		uint32_t b = hash_name(name.data(), name.length()) & (bucket_count - 1);
+
+		while (buckets[b]) {
+			if (entries[buckets[b] - 1].name == name) {
+				error = "Duplicate filename in archive: \"" + name + "\"";
+				return false;
+			}
+			b = (b + 1) & (bucket_count - 1);
+		}
+
+		buckets[b] = n + 1;
+	}
+
+	data.clear();
+	put32(data, entries.size());
+	put32(data, bucket_count);
+
+	for (uint32_t bucket : buckets) put32(data, bucket);
+
+	uint32_t position = 0;
+	for (const DirectoryEntry &entry : entries) {
+		put64(data, entry.offset);
+		put64(data, entry.size);
+		put32(data, entry.time_cr);
+		put32(data, entry.time_mod);
+		put32(data, entry.first_chunk);
+		put32(data, entry.chunk_count);
+		put32(data, position);
+		put32(data, entry.name.length());
+		position += entry.name.length();
+	}
+
+	for (const DirectoryEntry &entry : entries) data.insert(data.end(), entry.name.begin(), entry.name.end());
+
+	return true;
+}
+
+bool FileDirectory::unpack(const uint8_t *data, uint32_t length) {
+	Stats::Scope timing(Stats::PHASE_INDEX, length);
+
+	Layout layout;
+
+	entries.clear();
+
+	if (!read_layout(data, length, layout)) return false;
+
+	entries.resize(layout.entry_count);
+
+	for (uint32_t n = 0; n < layout.entry_count; n++) {
+		const char *name;
+		uint32_t name_length;
+
+		if (!read_entry(layout, n, entries[n], name, name_length)) return false;
+
+		entries[n].name.assign(name, name_length);
+		if (!safe_name(entries[n].name)) return false;
+	}
+
+	return true;
+}
+
+bool FileDirectory::lookup(const uint8_t *data, uint32_t length, const std::string &name, DirectoryEntry &entry) {
+	Layout layout;
+
+	if (!read_layout(data, length, layout)) return false;
+
+	uint32_t b = hash_name(name.data(), name.length()) & (layout.bucket_count - 1);
+
+	/* There is always an empty bucket, so this ends */
+	for (uint32_t probes = 0; probes < layout.bucket_count; probes++) {
+		uint32_t n = get32(layout.buckets + (uint64_t) b * BUCKET_SIZE);
+		if (!n || n > layout.entry_count) return false;
+
+		const char *entry_name;
+		uint32_t entry_name_length;
+
+		if (!read_entry(layout, n - 1, entry, entry_name, entry_name_length)) return false;
+
+		if (entry_name_length == name.length() && !memcmp(entry_name, name.data(), name.length())) {
+			entry.name = name;
+			return safe_name(name);
+		}
+
+		b = (b + 1) & (layout.bucket_count - 1);
+	}
+
+	return false;
+}
+
+bool FileDirectory::safe_name(const std::string &name) {
+	if (name.empty() || name[0] == '/' || name.find('\0') != std::string::npos) return false;
+
+	size_t start = 0;
+	while (start <= name.length()) {
+		size_t end = name.find('/', start);
+		if (end == std::string::npos) end = name.length();
+
+		std::string part = name.substr(start, end - start);
+		if (part.empty() || part == "." || part == "..") return false;
+
+		start = end + 1;
+	}
+
+	return true;
+}
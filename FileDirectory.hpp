@@ -0,0 +1,66 @@
+/*
+FILEDIRECTORY.HPP
+NICK WILSON
+2019
+*/
+
+#ifndef OBJ_FILEDIRECTORY
+#define OBJ_FILEDIRECTORY
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+/* One file within an archive's payload */
+struct DirectoryEntry {
+	std::string name;
+	uint64_t offset = 0;		/* Position of the file within the packed payload */
+	uint64_t size = 0;
+	uint32_t time_cr = 0;
+	uint32_t time_mod = 0;
+	uint32_t first_chunk = 0;	/* File chunks holding it, counted from the first */
+	uint32_t chunk_count = 0;
+};
+
+/* Contents of the directory (fiDR) chunk of an archive */
+/*
+N byte data:
+	4 byte entry count
+	4 byte bucket count (a power of two)
+	Buckets, 4 bytes each: entry number + 1, or 0 if empty
+	Entries, 40 bytes each:
+		8 byte offset
+		8 byte size
+		4 byte creation time
+		4 byte modification time
+		4 byte first file chunk
+		4 byte file chunk count
+		4 byte name position within the name pool
+		4 byte name length
+	N byte name pool
+(Fields are stored in host byte order)
+
+Names are relative paths, hashed with 64 bit FNV-1a into the buckets,
+with collisions moving on to the next bucket. The table is kept under
+half full, so a lookup only touches a bucket or two and the entries they
+point at, however many files there are.
+*/
+class FileDirectory{
+public:
+	std::vector<DirectoryEntry> entries;
+
+	/* False if any name is unsafe or repeated */
+	bool pack(std::vector<uint8_t> &data, std::string &error) const;
+
+	/* False if the data is malformed or holds an unsafe name */
+	bool unpack(const uint8_t *data, uint32_t length);
+
+	/* Find one entry in packed data without unpacking the rest */
+	static bool lookup(const uint8_t *data, uint32_t length, const std::string &name, DirectoryEntry &entry);
+
+	/* Relative, with no empty, "." or ".." parts, so it can't land outside where it is extracted */
+	static bool safe_name(const std::string &name);
+};
+
+#endif
@@ -0,0 +1,394 @@
+/*
+FILEINDEX.CPP
+NICK WILSON
+2019
+*/
+
+#include "FileIndex.hpp"
+#include "PngPack.hpp"
+#include "Stats.hpp"
+
+#include <algorithm>
+
+#include <string.h>
+
+/* Fixed fields ahead of the filename */
+static const uint32_t INDEX_HEADER_SIZE = 2 * sizeof(uint32_t) + sizeof(uint64_t);
+
+/* Tag and length ahead of each record's value */
+static const uint32_t RECORD_HEADER_SIZE = sizeof(uint8_t) + sizeof(uint32_t);
+
+static const uint8_t RECORD_OFFSET_TABLE = 1;
+static const uint32_t OFFSET_ENTRY_SIZE = 2 * sizeof(uint64_t);
+
+static const uint8_t RECORD_COMPRESSION = 2;
+
+static const uint8_t RECORD_HASHES = 3;
+static const uint32_t DIGEST_SIZE = 2 * sizeof(uint64_t);
+
+static const uint8_t RECORD_PAYLOAD_DIGEST = 4;
+
+static const uint8_t RECORD_TRAILING = 5;
+
+static const uint8_t RECORD_SHARD = 6;
+static const uint32_t SHARD_SIZE = 2 * sizeof(uint32_t) + sizeof(FileIndex::Shard::id) + 2 * sizeof(uint64_t);
+
+static const uint8_t RECORD_PARITY = 7;
+static const uint32_t PARITY_SIZE = sizeof(uint8_t) + 2 * sizeof(uint16_t);
+
+static const uint8_t RECORD_ENCRYPTION = 8;
+static const uint32_t ENCRYPTION_SIZE = 2 * sizeof(uint8_t) + sizeof(uint32_t) + Cipher::SALT_SIZE + Cipher::TAG_SIZE;
+
+static void put_record(std::vector<uint8_t> &data, uint8_t tag, uint32_t length) {
+	data.push_back(tag);
+	data.insert(data.end(), reinterpret_cast<const uint8_t *>(&length), reinterpret_cast<const uint8_t *>(&length) + sizeof(uint32_t));
+}
+
+std::vector<uint8_t> FileIndex::pack() const {
+	Stats::Scope timing(Stats::PHASE_INDEX);
+
+	std::vector<uint8_t> data(INDEX_HEADER_SIZE + filename.length());
+
+	memcpy(data.data(), &time_cr, sizeof(uint32_t));
+	memcpy(data.data() + sizeof(uint32_t), &time_mod, sizeof(uint32_t));
+	memcpy(data.data() + 2 * sizeof(uint32_t), &size, sizeof(uint64_t));
+	memcpy(data.data() + INDEX_HEADER_SIZE, filename.c_str(), filename.length());
+
+	return data;
+}
+
+std::vector<uint8_t> FileIndex::pack_table() const {
+	Stats::Scope timing(Stats::PHASE_INDEX);
+
+	std::vector<uint8_t> data;
+
+	if (chunks.empty()) return data;
+
+	put_record(data, RECORD_OFFSET_TABLE, chunks.size() * OFFSET_ENTRY_SIZE);
+	for (const IndexEntry &entry : chunks) {
+		const uint8_t *offset = reinterpret_cast<const uint8_t *>(&entry.offset);
+		const uint8_t *position = reinterpret_cast<const uint8_t *>(&entry.position);
+		data.insert(data.end(), offset, offset + sizeof(uint64_t));
+		data.insert(data.end(), position, position + sizeof(uint64_t));
+	}
+
+	if (codec != Codec::CODEC_NONE) {
+		put_record(data, RECORD_COMPRESSION, sizeof(uint8_t) + chunks.size() * sizeof(uint32_t));
+		data.push_back(codec);
+		for (const IndexEntry &entry : chunks) {
+			const uint8_t *stored = reinterpret_cast<const uint8_t *>(&entry.stored);
+			data.insert(data.end(), stored, stored + sizeof(uint32_t));
+		}
+	}
+
+	if (hash_type != BlockHash::HASH_NONE) {
+		put_record(data, RECORD_HASHES, sizeof(uint8_t) + chunks.size() * DIGEST_SIZE);
+		data.push_back(hash_type);
+		for (const IndexEntry &entry : chunks) {
+			const uint8_t *low = reinterpret_cast<const uint8_t *>(&entry.hash.low);
+			const uint8_t *high = reinterpret_cast<const uint8_t *>(&entry.hash.high);
+			data.insert(data.end(), low, low + sizeof(uint64_t));
+			data.insert(data.end(), high, high + sizeof(uint64_t));
+		}
+	}
+
+	if (digest_type != TreeHash::DIGEST_NONE) {
+		put_record(data, RECORD_PAYLOAD_DIGEST, sizeof(uint8_t) + TreeHash::DIGEST_SIZE);
+		data.push_back(digest_type);
+		data.insert(data.end(), digest.bytes, digest.bytes + TreeHash::DIGEST_SIZE);
+	}
+
+	if (trailing) put_record(data, RECORD_TRAILING, 0);
+
+	if (shard.count) {
+		const uint8_t *number = reinterpret_cast<const uint8_t *>(&shard.number);
+		const uint8_t *count = reinterpret_cast<const uint8_t *>(&shard.count);
+		const uint8_t *offset = reinterpret_cast<const uint8_t *>(&shard.offset);
+		const uint8_t *total = reinterpret_cast<const uint8_t *>(&shard.total);
+
+		put_record(data, RECORD_SHARD, SHARD_SIZE);
+		data.insert(data.end(), number, number + sizeof(uint32_t));
+		data.insert(data.end(), count, count + sizeof(uint32_t));
+		data.insert(data.end(), shard.id, shard.id + sizeof(shard.id));
+		data.insert(data.end(), offset, offset + sizeof(uint64_t));
+		data.insert(data.end(), total, total + sizeof(uint64_t));
+	}
+
+	if (parity_scheme != PARITY_NONE) {
+		const uint8_t *group = reinterpret_cast<const uint8_t *>(&parity_data);
+		const uint8_t *count = reinterpret_cast<const uint8_t *>(&parity_count);
+
+		put_record(data, RECORD_PARITY, PARITY_SIZE);
+		data.push_back(parity_scheme);
+		data.insert(data.end(), group, group + sizeof(uint16_t));
+		data.insert(data.end(), count, count + sizeof(uint16_t));
+	}
+
+	if (encrypted()) {
+		const uint8_t *iterations = reinterpret_cast<const uint8_t *>(&encryption.iterations);
+
+		put_record(data, RECORD_ENCRYPTION, ENCRYPTION_SIZE);
+		data.push_back(encryption.cipher);
+		data.push_back(encryption.kdf);
+		data.insert(data.end(), iterations, iterations + sizeof(uint32_t));
+		data.insert(data.end(), encryption.salt, encryption.salt + Cipher::SALT_SIZE);
+		data.insert(data.end(), encryption.check, encryption.check + Cipher::TAG_SIZE);
+	}
+
+	return data;
+}
+
+bool FileIndex::unpack(const uint8_t *data, uint32_t length) {
+	Stats::Scope timing(Stats::PHASE_INDEX, length);
+
+	filename.clear();
+	if (length <= INDEX_HEADER_SIZE) return false;
+
+	memcpy(&time_cr, data, sizeof(uint32_t));
+	memcpy(&time_mod, data + sizeof(uint32_t), sizeof(uint32_t));
+	memcpy(&size, data + 2 * sizeof(uint32_t), sizeof(uint64_t));
+
+	filename.assign(reinterpret_cast<const char *>(data + INDEX_HEADER_SIZE), length - INDEX_HEADER_SIZE);
+	clear_table();
+
+	return true;
+}
+
+void FileIndex::clear_table() {
+	chunks.clear();
+	codec = Codec::CODEC_NONE;
+	hash_type = BlockHash::HASH_NONE;
+	digest_type = TreeHash::DIGEST_NONE;
+	digest = TreeHash::Digest();
+	trailing = false;
+	shard = Shard();
+	parity_scheme = PARITY_NONE;
+	parity_data = 0;
+	parity_count = 0;
+	encryption = Encryption();
+}
+
+bool FileIndex::unpack_table(const uint8_t *data, uint32_t length) {
+	Stats::Scope timing(Stats::PHASE_INDEX, length);
+
+	clear_table();
+
+	/* Compression and hash records can come before or after the table */
+	const uint8_t *stored = nullptr;
+	uint32_t stored_count = 0;
+	const uint8_t *digests = nullptr;
+	uint32_t digest_count = 0;
+
+	const uint8_t *record = data;
+	const uint8_t *end = data + length;
+
+	while (record != end) {
+		uint8_t tag;
+		uint32_t record_length;
+
+		if ((uint64_t) (end - record) < RECORD_HEADER_SIZE) return false;
+
+		tag = record[0];
+		memcpy(&record_length, record + sizeof(uint8_t), sizeof(uint32_t));
+		record += RECORD_HEADER_SIZE;
+
+		if ((uint64_t) (end - record) < record_length) return false;
+
+		if (tag == RECORD_OFFSET_TABLE) {
+			if (record_length % OFFSET_ENTRY_SIZE) return false;
+
+			chunks.resize(record_length / OFFSET_ENTRY_SIZE);
+			for (size_t i = 0; i < chunks.size(); i++) {
+				memcpy(&chunks[i].offset, record + i * OFFSET_ENTRY_SIZE, sizeof(uint64_t));
+				memcpy(&chunks[i].position, record + i * OFFSET_ENTRY_SIZE + sizeof(uint64_t), sizeof(uint64_t));
+			}
+		}
+		else if (tag == RECORD_COMPRESSION) {
+			if (!record_length || (record_length - sizeof(uint8_t)) % sizeof(uint32_t)) return false;
+			if (record[0] == Codec::CODEC_NONE || record[0] >= Codec::CODEC_COUNT) return false;
+
+			codec = static_cast<Codec::Type>(record[0]);
+			stored = record + sizeof(uint8_t);
+			stored_count = (record_length - sizeof(uint8_t)) / sizeof(uint32_t);
+		}
+		else if (tag == RECORD_HASHES) {
+			if (!record_length || (record_length - sizeof(uint8_t)) % DIGEST_SIZE) return false;
+
+			/* Hashes are only ever compared, so an unknown kind is ignored rather than rejected */
+			if (record[0] != BlockHash::HASH_NONE && record[0] < BlockHash::HASH_COUNT) {
+				hash_type = static_cast<BlockHash::Type>(record[0]);
+				digests = record + sizeof(uint8_t);
+				digest_count = (record_length - sizeof(uint8_t)) / DIGEST_SIZE;
+			}
+		}
+		else if (tag == RECORD_PAYLOAD_DIGEST) {
+			if (record_length != sizeof(uint8_t) + TreeHash::DIGEST_SIZE) return false;
+
+			/* Same as block hashes, a kind this can't check is left unchecked */
+			if (record[0] != TreeHash::DIGEST_NONE && record[0] < TreeHash::DIGEST_COUNT) {
+				digest_type = static_cast<TreeHash::Type>(record[0]);
+				memcpy(digest.bytes, record + sizeof(uint8_t), TreeHash::DIGEST_SIZE);
+			}
+		}
+		else if (tag == RECORD_TRAILING) {
+			if (record_length) return false;
+			trailing = true;
+		}
+		else if (tag == RECORD_SHARD) {
+			if (record_length != SHARD_SIZE) return false;
+
+			const uint8_t *field = record;
+			memcpy(&shard.number, field, sizeof(uint32_t));
+			memcpy(&shard.count, field += sizeof(uint32_t), sizeof(uint32_t));
+			memcpy(shard.id, field += sizeof(uint32_t), sizeof(shard.id));
+			memcpy(&shard.offset, field += sizeof(shard.id), sizeof(uint64_t));
+			memcpy(&shard.total, field += sizeof(uint64_t), sizeof(uint64_t));
+
+			/* The part must lie within the payload */
+			if (!shard.count || shard.number >= shard.count || shard.offset > shard.total || size > shard.total - shard.offset) return false;
+		}
+		else if (tag == RECORD_PARITY) {
+			if (record_length != PARITY_SIZE) return false;
+
+			/* Parity only ever helps, so a kind this can't use is ignored like an unknown hash */
+			if (record[0] != PARITY_NONE && record[0] < PARITY_COUNT) {
+				parity_scheme = static_cast<ParityScheme>(record[0]);
+				memcpy(&parity_data, record + sizeof(uint8_t), sizeof(uint16_t));
+				memcpy(&parity_count, record + sizeof(uint8_t) + sizeof(uint16_t), sizeof(uint16_t));
+
+				if (!parity_data || !parity_count || parity_data + parity_count > ReedSolomon::MAX_SHARDS) return false;
+			}
+		}
+		else if (tag == RECORD_ENCRYPTION) {
+			if (record_length != ENCRYPTION_SIZE) return false;
+
+			/* Unlike parity, chunks sealed in a way this can't open are no use at all */
+			if (record[0] == Cipher::CIPHER_NONE || record[0] >= Cipher::CIPHER_COUNT) return false;
+			if (record[1] == Cipher::KDF_NONE || record[1] >= Cipher::KDF_COUNT) return false;
+
+			const uint8_t *field = record + 2 * sizeof(uint8_t);
+			encryption.cipher = static_cast<Cipher::Type>(record[0]);
+			encryption.kdf = static_cast<Cipher::Kdf>(record[1]);
+			memcpy(&encryption.iterations, field, sizeof(uint32_t));
+			memcpy(encryption.salt, field += sizeof(uint32_t), Cipher::SALT_SIZE);
+			memcpy(encryption.check, field += Cipher::SALT_SIZE, Cipher::TAG_SIZE);
+
+			if (!encryption.iterations || encryption.iterations > Cipher::KDF_ITERATIONS_MAX) return false;
+		}
+
+		record += record_length;
+	}
+
+	/* Table must cover the file from the start, in order */
+	for (size_t i = 0; i < chunks.size(); i++) {
+		if (i ? (chunks[i].offset <= chunks[i - 1].offset || chunks[i].position <= chunks[i - 1].position) : chunks[i].offset != 0) return false;
+		if (chunks[i].offset >= size) return false;
+	}
+
+	if (chunks.empty()) return false;
+
+	if (codec != Codec::CODEC_NONE && stored_count != chunks.size()) return false;
+	if (hash_type != BlockHash::HASH_NONE && digest_count != chunks.size()) return false;
+
+	/* The sealed digest is what shows the passphrase is right */
+	if (encrypted() && digest_type == TreeHash::DIGEST_NONE) return false;
+
+	/* Stored lengths never exceed their block */
+	for (size_t i = 0; i < chunks.size(); i++) {
+		if (stored) memcpy(&chunks[i].stored, stored + i * sizeof(uint32_t), sizeof(uint32_t));
+		else if (block_size(i) > 0x7FFFFFFF) return false;
+		else chunks[i].stored = block_size(i);
+
+		if (chunks[i].stored > block_size(i)) return false;
+
+		chunks[i].hash = BlockHash::Digest();
+		if (digests) {
+			memcpy(&chunks[i].hash.low, digests + i * DIGEST_SIZE, sizeof(uint64_t));
+			memcpy(&chunks[i].hash.high, digests + i * DIGEST_SIZE + sizeof(uint64_t), sizeof(uint64_t));
+		}
+
+		/* Blocks are at most one chunk's worth, which bounds what decompressing one can take */
+		if (compressed(i) && block_size(i) > CHUNK_SIZE_DATA_MAX) return false;
+	}
+
+	/* Parity chunks come between the index and the file chunks, and are never bigger than one */
+	if (parity_scheme != PARITY_NONE) {
+		if (trailing) return false;
+
+		for (size_t i = 0; i < chunks.size(); i++) {
+			if (block_size(i) > CHUNK_SIZE_DATA_MAX) return false;
+		}
+
+		if (chunks[0].position < parity_position(parity_groups())) return false;
+	}
+
+	return true;
+}
+
+/* What the digest is sealed along with */
+static std::vector<uint8_t> digest_aad(const FileIndex &index) {
+	std::vector<uint8_t> aad(reinterpret_cast<const uint8_t *>(&index.size), reinterpret_cast<const uint8_t *>(&index.size) + sizeof(uint64_t));
+	aad.insert(aad.end(), index.filename.begin(), index.filename.end());
+	return aad;
+}
+
+void FileIndex::seal_digest(const Cipher &cipher) {
+	uint8_t sealed[TreeHash::DIGEST_SIZE + Cipher::TAG_SIZE];
+	std::vector<uint8_t> aad = digest_aad(*this);
+
+	memcpy(sealed, digest.bytes, TreeHash::DIGEST_SIZE);
+	cipher.seal(UINT64_MAX, aad.data(), aad.size(), sealed, TreeHash::DIGEST_SIZE);
+
+	memcpy(digest.bytes, sealed, TreeHash::DIGEST_SIZE);
+	memcpy(encryption.check, sealed + TreeHash::DIGEST_SIZE, Cipher::TAG_SIZE);
+}
+
+bool FileIndex::open_digest(const Cipher &cipher) {
+	uint8_t sealed[TreeHash::DIGEST_SIZE + Cipher::TAG_SIZE];
+	std::vector<uint8_t> aad = digest_aad(*this);
+
+	memcpy(sealed, digest.bytes, TreeHash::DIGEST_SIZE);
+	memcpy(sealed + TreeHash::DIGEST_SIZE, encryption.check, Cipher::TAG_SIZE);
+	if (!cipher.open(UINT64_MAX, aad.data(), aad.size(), sealed, TreeHash::DIGEST_SIZE)) return false;
+
+	memcpy(digest.bytes, sealed, TreeHash::DIGEST_SIZE);
+	return true;
+}
+
+size_t FileIndex::find(uint64_t offset) const {
+	if (offset >= size) return chunks.size();
+
+	/* Last entry starting at or before offset */
+	auto it = std::upper_bound(chunks.begin(), chunks.end(), offset, [](uint64_t value, const IndexEntry &entry) {
+		return value < entry.offset;
+	});
+
+	return (it == chunks.begin()) ? chunks.size() : (it - chunks.begin()) - 1;
+}
+
+uint64_t FileIndex::block_size(size_t n) const {
+	return ((n + 1 < chunks.size()) ? chunks[n + 1].offset : size) - chunks[n].offset;
+}
+
+bool FileIndex::compressed(size_t n) const {
+	return codec != Codec::CODEC_NONE && chunks[n].stored != block_size(n);
+}
+
+size_t FileIndex::parity_groups() const {
+	return (parity_scheme != PARITY_NONE) ? (chunks.size() + parity_data - 1) / parity_data : 0;
+}
+
+uint64_t FileIndex::parity_length(size_t group) const {
+	uint64_t length = 0;
+	size_t end = std::min(chunks.size(), (group + 1) * parity_data);
+
+	for (size_t n = group * parity_data; n < end; n++) length = std::max(length, block_size(n));
+	return length;
+}
+
+uint64_t FileIndex::parity_position(size_t group) const {
+	uint64_t position = 0;
+
+	for (size_t g = 0; g < group; g++) position += parity_count * (3 * sizeof(uint32_t) + parity_length(g) + tag_length());
+	return position;
+}
@@ -0,0 +1,192 @@
+/*
+FILEINDEX.HPP
+NICK WILSON
+2019
+*/
+
+#ifndef OBJ_FILEINDEX
+#define OBJ_FILEINDEX
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#include "BlockHash.hpp"
+#include "Cipher.hpp"
+#include "Codec.hpp"
+#include "ReedSolomon.hpp"
+#include "TreeHash.hpp"
+
+/* Where one file chunk's data sits */
+struct IndexEntry {
+	uint64_t offset;	/* Position of the chunk's data within the packed file */
+	uint64_t position;	/* Position of the chunk's LENGTH field, counted from the end of the table chunk */
+	uint32_t stored;	/* Bytes of chunk data, less than the block's size if it was compressed, less any tag */
+	BlockHash::Digest hash;	/* Of the block's uncompressed data, if the index has hashes */
+};
+
+/* Contents of the index (fiDX) chunk */
+/*
+N byte data:
+	4 byte creation time
+	4 byte modification time
+	8 byte file size
+	N byte filename
+(Fields are stored in host byte order)
+*/
+
+/* Contents of the table (fiTB) chunk, which follows the index directly when there is one */
+/* It is a chunk of its own so the index stays as it always was, and older readers skip it */
+/*
+N byte data, any number of records:
+	1 byte tag
+	4 byte length
+	N byte value
+(Fields are stored in host byte order)
+
+Unknown tags are skipped.
+
+Record tags:
+	1: Offset table, one IndexEntry (8 byte offset, 8 byte position) per file chunk
+	2: Compression, a 1 byte codec then one 4 byte stored length per file chunk
+		A chunk stored at its full block size holds raw data, any other was compressed
+		Without it every chunk is raw
+	3: Block hashes, a 1 byte hash type then one 16 byte digest (low, high) per file chunk
+	4: Payload digest, a 1 byte digest type then the 32 byte digest of the whole file
+	5: Trailing, no value. The index and table follow their file chunks instead of leading them, and
+		positions count from the first file chunk's LENGTH field instead
+	6: Shard, this file is part of a payload split across several PNGs:
+		4 byte shard number, counting from 0
+		4 byte shard count
+		16 byte payload ID, the same in every shard of a payload
+		8 byte offset of this part within the payload
+		8 byte size of the whole payload
+		The index's own size is that of this part, and its digest covers only this part
+	7: Parity, a 1 byte scheme, 2 byte data chunks per group and 2 byte parity chunks per group
+		File chunks are taken a group at a time in table order, and each group gets that many
+		parity (fiPR) chunks, as long as the group's largest block, with shorter blocks taken
+		as zero padded. They sit between the table and the first file chunk, group by group,
+		and the table's positions leave room for them. A scheme this doesn't know is ignored
+	8: Encryption, the file and parity chunks are sealed, each followed by a 16 byte tag:
+		1 byte cipher
+		1 byte key derivation function
+		4 byte iterations
+		16 byte salt
+		16 byte tag of the sealed payload digest, whose record then holds it encrypted
+		Chunks are compressed before they are sealed. Filenames, the directory, sizes and
+		times are left in the clear. A cipher this doesn't know is an error
+*/
+class FileIndex{
+public:
+	uint32_t time_cr = 0;
+	uint32_t time_mod = 0;
+	uint64_t size = 0;
+	std::string filename;
+
+	/* One entry per file chunk in order, empty for indexes without a table */
+	std::vector<IndexEntry> chunks;
+
+	/* Codec for compressed chunks, only recorded alongside the table */
+	Codec::Type codec = Codec::CODEC_NONE;
+
+	/* How the blocks were hashed, only recorded alongside the table */
+	BlockHash::Type hash_type = BlockHash::HASH_NONE;
+
+	/* Digest of the whole file, only recorded alongside the table */
+	TreeHash::Type digest_type = TreeHash::DIGEST_NONE;
+	TreeHash::Digest digest;
+
+	/* Whether the index was written after its file chunks, only recorded alongside the table */
+	bool trailing = false;
+
+	/* Where this part sits in a payload split across several PNGs, */
+	/* only recorded alongside the table. A count of 0 means the payload is whole */
+	struct Shard {
+		uint32_t number = 0;
+		uint32_t count = 0;
+		uint8_t id[16] = {};
+		uint64_t offset = 0;
+		uint64_t total = 0;
+	};
+
+	Shard shard;
+
+	enum ParityScheme {
+		PARITY_NONE = 0,
+		PARITY_REED_SOLOMON,	/* ReedSolomon's code over the uncompressed blocks */
+		PARITY_COUNT
+	};
+
+	/* Parity chunks for the file chunks, only recorded alongside the table */
+	ParityScheme parity_scheme = PARITY_NONE;
+	uint16_t parity_data = 0;
+	uint16_t parity_count = 0;
+
+	/* How the chunks were sealed, only recorded alongside the table */
+	struct Encryption {
+		Cipher::Type cipher = Cipher::CIPHER_NONE;
+		Cipher::Kdf kdf = Cipher::KDF_NONE;
+		uint32_t iterations = 0;
+		uint8_t salt[Cipher::SALT_SIZE] = {};
+		uint8_t check[Cipher::TAG_SIZE] = {};
+	};
+
+	Encryption encryption;
+
+	/* Index chunk data, then table chunk data, which is empty for an index without a table */
+	std::vector<uint8_t> pack() const;
+	std::vector<uint8_t> pack_table() const;
+
+	/* False if the data is too short to hold a filename. Everything the table holds is cleared */
+	bool unpack(const uint8_t *data, uint32_t length);
+
+	/* After unpack(), false if a record is cut short, the offset table is missing or out of order */
+	/* the compression or hash records don't match it, a shard doesn't fit in its payload, */
+	/* the table leaves no room for the parity chunks or the chunks were sealed in a way this doesn't know */
+	/* or with more than Cipher::KDF_ITERATIONS_MAX iterations of key derivation, which encryption then holds */
+	/* Hashes and digests of a kind this doesn't know are dropped */
+	bool unpack_table(const uint8_t *data, uint32_t length);
+
+	/* The file chunk holding byte offset of the packed file, chunks.size() if none does */
+	size_t find(uint64_t offset) const;
+
+	/* Bytes of the packed file held by table entry n */
+	uint64_t block_size(size_t n) const;
+
+	/* Whether entry n's data must be decompressed */
+	bool compressed(size_t n) const;
+
+	bool encrypted() const { return encryption.cipher != Cipher::CIPHER_NONE; }
+
+	/* Bytes each sealed chunk's tag adds after its data, 0 unless encrypted */
+	uint32_t tag_length() const { return encrypted() ? Cipher::TAG_SIZE : 0; }
+
+	/* Bytes of chunk data entry n's chunk holds, tag and all */
+	uint64_t chunk_length(size_t n) const { return chunks[n].stored + (uint64_t) tag_length(); }
+
+	/* File chunk n is sealed under nonce n, and the rest above every file chunk's */
+	uint64_t parity_nonce(size_t group, unsigned j) const { return (1ULL << 63) + group * parity_count + j; }
+
+	/* Seal the digest in place under the last nonce, with the size and filename as AAD */
+	/* so neither can be changed without the passphrase, and keep its tag as the check */
+	void seal_digest(const Cipher &cipher);
+
+	/* The same in reverse, false if the tag doesn't match */
+	bool open_digest(const Cipher &cipher);
+
+	/* Groups of parity_data file chunks, the last of them maybe short, 0 without parity */
+	size_t parity_groups() const;
+
+	/* Length of each of a group's parity chunks, that of its largest block */
+	uint64_t parity_length(size_t group) const;
+
+	/* Position of a group's first parity chunk's LENGTH field, counted from the end of the index chunk */
+	/* Group parity_groups() is where the parity chunks end */
+	uint64_t parity_position(size_t group) const;
+
+private:
+	void clear_table();
+};
+
+#endif
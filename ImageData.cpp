@@ -0,0 +1,471 @@
+/*
+IMAGEDATA.CPP
+NICK WILSON
+2019
+*/
+
+#include "ImageData.hpp"
+#include "Stats.hpp"
+
+#include <algorithm>
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define IMAGEDATA_X86
+#include <immintrin.h>
+#endif
+
+/* Samples per pixel for each colour type, zero where the type isn't valid */
+static const uint8_t CHANNELS[7] = {1, 0, 3, 1, 2, 0, 4};
+
+/* Adam7 passes, where each starts and how far apart its pixels are, RFC 2083 section 8.2 */
+static const uint8_t ADAM7_X[7] = {0, 4, 0, 2, 0, 1, 0};
+static const uint8_t ADAM7_DX[7] = {8, 8, 4, 4, 2, 2, 1};
+static const uint8_t ADAM7_Y[7] = {0, 0, 4, 0, 2, 0, 1};
+static const uint8_t ADAM7_DY[7] = {8, 8, 8, 4, 4, 2, 2};
+
+/* No deflate stream inflates to more than this many times its size, a 258 byte match in two bits */
+static const uint64_t MAX_INFLATE_RATIO = 1032;
+
+typedef void (*unfilter_fn)(ImageData::Filter filter, uint8_t *row, const uint8_t *previous, size_t length, size_t pixel_bytes);
+
+/* Paeth predictor, whichever neighbour is closest to a + b - c, preferring a then b on a tie */
+static inline uint8_t paeth(uint8_t a, uint8_t b, uint8_t c) {
+	int pa = abs((int) b - c);
+	int pb = abs((int) a - c);
+	int pc = abs((int) a + b - 2 * c);
+
+	if (pa <= pb && pa <= pc) return a;
+	return (pb <= pc) ? b : c;
+}
+
+/* The zero bytes before each row stand in for the pixels left of the first */
+static void unfilter_portable(ImageData::Filter filter, uint8_t *row, const uint8_t *previous, size_t length, size_t pixel_bytes) {
+	switch (filter) {
+		case ImageData::FILTER_SUB:
+			for (size_t i = 0; i < length; i++) row[i] += row[i - pixel_bytes];
+			break;
+		case ImageData::FILTER_UP:
+			for (size_t i = 0; i < length; i++) row[i] += previous[i];
+			break;
+		case ImageData::FILTER_AVERAGE:
+			for (size_t i = 0; i < length; i++) row[i] += (row[i - pixel_bytes] + previous[i]) >> 1;
+			break;
+		case ImageData::FILTER_PAETH:
+			for (size_t i = 0; i < length; i++) row[i] += paeth(row[i - pixel_bytes], previous[i], previous[i - pixel_bytes]);
+			break;
+		default:
+			break;
+	}
+}
+
+#if defined(IMAGEDATA_X86)
+
+/* One pixel, as the low bytes of a vector. 3 and 4 byte pixels take 4 bytes, 6 and 8 byte pixels 8 */
+__attribute__((target("sse4.1")))
+static inline __m128i load_pixel(const uint8_t *p, size_t pixel_bytes) {
+	if (pixel_bytes <= 4) {
+		uint32_t v;
+		memcpy(&v, p, 4);
+		return _mm_cvtsi32_si128(v);
+	}
+	return _mm_loadl_epi64(reinterpret_cast<const __m128i *>(p));
+}
+
+/* Writes the byte or two after a 3 or 6 byte pixel too, which the next pixel then overwrites */
+__attribute__((target("sse4.1")))
+static inline void store_pixel(uint8_t *p, __m128i v, size_t pixel_bytes) {
+	if (pixel_bytes <= 4) {
+		uint32_t x = _mm_cvtsi128_si32(v);
+		memcpy(p, &x, 4);
+	}
+	else _mm_storel_epi64(reinterpret_cast<__m128i *>(p), v);
+}
+
+/* Sub is a running sum across each byte lane of the pixel, done 16 bytes at a time as a prefix sum */
+/* 3 and 6 byte pixels fill only 12 of them, and the last 4 are left as they were for the next step */
+__attribute__((target("sse4.1")))
+static size_t sub_sse41(uint8_t *row, size_t length, size_t pixel_bytes) {
+	const size_t step = (pixel_bytes == 3 || pixel_bytes == 6) ? 12 : 16;
+	__m128i carry = _mm_setzero_si128();
+	__m128i spread;
+	size_t i = 0;
+
+	switch (pixel_bytes) {
+		case 3:
+			spread = _mm_setr_epi8(9, 10, 11, 9, 10, 11, 9, 10, 11, 9, 10, 11, -1, -1, -1, -1);
+			break;
+		case 4:
+			spread = _mm_setr_epi8(12, 13, 14, 15, 12, 13, 14, 15, 12, 13, 14, 15, 12, 13, 14, 15);
+			break;
+		case 6:
+			spread = _mm_setr_epi8(6, 7, 8, 9, 10, 11, 6, 7, 8, 9, 10, 11, -1, -1, -1, -1);
+			break;
+		default:
+			spread = _mm_setr_epi8(8, 9, 10, 11, 12, 13, 14, 15, 8, 9, 10, 11, 12, 13, 14, 15);
+	}
+
+	for (; i + 16 <= length; i += step) {
+		__m128i raw = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + i));
+		__m128i x = raw;
+
+		switch (pixel_bytes) {
+			case 3:
+				x = _mm_add_epi8(x, _mm_slli_si128(x, 3));
+				x = _mm_add_epi8(x, _mm_slli_si128(x, 6));
+				break;
+			case 4:
+				x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+				x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+				break;
+			case 6:
+				x = _mm_add_epi8(x, _mm_slli_si128(x, 6));
+				break;
+			default:
+				x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+		}
+
+		x = _mm_add_epi8(x, carry);
+		if (step == 12) x = _mm_blend_epi16(x, raw, 0xC0);
+
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(row + i), x);
+		carry = _mm_shuffle_epi8(x, spread);
+	}
+
+	return i;
+}
+
+/* Average and Paeth depend on the pixel just done, so go a pixel at a time across its lanes */
+/* The next pixel is loaded before this one is stored, as a 3 or 6 byte store runs into it */
+__attribute__((target("sse4.1")))
+static void average_sse41(uint8_t *row, const uint8_t *previous, size_t length, size_t pixel_bytes) {
+	const __m128i one = _mm_set1_epi8(1);
+	__m128i a = _mm_setzero_si128();
+	__m128i raw = load_pixel(row, pixel_bytes);
+
+	for (size_t i = 0; i < length; i += pixel_bytes) {
+		__m128i next = load_pixel(row + i + pixel_bytes, pixel_bytes);
+		__m128i b = load_pixel(previous + i, pixel_bytes);
+
+		/* pavgb rounds up, so take off the bit it rounded with */
+		__m128i average = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+		a = _mm_add_epi8(raw, average);
+
+		store_pixel(row + i, a, pixel_bytes);
+		raw = next;
+	}
+}
+
+/* Distances worked out in 16 bit lanes, where they can't overflow */
+__attribute__((target("sse4.1")))
+static void paeth_sse41(uint8_t *row, const uint8_t *previous, size_t length, size_t pixel_bytes) {
+	const __m128i zero = _mm_setzero_si128();
+	__m128i a = zero;
+	__m128i c = zero;
+	__m128i raw = load_pixel(row, pixel_bytes);
+
+	for (size_t i = 0; i < length; i += pixel_bytes) {
+		__m128i next = load_pixel(row + i + pixel_bytes, pixel_bytes);
+		__m128i b = _mm_unpacklo_epi8(load_pixel(previous + i, pixel_bytes), zero);
+
+		__m128i pa = _mm_sub_epi16(b, c);
+		__m128i pb = _mm_sub_epi16(a, c);
+		__m128i pc = _mm_abs_epi16(_mm_add_epi16(pa, pb));
+		pa = _mm_abs_epi16(pa);
+		pb = _mm_abs_epi16(pb);
+
+		__m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+		__m128i predicted = _mm_blendv_epi8(c, b, _mm_cmpeq_epi16(pb, smallest));
+		predicted = _mm_blendv_epi8(predicted, a, _mm_cmpeq_epi16(pa, smallest));
+
+		__m128i x = _mm_add_epi8(raw, _mm_packus_epi16(predicted, predicted));
+		store_pixel(row + i, x, pixel_bytes);
+
+		a = _mm_unpacklo_epi8(x, zero);
+		c = b;
+		raw = next;
+	}
+}
+
+__attribute__((target("sse4.1")))
+static void unfilter_sse41(ImageData::Filter filter, uint8_t *row, const uint8_t *previous, size_t length, size_t pixel_bytes) {
+	bool wide = pixel_bytes >= 3 && pixel_bytes != 5 && pixel_bytes != 7;
+
+	if (filter == ImageData::FILTER_UP) {
+		size_t i = 0;
+		for (; i + 16 <= length; i += 16) {
+			__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + i));
+			__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(previous + i));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(row + i), _mm_add_epi8(x, b));
+		}
+		unfilter_portable(filter, row + i, previous + i, length - i, pixel_bytes);
+	}
+	else if (filter == ImageData::FILTER_SUB && wide) {
+		size_t done = sub_sse41(row, length, pixel_bytes);
+		unfilter_portable(filter, row + done, previous + done, length - done, pixel_bytes);
+	}
+	else if (filter == ImageData::FILTER_AVERAGE && wide) average_sse41(row, previous, length, pixel_bytes);
+	else if (filter == ImageData::FILTER_PAETH && wide) paeth_sse41(row, previous, length, pixel_bytes);
+	else unfilter_portable(filter, row, previous, length, pixel_bytes);
+}
+
+__attribute__((target("avx2")))
+static void unfilter_avx2(ImageData::Filter filter, uint8_t *row, const uint8_t *previous, size_t length, size_t pixel_bytes) {
+	if (filter != ImageData::FILTER_UP) {
+		unfilter_sse41(filter, row, previous, length, pixel_bytes);
+		return;
+	}
+
+	size_t i = 0;
+	for (; i + 32 <= length; i += 32) {
+		__m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(row + i));
+		__m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(previous + i));
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(row + i), _mm256_add_epi8(x, b));
+	}
+	unfilter_portable(filter, row + i, previous + i, length - i, pixel_bytes);
+}
+
+static bool sse41_supported() {
+	return __builtin_cpu_supports("sse4.1");
+}
+
+static bool avx2_supported() {
+	return __builtin_cpu_supports("avx2");
+}
+
+#else
+static bool sse41_supported() {
+	return false;
+}
+
+static bool avx2_supported() {
+	return false;
+}
+
+static void unfilter_sse41(ImageData::Filter filter, uint8_t *row, const uint8_t *previous, size_t length, size_t pixel_bytes) {
+	unfilter_portable(filter, row, previous, length, pixel_bytes);
+}
+
+static void unfilter_avx2(ImageData::Filter filter, uint8_t *row, const uint8_t *previous, size_t length, size_t pixel_bytes) {
+	unfilter_portable(filter, row, previous, length, pixel_bytes);
+}
+#endif
+
+static const unfilter_fn UNFILTER_ENGINES[ImageData::ENGINE_COUNT] = {unfilter_portable, unfilter_sse41, unfilter_avx2};
+
+static ImageData::Engine detect_engine() {
+	if (avx2_supported()) return ImageData::ENGINE_AVX2;
+	if (sse41_supported()) return ImageData::ENGINE_SSE41;
+	return ImageData::ENGINE_PORTABLE;
+}
+
+ImageData::ImageData(const ImageHeader &header) : header(header) {
+	bits_per_pixel = CHANNELS[header.colour] * header.depth;
+	pixel_bytes = std::max(bits_per_pixel / 8, 1);
+	passes = header.interlace ? 7 : 1;
+}
+
+uint64_t ImageData::scanline_bytes(uint8_t bits_per_pixel, uint32_t pixels) {
+	return ((uint64_t) pixels * bits_per_pixel + 7) / 8;
+}
+
+void ImageData::pass_size(unsigned pass, uint32_t &pass_width, uint32_t &pass_height) const {
+	pass_width = header.width;
+	pass_height = header.height;
+
+	if (passes == 1) return;
+
+	pass_width = (header.width > ADAM7_X[pass]) ? (header.width - ADAM7_X[pass] + ADAM7_DX[pass] - 1) / ADAM7_DX[pass] : 0;
+	pass_height = (header.height > ADAM7_Y[pass]) ? (header.height - ADAM7_Y[pass] + ADAM7_DY[pass] - 1) / ADAM7_DY[pass] : 0;
+}
+
+void ImageData::start_pass(unsigned next) {
+	for (pass = next; pass < passes; pass++) {
+		uint32_t pass_width;
+		pass_size(pass, pass_width, pass_rows);
+
+		/* A pass with no pixels has no scanlines, not even filter bytes */
+		if (pass_width && pass_rows) {
+			row_bytes = scanline_bytes(bits_per_pixel, pass_width);
+			row = 0;
+
+			/* The first scanline of each pass has nothing above it */
+			memset(previous.data(), 0, previous.size());
+			return;
+		}
+	}
+
+	finished = true;
+}
+
+bool ImageData::write(const uint8_t *data, size_t length, std::string &error) {
+	while (length) {
+		if (finished) {
+			error = "Image data runs on past the last scanline!";
+			return false;
+		}
+
+		if (filter < 0) {
+			if (*data >= FILTER_COUNT) {
+				error = "Scanline " + std::to_string(scanlines) + " has invalid filter type " + std::to_string(*data) + "!";
+				return false;
+			}
+
+			filter = *data++;
+			length--;
+			filled = 0;
+			continue;
+		}
+
+		size_t n = std::min(length, row_bytes - filled);
+		memcpy(current.data() + ROW_BEFORE + filled, data, n);
+		filled += n;
+		data += n;
+		length -= n;
+
+		if (filled == row_bytes) {
+			UNFILTER_ENGINES[active()]((Filter) filter, current.data() + ROW_BEFORE, previous.data() + ROW_BEFORE, row_bytes, pixel_bytes);
+			current.swap(previous);
+
+			filter = -1;
+			scanlines++;
+			if (++row == pass_rows) start_pass(pass + 1);
+		}
+	}
+
+	return true;
+}
+
+/* Public */
+bool ImageData::verify(const ImageHeader &header, const Inflate::Source &source, uint64_t compressed, Result &result, std::string &error) {
+	Stats::Scope timing(Stats::PHASE_DECODE);
+
+	/* Palettes only go up to 8 bits, and colour with more than one sample only comes in 8 and 16 */
+	bool depth_ok = (header.colour == 0) || (header.depth >= 8 && header.colour != 3) || (header.depth <= 8 && header.colour == 3);
+	if (!depth_ok) {
+		error = "Invalid bit depth for the colour type!";
+		return false;
+	}
+
+	ImageData image(header);
+
+	/* What the image should inflate to, filter bytes and all, before making room for any of it */
+	uint64_t limit = compressed * MAX_INFLATE_RATIO;
+	uint64_t expected = 0;
+	uint64_t widest = 0;
+	uint64_t scanlines = 0;
+
+	for (unsigned pass = 0; pass < image.passes; pass++) {
+		uint32_t pass_width, pass_height;
+		image.pass_size(pass, pass_width, pass_height);
+		if (!pass_width || !pass_height) continue;
+
+		uint64_t bytes = scanline_bytes(image.bits_per_pixel, pass_width) + 1;
+		if (pass_height > (limit - expected) / bytes) {
+			error = "Image data is too short for a " + std::to_string(header.width) + "x" + std::to_string(header.height) + " image!";
+			return false;
+		}
+
+		expected += pass_height * bytes;
+		scanlines += pass_height;
+		widest = std::max(widest, bytes - 1);
+	}
+
+	image.current.assign(ROW_BEFORE + widest + ROW_AFTER, 0);
+	image.previous.assign(ROW_BEFORE + widest + ROW_AFTER, 0);
+	image.start_pass(0);
+
+	std::string sink_error;
+	Inflate inflate(source, [&image, &sink_error](const uint8_t *data, size_t length) {
+		return image.write(data, length, sink_error);
+	});
+
+	bool ok = inflate.zlib(error);
+	if (!sink_error.empty()) error = sink_error;
+
+	if (ok && !image.finished) {
+		error = "Image data ends after " + std::to_string(image.scanlines) + " of its " + std::to_string(scanlines) + " scanlines!";
+		ok = false;
+	}
+
+	timing.add(inflate.total());
+
+	result.compressed = compressed;
+	result.filtered = inflate.total();
+	result.scanlines = image.scanlines;
+	return ok;
+}
+
+ImageData::Engine ImageData::active() {
+	static const Engine engine = detect_engine();
+	return engine;
+}
+
+bool ImageData::available(Engine engine) {
+	if (engine == ENGINE_SSE41) return sse41_supported();
+	if (engine == ENGINE_AVX2) return avx2_supported();
+	return engine < ENGINE_COUNT;
+}
+
+const char *ImageData::engine_name(Engine engine) {
+	switch (engine) {
+		case ENGINE_PORTABLE:
+			return "portable";
+		case ENGINE_SSE41:
+			return "sse4.1";
+		case ENGINE_AVX2:
+			return "avx2";
+		default:
+			return "unknown";
+	}
+}
+
+void ImageData::unfilter(Filter filter, uint8_t *row, const uint8_t *previous, size_t length, size_t pixel_bytes) {
+	UNFILTER_ENGINES[active()](filter, row, previous, length, pixel_bytes);
+}
+
+void ImageData::unfilter_with(Engine engine, Filter filter, uint8_t *row, const uint8_t *previous, size_t length, size_t pixel_bytes) {
+	UNFILTER_ENGINES[engine](filter, row, previous, length, pixel_bytes);
+}
+
+bool ImageData::self_test() {
+	const size_t SIZE = 600;
+	std::vector<uint8_t> above(ROW_BEFORE + SIZE + ROW_AFTER, 0);
+	std::vector<uint8_t> raw(ROW_BEFORE + SIZE + ROW_AFTER, 0);
+
+	/* Cheap LCG, the content only needs to be irregular */
+	uint32_t seed = 0x2083;
+	for (size_t i = ROW_BEFORE; i < ROW_BEFORE + SIZE; i++) {
+		seed = seed * 1103515245 + 12345;
+		above[i] = seed >> 16;
+		seed = seed * 1103515245 + 12345;
+		raw[i] = seed >> 16;
+	}
+
+	for (int e = 1; e < ENGINE_COUNT; e++) {
+		Engine engine = (Engine) e;
+		if (!available(engine)) continue;
+
+		/* Every pixel width a PNG can have, over lengths around each step size */
+		for (size_t pixel_bytes : {1, 2, 3, 4, 6, 8}) {
+			for (int f = 0; f < FILTER_COUNT; f++) {
+				for (size_t length = 0; length <= SIZE; length += (length < 80) ? pixel_bytes : 61 * pixel_bytes) {
+					std::vector<uint8_t> expected = raw;
+					std::vector<uint8_t> actual = raw;
+
+					unfilter_with(ENGINE_PORTABLE, (Filter) f, expected.data() + ROW_BEFORE, above.data() + ROW_BEFORE, length, pixel_bytes);
+					unfilter_with(engine, (Filter) f, actual.data() + ROW_BEFORE, above.data() + ROW_BEFORE, length, pixel_bytes);
+
+					if (memcmp(expected.data(), actual.data(), ROW_BEFORE + length)) return false;
+				}
+			}
+		}
+	}
+
+	/* Paeth by hand, for the ties */
+	if (paeth(10, 20, 10) != 20 || paeth(20, 10, 10) != 20 || paeth(5, 5, 5) != 5 || paeth(0, 255, 128) != 128) return false;
+
+	return Inflate::self_test();
+}
@@ -0,0 +1,102 @@
+/*
+IMAGEDATA.HPP
+NICK WILSON
+2019
+*/
+
+#ifndef OBJ_IMAGEDATA
+#define OBJ_IMAGEDATA
+
+#include <string>
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ImageHeader.hpp"
+#include "Inflate.hpp"
+
+/* Deep check of a PNG's image data, RFC 2083 sections 6 and 8 */
+/* The IDAT stream is inflated and each scanline's filter undone as it arrives, holding only it and the */
+/* one before, so the image must decode to exactly the scanlines its header calls for, pass by pass if */
+/* interlaced. The fastest unfilter engine the CPU supports is picked once */
+class ImageData{
+public:
+	enum Engine {
+		ENGINE_PORTABLE = 0,	/* A byte at a time */
+		ENGINE_SSE41,			/* A pixel at a time for 3, 4, 6 and 8 byte pixels, and Up 16 bytes at a time */
+		ENGINE_AVX2,			/* As SSE4.1, but Up 32 bytes at a time */
+		ENGINE_COUNT
+	};
+
+	enum Filter {
+		FILTER_NONE = 0,
+		FILTER_SUB,
+		FILTER_UP,
+		FILTER_AVERAGE,
+		FILTER_PAETH,
+		FILTER_COUNT
+	};
+
+	/* What a successful check found */
+	struct Result {
+		uint64_t compressed = 0;	/* Bytes of IDAT data */
+		uint64_t filtered = 0;		/* Bytes it inflated to, filter bytes included */
+		uint64_t scanlines = 0;		/* Over every pass */
+	};
+
+	/* Inflate the IDAT data pulled from source, compressed bytes in all, and unfilter every scanline */
+	/* The header must have passed its own check. On failure, error holds a description of the problem */
+	static bool verify(const ImageHeader &header, const Inflate::Source &source, uint64_t compressed, Result &result, std::string &error);
+
+	/* Undo filter on length bytes of row, given the row before it, with pixels pixel_bytes wide */
+	/* Both rows need 8 zero bytes before them, and room for 32 more after */
+	static void unfilter(Filter filter, uint8_t *row, const uint8_t *previous, size_t length, size_t pixel_bytes);
+	static void unfilter_with(Engine engine, Filter filter, uint8_t *row, const uint8_t *previous, size_t length, size_t pixel_bytes);
+
+	static bool available(Engine engine);
+	static Engine active();
+	static const char *engine_name(Engine engine);
+
+	/* Check every available engine against the portable one, for every filter and pixel width */
+	static bool self_test();
+
+private:
+	static const size_t ROW_BEFORE = 8;
+	static const size_t ROW_AFTER = 32;
+
+	uint8_t bits_per_pixel = 0;
+	size_t pixel_bytes = 1;
+	unsigned passes = 1;
+
+	/* Where the current pass is, and how many scanlines it has */
+	ImageHeader header;
+	unsigned pass = 0;
+	uint32_t pass_rows = 0;
+	uint32_t row = 0;
+
+	/* The scanline being filled in and the one before it, with its filter type */
+	std::vector<uint8_t> current;
+	std::vector<uint8_t> previous;
+	size_t row_bytes = 0;
+	size_t filled = 0;
+	int filter = -1;
+
+	uint64_t scanlines = 0;
+	bool finished = false;
+
+	ImageData(const ImageHeader &header);
+
+	/* Size of a pass in pixels, the whole image unless interlaced */
+	void pass_size(unsigned pass, uint32_t &pass_width, uint32_t &pass_height) const;
+
+	/* Skip to the next pass with any pixels in it, or finish */
+	void start_pass(unsigned next);
+
+	/* Filtered scanlines in pieces of any size, in order */
+	bool write(const uint8_t *data, size_t length, std::string &error);
+
+	static uint64_t scanline_bytes(uint8_t bits_per_pixel, uint32_t pixels);
+};
+
+#endif
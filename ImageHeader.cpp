@@ -0,0 +1,50 @@
+/*
+IMAGEHEADER.CPP
+NICK WILSON
+2019
+*/
+
+#include "ImageHeader.hpp"
+
+void ImageHeader::parse(const uint8_t *data) {
+	width =  (data[0] << 24) + (data[1] << 16) + (data[2] << 8) + (data[3]);
+	height = (data[4] << 24) + (data[5] << 16) + (data[6] << 8) + (data[7]);
+	depth =         data[8];
+	colour =        data[9];
+	compression =   data[10];
+	filter =        data[11];
+	interlace =     data[12];
+}
+
+bool ImageHeader::check(std::string &error) const {
+	if (!width) { //width is 0, not valid
+		error = "Invalid image width!";
+		return false;
+	}
+	if (!height) { //height is 0, not valid
+		error = "Invalid image height!";
+		return false;
+	}
+	if (!(depth == 1 || depth == 2 || depth == 4 || depth == 8 || depth == 16)) {
+		error = "Invalid bit depth!";
+		return false;
+	}
+	if (!(colour == 0 || colour == 2 || colour == 3 || colour == 4 || colour == 6)) {
+		error = "Invalid colour type!";
+		return false;
+	}
+	if (compression) { //zero is the only valid option
+		error = "Invalid compression method!";
+		return false;
+	}
+	if (filter) { //zero is the only valid option
+		error = "Invalid filter method!";
+		return false;
+	}
+	if (interlace > 1) { //zero and one are the only valid options
+		error = "Invalid interlace method!";
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,35 @@
+/*
+IMAGEHEADER.HPP
+NICK WILSON
+2019
+*/
+
+#ifndef OBJ_IMAGEHEADER
+#define OBJ_IMAGEHEADER
+
+#include <string>
+
+#include <stdint.h>
+
+/* IHDR data is always this long by RFC 2083 */
+const uint32_t IMAGE_HEADER_SIZE = 13;
+
+/* Fields of the IHDR chunk */
+class ImageHeader{
+public:
+	uint32_t width = 0;
+	uint32_t height = 0;
+	uint8_t depth = 0;
+	uint8_t colour = 0;
+	uint8_t compression = 0;
+	uint8_t filter = 0;
+	uint8_t interlace = 0;
+
+	/* Data must hold IMAGE_HEADER_SIZE bytes */
+	void parse(const uint8_t *data);
+
+	/* False if any field is not permitted by RFC 2083, with the reason in error */
+	bool check(std::string &error) const;
+};
+
+#endif
@@ -0,0 +1,625 @@
+/*
+INFLATE.CPP
+NICK WILSON
+2019
+*/
+
+#include "Inflate.hpp"
+
+#include <algorithm>
+
+#include <string.h>
+
+/* Bits looked up at once, codes longer than this go through a subtable */
+static const unsigned PRIMARY_BITS = 10;
+static const uint32_t PRIMARY_MASK = (1u << PRIMARY_BITS) - 1;
+
+/* Table entries are the symbol, or subtable offset, in the top 16 bits and the code length in the lowest 5 */
+static const uint32_t ENTRY_SUBTABLE = 0x100;
+static const uint32_t ENTRY_INVALID = 0x200;
+static const uint32_t ENTRY_LENGTH = 0x1F;
+
+static const unsigned MAX_CODE_LENGTH = 15;
+static const size_t MAX_MATCH = 258;
+
+/* Output between slides of the window, and room for copies to run over by a word */
+static const size_t BUFFER_SIZE = 262144;
+static const size_t SLACK = 16;
+
+/* Code length code lengths come in this order, RFC 1951 section 3.2.7 */
+static const uint8_t CODE_LENGTH_ORDER[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+/* Base match lengths and distances, and how many extra bits follow each code, RFC 1951 section 3.2.5 */
+/* Extra bits go up by one every four length codes and every two distance codes, after the first eight and four */
+struct MatchTables {
+	uint16_t length_base[29];
+	uint8_t length_extra[29];
+	uint16_t distance_base[30];
+	uint8_t distance_extra[30];
+
+	constexpr MatchTables() : length_base(), length_extra(), distance_base(), distance_extra() {
+		uint32_t base = 3;
+		for (uint32_t i = 0; i < 28; i++) {
+			length_extra[i] = (i < 8) ? 0 : (i - 4) / 4;
+			length_base[i] = base;
+			base += 1u << length_extra[i];
+		}
+
+		/* 258 has a code of its own, rather than the end of the last range */
+		length_extra[28] = 0;
+		length_base[28] = 258;
+
+		base = 1;
+		for (uint32_t i = 0; i < 30; i++) {
+			distance_extra[i] = (i < 4) ? 0 : (i - 2) / 2;
+			distance_base[i] = base;
+			base += 1u << distance_extra[i];
+		}
+	}
+};
+
+static constexpr MatchTables MATCH;
+
+/* Spot check against RFC 1951, evaluated by the compiler */
+static_assert(MATCH.length_base[8] == 11 && MATCH.length_base[27] == 227 && MATCH.length_extra[27] == 5, "Length table generation is broken");
+static_assert(MATCH.distance_base[4] == 5 && MATCH.distance_base[29] == 24577 && MATCH.distance_extra[29] == 13, "Distance table generation is broken");
+
+/* Adler-32 sums stay within 32 bits for this many bytes before they need reducing */
+static const size_t ADLER_BLOCK = 5552;
+static const uint32_t ADLER_MODULUS = 65521;
+
+Inflate::Inflate(const Source &source, const Sink &sink) : source(source), sink(sink) {}
+
+bool Inflate::next_piece() {
+	while (!input_ended) {
+		if (!source(next, available)) {
+			input_ended = true;
+			next = nullptr;
+			available = 0;
+		}
+		else if (available) return true;
+	}
+
+	return false;
+}
+
+/* Top up the bit buffer to at least 57 bits, with zeros once the input runs out */
+/* Those are counted in pad_bits, and using any of them means the stream was cut short */
+void Inflate::refill() {
+	if (bit_count > 56) return;
+
+	/* Whole words while the piece lasts, taking only as many bytes as fit */
+	if (available >= 8) {
+		uint64_t word = 0;
+		for (unsigned i = 0; i < 8; i++) word |= (uint64_t) next[i] << (8 * i);
+
+		bits |= word << bit_count;
+		size_t used = (63 - bit_count) >> 3;
+		next += used;
+		available -= used;
+		bit_count |= 56;
+		return;
+	}
+
+	while (bit_count <= 56) {
+		if (available || next_piece()) {
+			bits |= (uint64_t) *next++ << bit_count;
+			available--;
+		}
+		else pad_bits += 8;
+
+		bit_count += 8;
+	}
+}
+
+uint32_t Inflate::take(unsigned n) {
+	uint32_t value = bits & ((1ull << n) - 1);
+	bits >>= n;
+	bit_count -= n;
+	return value;
+}
+
+bool Inflate::flush() {
+	if (position == flushed) return true;
+
+	adler = adler32(adler, window.data() + flushed, position - flushed);
+	output_total += position - flushed;
+
+	if (!sink(window.data() + flushed, position - flushed)) {
+		sink_stopped = true;
+		return false;
+	}
+
+	flushed = position;
+	return true;
+}
+
+bool Inflate::make_room() {
+	if (position + MAX_MATCH + SLACK <= window.size()) return true;
+	if (!flush()) return false;
+
+	memmove(window.data(), window.data() + position - WINDOW_SIZE, WINDOW_SIZE);
+	position = WINDOW_SIZE;
+	flushed = WINDOW_SIZE;
+	return true;
+}
+
+/* Canonical Huffman code from code lengths, RFC 1951 section 3.2.2 */
+/* Bits arrive lowest first but codes are sent highest bit first, so each code is reversed to index the table */
+bool Inflate::build(Table &table, const uint8_t *lengths, unsigned count, bool complete, std::string &error) {
+	unsigned counts[MAX_CODE_LENGTH + 1] = {};
+	for (unsigned i = 0; i < count; i++) counts[lengths[i]]++;
+	counts[0] = 0;
+
+	unsigned longest = 0;
+	for (unsigned n = 1; n <= MAX_CODE_LENGTH; n++) {
+		if (counts[n]) longest = n;
+	}
+
+	/* Codes left over at each length, below zero if more are used than there are */
+	int left = 1;
+	for (unsigned n = 1; n <= MAX_CODE_LENGTH; n++) {
+		left = (left << 1) - counts[n];
+		if (left < 0) {
+			error = "Compressed data has an over-subscribed Huffman code!";
+			return false;
+		}
+	}
+
+	/* As zlib allows, a code of one symbol may leave the other pattern of its bit unused */
+	if (left > 0 && longest && (complete || longest != 1)) {
+		error = "Compressed data has an incomplete Huffman code!";
+		return false;
+	}
+
+	unsigned next_code[MAX_CODE_LENGTH + 1] = {};
+	unsigned code = 0;
+	for (unsigned n = 1; n <= MAX_CODE_LENGTH; n++) {
+		code = (code + counts[n - 1]) << 1;
+		next_code[n] = code;
+	}
+
+	/* Room for a subtable per symbol at most, so tables rebuilt block after block keep their memory */
+	table.sub_bits = (longest > PRIMARY_BITS) ? longest - PRIMARY_BITS : 0;
+	table.entries.reserve((1u << PRIMARY_BITS) + (count << (MAX_CODE_LENGTH - PRIMARY_BITS)));
+	table.entries.assign(1u << PRIMARY_BITS, ENTRY_INVALID);
+
+	for (unsigned symbol = 0; symbol < count; symbol++) {
+		unsigned length = lengths[symbol];
+		if (!length) continue;
+
+		unsigned reversed = 0;
+		for (unsigned c = next_code[length]++, n = 0; n < length; n++, c >>= 1) reversed = (reversed << 1) | (c & 1);
+
+		uint32_t entry = (symbol << 16) | length;
+
+		if (length <= PRIMARY_BITS) {
+			for (unsigned i = reversed; i <= PRIMARY_MASK; i += 1u << length) table.entries[i] = entry;
+			continue;
+		}
+
+		/* Codes sharing their first PRIMARY_BITS share a subtable, made when the first of them comes along */
+		uint32_t &primary = table.entries[reversed & PRIMARY_MASK];
+		if (primary & ENTRY_INVALID) {
+			primary = (table.entries.size() << 16) | ENTRY_SUBTABLE | PRIMARY_BITS;
+			table.entries.resize(table.entries.size() + (1u << table.sub_bits), ENTRY_INVALID);
+		}
+
+		size_t start = primary >> 16;
+		for (unsigned i = reversed >> PRIMARY_BITS; i < (1u << table.sub_bits); i += 1u << (length - PRIMARY_BITS)) {
+			table.entries[start + i] = entry;
+		}
+	}
+
+	return true;
+}
+
+/* Needs at least MAX_CODE_LENGTH bits in the buffer */
+bool Inflate::decode(const Table &table, unsigned &symbol) {
+	uint32_t entry = table.entries[bits & PRIMARY_MASK];
+	if (entry & ENTRY_SUBTABLE) entry = table.entries[(entry >> 16) + ((bits >> PRIMARY_BITS) & ((1u << table.sub_bits) - 1))];
+	if (entry & ENTRY_INVALID) return false;
+
+	take(entry & ENTRY_LENGTH);
+	symbol = entry >> 16;
+	return true;
+}
+
+const Inflate::Table &Inflate::fixed_literals() {
+	static const Table table = [] {
+		uint8_t lengths[288];
+		memset(lengths, 8, 144);
+		memset(lengths + 144, 9, 112);
+		memset(lengths + 256, 7, 24);
+		memset(lengths + 280, 8, 8);
+
+		Table fixed;
+		std::string error;
+		build(fixed, lengths, sizeof(lengths), false, error);
+		return fixed;
+	}();
+
+	return table;
+}
+
+/* All 32 codes, though the last two are never valid, so the code is complete */
+const Inflate::Table &Inflate::fixed_distances() {
+	static const Table table = [] {
+		uint8_t lengths[32];
+		memset(lengths, 5, sizeof(lengths));
+
+		Table fixed;
+		std::string error;
+		build(fixed, lengths, sizeof(lengths), false, error);
+		return fixed;
+	}();
+
+	return table;
+}
+
+bool Inflate::stored(std::string &error) {
+	/* Lengths start at the next byte */
+	take(bit_count & 7);
+	refill();
+
+	uint32_t length = take(16);
+	uint32_t check = take(16);
+
+	if (overran()) {
+		error = "Compressed data ends early!";
+		return false;
+	}
+
+	if (length != (~check & 0xFFFF)) {
+		error = "Compressed data has a corrupt stored block length!";
+		return false;
+	}
+
+	/* Whole bytes left in the bit buffer come first, then the rest straight from the input */
+	for (; length && bit_count > pad_bits; length--) {
+		if (!make_room()) return false;
+		window[position++] = take(8);
+	}
+
+	/* Whole word refills leave the bytes after the last one counted in the top of the buffer */
+	/* Those are about to be copied past, so they must go */
+	if (!bit_count) bits = 0;
+
+	while (length) {
+		if (!available && !next_piece()) {
+			error = "Compressed data ends early!";
+			return false;
+		}
+		if (!make_room()) return false;
+
+		size_t n = std::min({(size_t) length, available, window.size() - SLACK - position});
+		memcpy(window.data() + position, next, n);
+		position += n;
+		next += n;
+		available -= n;
+		length -= n;
+	}
+
+	return true;
+}
+
+bool Inflate::huffman(const Table &literal_table, const Table &distance_table, std::string &error) {
+	for (;;) {
+		/* The longest symbol, a length with its extra bits and a distance with its own, 48 bits in all */
+		refill();
+		if (overran()) {
+			error = "Compressed data ends early!";
+			return false;
+		}
+		if (!make_room()) return false;
+
+		unsigned symbol;
+		if (!decode(literal_table, symbol)) {
+			error = "Compressed data has an invalid literal or length code!";
+			return false;
+		}
+
+		if (symbol < 256) {
+			window[position++] = symbol;
+			continue;
+		}
+
+		if (symbol == 256) return true;
+
+		symbol -= 257;
+		if (symbol >= 29) {
+			error = "Compressed data has an invalid literal or length code!";
+			return false;
+		}
+
+		size_t length = MATCH.length_base[symbol] + take(MATCH.length_extra[symbol]);
+
+		if (!decode(distance_table, symbol) || symbol >= 30) {
+			error = "Compressed data has an invalid distance code!";
+			return false;
+		}
+
+		size_t distance = MATCH.distance_base[symbol] + take(MATCH.distance_extra[symbol]);
+
+		if (distance > position) {
+			error = "Compressed data refers back past its start!";
+			return false;
+		}
+
+		/* A word at a time when the copy never reads what it writes in the same step */
+		/* A distance of one repeats a byte, anything else in between goes byte by byte */
+		uint8_t *out = window.data() + position;
+		const uint8_t *from = out - distance;
+
+		if (distance >= 8) {
+			for (size_t i = 0; i < length; i += 8) memcpy(out + i, from + i, 8);
+		}
+		else if (distance == 1) memset(out, *from, length);
+		else {
+			for (size_t i = 0; i < length; i++) out[i] = from[i];
+		}
+
+		position += length;
+	}
+}
+
+bool Inflate::dynamic_tables(std::string &error) {
+	refill();
+
+	unsigned literal_count = take(5) + 257;
+	unsigned distance_count = take(5) + 1;
+	unsigned code_length_count = take(4) + 4;
+
+	if (literal_count > 286 || distance_count > 30) {
+		error = "Compressed data has too many literal or distance codes!";
+		return false;
+	}
+
+	/* Three bits each, which can run past one refill */
+	uint8_t code_lengths[19] = {};
+	for (unsigned i = 0; i < code_length_count; i++) {
+		if (i == 8) refill();
+		code_lengths[CODE_LENGTH_ORDER[i]] = take(3);
+	}
+
+	if (!build(code_length_table, code_lengths, 19, true, error)) return false;
+
+	/* Literal and distance code lengths run on from one into the other, repeats included */
+	uint8_t lengths[286 + 30];
+	unsigned total = literal_count + distance_count;
+
+	for (unsigned n = 0; n < total;) {
+		refill();
+		if (overran()) {
+			error = "Compressed data ends early!";
+			return false;
+		}
+
+		unsigned symbol;
+		if (!decode(code_length_table, symbol)) {
+			error = "Compressed data has an invalid code length code!";
+			return false;
+		}
+
+		if (symbol < 16) {
+			lengths[n++] = symbol;
+			continue;
+		}
+
+		uint8_t value = 0;
+		unsigned repeat;
+
+		if (symbol == 16) {
+			if (!n) {
+				error = "Compressed data repeats a code length before the first!";
+				return false;
+			}
+			value = lengths[n - 1];
+			repeat = 3 + take(2);
+		}
+		else if (symbol == 17) repeat = 3 + take(3);
+		else repeat = 11 + take(7);
+
+		if (n + repeat > total) {
+			error = "Compressed data has too many code lengths!";
+			return false;
+		}
+
+		memset(lengths + n, value, repeat);
+		n += repeat;
+	}
+
+	if (!lengths[256]) {
+		error = "Compressed data has no end of block code!";
+		return false;
+	}
+
+	return build(literals, lengths, literal_count, false, error) && build(distances, lengths + literal_count, distance_count, false, error);
+}
+
+bool Inflate::zlib(std::string &error) {
+	window.assign(WINDOW_SIZE + BUFFER_SIZE + SLACK, 0);
+	refill();
+
+	/* Deflate with at most a 32 KB window, and a check over both bytes, RFC 1950 section 2.2 */
+	uint32_t method = take(8);
+	uint32_t flags = take(8);
+
+	if (overran()) {
+		error = "Compressed data ends early!";
+		return false;
+	}
+
+	if ((method & 0x0F) != 8 || (method >> 4) > 7 || ((method << 8) | flags) % 31) {
+		error = "Compressed data has an invalid zlib header!";
+		return false;
+	}
+
+	if (flags & 0x20) {
+		error = "Compressed data needs a preset dictionary!";
+		return false;
+	}
+
+	bool last = false;
+	while (!last) {
+		refill();
+		last = take(1);
+		uint32_t type = take(2);
+
+		bool ok;
+		switch (type) {
+			case 0:
+				ok = stored(error);
+				break;
+			case 1:
+				ok = huffman(fixed_literals(), fixed_distances(), error);
+				break;
+			case 2:
+				ok = dynamic_tables(error) && huffman(literals, distances, error);
+				break;
+			default:
+				error = "Compressed data has an invalid block type!";
+				ok = false;
+		}
+
+		if (!ok) return false;
+	}
+
+	if (!flush()) return false;
+
+	/* Adler-32 of the output, highest byte first, from the next byte */
+	take(bit_count & 7);
+	refill();
+
+	uint32_t check = 0;
+	for (int i = 0; i < 4; i++) check = (check << 8) | take(8);
+
+	if (overran()) {
+		error = "Compressed data ends early!";
+		return false;
+	}
+
+	if (check != adler) {
+		error = "Compressed data fails its Adler-32 check!";
+		return false;
+	}
+
+	if (bit_count > pad_bits || available || next_piece()) {
+		error = "Compressed data carries on past the end of its stream!";
+		return false;
+	}
+
+	return true;
+}
+
+uint32_t Inflate::adler32(uint32_t adler, const uint8_t *data, size_t length) {
+	uint32_t a = adler & 0xFFFF;
+	uint32_t b = adler >> 16;
+
+	while (length) {
+		size_t n = std::min(length, ADLER_BLOCK);
+		length -= n;
+
+		for (; n >= 8; n -= 8, data += 8) {
+			a += data[0]; b += a;
+			a += data[1]; b += a;
+			a += data[2]; b += a;
+			a += data[3]; b += a;
+			a += data[4]; b += a;
+			a += data[5]; b += a;
+			a += data[6]; b += a;
+			a += data[7]; b += a;
+		}
+		for (; n; n--) {
+			a += *data++;
+			b += a;
+		}
+
+		a %= ADLER_MODULUS;
+		b %= ADLER_MODULUS;
+	}
+
+	return (b << 16) | a;
+}
+
+bool Inflate::self_test() {
+	/* 1000 bytes of rearranged pangram, from zlib at level 9 with and without Z_FIXED */
+	static const uint8_t FIXED[] = {
+		0x78, 0x01, 0x2B, 0x49, 0xCE, 0x2B, 0x4D, 0xCD, 0x49, 0x2F, 0xCD, 0x57, 0xC8, 0x4F, 0x4D, 0x29, 0x2C, 0xAA, 0x50, 0xC8,
+		0x50, 0x48, 0x55, 0x48, 0x2B, 0x50, 0xA8, 0x2A, 0xC9, 0x56, 0xC8, 0x2D, 0x4A, 0x54, 0xC8, 0x2C, 0xCF, 0x2A, 0x53, 0xC8,
+		0x2F, 0x04, 0x4B, 0x2B, 0x24, 0xE5, 0x17, 0x97, 0x54, 0x66, 0x64, 0x83, 0xA5, 0x61, 0xFA, 0xC0, 0xD2, 0x30, 0x7D, 0x60,
+		0x69, 0x98, 0x3E, 0xB8, 0xB1, 0x20, 0x7D, 0x70, 0x63, 0x41, 0xFA, 0xE0, 0xC6, 0x82, 0xF4, 0xC1, 0x8D, 0x05, 0xE9, 0x2B,
+		0x19, 0x75, 0xCE, 0xA8, 0x73, 0x46, 0x9D, 0x43, 0x7D, 0xE7, 0x00, 0x00, 0x41, 0x42, 0x71, 0xC8
+	};
+	static const uint8_t DYNAMIC[] = {
+		0x78, 0xDA, 0xED, 0x8E, 0xCB, 0x0D, 0x80, 0x30, 0x0C, 0xC5, 0x56, 0x79, 0xAB, 0xF1, 0x29, 0x14, 0x0A, 0x84, 0x96, 0x94,
+		0xDF, 0xF4, 0x28, 0x91, 0x9A, 0x09, 0x38, 0xF6, 0x6C, 0xD9, 0x32, 0x77, 0x5B, 0x76, 0xCB, 0x98, 0x09, 0xE4, 0xFA, 0x98,
+		0x6E, 0x78, 0x38, 0x0C, 0x3B, 0x5E, 0x0E, 0x58, 0x53, 0x83, 0xE9, 0x9A, 0x4F, 0x50, 0x54, 0x8C, 0x96, 0x0E, 0x7E, 0x7C,
+		0x50, 0x5C, 0x3C, 0xC5, 0xC5, 0x53, 0x5C, 0x3C, 0xCB, 0x8A, 0x67, 0x59, 0xF1, 0x2C, 0x2B, 0x9E, 0x65, 0xC5, 0xE3, 0xBA,
+		0x53, 0x77, 0xEA, 0xCE, 0xFF, 0x3B, 0x1F, 0x41, 0x42, 0x71, 0xC8
+	};
+
+	const char TEXT[] = "the quick brown fox jumps over the lazy dog ";
+	const size_t TEXT_LENGTH = sizeof(TEXT) - 1;
+
+	std::vector<uint8_t> expected(1000);
+	for (size_t i = 0; i < expected.size(); i++) expected[i] = TEXT[(i * 7 + i / 13) % TEXT_LENGTH];
+
+	/* The same bytes in two stored blocks, the second one empty */
+	std::vector<uint8_t> stored = {0x78, 0x01, 0x00, 0xE8, 0x03, 0x17, 0xFC};
+	stored.insert(stored.end(), expected.begin(), expected.end());
+	stored.insert(stored.end(), {0x01, 0x00, 0x00, 0xFF, 0xFF});
+	uint32_t check = adler32(1, expected.data(), expected.size());
+	for (int shift = 24; shift >= 0; shift -= 8) stored.push_back(check >> shift);
+
+	const std::vector<uint8_t> streams[] = {
+		stored,
+		std::vector<uint8_t>(FIXED, FIXED + sizeof(FIXED)),
+		std::vector<uint8_t>(DYNAMIC, DYNAMIC + sizeof(DYNAMIC))
+	};
+
+	/* Whole, and a byte per piece so every field is split at some point */
+	auto run = [&expected](const std::vector<uint8_t> &stream, size_t piece, std::vector<uint8_t> &output) {
+		size_t offset = 0;
+		Source source = [&stream, &offset, piece](const uint8_t *&data, size_t &length) {
+			if (offset == stream.size()) return false;
+			data = stream.data() + offset;
+			length = std::min(piece, stream.size() - offset);
+			offset += length;
+			return true;
+		};
+		Sink sink = [&output](const uint8_t *data, size_t length) {
+			output.insert(output.end(), data, data + length);
+			return true;
+		};
+
+		std::string error;
+		Inflate inflate(source, sink);
+		return inflate.zlib(error);
+	};
+
+	for (const std::vector<uint8_t> &stream : streams) {
+		for (size_t piece : {stream.size(), (size_t) 1, (size_t) 7}) {
+			std::vector<uint8_t> output;
+			if (!run(stream, piece, output) || output != expected) return false;
+		}
+
+		/* Cut short, or with a byte to spare */
+		std::vector<uint8_t> output;
+		if (run(std::vector<uint8_t>(stream.begin(), stream.end() - 1), stream.size(), output)) return false;
+
+		std::vector<uint8_t> longer = stream;
+		longer.push_back(0);
+		if (run(longer, longer.size(), output)) return false;
+
+		/* A low bit flipped anywhere after the header is caught, by the code itself or by the checksum */
+		/* Higher bits can land in the padding after a stored block's header, which is never read */
+		for (size_t i = 2; i < stream.size(); i += 5) {
+			std::vector<uint8_t> damaged = stream;
+			damaged[i] ^= 0x01;
+			if (run(damaged, damaged.size(), output)) return false;
+		}
+	}
+
+	return true;
+}
@@ -0,0 +1,104 @@
+/*
+INFLATE.HPP
+NICK WILSON
+2019
+*/
+
+#ifndef OBJ_INFLATE
+#define OBJ_INFLATE
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Streaming zlib (RFC 1950) and DEFLATE (RFC 1951) decoder */
+/* Input is pulled piece by piece, so a stream split over many chunks is never joined up, and output */
+/* is pushed out in runs as it is decoded. Memory is the 32 KB window plus a little, whatever the size */
+class Inflate{
+public:
+	/* Next piece of input, false once there is no more */
+	typedef std::function<bool(const uint8_t *&data, size_t &length)> Source;
+
+	/* Takes each run of output in order, false to stop decoding */
+	typedef std::function<bool(const uint8_t *data, size_t length)> Sink;
+
+	static const size_t WINDOW_SIZE = 32768;
+
+	Inflate(const Source &source, const Sink &sink);
+
+	/* Decode one zlib stream, checking its header and Adler-32, and that nothing follows it */
+	/* If the sink stops early, returns false and leaves error empty for it to fill */
+	bool zlib(std::string &error);
+
+	/* Bytes of output so far */
+	uint64_t total() const { return output_total; }
+
+	static uint32_t adler32(uint32_t adler, const uint8_t *data, size_t length);
+
+	/* Decode stored, fixed and dynamic Huffman blocks with known results */
+	static bool self_test();
+
+private:
+	/* Huffman lookup table, a primary table indexed by the next PRIMARY_BITS bits with */
+	/* subtables behind it for longer codes */
+	struct Table {
+		std::vector<uint32_t> entries;
+		unsigned sub_bits = 0;
+	};
+
+	Source source;
+	Sink sink;
+
+	/* Current piece of input */
+	const uint8_t *next = nullptr;
+	size_t available = 0;
+
+	/* Bits not yet used, lowest first, and how many zeros have been added past the end of input */
+	/* Those always come last, so fewer bits than that left means some were used */
+	uint64_t bits = 0;
+	unsigned bit_count = 0;
+	unsigned pad_bits = 0;
+
+	/* Window, then decoded output not yet pushed to the sink */
+	std::vector<uint8_t> window;
+	size_t position = 0;
+	size_t flushed = 0;
+	uint64_t output_total = 0;
+	uint32_t adler = 1;
+
+	/* Rebuilt for every dynamic block, reusing their room */
+	Table code_length_table;
+	Table literals;
+	Table distances;
+
+	bool input_ended = false;
+	bool sink_stopped = false;
+
+	void refill();
+	bool overran() const { return bit_count < pad_bits; }
+	uint32_t take(unsigned n);
+
+	/* Push out what has been decoded, and slide the window down once there's no room for a match */
+	bool flush();
+	bool make_room();
+
+	/* A code with unused bit patterns is only allowed when complete is false and it has one symbol */
+	static bool build(Table &table, const uint8_t *lengths, unsigned count, bool complete, std::string &error);
+	bool decode(const Table &table, unsigned &symbol);
+
+	/* The next piece of input with anything in it, false once there is none */
+	bool next_piece();
+
+	bool stored(std::string &error);
+	bool huffman(const Table &literal_table, const Table &distance_table, std::string &error);
+	bool dynamic_tables(std::string &error);
+
+	/* The same for every fixed block, so built once */
+	static const Table &fixed_literals();
+	static const Table &fixed_distances();
+};
+
+#endif
@@ -0,0 +1,118 @@
+/*
+MAPPEDPNG.CPP
+NICK WILSON
+2019
+*/
+
+#include "MappedPng.hpp"
+#include "Crc32.hpp"
+#include "PngPack.hpp"
+#include "Stats.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <string.h>
+
+/* PNG signature length */
+static const uint64_t SIGNATURE_SIZE = 8;
+
+static const uint32_t TYPE_END = as_type("IEND");
+
+static inline uint32_t load32(const uint8_t *p) {
+	uint32_t x;
+	memcpy(&x, p, sizeof(uint32_t));
+	return x;
+}
+
+/* ChunkView */
+uint32_t ChunkView::calc_crc() const {
+	/* TYPE sits directly before DATA in the file, so the CRC is one pass over both */
+	return Crc32::calc(data - sizeof(uint32_t), length + sizeof(uint32_t));
+}
+
+bool ChunkView::validate() const {
+	Stats::Scope timing(Stats::PHASE_VALIDATE, length);
+	return crc == calc_crc();
+}
+
+std::string ChunkView::name() const {
+	return std::string(reinterpret_cast<const char *>(&type), sizeof(uint32_t));
+}
+
+/* MappedPng */
+MappedPng::~MappedPng() {
+	close();
+}
+
+bool MappedPng::open(const std::string &filename) {
+	Stats::Scope timing(Stats::PHASE_OPEN);
+	struct stat st;
+
+	close();
+
+	fd = ::open(filename.c_str(), O_RDONLY);
+	if (fd < 0) return false;
+
+	if (fstat(fd, &st) || st.st_size <= 0) {
+		close();
+		return false;
+	}
+
+	void *m = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (m == MAP_FAILED) {
+		close();
+		return false;
+	}
+
+	map = static_cast<const uint8_t *>(m);
+	map_size = st.st_size;
+
+	/* Chunks are almost always visited front to back */
+	madvise(m, map_size, MADV_SEQUENTIAL);
+
+	return true;
+}
+
+void MappedPng::close() {
+	if (map) munmap(const_cast<uint8_t *>(map), map_size);
+	if (fd >= 0) ::close(fd);
+	map = nullptr;
+	map_size = 0;
+	fd = -1;
+	chunks.clear();
+}
+
+bool MappedPng::parse() {
+	uint64_t pos = SIGNATURE_SIZE;
+	Stats::Scope timing(Stats::PHASE_PARSE);
+
+	chunks.clear();
+
+	while (pos < map_size) {
+		/* LENGTH and TYPE must both be present */
+		if (pos + 2 * sizeof(uint32_t) > map_size) return false;
+
+		ChunkView chunk;
+		chunk.offset = pos;
+		chunk.length = ntohl(load32(map + pos));
+		chunk.type = load32(map + pos + sizeof(uint32_t));
+
+		/* Confirm it doesn't run past the end of the file */
+		if (pos + 3 * sizeof(uint32_t) + chunk.length > map_size) return false;
+
+		chunk.data = map + pos + 2 * sizeof(uint32_t);
+		chunk.crc = ntohl(load32(chunk.data + chunk.length));
+
+		chunks.push_back(chunk);
+		pos += 3 * sizeof(uint32_t) + chunk.length;
+		timing.add(3 * sizeof(uint32_t));
+
+		/* Anything after IEND is not part of the image */
+		if (chunk.type == TYPE_END) break;
+	}
+
+	return true;
+}
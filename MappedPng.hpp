@@ -0,0 +1,54 @@
+/*
+MAPPEDPNG.HPP
+NICK WILSON
+2019
+*/
+
+#ifndef OBJ_MAPPEDPNG
+#define OBJ_MAPPEDPNG
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+/* Non-owning view of a chunk inside a mapped PNG */
+class ChunkView{
+public:
+	uint64_t offset;		/* Position of the LENGTH field within the file */
+	uint32_t length;
+	uint32_t type;
+	uint32_t crc;
+	const uint8_t *data;	/* Points into the mapping, valid while it stays open */
+
+	uint32_t calc_crc() const;
+	bool validate() const;
+	std::string name() const;
+};
+
+/* Read-only mapping of a whole PNG, broken into chunk views without copying */
+class MappedPng{
+private:
+	int fd = -1;
+	const uint8_t *map = nullptr;
+	uint64_t map_size = 0;
+
+public:
+	std::vector<ChunkView> chunks;
+
+	MappedPng() {}
+	MappedPng(const MappedPng &) = delete;
+	MappedPng &operator=(const MappedPng &) = delete;
+	~MappedPng();
+
+	bool open(const std::string &filename);
+	void close();
+
+	/* Walk the chunks after the signature, false if one runs past EOF */
+	bool parse();
+
+	const uint8_t *data() const { return map; }
+	uint64_t size() const { return map_size; }
+};
+
+#endif
@@ -0,0 +1,56 @@
+/*
+PNGPACK.HPP
+NICK WILSON
+2019
+*/
+
+#ifndef OBJ_PNGPACK
+#define OBJ_PNGPACK
+
+#include <string>
+
+#include <stdint.h>
+#include <string.h>
+
+/* PNGs MUST have this as their leading bytes by RFC 2083 */
+const uint8_t PNG_SIGNATURE[] = {0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A};
+
+/* PNG writing constants */
+const std::string CHUNK_TYPE_INDEX = "fiDX";
+const std::string CHUNK_TYPE_FILE = "fiLE";
+const std::string CHUNK_TYPE_DIRECTORY = "fiDR";
+const std::string CHUNK_TYPE_PARITY = "fiPR";
+
+/* Offset table and the other records describing the file chunks, directly after the index */
+const std::string CHUNK_TYPE_TABLE = "fiTB";
+
+/* Empty chunk ahead of a packed file that was updated in place */
+/* It starts out as an IEND, hiding the new chunks until they are all written */
+const std::string CHUNK_TYPE_PAD = "fiPD";
+
+/* By trial and error, this seems to be about the biggest size permitted by most programs */
+/* This seems to contradict the spec which states it may be up to 2^31 - 1 */
+/* Programs should just skip these chunks but they don't. Instead, they crash :D */
+const uint32_t CHUNK_SIZE_DATA_MAX = 0x700000;
+
+/* General error checking */
+const uint64_t PNG_MIN_SIZE = 0x39;
+/*
+SIGNATURE: 8
+IHDR: 4 + 4 + N + 4
+	N: 13
+IDAT: 4 + 4 + N + 4
+	N: 0
+IEND: 4 + 4 + N + 4
+	N: 0
+TOTAL: 57 (0x39)
+*/
+
+/* Take pre-defined string type and return four bytes */
+inline uint32_t as_type(const std::string &str) {
+	uint32_t type = 0;
+	if (str.length() >= 4) memcpy(&type, str.data(), sizeof(uint32_t));
+	return type;
+}
+
+#endif
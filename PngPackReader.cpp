@@ -0,0 +1,878 @@
+/*
+PNGPACKREADER.CPP
+NICK WILSON
+2019
+*/
+
+#include "PngPackReader.hpp"
+#include "BlockPipeline.hpp"
+#include "Chunk.hpp"
+#include "Codec.hpp"
+#include "FileCopy.hpp"
+#include "PngPack.hpp"
+#include "ReedSolomon.hpp"
+#include "Stats.hpp"
+
+#include <algorithm>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Swap a block's data for what it holds, opening it if it was sealed and then */
+/* decompressing it if it was compressed. Raw blocks are left as they are */
+static bool decode(const FileIndex &index, const Cipher &cipher, size_t n, std::vector<uint8_t> &data) {
+	if (index.encrypted()) {
+		if (n >= index.chunks.size() || data.size() != index.chunk_length(n)) return false;
+		if (!cipher.open(n, nullptr, 0, data.data(), index.chunks[n].stored)) return false;
+		data.resize(index.chunks[n].stored);
+	}
+
+	if (!index.compressed(n)) return true;
+
+	static thread_local std::vector<uint8_t> decoded;
+	decoded.resize(index.block_size(n));
+
+	if (!Codec::decompress(index.codec, data.data(), data.size(), decoded.data(), decoded.size())) return false;
+
+	data.swap(decoded);
+	return true;
+}
+
+/* Whether block n came out the size the table gives it, as the digest relies on that to place it */
+static bool fits(const FileIndex &index, size_t n, const std::vector<uint8_t> &data) {
+	return n < index.chunks.size() && data.size() == index.block_size(n);
+}
+
+/* For a chunk that failed validation and couldn't be rebuilt */
+static std::string damaged(const FileIndex &index, uint64_t number) {
+	if (index.parity_scheme == FileIndex::PARITY_NONE) return "Chunk " + std::to_string(number) + " failed validation!";
+	return "Chunk " + std::to_string(number) + " failed validation, and too much of its parity group is damaged to rebuild it!";
+}
+
+/* For a chunk that validated, but then couldn't be opened or decompressed */
+static std::string undecodable(const FileIndex &index, uint64_t number) {
+	if (!index.encrypted()) return "Chunk " + std::to_string(number) + " could not be decompressed!";
+	return "Chunk " + std::to_string(number) + " has been altered, or could not be decompressed!";
+}
+
+bool PngPackReader::open(const std::string &filename, std::string &error) {
+	struct stat file_A;
+
+	close();
+
+	if (stat(filename.c_str(), &file_A)) {
+		error = "Could not read file details for \"" + filename + "\"";
+		return false;
+	}
+
+	if (!walker.open(filename)) {
+		error = "Could not read file \"" + filename + "\"";
+		return false;
+	}
+
+	if (walker.size() < PNG_MIN_SIZE) {
+		error = "PNG file is too small. Is it corrupted?";
+		return false;
+	}
+
+	/* File should lead with [89 50 4E 47 0D 0A 1A 0A] by RFC 2083 */
+	if (!walker.check_signature()) {
+		error = "Invalid PNG signature. Is the file corrupted or not a PNG?";
+		return false;
+	}
+
+	return true;
+}
+
+void PngPackReader::close() {
+	walker.close();
+	located = false;
+	chunks_walked = 0;
+	chunks_extracted = 0;
+	idx_header = ChunkHeader();
+	idx_pos = 0;
+	tbl_header = ChunkHeader();
+	tbl_pos = 0;
+	dir_pos = 0;
+	dir_header = ChunkHeader();
+	dir_data.clear();
+	dat_pos = 0;
+	file_index = FileIndex();
+	file_chunks.clear();
+	cipher = Cipher();
+}
+
+bool PngPackReader::enumerate(std::vector<ChunkHeader> &chunks, std::string &error) {
+	ChunkHeader header;
+
+	chunks.clear();
+
+	if (!walker.check_signature()) {
+		error = "Invalid PNG signature. Is the file corrupted or not a PNG?";
+		return false;
+	}
+
+	while (walker.next(header)) chunks.push_back(header);
+
+	if (walker.truncated()) {
+		error = "Reached EOF before all chunks were loaded. Is the PNG corrupted?";
+		return false;
+	}
+
+	return true;
+}
+
+bool PngPackReader::find_index(std::string &error) {
+	ChunkHeader header;
+
+	if (idx_pos) return true;
+
+	if (!walker.check_signature()) {
+		error = "Invalid PNG signature. Is the file corrupted or not a PNG?";
+		return false;
+	}
+
+	chunks_walked = 0;
+	tbl_pos = 0;
+	dir_pos = 0;
+	dir_data.clear();
+	dat_pos = 0;
+	file_chunks.clear();
+
+	/* An archive's directory comes before its index, and so do the file chunks of a trailing one */
+	while (!idx_pos && walker.next(header)) {
+		if (header.type == as_type(CHUNK_TYPE_INDEX)) {
+			idx_pos = chunks_walked;
+			idx_header = header;
+		}
+		else if (header.type == as_type(CHUNK_TYPE_DIRECTORY)) {
+			dir_pos = chunks_walked;
+			dir_header = header;
+		}
+		else if (header.type == as_type(CHUNK_TYPE_FILE)) {
+			/* Only the run leading straight up to the index can be its own */
+			if (!dat_pos || dat_pos + file_chunks.size() != chunks_walked) {
+				dat_pos = chunks_walked;
+				file_chunks.clear();
+			}
+			file_chunks.push_back(header);
+		}
+		chunks_walked++;
+	}
+
+	if (walker.truncated()) {
+		error = "Reached EOF before all chunks were loaded. Is the PNG corrupted?";
+		idx_pos = 0;
+		return false;
+	}
+
+	/* Index position still 0, which is impossible as IHDR must be first */
+	if (!idx_pos) {
+		error = "No index chunk present!";
+		return false;
+	}
+
+	std::vector<uint8_t> idx_data;
+	uint32_t idx_crc;
+
+	if (!walker.load(idx_header, idx_data, idx_crc)) {
+		error = "Could not read index chunk!";
+		idx_pos = 0;
+		return false;
+	}
+
+	Chunk index(idx_header.length, idx_header.type, std::move(idx_data), idx_crc);
+
+	if (!index.validate()) {
+		error = "Chunk " + std::to_string(idx_pos) + " failed validation!";
+		idx_pos = 0;
+		return false;
+	}
+
+	/* A freshly unpacked digest is still sealed */
+	cipher = Cipher();
+
+	if (!file_index.unpack(index.data.data(), index.length)) {
+		error = file_index.filename.empty() ? "Empty filename!" : "Invalid index chunk!";
+		idx_pos = 0;
+		return false;
+	}
+
+	/* The table, if there is one, comes straight after the index */
+	const uint8_t *next = walker.peek(walker.position() + sizeof(uint32_t), sizeof(uint32_t));
+
+	if (next && !memcmp(next, CHUNK_TYPE_TABLE.data(), sizeof(uint32_t)) && walker.next(tbl_header)) {
+		tbl_pos = chunks_walked++;
+
+		std::vector<uint8_t> tbl_data;
+		uint32_t tbl_crc;
+
+		if (!walker.load(tbl_header, tbl_data, tbl_crc)) {
+			error = "Could not read table chunk!";
+			idx_pos = 0;
+			return false;
+		}
+
+		Chunk table(tbl_header.length, tbl_header.type, std::move(tbl_data), tbl_crc);
+
+		if (!table.validate()) {
+			error = "Chunk " + std::to_string(tbl_pos) + " failed validation!";
+			idx_pos = 0;
+			return false;
+		}
+
+		if (!file_index.unpack_table(table.data.data(), table.length)) {
+			error = (file_index.encryption.iterations > Cipher::KDF_ITERATIONS_MAX) ? "Key derivation asks for too many iterations ("
+				+ std::to_string(file_index.encryption.iterations) + ", at most " + std::to_string(Cipher::KDF_ITERATIONS_MAX) + ")!" : "Invalid table chunk!";
+			idx_pos = 0;
+			return false;
+		}
+	}
+
+	/* File chunks ahead of a leading index aren't its own, locate() finds those after it */
+	if (!file_index.trailing || dat_pos + file_chunks.size() != idx_pos) {
+		dat_pos = 0;
+		file_chunks.clear();
+	}
+
+	return true;
+}
+
+bool PngPackReader::locate(std::string &error) {
+	ChunkHeader header;
+
+	if (located) return true;
+
+	if (!find_index(error) || !unlock(error)) return false;
+
+	/* A trailing index has already been walked past its file chunks */
+	while (!file_index.trailing && walker.next(header)) {
+		if (header.type == as_type(CHUNK_TYPE_FILE)) {
+			if (!dat_pos) dat_pos = chunks_walked;
+			file_chunks.push_back(header);
+		}
+		else if (dat_pos) {
+			chunks_walked++;
+			break;
+		}
+		chunks_walked++;
+	}
+
+	if (walker.truncated()) {
+		error = "Reached EOF before all chunks were loaded. Is the PNG corrupted?";
+		return false;
+	}
+
+	/* Data chunk was not found */
+	if (!dat_pos) {
+		error = "No file data chunk present!";
+		return false;
+	}
+
+	/* Compressed and sealed chunks can only be read back through the table */
+	if (file_index.codec != Codec::CODEC_NONE || file_index.encrypted()) {
+		bool match = file_chunks.size() == file_index.chunks.size();
+
+		for (size_t i = 0; match && i < file_chunks.size(); i++) {
+			match = file_chunks[i].length == file_index.chunk_length(i);
+		}
+
+		if (!match) {
+			error = "Offset table does not match the file chunks!";
+			return false;
+		}
+	}
+
+	located = true;
+	return true;
+}
+
+bool PngPackReader::unlock(std::string &error) {
+	if (!file_index.encrypted() || cipher.type() != Cipher::CIPHER_NONE) return true;
+
+	if (passphrase.empty()) {
+		error = "Packed file is encrypted, and no passphrase was given!";
+		return false;
+	}
+
+	const FileIndex::Encryption &encryption = file_index.encryption;
+	uint8_t key[Cipher::KEY_SIZE];
+
+	Cipher::derive(encryption.kdf, passphrase, encryption.salt, Cipher::SALT_SIZE, encryption.iterations, key);
+	Cipher opener(encryption.cipher, key);
+
+	/* Only the right key opens the digest, which also covers the size and filename */
+	if (!file_index.open_digest(opener)) {
+		error = "Wrong passphrase, or the index has been altered!";
+		return false;
+	}
+
+	cipher = opener;
+	return true;
+}
+
+bool PngPackReader::load_directory(std::string &error) {
+	if (!dir_data.empty()) return true;
+
+	if (!dir_pos) {
+		error = "No archive directory present!";
+		return false;
+	}
+
+	uint32_t dir_crc;
+
+	if (!walker.load(dir_header, dir_data, dir_crc)) {
+		error = "Could not read archive directory!";
+		dir_data.clear();
+		return false;
+	}
+
+	/* Data is lent to the chunk for validation, then taken back */
+	Chunk directory(dir_header.length, dir_header.type, std::move(dir_data), dir_crc);
+	bool valid = directory.validate();
+	dir_data = std::move(directory.data);
+
+	if (!valid || dir_data.empty()) {
+		error = "Chunk " + std::to_string(dir_pos) + " failed validation!";
+		dir_data.clear();
+		return false;
+	}
+
+	return true;
+}
+
+bool PngPackReader::directory(FileDirectory &directory, std::string &error) {
+	if (!find_index(error) || !load_directory(error)) return false;
+
+	if (!directory.unpack(dir_data.data(), dir_data.size())) {
+		error = "Invalid archive directory!";
+		return false;
+	}
+
+	for (const DirectoryEntry &entry : directory.entries) {
+		if (entry.offset > file_index.size || entry.size > file_index.size - entry.offset) {
+			error = "Invalid archive directory!";
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool PngPackReader::lookup(const std::string &name, DirectoryEntry &entry, std::string &error) {
+	if (!find_index(error) || !load_directory(error)) return false;
+
+	if (!FileDirectory::lookup(dir_data.data(), dir_data.size(), name, entry)) {
+		error = "No file named \"" + name + "\" in archive!";
+		return false;
+	}
+
+	/* The entry must lie within the payload for extract_range() */
+	if (entry.offset > file_index.size || entry.size > file_index.size - entry.offset) {
+		error = "Invalid archive directory!";
+		return false;
+	}
+
+	return true;
+}
+
+bool PngPackReader::extract_chunks(const std::vector<ChunkHeader> &chunks, uint64_t first_number, size_t first_block, uint64_t skip, uint64_t length, const Sink &sink, TreeHash *digest, ThreadPool &pool, unsigned width, std::string &error) {
+	if (!width) width = 1;
+
+	std::vector<std::vector<uint8_t>> blocks(width);
+	std::vector<uint8_t> block_valid(width);
+	std::vector<uint8_t> block_decoded(width);
+	std::vector<uint8_t> block_fits(width);
+	std::vector<uint8_t> block_rebuilt(width);
+	bool whole = length == UINT64_MAX;
+	uint64_t handed = 0;
+
+	chunks_extracted = 0;
+	chunks_repaired = 0;
+
+	for (size_t first = 0; first < chunks.size() && length; first += blocks.size()) {
+		size_t count = chunks.size() - first;
+		if (count > blocks.size()) count = blocks.size();
+
+		pool.parallel_for(count, [&](size_t i) {
+			const ChunkHeader &header = chunks[first + i];
+			uint32_t crc;
+
+			block_valid[i] = walker.load(header, blocks[i], crc);
+
+			/* Block is lent to the chunk for validation, then taken back */
+			if (block_valid[i]) {
+				Chunk file(header.length, header.type, std::move(blocks[i]), crc);
+				block_valid[i] = file.validate();
+				blocks[i] = std::move(file.data);
+			}
+
+			/* A damaged chunk comes back from its parity group already decompressed */
+			block_rebuilt[i] = !block_valid[i] && repair(first_block + first + i, blocks[i]);
+			if (block_rebuilt[i]) block_valid[i] = true;
+			if (!block_valid[i]) return;
+
+			block_decoded[i] = block_rebuilt[i] || decode(file_index, cipher, first_block + first + i, blocks[i]);
+
+			/* A chunk altered with its CRC fixed up passes validation but fails its tag, */
+			/* and is rebuilt the same way */
+			if (!block_decoded[i] && file_index.encrypted() && repair(first_block + first + i, blocks[i])) {
+				block_rebuilt[i] = true;
+				block_decoded[i] = true;
+			}
+
+			block_fits[i] = !digest || (block_decoded[i] && fits(file_index, first_block + first + i, blocks[i]));
+
+			/* Hashed here, on the pool, rather than as the blocks are handed over in order */
+			if (digest && block_fits[i]) digest->update(file_index.chunks[first_block + first + i].offset, blocks[i].data(), blocks[i].size());
+		});
+
+		for (size_t i = 0; i < count && length; i++) {
+			if (!block_valid[i]) {
+				error = damaged(file_index, first_number + first + i);
+				return false;
+			}
+
+			if (!block_decoded[i]) {
+				error = undecodable(file_index, first_number + first + i);
+				return false;
+			}
+
+			if (!block_fits[i]) {
+				error = "Chunk " + std::to_string(first_number + first + i) + " does not match the offset table!";
+				return false;
+			}
+
+			/* Only the part of the block inside the range is handed over */
+			const uint8_t *data = blocks[i].data();
+			uint64_t n = blocks[i].size();
+			uint64_t k = (skip < n) ? skip : n;
+
+			data += k;
+			n -= k;
+			skip -= k;
+			if (n > length) n = length;
+
+			if (n && !sink(data, n)) {
+				error = "Could not write extracted file!";
+				return false;
+			}
+			length -= n;
+			handed += n;
+			chunks_extracted++;
+			chunks_repaired += block_rebuilt[i];
+		}
+	}
+
+	if (whole ? handed != file_index.size : length != 0) {
+		error = whole ? "Packed file does not match the size in its index!" : "Range is outside the packed file!";
+		return false;
+	}
+
+	return true;
+}
+
+bool PngPackReader::repair(size_t n, std::vector<uint8_t> &data) const {
+	if (file_index.parity_scheme != FileIndex::PARITY_REED_SOLOMON || n >= file_index.chunks.size()) return false;
+
+	Stats::Scope timing(Stats::PHASE_PARITY);
+
+	unsigned group_data = file_index.parity_data;
+	unsigned group_parity = file_index.parity_count;
+	size_t group = n / group_data;
+	size_t first = group * group_data;
+	uint64_t length = file_index.parity_length(group);
+	uint64_t base = table_base();
+	uint64_t parity_start = base + file_index.parity_position(group);
+	uint32_t tag = file_index.tag_length();
+
+	std::vector<std::vector<uint8_t>> shards(group_data + group_parity);
+	std::vector<uint8_t *> pointers(shards.size());
+	std::vector<uint8_t> present(shards.size());
+
+	/* Every other chunk of the group that still validates, and every parity chunk that does */
+	for (size_t s = 0; s < shards.size(); s++) {
+		size_t m = first + s;
+		ChunkHeader header;
+		uint32_t crc;
+
+		/* A short last group is coded as if the rest were zeros */
+		if (s < group_data && m >= file_index.chunks.size()) present[s] = true;
+		else if (s < group_data) header = {base + file_index.chunks[m].position, (uint32_t) file_index.chunk_length(m), as_type(CHUNK_TYPE_FILE)};
+		else header = {parity_start + (s - group_data) * (3 * sizeof(uint32_t) + length + tag), (uint32_t) (length + tag), as_type(CHUNK_TYPE_PARITY)};
+
+		if (!present[s] && m != n && walker.load(header, shards[s], crc)) {
+			Chunk chunk(header.length, header.type, std::move(shards[s]), crc);
+			present[s] = chunk.validate();
+			shards[s] = std::move(chunk.data);
+
+			/* Blocks are coded uncompressed, and parity unsealed */
+			if (present[s] && s < group_data) present[s] = decode(file_index, cipher, m, shards[s]) && fits(file_index, m, shards[s]);
+			else if (present[s] && tag) present[s] = cipher.open(file_index.parity_nonce(group, s - group_data), nullptr, 0, shards[s].data(), length);
+		}
+
+		/* Shorter blocks are padded with zeros */
+		shards[s].resize(length);
+		pointers[s] = shards[s].data();
+	}
+
+	if (!ReedSolomon::reconstruct(group_data, group_parity, pointers.data(), present, length)) return false;
+
+	data = std::move(shards[n - first]);
+	data.resize(file_index.block_size(n));
+	return true;
+}
+
+bool PngPackReader::check_digest(TreeHash &digest, std::string &error) {
+	TreeHash::Digest found;
+
+	if (!digest.finish(file_index.size, found) || found != file_index.digest) {
+		error = "Packed file does not match its digest!";
+		return false;
+	}
+
+	return true;
+}
+
+bool PngPackReader::extract(const Sink &sink, ThreadPool &pool, unsigned width, std::string &error) {
+	if (!locate(error)) return false;
+
+	TreeHash digest;
+	bool checked = file_index.digest_type != TreeHash::DIGEST_NONE;
+
+	if (!extract_chunks(file_chunks, dat_pos, 0, 0, UINT64_MAX, sink, checked ? &digest : nullptr, pool, width, error)) return false;
+
+	return !checked || check_digest(digest, error);
+}
+
+bool PngPackReader::verify(ThreadPool &pool, unsigned width, std::string &error) {
+	return extract([](const uint8_t *data, size_t length) {
+		return true;
+	}, pool, width, error);
+}
+
+uint64_t PngPackReader::table_base() const {
+	if (!file_index.trailing) return tbl_header.offset + 3 * sizeof(uint32_t) + tbl_header.length;
+
+	/* The last file chunk ends where the index starts */
+	const IndexEntry &last = file_index.chunks.back();
+	uint64_t span = last.position + 3 * sizeof(uint32_t) + file_index.chunk_length(file_index.chunks.size() - 1);
+
+	return (span < idx_header.offset) ? idx_header.offset - span : 0;
+}
+
+bool PngPackReader::extract_range(uint64_t offset, uint64_t length, const Sink &sink, ThreadPool &pool, unsigned width, std::string &error) {
+	std::vector<ChunkHeader> chunks;
+	uint64_t first_number;
+	size_t first_block;
+	uint64_t chunk_offset;
+
+	if (!find_index(error) || !unlock(error)) return false;
+
+	if (offset > file_index.size || length > file_index.size - offset) {
+		error = "Range is outside the packed file!";
+		return false;
+	}
+
+	if (!length) return true;
+
+	const std::vector<IndexEntry> &table = file_index.chunks;
+
+	if (!table.empty()) {
+		/* Straight to the chunks holding the range */
+		size_t first = file_index.find(offset);
+		size_t last = file_index.find(offset + length - 1);
+		uint64_t base = table_base();
+
+		for (size_t i = first; i <= last; i++) {
+			uint32_t header[2];
+
+			if (!walker.read_at(base + table[i].position, header, sizeof(header))) {
+				error = "Reached EOF before all chunks were loaded. Is the PNG corrupted?";
+				return false;
+			}
+
+			/* The table is only trusted as far as the chunk it points at agrees with it */
+			if (header[1] != as_type(CHUNK_TYPE_FILE) || ntohl(header[0]) != file_index.chunk_length(i)) {
+				error = "Offset table does not match the file chunks!";
+				return false;
+			}
+
+			chunks.push_back({base + table[i].position, ntohl(header[0]), header[1]});
+		}
+
+		first_number = tbl_pos + 1 + first;
+		first_block = first;
+		chunk_offset = table[first].offset;
+	}
+	else {
+		/* Indexes without a table need the file chunks walked to find it */
+		if (!locate(error)) return false;
+
+		size_t first = 0;
+		chunk_offset = 0;
+
+		while (first < file_chunks.size() && chunk_offset + file_chunks[first].length <= offset) {
+			chunk_offset += file_chunks[first++].length;
+		}
+
+		uint64_t covered = chunk_offset;
+		for (size_t i = first; i < file_chunks.size() && covered < offset + length; i++) {
+			chunks.push_back(file_chunks[i]);
+			covered += file_chunks[i].length;
+		}
+
+		first_number = dat_pos + first;
+		first_block = first;
+	}
+
+	return extract_chunks(chunks, first_number, first_block, offset - chunk_offset, length, sink, nullptr, pool, width, error);
+}
+
+bool PngPackReader::extract_range(uint64_t offset, uint64_t length, int fd, ThreadPool &pool, unsigned width, std::string &error) {
+	return extract_range(offset, length, [fd](const uint8_t *data, size_t length) {
+		return write_all(fd, data, length);
+	}, pool, width, error);
+}
+
+bool PngPackReader::extract(int fd, ThreadPool &pool, unsigned width, std::string &error) {
+	struct stat output_A;
+	off_t output_start = lseek(fd, 0, SEEK_CUR);
+
+	/* Pipes and terminals can only be written in order */
+	if (fstat(fd, &output_A) || !S_ISREG(output_A.st_mode) || output_start < 0) {
+		return extract([fd](const uint8_t *data, size_t length) {
+			return write_all(fd, data, length);
+		}, pool, width, error);
+	}
+
+	if (!extract_at(fd, output_start, pool, width, error)) return false;
+
+	/* Pipeline writes are positioned, leave the descriptor after the payload */
+	if (lseek(fd, output_start + file_index.size, SEEK_SET) < 0) {
+		error = "Could not write extracted file!";
+		return false;
+	}
+
+	return true;
+}
+
+bool PngPackReader::extract_at(int fd, uint64_t output_start, ThreadPool &pool, unsigned width, std::string &error) {
+	if (!locate(error)) return false;
+
+	if (!width) width = 1;
+
+	/* Where each chunk's data lands in the output, once decompressed */
+	std::vector<uint64_t> positions(file_chunks.size());
+	uint64_t total = 0;
+	for (size_t i = 0; i < file_chunks.size(); i++) {
+		positions[i] = output_start + total;
+		total += (file_index.codec != Codec::CODEC_NONE || file_index.encrypted()) ? file_index.block_size(i) : file_chunks[i].length;
+	}
+
+	/* Caught before anything is written, unlike extracting in order */
+	if (total != file_index.size) {
+		error = "Packed file does not match the size in its index!";
+		return false;
+	}
+
+	TreeHash digest;
+	bool checked = file_index.digest_type != TreeHash::DIGEST_NONE;
+
+	/* Which blocks validated but failed to decompress or to fit the table, for the message */
+	std::vector<uint8_t> undecoded(file_chunks.size());
+	std::vector<uint8_t> misfit(file_chunks.size());
+	std::vector<uint8_t> rebuilt(file_chunks.size());
+
+	BlockPipeline pipeline(io_backend, width + 2, pool);
+	pipeline.read_error = "Reached EOF before all chunks were loaded. Is the PNG corrupted?";
+	pipeline.write_error = "Could not write extracted file!";
+
+	/* Each read takes the chunk's data and the CRC after it */
+	auto setup = [&](PipelineBlock &block) {
+		const ChunkHeader &header = file_chunks[block.index];
+
+		block.read_offset = header.offset + 2 * sizeof(uint32_t);
+		block.read_length = header.length + sizeof(uint32_t);
+		block.write_offset = positions[block.index];
+	};
+
+	auto process = [&](PipelineBlock &block) {
+		const ChunkHeader &header = file_chunks[block.index];
+		uint32_t crc;
+
+		memcpy(&crc, block.data.data() + header.length, sizeof(crc));
+		block.data.resize(header.length);
+
+		/* Block is lent to the chunk for validation, then taken back */
+		Chunk file(header.length, header.type, std::move(block.data), ntohl(crc));
+		bool valid = file.validate();
+		block.data = std::move(file.data);
+
+		/* A damaged chunk comes back from its parity group already decompressed */
+		if (!valid && repair(block.index, block.data)) {
+			rebuilt[block.index] = true;
+			valid = true;
+		}
+		else if (valid && !decode(file_index, cipher, block.index, block.data)) {
+			/* As is one that only fails its tag */
+			if (!file_index.encrypted() || !repair(block.index, block.data)) {
+				undecoded[block.index] = true;
+				return false;
+			}
+
+			rebuilt[block.index] = true;
+		}
+
+		if (valid && checked) {
+			if (!fits(file_index, block.index, block.data)) {
+				misfit[block.index] = true;
+				return false;
+			}
+
+			digest.update(file_index.chunks[block.index].offset, block.data.data(), block.data.size());
+		}
+
+		block.write_length = block.data.size();
+		return valid;
+	};
+
+	auto failure = [&](const PipelineBlock &block) {
+		if (undecoded[block.index]) return undecodable(file_index, dat_pos + block.index);
+		if (misfit[block.index]) return "Chunk " + std::to_string(dat_pos + block.index) + " does not match the offset table!";
+		return damaged(file_index, dat_pos + block.index);
+	};
+
+	chunks_extracted = 0;
+	chunks_repaired = 0;
+	if (!pipeline.run(walker.descriptor(), fd, file_chunks.size(), setup, process, failure, error)) return false;
+	chunks_extracted = file_chunks.size();
+	chunks_repaired = std::count(rebuilt.begin(), rebuilt.end(), 1);
+
+	return !checked || check_digest(digest, error);
+}
+
+bool PngPackReader::extract(std::vector<uint8_t> &buffer, ThreadPool &pool, unsigned width, std::string &error) {
+	if (!locate(error)) return false;
+
+	/* Sized from the chunks rather than the index, which could claim anything */
+	/* Compressed blocks are bounded by the table's checks instead */
+	uint64_t total = 0;
+	for (size_t i = 0; i < file_chunks.size(); i++) {
+		total += (file_index.codec != Codec::CODEC_NONE || file_index.encrypted()) ? file_index.block_size(i) : file_chunks[i].length;
+	}
+
+	buffer.clear();
+	buffer.reserve(total);
+
+	return extract([&buffer](const uint8_t *data, size_t length) {
+		buffer.insert(buffer.end(), data, data + length);
+		return true;
+	}, pool, width, error);
+}
+
+/* Create or truncate a file to extract into */
+static int create_file(const std::string &path) {
+	Stats::Scope timing(Stats::PHASE_OPEN);
+	return ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+}
+
+std::string PngPackReader::archive_path(const std::string &dir, const DirectoryEntry &entry) {
+	return (dir.empty() ? "" : dir + "/") + entry.name + "_EX";
+}
+
+bool PngPackReader::extract_archive(const std::string &dir, FileDirectory &files, ThreadPool &pool, unsigned width, std::string &error) {
+	times_missed = 0;
+
+	if (!directory(files, error)) return false;
+
+	std::vector<DirectoryEntry> &entries = files.entries;
+	/* Empty files share an offset with the file after them, so go first */
+	std::sort(entries.begin(), entries.end(), [](const DirectoryEntry &a, const DirectoryEntry &b) {
+		return (a.offset != b.offset) ? a.offset < b.offset : a.size < b.size;
+	});
+
+	/* Files must follow on from each other for the payload to be split between them */
+	uint64_t total = 0;
+	for (const DirectoryEntry &entry : entries) {
+		if (entry.offset != total) {
+			error = "Invalid archive directory!";
+			return false;
+		}
+		total += entry.size;
+	}
+
+	if (total != file_index.size) {
+		error = "Invalid archive directory!";
+		return false;
+	}
+
+	std::vector<std::string> created;
+	int output = -1;
+	size_t current = 0;
+	uint64_t written = 0;
+
+	/* Close finished files and open the next, stepping over empty ones, */
+	/* until there is one with bytes still to come */
+	auto next_file = [&]() {
+		while (current < entries.size() && (output < 0 || written == entries[current].size)) {
+			if (output >= 0) {
+				bool closed = !::close(output);
+				output = -1;
+				if (!closed) return false;
+				current++;
+				continue;
+			}
+
+			std::string path = archive_path(dir, entries[current]);
+			make_parents(path);
+
+			output = create_file(path);
+			if (output < 0) return false;
+
+			created.push_back(path);
+			written = 0;
+		}
+		return true;
+	};
+
+	bool ok = extract_range(0, total, [&](const uint8_t *data, size_t length) {
+		while (length) {
+			if (!next_file() || current == entries.size()) return false;
+
+			uint64_t n = entries[current].size - written;
+			if (n > length) n = length;
+
+			if (!write_all(output, data, n)) return false;
+
+			written += n;
+			data += n;
+			length -= n;
+		}
+		return true;
+	}, pool, width, error);
+
+	/* Trailing empty files */
+	if (ok && !next_file()) {
+		error = "Could not write extracted file!";
+		ok = false;
+	}
+
+	if (output >= 0) ::close(output);
+
+	if (!ok) {
+		/* Don't leave partial files behind */
+		for (const std::string &path : created) ::remove(path.c_str());
+		return false;
+	}
+
+	for (size_t i = 0; i < entries.size(); i++) {
+		if (!restore_times(created[i], entries[i].time_cr, entries[i].time_mod)) times_missed++;
+	}
+
+	return true;
+}
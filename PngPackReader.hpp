@@ -0,0 +1,153 @@
+/*
+PNGPACKREADER.HPP
+NICK WILSON
+2019
+*/
+
+#ifndef OBJ_PNGPACKREADER
+#define OBJ_PNGPACKREADER
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#include "AsyncIo.hpp"
+#include "ChunkWalker.hpp"
+#include "Cipher.hpp"
+#include "FileDirectory.hpp"
+#include "FileIndex.hpp"
+#include "ThreadPool.hpp"
+#include "TreeHash.hpp"
+
+/* Reads a file back out of a PNG */
+/* Only chunk headers are walked, the index and file chunks are the only data read */
+class PngPackReader{
+private:
+	ChunkWalker walker;
+	bool located = false;
+	uint64_t chunks_walked = 0;
+	uint64_t idx_pos = 0;
+	ChunkHeader idx_header = ChunkHeader();
+	uint64_t tbl_pos = 0;
+	ChunkHeader tbl_header = ChunkHeader();
+	uint64_t dat_pos = 0;
+	uint64_t dir_pos = 0;
+	ChunkHeader dir_header = ChunkHeader();
+	std::vector<uint8_t> dir_data;
+	FileIndex file_index;
+	std::vector<ChunkHeader> file_chunks;
+	uint64_t chunks_extracted = 0;
+	uint64_t chunks_repaired = 0;
+	uint64_t times_missed = 0;
+	Cipher cipher;
+
+public:
+	/* How extract() to a regular file reads and writes the payload */
+	AsyncIo::Backend io_backend = AsyncIo::BACKEND_SYNC;
+
+	/* For a packed file whose chunks were sealed. The key is derived from it, and checked */
+	/* against the sealed digest, the first time the file chunks are needed */
+	std::string passphrase;
+
+	/* Receives the payload in order, returning false stops extraction */
+	typedef std::function<bool(const uint8_t *data, size_t length)> Sink;
+
+	/* Checks the file is large enough and has a PNG signature */
+	bool open(const std::string &filename, std::string &error);
+	void close();
+
+	/* Every chunk header in the file */
+	bool enumerate(std::vector<ChunkHeader> &chunks, std::string &error);
+
+	/* Walk only as far as the index chunk and the table chunk after it, then validate and load them */
+	bool find_index(std::string &error);
+
+	/* Find and validate the index chunk, then find the run of file chunks after it, */
+	/* or before it for a trailing index. Walking stops at the end of that run */
+	/* An encrypted file is unlocked here, so fails without the right passphrase */
+	bool locate(std::string &error);
+
+	/* Only meaningful once find_index() has succeeded */
+	const FileIndex &index() const { return file_index; }
+	uint64_t index_chunk() const { return idx_pos; }
+	bool archive() const { return dir_pos != 0; }
+	uint64_t directory_chunk() const { return dir_pos; }
+
+	/* Every entry of an archive's directory */
+	bool directory(FileDirectory &directory, std::string &error);
+
+	/* One archive entry by name, found through the directory's hash table */
+	/* without unpacking the rest. extract_range() can then fetch it */
+	bool lookup(const std::string &name, DirectoryEntry &entry, std::string &error);
+
+	/* Only meaningful once locate() has succeeded */
+	const std::vector<ChunkHeader> &payload() const { return file_chunks; }
+	uint64_t payload_chunk() const { return dat_pos; }
+	uint64_t walked() const { return chunks_walked; }
+
+	/* File chunks read by the last extraction, and how many of those were rebuilt from parity */
+	uint64_t extracted() const { return chunks_extracted; }
+	uint64_t repaired() const { return chunks_repaired; }
+
+	/* Files written by the last extract_archive() whose stored times could not be set */
+	uint64_t untimed() const { return times_missed; }
+
+	/* Validate the file chunks and hand their data over in order, opened and decompressed */
+	/* Up to width chunks are read and validated in parallel at a time */
+	/* A chunk that fails validation or its tag is rebuilt from its parity group, if the index has parity */
+	/* The payload must come to the size the index gives, and match its digest if it has one, */
+	/* though that can only be known once everything has been handed over */
+	bool extract(const Sink &sink, ThreadPool &pool, unsigned width, std::string &error);
+	/* A regular file is written through a BlockPipeline, anything else in order */
+	bool extract(int fd, ThreadPool &pool, unsigned width, std::string &error);
+	bool extract(std::vector<uint8_t> &buffer, ThreadPool &pool, unsigned width, std::string &error);
+
+	/* Through a BlockPipeline into a regular file, offset bytes in, with positioned writes only */
+	/* The descriptor's own offset is left alone, so extractions can share one */
+	bool extract_at(int fd, uint64_t offset, ThreadPool &pool, unsigned width, std::string &error);
+
+	/* Every file of an archive, each written as archive_path() gives, creating directories as needed */
+	/* The payload is read once, in order, and split between the files as it goes, so the directory's */
+	/* files must follow on from each other and cover it exactly. files is left holding them in that */
+	/* order. Each gets its stored times where they can be set, and on failure every file is removed */
+	bool extract_archive(const std::string &dir, FileDirectory &files, ThreadPool &pool, unsigned width, std::string &error);
+
+	/* An entry's stored name with "_EX" appended, under dir unless it is empty */
+	static std::string archive_path(const std::string &dir, const DirectoryEntry &entry);
+
+	/* Everything extract() checks, with the payload thrown away */
+	bool verify(ThreadPool &pool, unsigned width, std::string &error);
+
+	/* Just length bytes of the payload, starting offset bytes in, with no digest to check them against */
+	/* The index's offset table leads straight to the chunks holding them, */
+	/* indexes without one have the file chunks walked as extract() does */
+	bool extract_range(uint64_t offset, uint64_t length, const Sink &sink, ThreadPool &pool, unsigned width, std::string &error);
+	bool extract_range(uint64_t offset, uint64_t length, int fd, ThreadPool &pool, unsigned width, std::string &error);
+
+private:
+	/* Derive the key and open the digest with it, once. True straight away if nothing was sealed */
+	bool unlock(std::string &error);
+
+	/* Load and validate the directory chunk once */
+	bool load_directory(std::string &error);
+
+	/* Validate chunks in order, opening and decompressing any that need it, and hand over */
+	/* length bytes, starting skip bytes in. first_block is the table entry of the first chunk */
+	/* A length of UINT64_MAX hands over everything, which must come to the index's size */
+	/* Blocks are added to digest, if there is one, where the table places them */
+	bool extract_chunks(const std::vector<ChunkHeader> &chunks, uint64_t first_number, size_t first_block, uint64_t skip, uint64_t length, const Sink &sink, TreeHash *digest, ThreadPool &pool, unsigned width, std::string &error);
+
+	/* Where the offset table's positions are counted from */
+	uint64_t table_base() const;
+
+	/* Rebuild table entry n's block, opened and decompressed, from the rest of its group and the group's */
+	/* parity chunks, whichever of them still validate. False without parity or with too few left */
+	bool repair(size_t n, std::vector<uint8_t> &data) const;
+
+	/* Finish digest and compare it with the index's */
+	bool check_digest(TreeHash &digest, std::string &error);
+};
+
+#endif
@@ -0,0 +1,1666 @@
+/*
+PNGPACKWRITER.CPP
+NICK WILSON
+2019
+*/
+
+#include "PngPackWriter.hpp"
+#include "BlockPipeline.hpp"
+#include "Chunk.hpp"
+#include "Codec.hpp"
+#include "ContentChunker.hpp"
+#include "Crc32.hpp"
+#include "FileCopy.hpp"
+#include "PngPack.hpp"
+#include "ReedSolomon.hpp"
+#include "Stats.hpp"
+#include "TreeHash.hpp"
+
+#include <algorithm>
+#include <mutex>
+#include <random>
+#include <unordered_map>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Read 4 bytes and swap ordering */
+static uint32_t read32_i(std::istream &input) {
+	uint32_t x = 0;
+	input.read(reinterpret_cast<char *>(&x), 4);
+	return ntohl(x);
+}
+
+/* Read 4 bytes */
+static uint32_t read32(std::istream &input) {
+	uint32_t x = 0;
+	input.read(reinterpret_cast<char *>(&x), 4);
+	return x;
+}
+
+/* Swap ordering and write 4 bytes */
+static void write32_i(std::ostream &output, uint32_t x) {
+	x = htonl(x);
+	output.write(reinterpret_cast<const char *>(&x), 4);
+}
+
+/* Copy a chunk's data across one buffer at a time, validating its CRC on the way through */
+/* Length and type must already have been read */
+static bool copy_chunk(std::istream &input, std::ostream &output, uint32_t length, uint32_t type, std::vector<uint8_t> &buffer) {
+	uint32_t crc = Crc32::update(0, reinterpret_cast<const uint8_t *>(&type), sizeof(uint32_t));
+
+	write32_i(output, length);
+	output.write(reinterpret_cast<const char *>(&type), sizeof(uint32_t));
+
+	while (length) {
+		uint32_t n = (length < buffer.size()) ? length : buffer.size();
+		input.read(reinterpret_cast<char *>(buffer.data()), n);
+		if ((uint32_t) input.gcount() != n) return false;
+
+		crc = Crc32::update(crc, buffer.data(), n);
+		output.write(reinterpret_cast<const char *>(buffer.data()), n);
+		length -= n;
+	}
+
+	if (read32_i(input) != crc) return false;
+	write32_i(output, crc);
+
+	return true;
+}
+
+/* File chunks go back to back after the index, each one full but the last */
+/* Fills in the offset table to match, with every chunk stored raw */
+static void lay_out(FileIndex &index, Codec::Type codec) {
+	index.chunks.clear();
+	index.codec = codec;
+	index.hash_type = BlockHash::HASH_NONE;
+	index.digest_type = TreeHash::DIGEST_NONE;
+
+	for (uint64_t offset = 0; offset < index.size; offset += CHUNK_SIZE_DATA_MAX) {
+		uint32_t stored = (index.size - offset > CHUNK_SIZE_DATA_MAX) ? CHUNK_SIZE_DATA_MAX : index.size - offset;
+		index.chunks.push_back({offset, offset + index.chunks.size() * 3 * sizeof(uint32_t), stored});
+	}
+}
+
+/* Parity chunks for one group of file chunks, built up as its blocks go by in any order */
+struct ParityGroup {
+	std::mutex lock;
+	std::vector<std::vector<uint8_t>> shards;
+	size_t added = 0;
+};
+
+/* The index chunk and the table chunk after it, if there is a table, or false if the table won't fit in one chunk */
+/* Their size depends only on the number of chunks, not where they sit or how they're stored */
+static bool pack_index(const FileIndex &index, std::vector<Chunk> &chunks, std::string &error) {
+	std::vector<uint8_t> idx_data = index.pack();
+	std::vector<uint8_t> tbl_data = index.pack_table();
+
+	if (tbl_data.size() > CHUNK_SIZE_DATA_MAX) {
+		error = "Target file is too large to index!";
+		return false;
+	}
+
+	chunks.clear();
+	chunks.emplace_back(idx_data.size(), as_type(CHUNK_TYPE_INDEX), std::move(idx_data));
+	if (!tbl_data.empty()) chunks.emplace_back(tbl_data.size(), as_type(CHUNK_TYPE_TABLE), std::move(tbl_data));
+
+	return true;
+}
+
+/* Write chunks out one after another */
+static bool put_chunks(std::vector<Chunk> &chunks, int output) {
+	for (Chunk &chunk : chunks) {
+		if (!chunk.write(output)) return false;
+	}
+
+	return true;
+}
+
+/* Key for sealing a write, from the passphrase and a fresh salt, recorded in the index */
+/* No two writes share a key, so chunk numbers alone are safe to use as nonces */
+static bool start_sealing(Cipher::Type type, const std::string &passphrase, FileIndex &index, Cipher &sealer, std::string &error) {
+	index.encryption = FileIndex::Encryption();
+	if (type == Cipher::CIPHER_NONE) return true;
+
+	if (type >= Cipher::CIPHER_COUNT || passphrase.empty()) {
+		error = "Encryption needs a cipher and a passphrase!";
+		return false;
+	}
+
+	std::random_device random;
+	for (size_t i = 0; i < Cipher::SALT_SIZE; i += sizeof(uint32_t)) {
+		uint32_t r = random();
+		memcpy(index.encryption.salt + i, &r, sizeof(r));
+	}
+
+	index.encryption.cipher = type;
+	index.encryption.kdf = Cipher::KDF_PBKDF2_SHA256;
+	index.encryption.iterations = Cipher::KDF_ITERATIONS;
+
+	uint8_t key[Cipher::KEY_SIZE];
+	Cipher::derive(index.encryption.kdf, passphrase, index.encryption.salt, Cipher::SALT_SIZE, index.encryption.iterations, key);
+	sealer = Cipher(type, key);
+
+	return true;
+}
+
+PngPackWriter::PngPackWriter(ThreadPool &pool, unsigned width) : pool(pool), width(width ? width : pool.size()) {}
+
+bool PngPackWriter::write(std::istream &carrier, uint64_t carrier_size, std::istream &payload, const FileIndex &index, std::ostream &output, std::string &error) {
+	uint32_t chunk_type, chunk_length;
+	std::vector<uint8_t> buffer(CHUNK_SIZE_DATA_MAX);
+	std::vector<std::vector<uint8_t>> blocks(width);
+
+	image_header = ImageHeader();
+	carrier_chunks.clear();
+	bytes_packed = 0;
+	bytes_stored = 0;
+	chunks_packed = 0;
+	chunks_parity = 0;
+
+	if (cipher != Cipher::CIPHER_NONE) {
+		error = "Only the descriptor and stream paths can encrypt!";
+		return false;
+	}
+
+	FileIndex stored = index;
+	lay_out(stored, Codec::CODEC_NONE);
+
+	std::vector<Chunk> index_chunks;
+	if (!pack_index(stored, index_chunks, error)) return false;
+
+	output.write(reinterpret_cast<const char *>(PNG_SIGNATURE), sizeof(PNG_SIGNATURE));
+
+	while ((uint64_t) carrier.tellg() < carrier_size) {
+		uint64_t offset = carrier.tellg();
+
+		/* Read Chunk */
+		chunk_length = read32_i(carrier);
+		chunk_type = read32(carrier);
+
+		/* Confirm it doesn't run past the end of the file */
+		if (!carrier || offset + 3 * sizeof(uint32_t) + chunk_length > carrier_size) {
+			error = "Reached EOF before all chunks were loaded. Is the PNG corrupted?";
+			return false;
+		}
+
+		/* First chunk MUST be of type IHDR by RFC 2083 */
+		/* IHDR chunk MUST have 13 bytes of data */
+		if (carrier_chunks.empty() && (chunk_type != as_type("IHDR") || chunk_length != IMAGE_HEADER_SIZE)) {
+			error = "Invalid leading chunk!";
+			return false;
+		}
+
+		if (chunk_type == as_type(CHUNK_TYPE_INDEX)) {
+			error = "Index already exists in input file.";
+			return false;
+		}
+		else if (chunk_type == as_type(CHUNK_TYPE_FILE)) {
+			error = "File data already exists in input file.";
+			return false;
+		}
+		else if (chunk_type == as_type(CHUNK_TYPE_DIRECTORY)) {
+			error = "Archive directory already exists in input file.";
+			return false;
+		}
+
+		if (!copy_chunk(carrier, output, chunk_length, chunk_type, buffer)) {
+			error = "Chunk " + std::to_string(carrier_chunks.size()) + " failed validation!";
+			return false;
+		}
+
+		carrier_chunks.push_back({offset, chunk_length, chunk_type});
+
+		/* Index and file chunks go directly after IHDR */
+		if (carrier_chunks.size() != 1) continue;
+
+		/* IHDR has just been copied and is still at the front of the buffer */
+		image_header.parse(buffer.data());
+		if (!image_header.check(error)) return false;
+
+		for (Chunk &chunk : index_chunks) chunk.write(output);
+
+		uint64_t data_remaining = index.size;
+
+		/* Up to width blocks are read in, CRC'd in parallel, then written in order */
+		/* The carrier buffer doubles as the first block */
+		blocks[0].swap(buffer);
+
+		while (data_remaining) {
+			std::vector<Chunk> batch;
+			batch.reserve(blocks.size());
+
+			while (data_remaining && batch.size() < blocks.size()) {
+				std::vector<uint8_t> &block = blocks[batch.size()];
+				uint32_t n = (data_remaining > CHUNK_SIZE_DATA_MAX) ? CHUNK_SIZE_DATA_MAX : data_remaining;
+
+				block.resize(n);
+				payload.read(reinterpret_cast<char *>(block.data()), n);
+				if ((uint32_t) payload.gcount() != n) {
+					error = "Target file ended early. Was it modified?";
+					return false;
+				}
+
+				/* Block is lent to the chunk for CRC and writing, then taken back */
+				batch.emplace_back(n, as_type(CHUNK_TYPE_FILE), std::move(block), 0);
+				data_remaining -= n;
+			}
+
+			pool.parallel_for(batch.size(), [&batch](size_t i) {
+				batch[i].force_crc_update();
+			});
+
+			for (uint32_t i = 0; i < batch.size(); i++) {
+				batch[i].write(output);
+				blocks[i] = std::move(batch[i].data);
+				bytes_packed += blocks[i].size();
+				bytes_stored += blocks[i].size();
+				chunks_packed++;
+			}
+		}
+
+		blocks[0].swap(buffer);
+		buffer.resize(CHUNK_SIZE_DATA_MAX);
+	}
+
+	if (!output) {
+		error = "Could not write output file!";
+		return false;
+	}
+
+	return true;
+}
+
+/* Check a chunk's CRC a block at a time, so a large chunk never has to be held whole */
+static bool verify_chunk(const ChunkWalker &walker, const ChunkHeader &header) {
+	std::vector<uint8_t> block(std::min(header.length, CHUNK_SIZE_DATA_MAX));
+	uint64_t offset = header.offset + 2 * sizeof(uint32_t);
+	uint32_t remaining = header.length;
+	uint32_t stored;
+
+	uint32_t crc = Crc32::update(0, reinterpret_cast<const uint8_t *>(&header.type), sizeof(uint32_t));
+
+	while (remaining) {
+		uint32_t n = std::min(remaining, (uint32_t) block.size());
+		if (!walker.read_at(offset, block.data(), n)) return false;
+
+		Stats::Scope timing(Stats::PHASE_CRC, n);
+		crc = Crc32::update(crc, block.data(), n);
+		offset += n;
+		remaining -= n;
+	}
+
+	if (!walker.read_at(offset, &stored, sizeof(uint32_t))) return false;
+	return ntohl(stored) == crc;
+}
+
+bool PngPackWriter::check_carrier(ChunkWalker &carrier, std::vector<ChunkHeader> *packed, bool copied, std::string &error) {
+	ChunkHeader header;
+
+	image_header = ImageHeader();
+	carrier_chunks.clear();
+	if (packed) packed->clear();
+
+	/* File should lead with [89 50 4E 47 0D 0A 1A 0A] by RFC 2083 */
+	if (!carrier.check_signature()) {
+		error = "Invalid PNG signature. Is the file corrupted or not a PNG?";
+		return false;
+	}
+
+	/* Every header is checked before anything is written */
+	while (carrier.next(header)) {
+		/* First chunk MUST be of type IHDR by RFC 2083 */
+		/* IHDR chunk MUST have 13 bytes of data */
+		if (carrier_chunks.empty() && (header.type != as_type("IHDR") || header.length != IMAGE_HEADER_SIZE)) {
+			error = "Invalid leading chunk!";
+			return false;
+		}
+
+		bool is_packed = header.type == as_type(CHUNK_TYPE_INDEX) || header.type == as_type(CHUNK_TYPE_TABLE)
+			|| header.type == as_type(CHUNK_TYPE_FILE) || header.type == as_type(CHUNK_TYPE_DIRECTORY)
+			|| header.type == as_type(CHUNK_TYPE_PARITY) || header.type == as_type(CHUNK_TYPE_PAD);
+
+		if (packed && is_packed) {
+			/* An old packed file is replaced as a whole, so it must be one run of chunks */
+			if (!packed->empty() && packed->back().offset + 3 * sizeof(uint32_t) + packed->back().length != header.offset) {
+				error = "Packed file is split up by other chunks, so it can't be replaced!";
+				return false;
+			}
+
+			packed->push_back(header);
+			continue;
+		}
+
+		if (header.type == as_type(CHUNK_TYPE_INDEX)) {
+			error = "Index already exists in input file.";
+			return false;
+		}
+		else if (header.type == as_type(CHUNK_TYPE_FILE)) {
+			error = "File data already exists in input file.";
+			return false;
+		}
+		else if (header.type == as_type(CHUNK_TYPE_DIRECTORY)) {
+			error = "Archive directory already exists in input file.";
+			return false;
+		}
+
+		carrier_chunks.push_back(header);
+	}
+
+	if (carrier.truncated() || carrier_chunks.empty()) {
+		error = "Reached EOF before all chunks were loaded. Is the PNG corrupted?";
+		return false;
+	}
+
+	/* Carrier chunks are copied through by the kernel without being looked at, so their CRCs are */
+	/* checked first. Chunks are independent, so check them all at once and report the first failure */
+	/* In place, the carrier's chunks stay where they are and only the tail is rewritten, so they are left alone */
+	if (copied) {
+		std::vector<uint8_t> chunk_valid(carrier_chunks.size());
+		pool.parallel_for(carrier_chunks.size(), [this, &carrier, &chunk_valid](size_t i) {
+			chunk_valid[i] = verify_chunk(carrier, carrier_chunks[i]);
+		});
+
+		for (size_t i = 0; i < chunk_valid.size(); i++) {
+			if (!chunk_valid[i]) {
+				error = "Chunk " + std::to_string(i) + " failed validation!";
+				return false;
+			}
+		}
+	}
+
+	/* IHDR is the one carrier chunk whose contents are used, so it is always checked */
+	std::vector<uint8_t> ihdr_data;
+	uint32_t ihdr_crc;
+
+	if (!carrier.load(carrier_chunks[0], ihdr_data, ihdr_crc)) {
+		error = "Reached EOF before all chunks were loaded. Is the PNG corrupted?";
+		return false;
+	}
+
+	Chunk ihdr(carrier_chunks[0].length, carrier_chunks[0].type, std::move(ihdr_data), ihdr_crc);
+
+	if (!ihdr.validate()) {
+		error = "Chunk 0 failed validation!";
+		return false;
+	}
+
+	image_header.parse(ihdr.data.data());
+	return image_header.check(error);
+}
+
+/* Where IEND starts, which the walk stopped at, or false if the carrier has none */
+static bool find_end(const std::vector<ChunkHeader> &carrier_chunks, uint64_t &end, std::string &error) {
+	if (carrier_chunks.back().type != as_type("IEND")) {
+		error = "No IEND chunk to put the packed file ahead of!";
+		return false;
+	}
+
+	end = carrier_chunks.back().offset;
+	return true;
+}
+
+bool PngPackWriter::write_chunks(ChunkWalker &carrier, const FileIndex &index, const std::vector<uint8_t> &directory, int payload, const Fill &fill, int output, std::string &error) {
+	if (!check_carrier(carrier, nullptr, true, error)) return false;
+
+	/* Up to IHDR or IEND, then the new chunks, then the rest of the carrier */
+	uint64_t split = carrier_chunks[0].offset + 3 * sizeof(uint32_t) + IMAGE_HEADER_SIZE;
+	if (layout == LAYOUT_BEFORE_IEND && !find_end(carrier_chunks, split, error)) return false;
+
+	if (!copy_range(carrier.descriptor(), 0, split, output)) {
+		error = "Could not write output file!";
+		return false;
+	}
+
+	if (!write_payload(index, directory, payload, fill, nullptr, output, error)) return false;
+
+	if (!copy_range(carrier.descriptor(), split, carrier.position() - split, output)) {
+		error = "Could not write output file!";
+		return false;
+	}
+
+	return true;
+}
+
+bool PngPackWriter::write_payload(const FileIndex &index, const std::vector<uint8_t> &directory, int payload, const Fill &fill, const Previous *previous, int output, std::string &error) {
+	bytes_packed = 0;
+	bytes_stored = 0;
+	chunks_packed = 0;
+	chunks_reused = 0;
+	chunks_parity = 0;
+
+	/* An archive's directory goes ahead of the index, so the offset table is unaffected by it */
+	if (!directory.empty()) {
+		Chunk directory_chunk(directory.size(), as_type(CHUNK_TYPE_DIRECTORY), directory);
+
+		if (!directory_chunk.write(output)) {
+			error = "Could not write output file!";
+			return false;
+		}
+	}
+
+	off_t payload_start = fill ? 0 : lseek(payload, 0, SEEK_CUR);
+
+	if (payload_start < 0) {
+		error = "Could not read file \"" + index.filename + "\"";
+		return false;
+	}
+
+	/* Compressed chunks are placed once their sizes are known and the digest once every */
+	/* block has been seen, so the index is written again over its first copy to record them */
+	FileIndex stored = index;
+	TreeHash digest;
+
+	/* Content chunking reads the whole payload up front and hashes it then, */
+	/* otherwise each block is hashed as the pipeline reads it */
+	bool chunked = !fill && (chunking == CHUNKING_CONTENT || previous);
+
+	if (chunked && cipher != Cipher::CIPHER_NONE) {
+		error = "Encrypted files can't be cut by content, as their block hashes would give it away!";
+		return false;
+	}
+
+	if (chunked) {
+		if (!ContentChunker::split(payload, payload_start, index.size, BlockHash::HASH_MURMUR3_128, &digest, pool, stored.chunks, error)) return false;
+		stored.codec = codec;
+		stored.hash_type = BlockHash::HASH_MURMUR3_128;
+	}
+	else lay_out(stored, codec);
+
+	/* Recorded now so the first copy of the index is already its final size */
+	stored.digest_type = TreeHash::DIGEST_BLAKE3;
+
+	Cipher sealer;
+	if (!start_sealing(cipher, passphrase, stored, sealer, error)) return false;
+
+	/* Sealed chunks are each followed by their tag */
+	uint32_t tag = stored.tag_length();
+
+	size_t count = stored.chunks.size();
+
+	/* Parity is built from each block as the pipeline goes by, which a delta's reused chunks never do */
+	bool with_parity = parity_count && !previous && count;
+
+	stored.parity_scheme = with_parity ? FileIndex::PARITY_REED_SOLOMON : FileIndex::PARITY_NONE;
+	stored.parity_data = with_parity ? parity_data : 0;
+	stored.parity_count = with_parity ? parity_count : 0;
+
+	if (with_parity && (!parity_data || parity_data + parity_count > ReedSolomon::MAX_SHARDS)) {
+		error = "Parity groups can hold at most " + std::to_string(ReedSolomon::MAX_SHARDS) + " file and parity chunks!";
+		return false;
+	}
+
+	/* Parity chunks go ahead of the file chunks, where each group's can be placed up front */
+	size_t groups = stored.parity_groups();
+	std::vector<uint64_t> parity_positions(groups + 1);
+	std::vector<ParityGroup> parity(groups);
+
+	for (size_t g = 0; g < groups; g++) {
+		parity_positions[g + 1] = parity_positions[g] + parity_count * (3 * sizeof(uint32_t) + stored.parity_length(g) + tag);
+	}
+
+	/* Blocks the previous file already holds keep its chunk, the rest are fresh */
+	std::vector<const ChunkHeader *> reused(count, nullptr);
+	std::vector<size_t> fresh;
+
+	if (previous) {
+		const FileIndex &old = previous->index;
+		std::unordered_map<uint64_t, size_t> known;
+
+		/* A compressed chunk can only be kept if the table will name its codec */
+		for (size_t i = 0; i < old.chunks.size(); i++) {
+			if (!old.compressed(i) || old.codec == codec) known.emplace(old.chunks[i].hash.low, i);
+		}
+
+		for (size_t n = 0; n < count; n++) {
+			IndexEntry &entry = stored.chunks[n];
+			auto match = known.find(entry.hash.low);
+
+			if (match != known.end() && old.chunks[match->second].hash == entry.hash && old.block_size(match->second) == entry.stored) {
+				reused[n] = &previous->chunks[match->second];
+				entry.stored = old.chunks[match->second].stored;
+			}
+		}
+	}
+
+	for (size_t n = 0; n < count; n++) {
+		if (!reused[n]) fresh.push_back(n);
+	}
+
+	/* Raw chunks are laid out back to back, so each one's place is known up front */
+	/* and the pipeline can read, CRC and write several of them at once */
+	uint64_t position = parity_positions[groups];
+	size_t placed = 0;
+
+	auto place_up_to = [&](size_t n) {
+		for (; placed < n; placed++) {
+			stored.chunks[placed].position = position;
+			position += 3 * sizeof(uint32_t) + stored.chunks[placed].stored + tag;
+		}
+	};
+
+	if (codec == Codec::CODEC_NONE) place_up_to(count);
+
+	std::vector<Chunk> index_chunks;
+	if (!pack_index(stored, index_chunks, error)) return false;
+
+	off_t index_start = lseek(output, 0, SEEK_CUR);
+
+	if (index_start < 0 || !put_chunks(index_chunks, output)) {
+		error = "Could not write output file!";
+		return false;
+	}
+
+	off_t output_start = lseek(output, 0, SEEK_CUR);
+
+	if (output_start < 0) {
+		error = "Could not write output file!";
+		return false;
+	}
+
+	/* Each block is added into its group's parity uncompressed, and once the last of the group */
+	/* is in, the group's parity chunks are written where the layout put them */
+	auto add_parity = [&](size_t n, const uint8_t *data, size_t length) {
+		Stats::Scope timing(Stats::PHASE_PARITY, (uint64_t) length * parity_count);
+
+		size_t g = n / parity_data;
+		size_t first = g * parity_data;
+		uint64_t parity_length = stored.parity_length(g);
+		ParityGroup &group = parity[g];
+		std::lock_guard<std::mutex> hold(group.lock);
+
+		if (group.shards.empty()) group.shards.assign(parity_count, std::vector<uint8_t>(parity_length));
+
+		for (unsigned j = 0; j < parity_count; j++) {
+			ReedSolomon::multiply_add(ReedSolomon::coefficient(parity_data, j, n - first), data, group.shards[j].data(), length);
+		}
+
+		if (++group.added < std::min<size_t>(parity_data, count - first)) return true;
+
+		for (unsigned j = 0; j < parity_count; j++) {
+			if (tag) {
+				group.shards[j].resize(parity_length + tag);
+				sealer.seal(stored.parity_nonce(g, j), nullptr, 0, group.shards[j].data(), parity_length);
+			}
+
+			Chunk chunk(parity_length + tag, as_type(CHUNK_TYPE_PARITY), std::move(group.shards[j]));
+
+			uint32_t header[2] = {htonl(chunk.length), chunk.type};
+			uint32_t crc = htonl(chunk.crc);
+			uint64_t at = output_start + parity_positions[g] + j * (3 * sizeof(uint32_t) + chunk.length);
+
+			if (!write_all_at(output, header, sizeof(header), at)
+				|| !write_all_at(output, chunk.data.data(), chunk.length, at + sizeof(header))
+				|| !write_all_at(output, &crc, sizeof(crc), at + sizeof(header) + chunk.length)) return false;
+		}
+
+		group.shards.clear();
+		return true;
+	};
+
+	/* Which blocks failed to have their parity written, for the message */
+	std::vector<uint8_t> unwritten(fresh.size());
+
+	BlockPipeline pipeline(io_backend, width + 2, pool);
+	pipeline.read_error = "Target file ended early. Was it modified?";
+
+	auto setup = [&](PipelineBlock &block) {
+		const IndexEntry &entry = stored.chunks[fresh[block.index]];
+
+		block.write_offset = output_start + entry.position;
+		block.write_length = entry.stored;
+
+		/* Blocks that are filled in are read on the thread pool instead */
+		block.read_offset = payload_start + entry.offset;
+		block.read_length = fill ? 0 : block.write_length;
+	};
+
+	auto process = [&](PipelineBlock &block) {
+		IndexEntry &entry = stored.chunks[fresh[block.index]];
+
+		if (fill) {
+			block.data.resize(block.write_length);
+			if (!fill(entry.offset, block.data.data(), block.write_length)) return false;
+		}
+
+		if (!chunked) digest.update(entry.offset, block.data.data(), block.write_length);
+
+		if (with_parity && !add_parity(fresh[block.index], block.data.data(), block.write_length)) {
+			unwritten[block.index] = true;
+			return false;
+		}
+
+		/* Kept only if it comes out smaller, so incompressible blocks stay raw */
+		if (codec != Codec::CODEC_NONE) {
+			static thread_local std::vector<uint8_t> packed;
+			packed.resize(block.write_length);
+
+			size_t n = Codec::compress(codec, block.data.data(), block.write_length, packed.data(), block.write_length - 1);
+			if (n) {
+				packed.resize(n);
+				block.data.swap(packed);
+				block.write_length = n;
+			}
+
+			/* Each block has its own entry, so this is safe from any thread */
+			entry.stored = block.write_length;
+		}
+
+		/* Sealed once compressed, as ciphertext won't compress */
+		if (tag) {
+			block.data.resize(block.write_length + tag);
+			sealer.seal(fresh[block.index], nullptr, 0, block.data.data(), block.write_length);
+			block.write_length += tag;
+		}
+
+		/* Block is lent to the chunk for CRC, then taken back */
+		Chunk file(block.write_length, as_type(CHUNK_TYPE_FILE), std::move(block.data));
+		block.data = std::move(file.data);
+
+		uint32_t header[2] = {htonl(file.length), file.type};
+		uint32_t crc = htonl(file.crc);
+
+		memcpy(block.head, header, sizeof(header));
+		memcpy(block.tail, &crc, sizeof(crc));
+		block.head_length = sizeof(header);
+		block.tail_length = sizeof(crc);
+		return true;
+	};
+
+	/* Only filling in and writing parity can fail */
+	auto failure = [&](const PipelineBlock &block) {
+		if (unwritten[block.index]) return std::string("Could not write output file!");
+		return std::string("Target file ended early. Was it modified?");
+	};
+
+	/* Reused chunks keep their size, so those ahead of each fresh one are placed along with it */
+	if (codec != Codec::CODEC_NONE) {
+		pipeline.place = [&](PipelineBlock &block) {
+			size_t n = fresh[block.index];
+			place_up_to(n);
+
+			stored.chunks[n].position = position;
+			block.write_offset = output_start + position;
+			position += 3 * sizeof(uint32_t) + block.write_length;
+			placed = n + 1;
+		};
+	}
+
+	if (!pipeline.run(payload, output, fresh.size(), setup, process, failure, error)) return false;
+
+	place_up_to(count);
+
+	/* Reused chunks are copied whole from the previous file, leaving their CRCs as they were */
+	for (size_t n = 0; n < count; n++) {
+		if (!reused[n]) continue;
+
+		if (lseek(output, output_start + stored.chunks[n].position, SEEK_SET) < 0
+			|| !copy_range(previous->fd, reused[n]->offset, 3 * sizeof(uint32_t) + reused[n]->length, output)) {
+			error = "Could not write output file!";
+			return false;
+		}
+	}
+
+	if (!digest.finish(index.size, stored.digest)) {
+		error = "Could not hash the whole target file!";
+		return false;
+	}
+
+	if (tag) stored.seal_digest(sealer);
+
+	/* Same record sizes, so the index and table fit exactly where they were */
+	if (!pack_index(stored, index_chunks, error)) return false;
+
+	if (lseek(output, index_start, SEEK_SET) < 0 || !put_chunks(index_chunks, output)) {
+		error = "Could not write output file!";
+		return false;
+	}
+
+	bytes_packed = index.size;
+	bytes_stored = position - count * (3 * sizeof(uint32_t) + tag) - parity_positions[groups];
+	chunks_packed = count;
+	chunks_parity = groups * parity_count;
+	chunks_reused = count - fresh.size();
+
+	/* Pipeline writes are positioned, so move past them */
+	if (lseek(output, output_start + position, SEEK_SET) < 0) {
+		error = "Could not write output file!";
+		return false;
+	}
+
+	return true;
+}
+
+bool PngPackWriter::write(ChunkWalker &carrier, int payload, const FileIndex &index, int output, std::string &error) {
+	archive.entries.clear();
+	return write_chunks(carrier, index, std::vector<uint8_t>(), payload, Fill(), output, error);
+}
+
+bool PngPackWriter::plan_archive(const std::vector<ArchiveMember> &members, FileIndex &index, std::vector<uint8_t> &directory, Fill &fill, std::string &error) {
+	archive.entries.clear();
+
+	if (members.empty()) {
+		error = "No files to archive!";
+		return false;
+	}
+
+	/* Files go end to end, so small ones share file chunks */
+	uint64_t offset = 0;
+
+	for (const ArchiveMember &member : members) {
+		Stats::Scope timing(Stats::PHASE_OPEN);
+		struct stat file_B;
+
+		if (stat(member.path.c_str(), &file_B) || !S_ISREG(file_B.st_mode)) {
+			error = "Could not read file details for \"" + member.path + "\"";
+			return false;
+		}
+
+		DirectoryEntry entry;
+		entry.name = member.name;
+		entry.offset = offset;
+		entry.size = file_B.st_size;
+		entry.time_cr = file_B.st_ctime;
+		entry.time_mod = file_B.st_mtime;
+		entry.first_chunk = offset / CHUNK_SIZE_DATA_MAX;
+		entry.chunk_count = entry.size ? (offset + entry.size - 1) / CHUNK_SIZE_DATA_MAX - entry.first_chunk + 1 : 0;
+
+		archive.entries.push_back(entry);
+		offset += entry.size;
+	}
+
+	if (!archive.pack(directory, error)) return false;
+
+	if (directory.size() > CHUNK_SIZE_DATA_MAX) {
+		error = "Too many files for the archive directory!";
+		return false;
+	}
+
+	/* To anything that doesn't know about archives, the payload is one file holding them all */
+	index = FileIndex();
+	index.time_cr = index.time_mod = time(nullptr);
+	index.size = offset;
+	index.filename = "archive";
+
+	/* Each block is gathered from whichever files it spans, opening them as it goes */
+	/* so thousands of files never need to be open at once */
+	fill = [this, &members](uint64_t offset, uint8_t *data, uint32_t length) {
+		const std::vector<DirectoryEntry> &entries = archive.entries;
+
+		/* Last file starting at or before offset */
+		size_t m = std::upper_bound(entries.begin(), entries.end(), offset, [](uint64_t value, const DirectoryEntry &entry) {
+			return value < entry.offset;
+		}) - entries.begin() - 1;
+
+		while (length) {
+			/* Empty files take up no room and are stepped over */
+			while (offset >= entries[m].offset + entries[m].size) m++;
+
+			uint64_t within = offset - entries[m].offset;
+			uint64_t n = entries[m].size - within;
+			if (n > length) n = length;
+
+			int fd;
+			{
+				Stats::Scope timing(Stats::PHASE_OPEN);
+				fd = open(members[m].path.c_str(), O_RDONLY);
+			}
+			if (fd < 0) return false;
+
+			bool ok = lseek(fd, within, SEEK_SET) >= 0 && read_all(fd, data, n);
+			::close(fd);
+			if (!ok) return false;
+
+			data += n;
+			offset += n;
+			length -= n;
+		}
+
+		return true;
+	};
+
+	return true;
+}
+
+bool PngPackWriter::write(ChunkWalker &carrier, const std::vector<ArchiveMember> &members, int output, std::string &error) {
+	FileIndex index;
+	std::vector<uint8_t> directory;
+	Fill fill;
+
+	if (!plan_archive(members, index, directory, fill, error)) return false;
+
+	return write_chunks(carrier, index, directory, -1, fill, output, error);
+}
+
+/* Load a chunk whole, false if it can't be read or fails its CRC */
+static bool load_chunk(const ChunkWalker &walker, const ChunkHeader &header, Chunk &chunk) {
+	std::vector<uint8_t> data;
+	uint32_t crc;
+
+	if (!walker.load(header, data, crc)) return false;
+
+	chunk = Chunk(header.length, header.type, std::move(data), crc);
+	return chunk.validate();
+}
+
+bool PngPackWriter::write_delta(ChunkWalker &previous, int payload, const FileIndex &index, int output, std::string &error) {
+	std::vector<ChunkHeader> packed;
+	Previous old;
+
+	archive.entries.clear();
+
+	if (!check_carrier(previous, &packed, true, error)) return false;
+
+	/* The old index says what each of its file chunks holds */
+	auto found = std::find_if(packed.begin(), packed.end(), [](const ChunkHeader &header) {
+		return header.type == as_type(CHUNK_TYPE_INDEX);
+	});
+
+	if (found == packed.end()) {
+		error = "No packed file to compare against!";
+		return false;
+	}
+
+	/* Block hashes are in the table, straight after the index */
+	Chunk index_chunk, table_chunk;
+	bool has_table = found + 1 != packed.end() && found[1].type == as_type(CHUNK_TYPE_TABLE);
+
+	if (!load_chunk(previous, found[0], index_chunk) || !old.index.unpack(index_chunk.data.data(), index_chunk.length)
+		|| (has_table && (!load_chunk(previous, found[1], table_chunk) || !old.index.unpack_table(table_chunk.data.data(), table_chunk.length)))) {
+		error = "Index chunk is invalid!";
+		return false;
+	}
+
+	if (old.index.hash_type != BlockHash::HASH_MURMUR3_128) {
+		error = "Packed file has no block hashes to compare against. Insert it with --cdc first.";
+		return false;
+	}
+
+	for (const ChunkHeader &header : packed) {
+		if (header.type == as_type(CHUNK_TYPE_FILE)) old.chunks.push_back(header);
+	}
+
+	/* Chunks are copied without being read, so the table must describe them exactly */
+	bool match = old.chunks.size() == old.index.chunks.size();
+	for (size_t i = 0; match && i < old.chunks.size(); i++) {
+		match = old.chunks[i].length == old.index.chunks[i].stored;
+	}
+
+	if (!match) {
+		error = "Offset table does not match the file chunks!";
+		return false;
+	}
+
+	old.fd = previous.descriptor();
+
+	/* The new chunks take the old ones' place, wherever that was */
+	uint64_t split = packed[0].offset;
+	uint64_t resume = packed.back().offset + 3 * sizeof(uint32_t) + packed.back().length;
+
+	if (!copy_range(previous.descriptor(), 0, split, output)) {
+		error = "Could not write output file!";
+		return false;
+	}
+
+	if (!write_payload(index, std::vector<uint8_t>(), payload, Fill(), &old, output, error)) return false;
+
+	if (!copy_range(previous.descriptor(), resume, previous.position() - resume, output)) {
+		error = "Could not write output file!";
+		return false;
+	}
+
+	return true;
+}
+
+/* Copy length bytes straight through from one descriptor to another, in order */
+static bool pass_through(int in, uint64_t length, int out, std::vector<uint8_t> &buffer, std::string &error) {
+	while (length) {
+		size_t n = (length > CHUNK_SIZE_DATA_MAX) ? CHUNK_SIZE_DATA_MAX : length;
+		buffer.resize(n);
+
+		if (!read_all(in, buffer.data(), n)) {
+			error = "Reached EOF before all chunks were loaded. Is the PNG corrupted?";
+			return false;
+		}
+
+		if (!write_all(out, buffer.data(), n)) {
+			error = "Could not write output file!";
+			return false;
+		}
+
+		length -= n;
+	}
+
+	return true;
+}
+
+bool PngPackWriter::write_stream(int carrier, int payload, const FileIndex &index, int output, std::string &error) {
+	std::vector<uint8_t> buffer;
+	uint8_t signature[sizeof(PNG_SIGNATURE)];
+	uint64_t offset = sizeof(PNG_SIGNATURE);
+
+	image_header = ImageHeader();
+	carrier_chunks.clear();
+	archive.entries.clear();
+	bytes_packed = 0;
+	bytes_stored = 0;
+	chunks_packed = 0;
+	chunks_reused = 0;
+	chunks_parity = 0;
+
+	/* File should lead with [89 50 4E 47 0D 0A 1A 0A] by RFC 2083 */
+	if (!read_all(carrier, signature, sizeof(signature)) || memcmp(signature, PNG_SIGNATURE, sizeof(signature))) {
+		error = "Invalid PNG signature. Is the file corrupted or not a PNG?";
+		return false;
+	}
+
+	if (!write_all(output, PNG_SIGNATURE, sizeof(PNG_SIGNATURE))) {
+		error = "Could not write output file!";
+		return false;
+	}
+
+	/* Each carrier chunk is checked as it comes, as there is no going back to it */
+	while (carrier_chunks.empty() || carrier_chunks.back().type != as_type("IEND")) {
+		uint32_t header[2];
+
+		if (!read_all(carrier, header, sizeof(header))) {
+			error = "Reached EOF before all chunks were loaded. Is the PNG corrupted?";
+			return false;
+		}
+
+		ChunkHeader chunk = {offset, ntohl(header[0]), header[1]};
+
+		/* First chunk MUST be of type IHDR by RFC 2083 */
+		/* IHDR chunk MUST have 13 bytes of data */
+		if (carrier_chunks.empty() && (chunk.type != as_type("IHDR") || chunk.length != IMAGE_HEADER_SIZE)) {
+			error = "Invalid leading chunk!";
+			return false;
+		}
+
+		if (chunk.type == as_type(CHUNK_TYPE_INDEX)) {
+			error = "Index already exists in input file.";
+			return false;
+		}
+		else if (chunk.type == as_type(CHUNK_TYPE_FILE)) {
+			error = "File data already exists in input file.";
+			return false;
+		}
+		else if (chunk.type == as_type(CHUNK_TYPE_DIRECTORY)) {
+			error = "Archive directory already exists in input file.";
+			return false;
+		}
+
+		if (chunk.type == as_type("IEND") && layout == LAYOUT_BEFORE_IEND && !write_stream_payload(index, payload, output, error)) return false;
+
+		if (!write_all(output, header, sizeof(header))) {
+			error = "Could not write output file!";
+			return false;
+		}
+
+		/* IHDR is the one carrier chunk that is read, to check it */
+		if (carrier_chunks.empty()) {
+			uint32_t ihdr_crc;
+			buffer.resize(IMAGE_HEADER_SIZE);
+
+			if (!read_all(carrier, buffer.data(), IMAGE_HEADER_SIZE) || !read_all(carrier, &ihdr_crc, sizeof(ihdr_crc))) {
+				error = "Reached EOF before all chunks were loaded. Is the PNG corrupted?";
+				return false;
+			}
+
+			Chunk ihdr(chunk.length, chunk.type, std::move(buffer), ntohl(ihdr_crc));
+
+			if (!ihdr.validate()) {
+				error = "Chunk 0 failed validation!";
+				return false;
+			}
+
+			image_header.parse(ihdr.data.data());
+			if (!image_header.check(error)) return false;
+
+			if (!write_all(output, ihdr.data.data(), IMAGE_HEADER_SIZE) || !write_all(output, &ihdr_crc, sizeof(ihdr_crc))) {
+				error = "Could not write output file!";
+				return false;
+			}
+		}
+		else if (!pass_through(carrier, chunk.length + sizeof(uint32_t), output, buffer, error)) return false;
+
+		carrier_chunks.push_back(chunk);
+		offset += 3 * sizeof(uint32_t) + chunk.length;
+
+		if (carrier_chunks.size() == 1 && layout == LAYOUT_AFTER_IHDR && !write_stream_payload(index, payload, output, error)) return false;
+	}
+
+	return true;
+}
+
+bool PngPackWriter::write_stream_payload(const FileIndex &index, int payload, int output, std::string &error) {
+	FileIndex stored = index;
+	TreeHash digest;
+	std::vector<std::vector<uint8_t>> blocks(width);
+	std::vector<uint64_t> offsets(width);
+	std::vector<Chunk> batch(width);
+	uint64_t position = 0;
+	bool ended = false;
+
+	/* Only known once the payload ends, so the index goes after the file chunks */
+	stored.size = 0;
+	stored.chunks.clear();
+	stored.codec = codec;
+	stored.hash_type = BlockHash::HASH_NONE;
+	stored.digest_type = TreeHash::DIGEST_BLAKE3;
+	stored.trailing = true;
+
+	Cipher sealer;
+	if (!start_sealing(cipher, passphrase, stored, sealer, error)) return false;
+
+	uint32_t tag = stored.tag_length();
+
+	while (!ended) {
+		size_t count = 0;
+
+		/* Blocks are read in order, as a pipe only gives them that way, then CRC'd, */
+		/* compressed and hashed in parallel, then written in order */
+		for (; count < blocks.size() && !ended; count++) {
+			size_t got;
+
+			blocks[count].resize(CHUNK_SIZE_DATA_MAX);
+
+			if (!read_up_to(payload, blocks[count].data(), CHUNK_SIZE_DATA_MAX, got)) {
+				error = "Could not read target file!";
+				return false;
+			}
+
+			blocks[count].resize(got);
+			offsets[count] = stored.size;
+			stored.size += got;
+			ended = got < CHUNK_SIZE_DATA_MAX;
+
+			if (!got) break;
+		}
+
+		pool.parallel_for(count, [&](size_t i) {
+			std::vector<uint8_t> &block = blocks[i];
+			uint32_t length = block.size();
+
+			digest.update(offsets[i], block.data(), length);
+
+			/* Kept only if it comes out smaller, so incompressible blocks stay raw */
+			if (codec != Codec::CODEC_NONE) {
+				static thread_local std::vector<uint8_t> packed;
+				packed.resize(length);
+
+				size_t n = Codec::compress(codec, block.data(), length, packed.data(), length - 1);
+				if (n) {
+					packed.resize(n);
+					block.swap(packed);
+					length = n;
+				}
+			}
+
+			/* Chunks are numbered in the order they're written */
+			if (tag) {
+				block.resize(length + tag);
+				sealer.seal(stored.chunks.size() + i, nullptr, 0, block.data(), length);
+				length += tag;
+			}
+
+			/* Block is lent to the chunk for CRC and writing, then taken back */
+			batch[i] = Chunk(length, as_type(CHUNK_TYPE_FILE), std::move(block));
+		});
+
+		for (size_t i = 0; i < count; i++) {
+			if (!batch[i].write(output)) {
+				error = "Could not write output file!";
+				return false;
+			}
+
+			stored.chunks.push_back({offsets[i], position, batch[i].length - tag, BlockHash::Digest()});
+			position += 3 * sizeof(uint32_t) + batch[i].length;
+			blocks[i] = std::move(batch[i].data);
+		}
+	}
+
+	if (!digest.finish(stored.size, stored.digest)) {
+		error = "Could not hash the whole target file!";
+		return false;
+	}
+
+	if (tag) stored.seal_digest(sealer);
+
+	std::vector<Chunk> index_chunks;
+	if (!pack_index(stored, index_chunks, error)) return false;
+
+	if (!put_chunks(index_chunks, output)) {
+		error = "Could not write output file!";
+		return false;
+	}
+
+	bytes_packed = stored.size;
+	bytes_stored = position - stored.chunks.size() * (3 * sizeof(uint32_t) + tag);
+	chunks_packed = stored.chunks.size();
+
+	return true;
+}
+
+/* An empty chunk of the given type at offset */
+static bool put_empty(int fd, uint64_t offset, uint32_t type) {
+	uint32_t chunk[3] = {0, type, htonl(Crc32::calc(reinterpret_cast<const uint8_t *>(&type), sizeof(uint32_t)))};
+
+	return lseek(fd, offset, SEEK_SET) >= 0 && write_all(fd, chunk, sizeof(chunk));
+}
+
+bool PngPackWriter::replace_tail(ChunkWalker &png, int fd, const std::function<bool(int fd)> &write_new, std::string &error) {
+	std::vector<ChunkHeader> packed;
+	uint64_t tail;
+
+	bytes_packed = 0;
+	bytes_stored = 0;
+	chunks_packed = 0;
+	chunks_reused = 0;
+	chunks_parity = 0;
+
+	if (!check_carrier(png, &packed, false, error)) return false;
+	if (!find_end(carrier_chunks, tail, error)) return false;
+
+	/* An old packed file is replaced, so it must have only IEND after it */
+	if (!packed.empty()) {
+		if (packed.back().offset + 3 * sizeof(uint32_t) + packed.back().length != tail) {
+			error = "Packed file is not at the end of the PNG, so it can't be updated in place!";
+			return false;
+		}
+
+		tail = packed[0].offset;
+	}
+
+	uint64_t end = tail + 3 * sizeof(uint32_t);
+
+	/* Each step is synced before the next, so the PNG always ends at a complete IEND */
+	/* and holds either the old packed file, none, or the new one */
+
+	/* An IEND where the old packed file starts cuts it off, then it is dropped */
+	if (tail != carrier_chunks.back().offset && (!put_empty(fd, tail, as_type("IEND")) || fsync(fd))) {
+		error = "Could not write output file!";
+		return false;
+	}
+
+	if (ftruncate(fd, end) || fsync(fd)) {
+		error = "Could not write output file!";
+		return false;
+	}
+
+	if (!write_new) return true;
+
+	/* New chunks go after that IEND, where nothing reads them, with an IEND of their own */
+	bool ok = lseek(fd, end, SEEK_SET) >= 0 && write_new(fd);
+
+	off_t new_end = ok ? lseek(fd, 0, SEEK_CUR) : -1;
+	if (ok && (new_end < 0 || !put_empty(fd, new_end, as_type("IEND")) || fsync(fd))) {
+		error = "Could not write output file!";
+		ok = false;
+	}
+
+	/* Leave the PNG without a packed file rather than with half of one */
+	if (!ok) {
+		if (!ftruncate(fd, end)) fsync(fd);
+		return false;
+	}
+
+	/* Turning the first IEND into an empty chunk brings them all in at once */
+	if (!put_empty(fd, tail, as_type(CHUNK_TYPE_PAD)) || fsync(fd)) {
+		error = "Could not write output file!";
+		return false;
+	}
+
+	return true;
+}
+
+bool PngPackWriter::update(ChunkWalker &png, int fd, int payload, const FileIndex &index, std::string &error) {
+	archive.entries.clear();
+
+	return replace_tail(png, fd, [&](int output) {
+		return write_payload(index, std::vector<uint8_t>(), payload, Fill(), nullptr, output, error);
+	}, error);
+}
+
+bool PngPackWriter::update(ChunkWalker &png, int fd, const std::vector<ArchiveMember> &members, std::string &error) {
+	FileIndex index;
+	std::vector<uint8_t> directory;
+	Fill fill;
+
+	if (!plan_archive(members, index, directory, fill, error)) return false;
+
+	return replace_tail(png, fd, [&](int output) {
+		return write_payload(index, directory, -1, fill, nullptr, output, error);
+	}, error);
+}
+
+bool PngPackWriter::strip(ChunkWalker &png, int fd, std::string &error) {
+	archive.entries.clear();
+
+	return replace_tail(png, fd, nullptr, error);
+}
+
+/* Open a carrier by name, checking it could hold a PNG */
+static bool open_carrier(ChunkWalker &input_A, const std::string &carrier, std::string &error) {
+	Stats::Scope timing(Stats::PHASE_OPEN);
+
+	/* Read file details */
+	struct stat file_A;
+	if (stat(carrier.c_str(), &file_A)) {
+		error = "Could not read file details for \"" + carrier + "\"";
+		return false;
+	}
+
+	if (!input_A.open(carrier)) {
+		error = "Could not read file \"" + carrier + "\"";
+		return false;
+	}
+
+	if (input_A.size() < PNG_MIN_SIZE) {
+		error = "PNG file is too small. Is it corrupted?";
+		return false;
+	}
+
+	return true;
+}
+
+/* Fill in an index from a target's details and open it for reading */
+static bool open_target(const std::string &target, FileIndex &index, int &fd, std::string &error) {
+	Stats::Scope timing(Stats::PHASE_OPEN);
+
+	/*  This should never be triggered.
+		No modern FS supports filenames this long.
+		This is here to enforce a sane limit to the length of filenames
+		so that the index chunk doesn't overflow the 32 bit length value. */
+	if (target.length() > 0xFF) {
+		error = "Somehow you've exceeed the maximum filename size. Congratulations.\n";
+		error += "Unfortunately, this filename is too long to encode.";
+		return false;
+	}
+
+	/* Extract file metadata */
+	struct stat file_B;
+	if (stat(target.c_str(), &file_B)) {
+		error = "Could not read file details for \"" + target + "\"";
+		return false;
+	}
+
+	/* Grab filesize, file creation and modification times */
+	/* 	These may need to be a larger type, time_t is not consistant
+		across operating systems and appears to range from 32 to 64
+		bytes (less relevant, but it can also be int or float). */
+	index.time_cr = file_B.st_ctime;
+	index.time_mod = file_B.st_mtime;
+	index.size = file_B.st_size;
+	index.filename = target;
+
+	/* Open file to read data */
+	fd = open(target.c_str(), O_RDONLY);
+	if (fd < 0) {
+		error = "Could not read file \"" + target + "\"";
+		return false;
+	}
+
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	return true;
+}
+
+/* Open a PNG by name to be walked and changed in place */
+static bool open_in_place(ChunkWalker &input_A, int &fd, const std::string &png, std::string &error) {
+	Stats::Scope timing(Stats::PHASE_OPEN);
+
+	if (!open_carrier(input_A, png, error)) return false;
+
+	fd = open(png.c_str(), O_RDWR);
+	if (fd < 0) {
+		error = "Could not open \"" + png + "\" for writing!";
+		return false;
+	}
+
+	return true;
+}
+
+/* Create or truncate an output PNG */
+static int open_output(const std::string &output) {
+	Stats::Scope timing(Stats::PHASE_OPEN);
+	return open(output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+}
+
+bool PngPackWriter::write_file(const std::string &carrier, const std::string &target, const std::string &output, std::string &error) {
+	ChunkWalker input_A;
+	FileIndex index;
+	int input_B;
+
+	if (!open_carrier(input_A, carrier, error)) return false;
+	if (!open_target(target, index, input_B, error)) return false;
+
+	int output_C = open_output(output);
+
+	if (output_C < 0) {
+		::close(input_B);
+		error = "Could not open \"" + output + "\" for writing!";
+		return false;
+	}
+
+	bool ok = write(input_A, input_B, index, output_C, error);
+	::close(input_B);
+
+	if (::close(output_C) && ok) {
+		error = "Could not write output file!";
+		ok = false;
+	}
+
+	/* Don't leave a partial PNG behind */
+	if (!ok) ::remove(output.c_str());
+
+	return ok;
+}
+
+bool PngPackWriter::write_stream_file(const std::string &carrier, const std::string &target, const std::string &output, std::string &error) {
+	FileIndex index;
+	int input_A = STDIN_FILENO;
+	int input_B = STDIN_FILENO;
+	int output_C = STDOUT_FILENO;
+
+	if (carrier == "-" && target == "-") {
+		error = "Only one of the carrier and target can come from stdin!";
+		return false;
+	}
+
+	/* Stdin has no name or times of its own */
+	if (target == "-") {
+		index.time_cr = time(nullptr);
+		index.time_mod = index.time_cr;
+		index.filename = "stdin";
+	}
+	else if (!open_target(target, index, input_B, error)) return false;
+
+	if (carrier != "-") {
+		Stats::Scope timing(Stats::PHASE_OPEN);
+		input_A = open(carrier.c_str(), O_RDONLY);
+	}
+
+	if (input_A < 0) {
+		if (input_B != STDIN_FILENO) ::close(input_B);
+		error = "Could not read file \"" + carrier + "\"";
+		return false;
+	}
+
+	if (output != "-") output_C = open_output(output);
+
+	if (output_C < 0) {
+		if (input_A != STDIN_FILENO) ::close(input_A);
+		if (input_B != STDIN_FILENO) ::close(input_B);
+		error = "Could not open \"" + output + "\" for writing!";
+		return false;
+	}
+
+	bool ok = write_stream(input_A, input_B, index, output_C, error);
+	if (input_A != STDIN_FILENO) ::close(input_A);
+	if (input_B != STDIN_FILENO) ::close(input_B);
+
+	/* Stdout is left for the program to close */
+	if (output_C != STDOUT_FILENO) {
+		if (::close(output_C) && ok) {
+			error = "Could not write output file!";
+			ok = false;
+		}
+
+		/* Don't leave a partial PNG behind */
+		if (!ok) ::remove(output.c_str());
+	}
+
+	return ok;
+}
+
+bool PngPackWriter::write_shards(const std::vector<std::string> &carriers, const std::string &target, const std::vector<std::string> &outputs, std::string &error) {
+	FileIndex index;
+	int input_B;
+
+	if (carriers.empty() || carriers.size() != outputs.size()) {
+		error = "Every shard needs a carrier and an output!";
+		return false;
+	}
+
+	/* Each shard reads the target through its own descriptor, as its offset is where its part starts */
+	if (!open_target(target, index, input_B, error)) return false;
+	::close(input_B);
+
+	size_t count = carriers.size();
+	uint64_t blocks = (index.size + CHUNK_SIZE_DATA_MAX - 1) / CHUNK_SIZE_DATA_MAX;
+
+	if (blocks < count) {
+		error = "Target file is too small to split into " + std::to_string(count) + " shards!";
+		return false;
+	}
+
+	/* Shards only need to tell each other apart from those of other payloads */
+	std::random_device random;
+	uint8_t id[sizeof(FileIndex::Shard::id)];
+
+	for (size_t i = 0; i < sizeof(id); i += sizeof(uint32_t)) {
+		uint32_t r = random();
+		memcpy(id + i, &r, sizeof(r));
+	}
+
+	std::vector<std::string> errors(count);
+	std::vector<uint8_t> failed(count);
+	std::vector<PngPackWriter> writers;
+
+	/* Width is shared out so the shards together keep about as much in flight as one write would */
+	unsigned each = (width > count) ? width / count : 1;
+
+	for (size_t n = 0; n < count; n++) {
+		writers.emplace_back(pool, each);
+		writers.back().layout = layout;
+		writers.back().io_backend = io_backend;
+		writers.back().codec = codec;
+		writers.back().chunking = chunking;
+		writers.back().parity_data = parity_data;
+		writers.back().parity_count = parity_count;
+		writers.back().cipher = cipher;
+		writers.back().passphrase = passphrase;
+	}
+
+	/* Parts are whole file chunks, shared out as evenly as they go */
+	pool.parallel_for(count, [&](size_t n) {
+		uint64_t start = std::min(index.size, blocks * n / count * CHUNK_SIZE_DATA_MAX);
+		uint64_t end = std::min(index.size, blocks * (n + 1) / count * CHUNK_SIZE_DATA_MAX);
+
+		FileIndex part = index;
+		part.size = end - start;
+		part.shard.number = n;
+		part.shard.count = count;
+		memcpy(part.shard.id, id, sizeof(id));
+		part.shard.offset = start;
+		part.shard.total = index.size;
+
+		ChunkWalker input_A;
+		int payload;
+		int output_C;
+
+		if (!open_carrier(input_A, carriers[n], errors[n])) {
+			failed[n] = true;
+			return;
+		}
+
+		{
+			Stats::Scope timing(Stats::PHASE_OPEN);
+			payload = open(target.c_str(), O_RDONLY);
+		}
+
+		if (payload < 0 || lseek(payload, start, SEEK_SET) < 0) {
+			if (payload >= 0) ::close(payload);
+			errors[n] = "Could not read file \"" + target + "\"";
+			failed[n] = true;
+			return;
+		}
+
+		output_C = open_output(outputs[n]);
+
+		if (output_C < 0) {
+			::close(payload);
+			errors[n] = "Could not open \"" + outputs[n] + "\" for writing!";
+			failed[n] = true;
+			return;
+		}
+
+		failed[n] = !writers[n].write(input_A, payload, part, output_C, errors[n]);
+		::close(payload);
+
+		if (::close(output_C) && !failed[n]) {
+			errors[n] = "Could not write output file!";
+			failed[n] = true;
+		}
+	});
+
+	bool ok = true;
+
+	for (size_t n = 0; n < count && ok; n++) {
+		if (failed[n]) {
+			error = errors[n];
+			ok = false;
+		}
+	}
+
+	/* Don't leave a partial set behind */
+	if (!ok) {
+		for (const std::string &output : outputs) ::remove(output.c_str());
+		return false;
+	}
+
+	image_header = writers[0].image_header;
+	carrier_chunks = writers[0].carrier_chunks;
+	archive.entries.clear();
+	bytes_packed = 0;
+	bytes_stored = 0;
+	chunks_packed = 0;
+	chunks_reused = 0;
+	chunks_parity = 0;
+
+	for (const PngPackWriter &writer : writers) {
+		bytes_packed += writer.bytes_packed;
+		bytes_stored += writer.bytes_stored;
+		chunks_packed += writer.chunks_packed;
+		chunks_parity += writer.chunks_parity;
+	}
+
+	return true;
+}
+
+bool PngPackWriter::write_archive(const std::string &carrier, const std::vector<ArchiveMember> &members, const std::string &output, std::string &error) {
+	ChunkWalker input_A;
+
+	if (!open_carrier(input_A, carrier, error)) return false;
+
+	int output_C = open_output(output);
+
+	if (output_C < 0) {
+		error = "Could not open \"" + output + "\" for writing!";
+		return false;
+	}
+
+	bool ok = write(input_A, members, output_C, error);
+
+	if (::close(output_C) && ok) {
+		error = "Could not write output file!";
+		ok = false;
+	}
+
+	/* Don't leave a partial PNG behind */
+	if (!ok) ::remove(output.c_str());
+
+	return ok;
+}
+
+bool PngPackWriter::write_delta_file(const std::string &previous, const std::string &target, const std::string &output, std::string &error) {
+	ChunkWalker input_A;
+	FileIndex index;
+	int input_B;
+
+	if (!open_carrier(input_A, previous, error)) return false;
+	if (!open_target(target, index, input_B, error)) return false;
+
+	int output_C = open_output(output);
+
+	if (output_C < 0) {
+		::close(input_B);
+		error = "Could not open \"" + output + "\" for writing!";
+		return false;
+	}
+
+	bool ok = write_delta(input_A, input_B, index, output_C, error);
+	::close(input_B);
+
+	if (::close(output_C) && ok) {
+		error = "Could not write output file!";
+		ok = false;
+	}
+
+	/* Don't leave a partial PNG behind */
+	if (!ok) ::remove(output.c_str());
+
+	return ok;
+}
+
+bool PngPackWriter::update_file(const std::string &png, const std::string &target, std::string &error) {
+	ChunkWalker input_A;
+	FileIndex index;
+	int input_B, output_C;
+
+	if (!open_in_place(input_A, output_C, png, error)) return false;
+
+	if (!open_target(target, index, input_B, error)) {
+		::close(output_C);
+		return false;
+	}
+
+	bool ok = update(input_A, output_C, input_B, index, error);
+	::close(input_B);
+
+	if (::close(output_C) && ok) {
+		error = "Could not write output file!";
+		ok = false;
+	}
+
+	return ok;
+}
+
+bool PngPackWriter::update_archive(const std::string &png, const std::vector<ArchiveMember> &members, std::string &error) {
+	ChunkWalker input_A;
+	int output_C;
+
+	if (!open_in_place(input_A, output_C, png, error)) return false;
+
+	bool ok = update(input_A, output_C, members, error);
+
+	if (::close(output_C) && ok) {
+		error = "Could not write output file!";
+		ok = false;
+	}
+
+	return ok;
+}
+
+bool PngPackWriter::strip_file(const std::string &png, std::string &error) {
+	ChunkWalker input_A;
+	int output_C;
+
+	if (!open_in_place(input_A, output_C, png, error)) return false;
+
+	bool ok = strip(input_A, output_C, error);
+
+	if (::close(output_C) && ok) {
+		error = "Could not write output file!";
+		ok = false;
+	}
+
+	return ok;
+}
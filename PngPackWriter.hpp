@@ -0,0 +1,203 @@
+/*
+PNGPACKWRITER.HPP
+NICK WILSON
+2019
+*/
+
+#ifndef OBJ_PNGPACKWRITER
+#define OBJ_PNGPACKWRITER
+
+#include <functional>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#include "AsyncIo.hpp"
+#include "ChunkWalker.hpp"
+#include "Cipher.hpp"
+#include "Codec.hpp"
+#include "FileDirectory.hpp"
+#include "FileIndex.hpp"
+#include "ImageHeader.hpp"
+#include "ThreadPool.hpp"
+
+/* Packs a file into a PNG */
+/* The carrier is streamed to the output with the index and file chunks placed directly after IHDR or before IEND */
+/* At most width buffers of CHUNK_SIZE_DATA_MAX are held, whatever the size of either file */
+/* A file to go into an archive, and the name it is stored under */
+struct ArchiveMember {
+	std::string path;
+	std::string name;
+};
+
+class PngPackWriter{
+private:
+	ThreadPool &pool;
+	unsigned width;
+
+	ImageHeader image_header;
+	std::vector<ChunkHeader> carrier_chunks;
+	uint64_t bytes_packed = 0;
+	uint64_t bytes_stored = 0;
+	uint64_t chunks_packed = 0;
+	uint64_t chunks_reused = 0;
+	uint64_t chunks_parity = 0;
+	FileDirectory archive;
+
+	/* Fill length bytes of the payload from offset, false if they can't be read */
+	typedef std::function<bool(uint64_t offset, uint8_t *data, uint32_t length)> Fill;
+
+	/* An earlier packed file, whose file chunks are copied across as they are when a new block matches */
+	struct Previous {
+		int fd;
+		FileIndex index;
+		std::vector<ChunkHeader> chunks;	/* File chunks, one per table entry */
+	};
+
+	/* Walk the carrier's headers and check IHDR, filling in carrier_chunks and image_header */
+	/* When copied, every carrier chunk's CRC is checked too, a block at a time, as it is about to be copied */
+	/* Without packed, a packed file already in the carrier is an error. With it, one is allowed */
+	/* as a single run of chunks, which are left out of carrier_chunks and listed there instead */
+	bool check_carrier(ChunkWalker &carrier, std::vector<ChunkHeader> *packed, bool copied, std::string &error);
+
+	/* Check the carrier, then write it out with the new chunks where layout puts them */
+	bool write_chunks(ChunkWalker &carrier, const FileIndex &index, const std::vector<uint8_t> &directory, int payload, const Fill &fill, int output, std::string &error);
+
+	/* The new chunks alone, from the output's current position, leaving it after them */
+	/* Payload blocks are read from the payload descriptor, or filled in when fill is set */
+	/* A non-empty directory is written as an archive directory chunk ahead of the index */
+	/* With previous, blocks are cut by content and any it already holds are copied from it */
+	/* The index records a digest of the whole payload, taken as its blocks go by */
+	bool write_payload(const FileIndex &index, const std::vector<uint8_t> &directory, int payload, const Fill &fill, const Previous *previous, int output, std::string &error);
+
+	/* File chunks for a payload read until it ends, followed by a trailing index */
+	bool write_stream_payload(const FileIndex &index, int payload, int output, std::string &error);
+
+	/* Index, directory and fill for an archive of members */
+	bool plan_archive(const std::vector<ArchiveMember> &members, FileIndex &index, std::vector<uint8_t> &directory, Fill &fill, std::string &error);
+
+	/* Cut any packed file off the end of the PNG, then add what write_new writes if it is set */
+	bool replace_tail(ChunkWalker &png, int fd, const std::function<bool(int fd)> &write_new, std::string &error);
+
+public:
+	/* Where the new chunks go in a fresh output */
+	enum Layout {
+		LAYOUT_AFTER_IHDR = 0,	/* Ahead of the image data, so readers find them quickly */
+		LAYOUT_BEFORE_IEND		/* At the end, where update() and strip() can change them in place */
+	};
+
+	/* Both descriptor paths honour it. The istream path always writes after IHDR */
+	Layout layout = LAYOUT_AFTER_IHDR;
+
+	/* How the descriptor path reads and writes the payload */
+	AsyncIo::Backend io_backend = AsyncIo::BACKEND_SYNC;
+
+	/* How the descriptor and stream paths compress file chunks, each block on its own */
+	/* Blocks that don't come out smaller are stored raw. The istream path never compresses */
+	Codec::Type codec = Codec::CODEC_NONE;
+
+	/* How the descriptor path cuts a single file into file chunks */
+	enum Chunking {
+		CHUNKING_FIXED = 0,	/* Full chunks of CHUNK_SIZE_DATA_MAX bytes */
+		CHUNKING_CONTENT	/* Cut by content and hashed, so write_delta() can match them later */
+	};
+
+	/* Archives are always cut into fixed chunks */
+	Chunking chunking = CHUNKING_FIXED;
+
+	/* Reed-Solomon parity the descriptor path adds, parity_count chunks for every parity_data */
+	/* file chunks, so up to parity_count damaged chunks of each group can be rebuilt */
+	/* 0 adds none. The istream and stream paths and write_delta() never add parity */
+	unsigned parity_data = 0;
+	unsigned parity_count = 0;
+
+	/* How file and parity chunks are sealed, after compression, under a key derived from */
+	/* passphrase with a fresh salt for every write. The payload digest is sealed along with */
+	/* them, and readers need the same passphrase to check it. Not for the istream path, */
+	/* content chunking or write_delta(), whose block hashes would give the content away */
+	Cipher::Type cipher = Cipher::CIPHER_NONE;
+	std::string passphrase;
+
+	/* Width of 0 uses one buffer per worker */
+	PngPackWriter(ThreadPool &pool, unsigned width = 0);
+
+	/* Payload must hold index.size bytes */
+	/* Carrier must already be past its signature */
+	/* The index is written with an offset table for the file chunks, replacing any it had, */
+	/* but no digest, as it goes out before the payload has been seen */
+	bool write(std::istream &carrier, uint64_t carrier_size, std::istream &payload, const FileIndex &index, std::ostream &output, std::string &error);
+
+	/* As above, between descriptors */
+	/* The carrier's own chunks are never held whole: its headers are walked and each chunk's CRC */
+	/* is checked a block at a time, then it is copied across by the kernel either side of the */
+	/* new chunks. Payload blocks go through a BlockPipeline, width + 2 of them in flight */
+	bool write(ChunkWalker &carrier, int payload, const FileIndex &index, int output, std::string &error);
+
+	/* As above, but every descriptor is only read or written in order, so any of them can be a pipe */
+	/* The payload is read until it ends, and the index's size is ignored. As that is the */
+	/* one thing not known up front, the index goes after the file chunks, recording the size, */
+	/* table and digest then. Carrier chunks are checked as they are copied, so a failure */
+	/* can leave a partial output behind. layout and codec apply as above, but chunking is */
+	/* always fixed and parity is never added */
+	bool write_stream(int carrier, int payload, const FileIndex &index, int output, std::string &error);
+
+	/* Many files as one archive. They are packed end to end into shared file chunks, */
+	/* with a directory chunk to find each by name. Names must be relative paths */
+	bool write(ChunkWalker &carrier, const std::vector<ArchiveMember> &members, int output, std::string &error);
+
+	/* By filename, using the descriptor path. The index is filled in from the target's details */
+	/* A partial output is removed on failure */
+	bool write_file(const std::string &carrier, const std::string &target, const std::string &output, std::string &error);
+	bool write_archive(const std::string &carrier, const std::vector<ArchiveMember> &members, const std::string &output, std::string &error);
+
+	/* By filename, using write_stream(), with "-" for stdin or stdout. A payload from stdin */
+	/* is stored as "stdin", with the current time. A partial output is removed on failure, */
+	/* unless it went to stdout */
+	bool write_stream_file(const std::string &carrier, const std::string &target, const std::string &output, std::string &error);
+
+	/* Split target across several PNGs, the nth part going into carriers[n] and out to outputs[n] */
+	/* Parts are whole file chunks, as even as those allow, and each index records where its */
+	/* part sits in the payload under an ID shared by all of them. ShardSet reads them back */
+	/* Shards are written at the same time, each through the descriptor path with its own digest */
+	/* Every output is removed if any shard fails. Details of the last write are the totals, */
+	/* with the carrier's taken from the first shard */
+	bool write_shards(const std::vector<std::string> &carriers, const std::string &target, const std::vector<std::string> &outputs, std::string &error);
+
+	/* Add or replace the packed file in place, in a PNG walked by png and open for writing as fd */
+	/* Any packed file it already has must be at the end (LAYOUT_BEFORE_IEND), and the new one goes there */
+	/* Only the new chunks are written, and of the carrier's own only IHDR is read and checked */
+	/* Every step is synced before the next, so if it is cut short */
+	/* the PNG is still whole, holding the old packed file, no packed file, or the new one */
+	bool update(ChunkWalker &png, int fd, int payload, const FileIndex &index, std::string &error);
+	bool update(ChunkWalker &png, int fd, const std::vector<ArchiveMember> &members, std::string &error);
+
+	/* Remove the packed file in place, the same way */
+	bool strip(ChunkWalker &png, int fd, std::string &error);
+
+	/* A new version of the packed file in previous, written to output with everything else left as it was */
+	/* The new payload is cut by content and hashed, and file chunks previous already holds for a block */
+	/* are copied across by the kernel, CRC and all. Only the other blocks are CRC'd or compressed */
+	/* The packed file in previous must have been written with CHUNKING_CONTENT */
+	bool write_delta(ChunkWalker &previous, int payload, const FileIndex &index, int output, std::string &error);
+
+	/* By filename */
+	bool write_delta_file(const std::string &previous, const std::string &target, const std::string &output, std::string &error);
+	bool update_file(const std::string &png, const std::string &target, std::string &error);
+	bool update_archive(const std::string &png, const std::vector<ArchiveMember> &members, std::string &error);
+	bool strip_file(const std::string &png, std::string &error);
+
+	/* Details of the last write */
+	const ImageHeader &header() const { return image_header; }
+	const std::vector<ChunkHeader> &carrier() const { return carrier_chunks; }
+	uint64_t payload_bytes() const { return bytes_packed; }
+	uint64_t stored_bytes() const { return bytes_stored; }
+	uint64_t payload_chunks() const { return chunks_packed; }
+	uint64_t reused_chunks() const { return chunks_reused; }
+	uint64_t parity_chunks() const { return chunks_parity; }
+	const FileDirectory &directory() const { return archive; }
+};
+
+#endif
@@ -0,0 +1,163 @@
+/*
+PROBE.CPP
+NICK WILSON
+2019
+*/
+
+#include "Probe.hpp"
+#include "Chunk.hpp"
+
+#include <string.h>
+
+static uint32_t type_of(const char *name) {
+	uint32_t type;
+	memcpy(&type, name, sizeof(uint32_t));
+	return type;
+}
+
+/* Load one chunk and check its CRC */
+static bool verify_chunk(const ChunkWalker &walker, const ChunkHeader &header, std::vector<uint8_t> &buffer) {
+	uint32_t crc;
+
+	if (!walker.load(header, buffer, crc)) return false;
+
+	/* Buffer is lent to the chunk for validation, then taken back */
+	Chunk chunk(header.length, header.type, std::move(buffer), crc);
+	bool valid = chunk.validate();
+	buffer = std::move(chunk.data);
+
+	return valid;
+}
+
+bool probe_png(const std::string &filename, ProbeVerify verify, ThreadPool &pool, ProbeResult &result, std::string &error) {
+	const uint32_t TYPE_IHDR = type_of("IHDR");
+	const uint32_t TYPE_INDEX = type_of("fiDX");
+	const uint32_t TYPE_TABLE = type_of("fiTB");
+	const uint32_t TYPE_FILE = type_of("fiLE");
+
+	ChunkWalker walker;
+	ChunkHeader header;
+	std::vector<uint8_t> buffer;
+	bool run_ended = false;
+
+	result = ProbeResult();
+
+	if (!walker.open(filename)) {
+		error = "Could not read file";
+		return false;
+	}
+
+	result.file_size = walker.size();
+
+	if (!walker.check_signature()) {
+		error = "Invalid PNG signature";
+		return false;
+	}
+
+	while (walker.next(header)) {
+		uint64_t i = result.chunks.size();
+
+		if (!i) {
+			/* First chunk MUST be of type IHDR with 13 bytes of data by RFC 2083 */
+			const uint8_t *data = walker.peek(header.offset + 2 * sizeof(uint32_t), IMAGE_HEADER_SIZE);
+			if (header.type != TYPE_IHDR || header.length != IMAGE_HEADER_SIZE || !data) {
+				error = "Invalid leading chunk";
+				return false;
+			}
+
+			result.header.parse(data);
+
+			if (verify >= PROBE_VERIFY_HEADERS && !verify_chunk(walker, header, buffer)) {
+				error = "Chunk 0 failed validation";
+				return false;
+			}
+		}
+
+		if (header.type == TYPE_INDEX && !result.has_index) {
+			result.has_index = true;
+			result.index_chunk = i;
+
+			uint32_t crc;
+			if (!walker.load(header, buffer, crc) || !result.index.unpack(buffer.data(), buffer.size())) {
+				error = "Unreadable index chunk";
+				return false;
+			}
+
+			if (verify >= PROBE_VERIFY_HEADERS) {
+				Chunk index(header.length, header.type, std::move(buffer), crc);
+				if (!index.validate()) {
+					error = "Chunk " + std::to_string(i) + " failed validation";
+					return false;
+				}
+			}
+		}
+
+		/* The index's table comes straight after it */
+		if (header.type == TYPE_TABLE && result.has_index && i == result.index_chunk + 1) {
+			uint32_t crc;
+			if (!walker.load(header, buffer, crc) || !result.index.unpack_table(buffer.data(), buffer.size())) {
+				error = (result.index.encryption.iterations > Cipher::KDF_ITERATIONS_MAX) ? "Key derivation asks for too many iterations" : "Unreadable table chunk";
+				return false;
+			}
+
+			if (verify >= PROBE_VERIFY_HEADERS) {
+				Chunk table(header.length, header.type, std::move(buffer), crc);
+				if (!table.validate()) {
+					error = "Chunk " + std::to_string(i) + " failed validation";
+					return false;
+				}
+			}
+		}
+
+		/* Only the first contiguous run of file chunks counts as the payload */
+		if (header.type == TYPE_FILE && !run_ended) {
+			if (!result.has_file) {
+				result.has_file = true;
+				result.file_chunk = i;
+			}
+			result.file_chunk_count++;
+			result.file_bytes += header.length;
+		}
+		else if (result.has_file) {
+			run_ended = true;
+		}
+
+		/* Inventory, there are only ever a handful of distinct types */
+		size_t t = 0;
+		while (t < result.inventory.size() && result.inventory[t].type != header.type) t++;
+		if (t == result.inventory.size()) result.inventory.push_back({header.type, 0, 0});
+		result.inventory[t].count++;
+		result.inventory[t].bytes += header.length;
+
+		result.chunks.push_back(header);
+	}
+
+	if (walker.truncated()) {
+		error = "Reached EOF before all chunks were read";
+		return false;
+	}
+
+	if (result.chunks.empty()) {
+		error = "No chunks present";
+		return false;
+	}
+
+	if (verify >= PROBE_VERIFY_ALL) {
+		/* Report the first failure, whichever worker found it */
+		std::vector<uint8_t> chunk_valid(result.chunks.size());
+
+		pool.parallel_for(result.chunks.size(), [&walker, &result, &chunk_valid](size_t i) {
+			static thread_local std::vector<uint8_t> block;
+			chunk_valid[i] = verify_chunk(walker, result.chunks[i], block);
+		});
+
+		for (size_t i = 0; i < chunk_valid.size(); i++) {
+			if (!chunk_valid[i]) {
+				error = "Chunk " + std::to_string(i) + " failed validation";
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
@@ -0,0 +1,60 @@
+/*
+PROBE.HPP
+NICK WILSON
+2019
+*/
+
+#ifndef OBJ_PROBE
+#define OBJ_PROBE
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#include "ChunkWalker.hpp"
+#include "FileIndex.hpp"
+#include "ImageHeader.hpp"
+#include "ThreadPool.hpp"
+
+/* How much CRC work a probe does */
+enum ProbeVerify {
+	PROBE_VERIFY_NONE = 0,		/* Headers only */
+	PROBE_VERIFY_HEADERS,		/* IHDR, index and table chunk CRCs */
+	PROBE_VERIFY_ALL,			/* Every chunk CRC */
+	PROBE_VERIFY_COUNT
+};
+
+/* Count and total data length of one chunk type */
+struct ChunkSummary {
+	uint32_t type;
+	uint64_t count;
+	uint64_t bytes;
+};
+
+struct ProbeResult {
+	uint64_t file_size = 0;
+
+	ImageHeader header;
+
+	/* Every chunk header, and a summary per type in order of first appearance */
+	std::vector<ChunkHeader> chunks;
+	std::vector<ChunkSummary> inventory;
+
+	/* Index chunk */
+	bool has_index = false;
+	uint64_t index_chunk = 0;
+	FileIndex index;
+
+	/* First run of file chunks */
+	bool has_file = false;
+	uint64_t file_chunk = 0;
+	uint64_t file_chunk_count = 0;
+	uint64_t file_bytes = 0;
+};
+
+/* Walk the chunk headers of a PNG without reading image data */
+/* On failure, error holds a description of the problem */
+bool probe_png(const std::string &filename, ProbeVerify verify, ThreadPool &pool, ProbeResult &result, std::string &error);
+
+#endif
@@ -0,0 +1,345 @@
+/*
+REEDSOLOMON.CPP
+NICK WILSON
+2019
+*/
+
+#include "ReedSolomon.hpp"
+#include "Stats.hpp"
+
+#include <algorithm>
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define REEDSOLOMON_X86
+#include <immintrin.h>
+#endif
+
+/* Powers of the generator 2 and their logarithms, generated by the compiler */
+/* exp runs on past 255 so the sum of two logarithms never needs reducing */
+struct GaloisTables {
+	uint8_t exp[512];
+	uint8_t log[256];
+
+	constexpr GaloisTables() : exp(), log() {
+		uint32_t x = 1;
+
+		for (uint32_t i = 0; i < 255; i++) {
+			exp[i] = x;
+			exp[i + 255] = x;
+			log[x] = i;
+
+			x <<= 1;
+			if (x & 0x100) x ^= 0x11D;
+		}
+
+		exp[510] = exp[0];
+		exp[511] = exp[1];
+	}
+};
+
+static constexpr GaloisTables GF;
+
+/* Spot check against the field's known powers, evaluated by the compiler */
+static_assert(GF.exp[8] == 0x1D && GF.exp[254] == 0x8E, "GF(256) table generation is broken");
+static_assert(GF.log[0x1D] == 8 && GF.log[0x8E] == 254, "GF(256) table generation is broken");
+
+static inline uint8_t gf_mul(uint8_t a, uint8_t b) {
+	return (a && b) ? GF.exp[GF.log[a] + GF.log[b]] : 0;
+}
+
+static inline uint8_t gf_inv(uint8_t a) {
+	return GF.exp[255 - GF.log[a]];
+}
+
+/* c times every low nibble, and c times every high nibble */
+/* c * x is then low[x & 15] ^ high[x >> 4], as multiplication distributes over XOR */
+static void nibble_tables(uint8_t c, uint8_t *low, uint8_t *high) {
+	for (uint8_t x = 0; x < 16; x++) {
+		low[x] = gf_mul(c, x);
+		high[x] = gf_mul(c, x << 4);
+	}
+}
+
+typedef void (*multiply_fn)(const uint8_t *low, const uint8_t *high, const uint8_t *in, uint8_t *out, size_t length);
+
+static void multiply_portable(const uint8_t *low, const uint8_t *high, const uint8_t *in, uint8_t *out, size_t length) {
+	for (size_t i = 0; i < length; i++) out[i] ^= low[in[i] & 15] ^ high[in[i] >> 4];
+}
+
+#if defined(REEDSOLOMON_X86)
+
+__attribute__((target("ssse3")))
+static void multiply_ssse3(const uint8_t *low, const uint8_t *high, const uint8_t *in, uint8_t *out, size_t length) {
+	const __m128i low_table = _mm_loadu_si128(reinterpret_cast<const __m128i *>(low));
+	const __m128i high_table = _mm_loadu_si128(reinterpret_cast<const __m128i *>(high));
+	const __m128i mask = _mm_set1_epi8(0x0F);
+	size_t i = 0;
+
+	for (; i + 16 <= length; i += 16) {
+		__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+		__m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i *>(out + i));
+
+		__m128i l = _mm_shuffle_epi8(low_table, _mm_and_si128(x, mask));
+		__m128i h = _mm_shuffle_epi8(high_table, _mm_and_si128(_mm_srli_epi64(x, 4), mask));
+
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), _mm_xor_si128(y, _mm_xor_si128(l, h)));
+	}
+
+	multiply_portable(low, high, in + i, out + i, length - i);
+}
+
+/* Two vectors a step, so the loads of one overlap the shuffles of the other */
+__attribute__((target("avx2")))
+static void multiply_avx2(const uint8_t *low, const uint8_t *high, const uint8_t *in, uint8_t *out, size_t length) {
+	const __m256i low_table = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(low)));
+	const __m256i high_table = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(high)));
+	const __m256i mask = _mm256_set1_epi8(0x0F);
+	size_t i = 0;
+
+	for (; i + 64 <= length; i += 64) {
+		__m256i x0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + i));
+		__m256i x1 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + i + 32));
+		__m256i y0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(out + i));
+		__m256i y1 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(out + i + 32));
+
+		__m256i l0 = _mm256_shuffle_epi8(low_table, _mm256_and_si256(x0, mask));
+		__m256i l1 = _mm256_shuffle_epi8(low_table, _mm256_and_si256(x1, mask));
+		__m256i h0 = _mm256_shuffle_epi8(high_table, _mm256_and_si256(_mm256_srli_epi64(x0, 4), mask));
+		__m256i h1 = _mm256_shuffle_epi8(high_table, _mm256_and_si256(_mm256_srli_epi64(x1, 4), mask));
+
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), _mm256_xor_si256(y0, _mm256_xor_si256(l0, h0)));
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i + 32), _mm256_xor_si256(y1, _mm256_xor_si256(l1, h1)));
+	}
+
+	multiply_ssse3(low, high, in + i, out + i, length - i);
+}
+
+static bool ssse3_supported() {
+	return __builtin_cpu_supports("ssse3");
+}
+
+static bool avx2_supported() {
+	return __builtin_cpu_supports("avx2");
+}
+
+#else
+
+static void multiply_ssse3(const uint8_t *low, const uint8_t *high, const uint8_t *in, uint8_t *out, size_t length) {
+	multiply_portable(low, high, in, out, length);
+}
+
+static void multiply_avx2(const uint8_t *low, const uint8_t *high, const uint8_t *in, uint8_t *out, size_t length) {
+	multiply_portable(low, high, in, out, length);
+}
+
+static bool ssse3_supported() {
+	return false;
+}
+
+static bool avx2_supported() {
+	return false;
+}
+
+#endif
+
+static const multiply_fn MULTIPLY_ENGINES[ReedSolomon::ENGINE_COUNT] = {multiply_portable, multiply_ssse3, multiply_avx2};
+
+static ReedSolomon::Engine detect_engine() {
+	if (avx2_supported()) return ReedSolomon::ENGINE_AVX2;
+	if (ssse3_supported()) return ReedSolomon::ENGINE_SSSE3;
+	return ReedSolomon::ENGINE_PORTABLE;
+}
+
+/* Invert an n by n matrix in place by Gauss-Jordan elimination, false if it is singular */
+static bool invert(std::vector<uint8_t> &matrix, size_t n) {
+	std::vector<uint8_t> inverse(n * n);
+	for (size_t i = 0; i < n; i++) inverse[i * n + i] = 1;
+
+	for (size_t column = 0; column < n; column++) {
+		size_t pivot = column;
+		while (pivot < n && !matrix[pivot * n + column]) pivot++;
+		if (pivot == n) return false;
+
+		for (size_t k = 0; k < n; k++) {
+			std::swap(matrix[pivot * n + k], matrix[column * n + k]);
+			std::swap(inverse[pivot * n + k], inverse[column * n + k]);
+		}
+
+		uint8_t scale = gf_inv(matrix[column * n + column]);
+		for (size_t k = 0; k < n; k++) {
+			matrix[column * n + k] = gf_mul(matrix[column * n + k], scale);
+			inverse[column * n + k] = gf_mul(inverse[column * n + k], scale);
+		}
+
+		for (size_t row = 0; row < n; row++) {
+			uint8_t factor = matrix[row * n + column];
+			if (row == column || !factor) continue;
+
+			for (size_t k = 0; k < n; k++) {
+				matrix[row * n + k] ^= gf_mul(factor, matrix[column * n + k]);
+				inverse[row * n + k] ^= gf_mul(factor, inverse[column * n + k]);
+			}
+		}
+	}
+
+	matrix.swap(inverse);
+	return true;
+}
+
+/* Public */
+/* Cauchy rows 1 / (x_j + y_i), with x_j = data + j and y_i = i all distinct. Every square */
+/* submatrix of a Cauchy matrix is invertible, so any data rows of the whole code are too */
+uint8_t ReedSolomon::coefficient(unsigned data, unsigned j, unsigned i) {
+	return gf_inv((data + j) ^ i);
+}
+
+void ReedSolomon::multiply_add(uint8_t c, const uint8_t *in, uint8_t *out, size_t length) {
+	static const Engine engine = active();
+	multiply_add_with(engine, c, in, out, length);
+}
+
+void ReedSolomon::multiply_add_with(Engine engine, uint8_t c, const uint8_t *in, uint8_t *out, size_t length) {
+	if (!c) return;
+
+	uint8_t low[16], high[16];
+	nibble_tables(c, low, high);
+
+	MULTIPLY_ENGINES[engine](low, high, in, out, length);
+}
+
+void ReedSolomon::encode(unsigned data, unsigned parity, const uint8_t *const *data_shards, uint8_t *const *parity_shards, size_t length) {
+	Stats::Scope timing(Stats::PHASE_PARITY, (uint64_t) data * length);
+
+	for (unsigned j = 0; j < parity; j++) {
+		memset(parity_shards[j], 0, length);
+		for (unsigned i = 0; i < data; i++) multiply_add(coefficient(data, j, i), data_shards[i], parity_shards[j], length);
+	}
+}
+
+bool ReedSolomon::reconstruct(unsigned data, unsigned parity, uint8_t *const *shards, const std::vector<uint8_t> &present, size_t length) {
+	Stats::Scope timing(Stats::PHASE_PARITY);
+
+	std::vector<unsigned> missing, used;
+
+	for (unsigned i = 0; i < data; i++) {
+		if (!present[i]) missing.push_back(i);
+	}
+
+	if (missing.empty()) return true;
+
+	/* The first data shards present, and enough parity shards to make up the rest */
+	for (unsigned s = 0; s < data + parity && used.size() < data; s++) {
+		if (present[s]) used.push_back(s);
+	}
+
+	if (used.size() < data) return false;
+
+	/* Each shard used is its row of the code times the data, so the data is the inverse times them */
+	std::vector<uint8_t> matrix(data * data);
+
+	for (unsigned r = 0; r < data; r++) {
+		for (unsigned i = 0; i < data; i++) {
+			matrix[r * data + i] = (used[r] < data) ? (used[r] == i) : coefficient(data, used[r] - data, i);
+		}
+	}
+
+	if (!invert(matrix, data)) return false;
+
+	/* Built aside first, as the shards used must stay as they are until every missing one is done */
+	std::vector<std::vector<uint8_t>> rebuilt(missing.size(), std::vector<uint8_t>(length));
+
+	for (size_t m = 0; m < missing.size(); m++) {
+		for (unsigned r = 0; r < data; r++) multiply_add(matrix[missing[m] * data + r], shards[used[r]], rebuilt[m].data(), length);
+		timing.add((uint64_t) data * length);
+	}
+
+	for (size_t m = 0; m < missing.size(); m++) memcpy(shards[missing[m]], rebuilt[m].data(), length);
+
+	return true;
+}
+
+ReedSolomon::Engine ReedSolomon::active() {
+	static const Engine engine = detect_engine();
+	return engine;
+}
+
+bool ReedSolomon::available(Engine engine) {
+	if (engine == ENGINE_AVX2) return avx2_supported();
+	if (engine == ENGINE_SSSE3) return ssse3_supported();
+	return engine < ENGINE_COUNT;
+}
+
+const char *ReedSolomon::engine_name(Engine engine) {
+	switch (engine) {
+		case ENGINE_PORTABLE:
+			return "portable";
+		case ENGINE_SSSE3:
+			return "ssse3";
+		case ENGINE_AVX2:
+			return "avx2";
+		default:
+			return "unknown";
+	}
+}
+
+bool ReedSolomon::self_test() {
+	const size_t SIZE = 256 + 64 + 7;
+	uint8_t in[SIZE], out[SIZE], expected[SIZE];
+
+	/* Cheap LCG, the content only needs to be irregular */
+	uint32_t seed = 0x11D;
+	for (size_t i = 0; i < SIZE; i++) {
+		seed = seed * 1103515245 + 12345;
+		in[i] = seed >> 16;
+	}
+
+	/* Every coefficient, at lengths and alignments either side of each engine's step */
+	for (int e = 0; e < ENGINE_COUNT; e++) {
+		Engine engine = (Engine) e;
+		if (!available(engine)) continue;
+
+		for (unsigned c = 0; c < 256; c++) {
+			for (size_t offset = 0; offset < 3; offset++) {
+				size_t length = SIZE - offset - c % 67;
+
+				for (size_t i = 0; i < length; i++) {
+					out[i] = in[SIZE - 1 - i];
+					expected[i] = out[i] ^ gf_mul(c, in[offset + i]);
+				}
+
+				multiply_add_with(engine, c, in + offset, out, length);
+				if (memcmp(out, expected, length)) return false;
+			}
+		}
+	}
+
+	/* Lose as many shards of a group as it has parity, data and parity both, and rebuild them */
+	const unsigned DATA = 5, PARITY = 3;
+	const size_t LENGTH = 100;
+	std::vector<std::vector<uint8_t>> shards(DATA + PARITY, std::vector<uint8_t>(LENGTH));
+	uint8_t *pointers[DATA + PARITY];
+
+	for (unsigned s = 0; s < DATA + PARITY; s++) pointers[s] = shards[s].data();
+	for (unsigned i = 0; i < DATA; i++) memcpy(pointers[i], in + i * 7, LENGTH);
+
+	encode(DATA, PARITY, pointers, pointers + DATA, LENGTH);
+
+	std::vector<uint8_t> present(DATA + PARITY, 1);
+	present[0] = present[3] = present[DATA + 1] = 0;
+
+	for (unsigned s = 0; s < DATA + PARITY; s++) {
+		if (!present[s]) memset(pointers[s], 0, LENGTH);
+	}
+
+	if (!reconstruct(DATA, PARITY, pointers, present, LENGTH)) return false;
+
+	for (unsigned i = 0; i < DATA; i++) {
+		if (memcmp(pointers[i], in + i * 7, LENGTH)) return false;
+	}
+
+	/* One more lost is one too many */
+	present[4] = 0;
+	return !reconstruct(DATA, PARITY, pointers, present, LENGTH);
+}
@@ -0,0 +1,57 @@
+/*
+REEDSOLOMON.HPP
+NICK WILSON
+2019
+*/
+
+#ifndef OBJ_REEDSOLOMON
+#define OBJ_REEDSOLOMON
+
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Systematic Reed-Solomon erasure code over GF(256), polynomial 0x11D */
+/* A group of data shards is followed by parity shards, each parity shard the sum of every */
+/* data shard times its row of a Cauchy matrix. Any data shards of the group can then be */
+/* rebuilt from any others, so long as as many shards are left as there are data shards */
+/* Shards are byte strings of equal length, worked on a byte position at a time */
+class ReedSolomon{
+public:
+	enum Engine {
+		ENGINE_PORTABLE = 0,	/* Two 16 entry tables per coefficient, one byte at a time */
+		ENGINE_SSSE3,			/* The same tables in PSHUFB, 16 bytes at a time */
+		ENGINE_AVX2,			/* The same tables in VPSHUFB, 64 bytes at a time */
+		ENGINE_COUNT
+	};
+
+	/* Data and parity shards in one group between them */
+	static const unsigned MAX_SHARDS = 256;
+
+	/* What parity shard j of a group of data shards multiplies data shard i by */
+	static uint8_t coefficient(unsigned data, unsigned j, unsigned i);
+
+	/* out ^= c * in, byte by byte, on the active engine */
+	static void multiply_add(uint8_t c, const uint8_t *in, uint8_t *out, size_t length);
+
+	/* Parity shards from data shards, each length bytes */
+	static void encode(unsigned data, unsigned parity, const uint8_t *const *data_shards, uint8_t *const *parity_shards, size_t length);
+
+	/* Rebuild the data shards present doesn't mark, in place, from those it does */
+	/* shards holds the data shards then the parity shards, each length bytes */
+	/* Missing parity shards are left as they are. False if too few shards are present */
+	static bool reconstruct(unsigned data, unsigned parity, uint8_t *const *shards, const std::vector<uint8_t> &present, size_t length);
+
+	static bool available(Engine engine);
+	static Engine active();
+	static const char *engine_name(Engine engine);
+
+	/* Check every available engine against plain GF(256) arithmetic, and a group round trip */
+	static bool self_test();
+
+private:
+	static void multiply_add_with(Engine engine, uint8_t c, const uint8_t *in, uint8_t *out, size_t length);
+};
+
+#endif
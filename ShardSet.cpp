@@ -0,0 +1,142 @@
+/*
+SHARDSET.CPP
+NICK WILSON
+2019
+*/
+
+#include "ShardSet.hpp"
+
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+bool ShardSet::open(const std::vector<std::string> &filenames, std::string &error) {
+	close();
+
+	if (filenames.empty()) {
+		error = "No shards to read!";
+		return false;
+	}
+
+	std::vector<std::unique_ptr<PngPackReader>> found(filenames.size());
+	std::vector<std::string> found_names(filenames.size());
+	const FileIndex *first = nullptr;
+
+	for (const std::string &filename : filenames) {
+		std::unique_ptr<PngPackReader> reader(new PngPackReader());
+		reader->io_backend = io_backend;
+		reader->passphrase = passphrase;
+
+		if (!reader->open(filename, error) || !reader->find_index(error)) {
+			error += " in \"" + filename + "\"";
+			return false;
+		}
+
+		const FileIndex &index = reader->index();
+		const FileIndex::Shard &shard = index.shard;
+
+		if (!shard.count) {
+			error = "\"" + filename + "\" does not hold a shard!";
+			return false;
+		}
+
+		/* Every shard names the same payload, and the number of them */
+		if (first && (memcmp(shard.id, first->shard.id, sizeof(shard.id)) || shard.total != first->shard.total)) {
+			error = "\"" + filename + "\" holds a shard of a different file!";
+			return false;
+		}
+
+		if (shard.count != filenames.size()) {
+			error = "\"" + filename + "\" is one of " + std::to_string(shard.count) + " shards, not " + std::to_string(filenames.size()) + "!";
+			return false;
+		}
+
+		if (found[shard.number]) {
+			error = "\"" + filename + "\" holds the same shard as \"" + found_names[shard.number] + "\"!";
+			return false;
+		}
+
+		first = &reader->index();
+		found[shard.number] = std::move(reader);
+		found_names[shard.number] = filename;
+	}
+
+	/* With every number present once, the parts must follow each other and add up */
+	uint64_t offset = 0;
+	for (size_t n = 0; n < found.size(); n++) {
+		const FileIndex &index = found[n]->index();
+
+		if (index.shard.offset != offset) {
+			error = "\"" + found_names[n] + "\" does not follow on from the shard before it!";
+			return false;
+		}
+
+		offset += index.size;
+	}
+
+	if (offset != first->shard.total) {
+		error = "Shards do not add up to the whole file!";
+		return false;
+	}
+
+	whole.filename = first->filename;
+	whole.time_cr = first->time_cr;
+	whole.time_mod = first->time_mod;
+	whole.size = offset;
+
+	shards = std::move(found);
+	names = std::move(found_names);
+	return true;
+}
+
+void ShardSet::close() {
+	shards.clear();
+	names.clear();
+	whole = FileIndex();
+	chunks_extracted = 0;
+	chunks_repaired = 0;
+}
+
+bool ShardSet::extract(int fd, ThreadPool &pool, unsigned width, std::string &error) {
+	struct stat output_A;
+	off_t output_start = lseek(fd, 0, SEEK_CUR);
+
+	/* Shards land out of order, so only a file can take them */
+	if (fstat(fd, &output_A) || !S_ISREG(output_A.st_mode) || output_start < 0) {
+		error = "Shards can only be extracted to a regular file!";
+		return false;
+	}
+
+	size_t count = shards.size();
+	std::vector<std::string> errors(count);
+	std::vector<uint8_t> failed(count);
+
+	/* Width is shared out so the shards together keep about as much in flight as one would */
+	unsigned each = (width > count) ? width / count : 1;
+
+	chunks_extracted = 0;
+	chunks_repaired = 0;
+
+	pool.parallel_for(count, [&](size_t n) {
+		PngPackReader &reader = *shards[n];
+		failed[n] = !reader.extract_at(fd, output_start + reader.index().shard.offset, pool, each, errors[n]);
+	});
+
+	for (size_t n = 0; n < count; n++) {
+		if (failed[n]) {
+			error = errors[n] + " in \"" + names[n] + "\"";
+			return false;
+		}
+
+		chunks_extracted += shards[n]->extracted();
+		chunks_repaired += shards[n]->repaired();
+	}
+
+	/* Writes are positioned, leave the descriptor after the payload */
+	if (lseek(fd, output_start + whole.size, SEEK_SET) < 0) {
+		error = "Could not write extracted file!";
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,59 @@
+/*
+SHARDSET.HPP
+NICK WILSON
+2019
+*/
+
+#ifndef OBJ_SHARDSET
+#define OBJ_SHARDSET
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#include "AsyncIo.hpp"
+#include "FileIndex.hpp"
+#include "PngPackReader.hpp"
+#include "ThreadPool.hpp"
+
+/* A payload split across several PNGs by PngPackWriter::write_shards(), read back together */
+/* Each shard is extracted straight to its own place in the output, all of them at once, */
+/* so reading from several disks goes as fast as the slowest of them */
+class ShardSet{
+private:
+	std::vector<std::unique_ptr<PngPackReader>> shards;	/* In shard order */
+	std::vector<std::string> names;
+	FileIndex whole;
+	uint64_t chunks_extracted = 0;
+	uint64_t chunks_repaired = 0;
+
+public:
+	/* How each shard's extraction reads and writes */
+	AsyncIo::Backend io_backend = AsyncIo::BACKEND_SYNC;
+
+	/* Given to every shard's reader, for shards that were encrypted */
+	std::string passphrase;
+
+	/* Open every PNG, given in any order, and check their indexes make up one whole payload */
+	bool open(const std::vector<std::string> &filenames, std::string &error);
+	void close();
+
+	/* Name, times and size of the whole payload, with no table. Only meaningful once open() has succeeded */
+	const FileIndex &index() const { return whole; }
+	size_t count() const { return shards.size(); }
+	const PngPackReader &shard(size_t n) const { return *shards[n]; }
+	const std::string &filename(size_t n) const { return names[n]; }
+
+	/* File chunks read by the last extraction, and those rebuilt from parity, across every shard */
+	uint64_t extracted() const { return chunks_extracted; }
+	uint64_t repaired() const { return chunks_repaired; }
+
+	/* Extract every shard into fd, which must be a regular file, from its current offset */
+	/* Shards run across the pool together, width chunks in flight between them, and each */
+	/* is checked against its own digest. The descriptor is left after the payload */
+	bool extract(int fd, ThreadPool &pool, unsigned width, std::string &error);
+};
+
+#endif
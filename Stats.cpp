@@ -0,0 +1,152 @@
+/*
+STATS.CPP
+NICK WILSON
+2019
+*/
+
+#include "Stats.hpp"
+
+#include <atomic>
+#include <chrono>
+
+#include <sys/resource.h>
+
+/* Counters for one phase, updated from any thread */
+struct Counters {
+	std::atomic<uint64_t> calls;
+	std::atomic<uint64_t> nanoseconds;
+	std::atomic<uint64_t> bytes;
+	std::atomic<uint64_t> allocations;
+	std::atomic<uint64_t> allocated_bytes;
+	std::atomic<uint64_t> peak_rss;
+};
+
+/* One extra for allocations outside any phase */
+static Counters counters[Stats::PHASE_COUNT + 1];
+
+static uint64_t wall_start = 0;
+
+/* Innermost scope on this thread */
+static thread_local Stats::Scope *current = nullptr;
+
+/* Resident set is sampled at most this often per thread, since it takes a system call */
+static const uint64_t RSS_INTERVAL = 1000000;
+static thread_local uint64_t rss_sampled = 0;
+
+bool Stats::on = false;
+
+static uint64_t now() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void raise_to(std::atomic<uint64_t> &value, uint64_t n) {
+	uint64_t seen = value.load(std::memory_order_relaxed);
+	while (n > seen && !value.compare_exchange_weak(seen, n, std::memory_order_relaxed));
+}
+
+static Stats::Totals load(const Counters &c) {
+	Stats::Totals totals;
+	totals.calls = c.calls.load();
+	totals.nanoseconds = c.nanoseconds.load();
+	totals.bytes = c.bytes.load();
+	totals.allocations = c.allocations.load();
+	totals.allocated_bytes = c.allocated_bytes.load();
+	totals.peak_rss = c.peak_rss.load();
+	return totals;
+}
+
+Stats::Scope::Scope(Phase phase, uint64_t bytes) : phase(phase), bytes(bytes), active(on) {
+	if (!active) return;
+
+	outer = current;
+	current = this;
+	start = now();
+}
+
+Stats::Scope::~Scope() {
+	if (!active) return;
+
+	uint64_t end = now();
+	uint64_t elapsed = end - start;
+	Counters &c = counters[phase];
+
+	c.calls.fetch_add(1, std::memory_order_relaxed);
+	c.nanoseconds.fetch_add(elapsed - nested, std::memory_order_relaxed);
+	c.bytes.fetch_add(bytes, std::memory_order_relaxed);
+
+	if (end - rss_sampled >= RSS_INTERVAL) {
+		rss_sampled = end;
+		raise_to(c.peak_rss, Stats::peak_rss());
+	}
+
+	current = outer;
+	if (outer) outer->nested += elapsed;
+}
+
+void Stats::enable(bool on) {
+	Stats::on = on;
+	reset();
+}
+
+void Stats::reset() {
+	for (Counters &c : counters) {
+		c.calls = 0;
+		c.nanoseconds = 0;
+		c.bytes = 0;
+		c.allocations = 0;
+		c.allocated_bytes = 0;
+		c.peak_rss = 0;
+	}
+
+	wall_start = now();
+}
+
+void Stats::count(Phase phase, uint64_t bytes) {
+	if (on) counters[phase].bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void Stats::allocated(size_t size) {
+	Counters &c = counters[current ? current->phase : PHASE_COUNT];
+
+	c.allocations.fetch_add(1, std::memory_order_relaxed);
+	c.allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+}
+
+Stats::Totals Stats::totals(Phase phase) {
+	return load(counters[phase]);
+}
+
+Stats::Totals Stats::unattributed() {
+	return load(counters[PHASE_COUNT]);
+}
+
+uint64_t Stats::wall_nanoseconds() {
+	return now() - wall_start;
+}
+
+uint64_t Stats::peak_rss() {
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage)) return 0;
+
+	/* Linux reports kilobytes */
+	return (uint64_t) usage.ru_maxrss * 1024;
+}
+
+const char *Stats::name(Phase phase) {
+	switch (phase) {
+		case PHASE_OPEN: return "open";
+		case PHASE_SIGNATURE: return "signature";
+		case PHASE_PARSE: return "parse";
+		case PHASE_VALIDATE: return "validate";
+		case PHASE_DECODE: return "decode";
+		case PHASE_READ: return "read";
+		case PHASE_CRC: return "crc";
+		case PHASE_DIGEST: return "digest";
+		case PHASE_PARITY: return "parity";
+		case PHASE_COMPRESS: return "compress";
+		case PHASE_CRYPT: return "crypt";
+		case PHASE_INDEX: return "index";
+		case PHASE_WRITE: return "write";
+		default: return "unknown";
+	}
+}
@@ -0,0 +1,97 @@
+/*
+STATS.HPP
+NICK WILSON
+2019
+*/
+
+#ifndef OBJ_STATS
+#define OBJ_STATS
+
+#include <cstddef>
+#include <cstdint>
+
+/* Where time, bytes and memory go, broken down by phase of work */
+/* Off until enabled, when each Scope costs a flag check and nothing else */
+/* Counters are shared by every thread, so parallel phases add up to more than the wall time */
+class Stats{
+public:
+	enum Phase {
+		PHASE_OPEN = 0,		/* Finding and opening files */
+		PHASE_SIGNATURE,	/* Checking PNG signatures */
+		PHASE_PARSE,		/* Walking chunk headers */
+		PHASE_VALIDATE,		/* Checking chunks, less the CRC itself */
+		PHASE_DECODE,		/* Inflating and unfiltering image data */
+		PHASE_READ,			/* Reading, or waiting on reads */
+		PHASE_CRC,			/* Calculating CRCs */
+		PHASE_DIGEST,		/* Hashing the whole payload */
+		PHASE_PARITY,		/* Building parity chunks, and rebuilding damaged chunks from them */
+		PHASE_COMPRESS,		/* Compressing and decompressing file chunks */
+		PHASE_CRYPT,		/* Encrypting and decrypting file chunks, and deriving keys */
+		PHASE_INDEX,		/* Building, packing and unpacking the index and directory, and cutting blocks by content */
+		PHASE_WRITE,		/* Writing and copying, or waiting on writes */
+		PHASE_COUNT
+	};
+
+	struct Totals {
+		uint64_t calls = 0;
+		uint64_t nanoseconds = 0;	/* Summed over threads, less time spent in other phases within */
+		uint64_t bytes = 0;
+		uint64_t allocations = 0;
+		uint64_t allocated_bytes = 0;
+		uint64_t peak_rss = 0;		/* Process high-water resident set as of when it last ran, in bytes */
+	};
+
+	/* Counts time from construction to destruction against phase, on this thread */
+	/* Scopes nest, and time spent in an inner one only counts for the inner phase */
+	class Scope{
+	private:
+		Phase phase;
+		uint64_t bytes;
+		uint64_t start = 0;
+		uint64_t nested = 0;
+		Scope *outer = nullptr;
+		bool active;
+
+		friend class Stats;
+
+	public:
+		explicit Scope(Phase phase, uint64_t bytes = 0);
+		~Scope();
+
+		Scope(const Scope &) = delete;
+		Scope &operator=(const Scope &) = delete;
+
+		void add(uint64_t n) { bytes += n; }
+
+		/* For time that is only known to belong to a phase once it is over */
+		void move_to(Phase phase) { this->phase = phase; }
+	};
+
+	/* Set before any other threads start */
+	static void enable(bool on);
+	static bool enabled() { return on; }
+
+	/* Clear the counters and start the wall clock */
+	static void reset();
+
+	/* Bytes handled outside of any timing, such as those a background read completed */
+	static void count(Phase phase, uint64_t bytes);
+
+	/* For programs that hook allocation, counted against this thread's innermost phase */
+	static void allocated(size_t size);
+
+	static Totals totals(Phase phase);
+
+	/* Allocations made outside any phase */
+	static Totals unattributed();
+
+	static uint64_t wall_nanoseconds();
+	static uint64_t peak_rss();
+
+	static const char *name(Phase phase);
+
+private:
+	static bool on;
+};
+
+#endif
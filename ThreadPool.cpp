@@ -0,0 +1,156 @@
+/*
+THREADPOOL.CPP
+NICK WILSON
+2019
+*/
+
+#include "ThreadPool.hpp"
+
+/* Queue of the worker running on this thread, if any */
+static thread_local const ThreadPool *current_pool = nullptr;
+static thread_local size_t current_queue = 0;
+
+/* Private */
+void ThreadPool::worker(size_t index) {
+	current_pool = this;
+	current_queue = index;
+
+	for (;;) {
+		if (run_one(index)) continue;
+
+		std::unique_lock<std::mutex> guard(sleep_lock);
+		wake.wait(guard, [this] { return stopping || queued; });
+		if (stopping && !queued) return;
+	}
+}
+
+/* Take a job from our own queue first (newest), otherwise steal the oldest from another */
+bool ThreadPool::run_one(size_t home) {
+	std::function<void()> job;
+	size_t count = queues.size();
+
+	for (size_t i = 0; i < count && !job; i++) {
+		Queue &queue = *queues[(home + i) % count];
+		std::lock_guard<std::mutex> guard(queue.lock);
+		if (queue.jobs.empty()) continue;
+
+		if (!i) {
+			job = std::move(queue.jobs.back());
+			queue.jobs.pop_back();
+		}
+		else {
+			job = std::move(queue.jobs.front());
+			queue.jobs.pop_front();
+		}
+	}
+
+	if (!job) return false;
+
+	{
+		std::lock_guard<std::mutex> guard(sleep_lock);
+		queued--;
+	}
+
+	job();
+
+	std::lock_guard<std::mutex> guard(done_lock);
+	if (!--pending) all_done.notify_all();
+	return true;
+}
+
+/* Wake everything waiting on the pool, taking the lock so no wakeup is missed */
+void ThreadPool::notify() {
+	{
+		std::lock_guard<std::mutex> guard(sleep_lock);
+	}
+	wake.notify_all();
+}
+
+/* Public */
+ThreadPool::ThreadPool(unsigned threads) : next_queue(0) {
+	if (threads <= 1) return;
+
+	for (unsigned i = 0; i < threads; i++) queues.emplace_back(new Queue);
+	for (unsigned i = 0; i < threads; i++) workers.emplace_back(&ThreadPool::worker, this, i);
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> guard(sleep_lock);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (std::thread &t : workers) t.join();
+}
+
+void ThreadPool::submit(std::function<void()> job) {
+	if (workers.empty()) {
+		job();
+		return;
+	}
+
+	/* Jobs from a worker stay local to it, others are dealt out in turn */
+	size_t index = (current_pool == this) ? current_queue : next_queue++ % queues.size();
+
+	{
+		std::lock_guard<std::mutex> guard(done_lock);
+		pending++;
+	}
+	{
+		std::lock_guard<std::mutex> guard(queues[index]->lock);
+		queues[index]->jobs.push_back(std::move(job));
+	}
+	{
+		std::lock_guard<std::mutex> guard(sleep_lock);
+		queued++;
+	}
+	wake.notify_one();
+}
+
+void ThreadPool::wait() {
+	std::unique_lock<std::mutex> guard(done_lock);
+	all_done.wait(guard, [this] { return !pending; });
+}
+
+void ThreadPool::help_until(const std::function<bool()> &done) {
+	size_t home = (current_pool == this) ? current_queue : 0;
+
+	while (!done()) {
+		if (!queues.empty() && run_one(home)) continue;
+
+		std::unique_lock<std::mutex> guard(sleep_lock);
+		wake.wait(guard, [this, &done] { return queued || done(); });
+	}
+}
+
+void ThreadPool::parallel_for(size_t n, const std::function<void(size_t)> &fn) {
+	if (workers.empty() || n <= 1) {
+		for (size_t i = 0; i < n; i++) fn(i);
+		return;
+	}
+
+	/* Indices are handed out one at a time so uneven items still balance */
+	/* The caller is one of the runners, the rest are queued for idle workers to steal */
+	std::atomic<size_t> next(0);
+	size_t runners = (n < size()) ? n : size();
+	std::atomic<size_t> active(runners);
+
+	auto run = [this, &next, &active, n, &fn] {
+		for (size_t i = next++; i < n; i = next++) fn(i);
+		if (!--active) notify();
+	};
+
+	for (size_t r = 1; r < runners; r++) submit(run);
+	run();
+
+	help_until([&active] { return !active; });
+}
+
+unsigned ThreadPool::size() const {
+	return workers.empty() ? 1 : workers.size();
+}
+
+unsigned ThreadPool::default_size() {
+	unsigned n = std::thread::hardware_concurrency();
+	return n ? n : 1;
+}
@@ -0,0 +1,76 @@
+/*
+THREADPOOL.HPP
+NICK WILSON
+2019
+*/
+
+#ifndef OBJ_THREADPOOL
+#define OBJ_THREADPOOL
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* Work-stealing pool: every worker has its own queue and takes jobs from */
+/* the back of it, idle workers steal from the front of the others' queues */
+/* Jobs may submit further jobs or call parallel_for themselves */
+/* A pool of one thread runs everything inline on the caller */
+class ThreadPool{
+private:
+	struct Queue {
+		std::mutex lock;
+		std::deque<std::function<void()>> jobs;
+	};
+
+	std::vector<std::thread> workers;
+	std::vector<std::unique_ptr<Queue>> queues;
+
+	/* Sleeping workers and helping callers wait on this */
+	std::mutex sleep_lock;
+	std::condition_variable wake;
+	size_t queued = 0;
+	bool stopping = false;
+
+	/* Jobs submitted and not yet finished, for wait() */
+	std::mutex done_lock;
+	std::condition_variable all_done;
+	size_t pending = 0;
+
+	std::atomic<size_t> next_queue;
+
+	void worker(size_t index);
+	bool run_one(size_t home);
+	void notify();
+
+public:
+	explicit ThreadPool(unsigned threads);
+	ThreadPool(const ThreadPool &) = delete;
+	ThreadPool &operator=(const ThreadPool &) = delete;
+	~ThreadPool();
+
+	void submit(std::function<void()> job);
+
+	/* Block until every submitted job has finished */
+	/* Must not be called from inside a job, use help_until() there */
+	void wait();
+
+	/* Run queued jobs on the calling thread until done() holds */
+	void help_until(const std::function<bool()> &done);
+
+	/* Run fn(0) ... fn(n - 1) across the pool and wait for them */
+	/* The caller takes part, so this is safe to use from inside a job */
+	void parallel_for(size_t n, const std::function<void(size_t)> &fn);
+
+	unsigned size() const;
+
+	/* Hardware concurrency, never less than 1 */
+	static unsigned default_size();
+};
+
+#endif
@@ -0,0 +1,657 @@
+/*
+TREEHASH.CPP
+NICK WILSON
+2019
+*/
+
+#include "TreeHash.hpp"
+#include "Stats.hpp"
+
+#include <algorithm>
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TREEHASH_X86
+#include <immintrin.h>
+#endif
+
+/* See: O'Connor, Aumasson, Neves and Wilcox-O'Hearn, "BLAKE3: one function, fast everywhere" */
+static const size_t CHUNK_SIZE = 1024;
+static const size_t BLOCK_SIZE = 64;
+static const uint64_t CHUNKS_PER_SEGMENT = TreeHash::SEGMENT_SIZE / CHUNK_SIZE;
+
+static const uint8_t FLAG_CHUNK_START = 1;
+static const uint8_t FLAG_CHUNK_END = 2;
+static const uint8_t FLAG_PARENT = 4;
+static const uint8_t FLAG_ROOT = 8;
+
+static const uint32_t IV[8] = {0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19};
+
+static constexpr uint8_t PERMUTATION[16] = {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8};
+
+/* Message word each round takes at each position, the permutation applied round after round */
+struct MessageSchedule {
+	uint8_t table[7][16];
+
+	constexpr MessageSchedule() : table() {
+		for (int i = 0; i < 16; i++) table[0][i] = i;
+		for (int r = 1; r < 7; r++) {
+			for (int i = 0; i < 16; i++) table[r][i] = table[r - 1][PERMUTATION[i]];
+		}
+	}
+};
+
+static constexpr MessageSchedule SCHEDULE;
+
+/* Spot check against the BLAKE3 reference, evaluated by the compiler */
+static_assert(SCHEDULE.table[2][0] == 3 && SCHEDULE.table[6][15] == 13, "Message schedule generation is broken");
+
+static_assert(TreeHash::SEGMENT_SIZE % CHUNK_SIZE == 0 && !(CHUNKS_PER_SEGMENT & (CHUNKS_PER_SEGMENT - 1)), "Segments must be a power of two number of chunks");
+
+static inline uint32_t load32_le(const uint8_t *p) {
+	return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static inline uint32_t rotr(uint32_t x, int n) {
+	return (x >> n) | (x << (32 - n));
+}
+
+static inline void g(uint32_t *v, int a, int b, int c, int d, uint32_t x, uint32_t y) {
+	v[a] = v[a] + v[b] + x;
+	v[d] = rotr(v[d] ^ v[a], 16);
+	v[c] = v[c] + v[d];
+	v[b] = rotr(v[b] ^ v[c], 12);
+	v[a] = v[a] + v[b] + y;
+	v[d] = rotr(v[d] ^ v[a], 8);
+	v[c] = v[c] + v[d];
+	v[b] = rotr(v[b] ^ v[c], 7);
+}
+
+/* One compression, leaving the next chaining value in out (which may be cv) */
+static void compress(const uint32_t cv[8], const uint32_t m[16], uint32_t block_length, uint64_t counter, uint32_t flags, uint32_t out[8]) {
+	uint32_t v[16] = {
+		cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+		IV[0], IV[1], IV[2], IV[3], (uint32_t) counter, (uint32_t) (counter >> 32), block_length, flags
+	};
+
+	for (int r = 0; r < 7; r++) {
+		const uint8_t *s = SCHEDULE.table[r];
+
+		g(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+		g(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+		g(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+		g(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+		g(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+		g(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+		g(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+		g(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+	}
+
+	for (int i = 0; i < 8; i++) out[i] = v[i] ^ v[i + 8];
+}
+
+/* Chaining value of one chunk of up to CHUNK_SIZE bytes, with extra flags on its last block */
+static void chunk_cv(const uint8_t *data, size_t length, uint64_t counter, uint32_t extra, uint32_t out[8]) {
+	size_t blocks = length ? (length + BLOCK_SIZE - 1) / BLOCK_SIZE : 1;
+
+	memcpy(out, IV, sizeof(IV));
+
+	for (size_t b = 0; b < blocks; b++) {
+		uint8_t block[BLOCK_SIZE] = {};
+		size_t n = std::min(BLOCK_SIZE, length - b * BLOCK_SIZE);
+		uint32_t m[16];
+
+		memcpy(block, data + b * BLOCK_SIZE, n);
+		for (int i = 0; i < 16; i++) m[i] = load32_le(block + 4 * i);
+
+		uint32_t flags = (b ? 0 : FLAG_CHUNK_START) | ((b + 1 == blocks) ? FLAG_CHUNK_END | extra : 0);
+		compress(out, m, n, counter, flags, out);
+	}
+}
+
+/* Chaining value of two children, as a parent node */
+static void parent_cv(const uint32_t left[8], const uint32_t right[8], uint32_t flags, uint32_t out[8]) {
+	uint32_t m[16];
+
+	memcpy(m, left, 8 * sizeof(uint32_t));
+	memcpy(m + 8, right, 8 * sizeof(uint32_t));
+	compress(IV, m, BLOCK_SIZE, 0, FLAG_PARENT | flags, out);
+}
+
+/* Engines */
+/* count whole chunks from data, the first numbered counter */
+typedef void (*chunks_fn)(const uint8_t *data, size_t count, uint64_t counter, uint32_t (*out)[8]);
+
+/* count parents of the children pairs, out may be children */
+typedef void (*parents_fn)(const uint32_t (*children)[8], size_t count, uint32_t (*out)[8]);
+
+static void chunks_portable(const uint8_t *data, size_t count, uint64_t counter, uint32_t (*out)[8]) {
+	for (size_t i = 0; i < count; i++) chunk_cv(data + i * CHUNK_SIZE, CHUNK_SIZE, counter + i, 0, out[i]);
+}
+
+static void parents_portable(const uint32_t (*children)[8], size_t count, uint32_t (*out)[8]) {
+	for (size_t i = 0; i < count; i++) parent_cv(children[2 * i], children[2 * i + 1], 0, out[i]);
+}
+
+#if defined(TREEHASH_X86)
+
+/* Each vector holds the same word of eight inputs' states */
+#define TREEHASH_TARGET_AVX2 __attribute__((target("avx2")))
+
+TREEHASH_TARGET_AVX2
+static inline __m256i rotr_avx2(__m256i x, const int n) {
+	return _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n));
+}
+
+/* Rotations by whole bytes are a single shuffle */
+TREEHASH_TARGET_AVX2
+static inline __m256i rotr16_avx2(__m256i x) {
+	return _mm256_shuffle_epi8(x, _mm256_set_epi8(13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2, 13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2));
+}
+
+TREEHASH_TARGET_AVX2
+static inline __m256i rotr8_avx2(__m256i x) {
+	return _mm256_shuffle_epi8(x, _mm256_set_epi8(12, 15, 14, 13, 8, 11, 10, 9, 4, 7, 6, 5, 0, 3, 2, 1, 12, 15, 14, 13, 8, 11, 10, 9, 4, 7, 6, 5, 0, 3, 2, 1));
+}
+
+TREEHASH_TARGET_AVX2
+static inline void g_avx2(__m256i *v, int a, int b, int c, int d, __m256i x, __m256i y) {
+	v[a] = _mm256_add_epi32(_mm256_add_epi32(v[a], v[b]), x);
+	v[d] = rotr16_avx2(_mm256_xor_si256(v[d], v[a]));
+	v[c] = _mm256_add_epi32(v[c], v[d]);
+	v[b] = rotr_avx2(_mm256_xor_si256(v[b], v[c]), 12);
+	v[a] = _mm256_add_epi32(_mm256_add_epi32(v[a], v[b]), y);
+	v[d] = rotr8_avx2(_mm256_xor_si256(v[d], v[a]));
+	v[c] = _mm256_add_epi32(v[c], v[d]);
+	v[b] = rotr_avx2(_mm256_xor_si256(v[b], v[c]), 7);
+}
+
+/* Rows of eight words become columns */
+TREEHASH_TARGET_AVX2
+static inline void transpose_avx2(__m256i *v) {
+	__m256i ab_0145 = _mm256_unpacklo_epi32(v[0], v[1]);
+	__m256i ab_2367 = _mm256_unpackhi_epi32(v[0], v[1]);
+	__m256i cd_0145 = _mm256_unpacklo_epi32(v[2], v[3]);
+	__m256i cd_2367 = _mm256_unpackhi_epi32(v[2], v[3]);
+	__m256i ef_0145 = _mm256_unpacklo_epi32(v[4], v[5]);
+	__m256i ef_2367 = _mm256_unpackhi_epi32(v[4], v[5]);
+	__m256i gh_0145 = _mm256_unpacklo_epi32(v[6], v[7]);
+	__m256i gh_2367 = _mm256_unpackhi_epi32(v[6], v[7]);
+
+	__m256i abcd_04 = _mm256_unpacklo_epi64(ab_0145, cd_0145);
+	__m256i abcd_15 = _mm256_unpackhi_epi64(ab_0145, cd_0145);
+	__m256i abcd_26 = _mm256_unpacklo_epi64(ab_2367, cd_2367);
+	__m256i abcd_37 = _mm256_unpackhi_epi64(ab_2367, cd_2367);
+	__m256i efgh_04 = _mm256_unpacklo_epi64(ef_0145, gh_0145);
+	__m256i efgh_15 = _mm256_unpackhi_epi64(ef_0145, gh_0145);
+	__m256i efgh_26 = _mm256_unpacklo_epi64(ef_2367, gh_2367);
+	__m256i efgh_37 = _mm256_unpackhi_epi64(ef_2367, gh_2367);
+
+	v[0] = _mm256_permute2x128_si256(abcd_04, efgh_04, 0x20);
+	v[1] = _mm256_permute2x128_si256(abcd_15, efgh_15, 0x20);
+	v[2] = _mm256_permute2x128_si256(abcd_26, efgh_26, 0x20);
+	v[3] = _mm256_permute2x128_si256(abcd_37, efgh_37, 0x20);
+	v[4] = _mm256_permute2x128_si256(abcd_04, efgh_04, 0x31);
+	v[5] = _mm256_permute2x128_si256(abcd_15, efgh_15, 0x31);
+	v[6] = _mm256_permute2x128_si256(abcd_26, efgh_26, 0x31);
+	v[7] = _mm256_permute2x128_si256(abcd_37, efgh_37, 0x31);
+}
+
+/* Eight inputs of blocks whole blocks each. Chunks are numbered from counter, parents all 0 */
+/* start and end are the flags for the first and last block, on top of flags */
+TREEHASH_TARGET_AVX2
+static void hash8_avx2(const uint8_t *const *inputs, size_t blocks, uint64_t counter, bool chunks, uint32_t flags, uint32_t start, uint32_t end, uint32_t (*out)[8]) {
+	__m256i h[8];
+	uint32_t low[8], high[8];
+
+	for (int i = 0; i < 8; i++) {
+		uint64_t number = chunks ? counter + i : 0;
+
+		h[i] = _mm256_set1_epi32(IV[i]);
+		low[i] = (uint32_t) number;
+		high[i] = (uint32_t) (number >> 32);
+	}
+
+	__m256i counter_low = _mm256_loadu_si256((const __m256i *) low);
+	__m256i counter_high = _mm256_loadu_si256((const __m256i *) high);
+
+	for (size_t b = 0; b < blocks; b++) {
+		__m256i m[16];
+
+		for (int j = 0; j < 8; j++) {
+			m[j] = _mm256_loadu_si256((const __m256i *) (inputs[j] + b * BLOCK_SIZE));
+			m[j + 8] = _mm256_loadu_si256((const __m256i *) (inputs[j] + b * BLOCK_SIZE + 32));
+		}
+
+		transpose_avx2(m);
+		transpose_avx2(m + 8);
+
+		uint32_t block_flags = flags | (b ? 0 : start) | ((b + 1 == blocks) ? end : 0);
+		__m256i v[16] = {
+			h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7],
+			_mm256_set1_epi32(IV[0]), _mm256_set1_epi32(IV[1]), _mm256_set1_epi32(IV[2]), _mm256_set1_epi32(IV[3]),
+			counter_low, counter_high, _mm256_set1_epi32(BLOCK_SIZE), _mm256_set1_epi32(block_flags)
+		};
+
+		for (int r = 0; r < 7; r++) {
+			const uint8_t *s = SCHEDULE.table[r];
+
+			g_avx2(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+			g_avx2(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+			g_avx2(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+			g_avx2(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+			g_avx2(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+			g_avx2(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+			g_avx2(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+			g_avx2(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+		}
+
+		for (int i = 0; i < 8; i++) h[i] = _mm256_xor_si256(v[i], v[i + 8]);
+	}
+
+	/* Back to one chaining value per input */
+	transpose_avx2(h);
+	for (int j = 0; j < 8; j++) _mm256_storeu_si256((__m256i *) out[j], h[j]);
+}
+
+static void chunks_avx2(const uint8_t *data, size_t count, uint64_t counter, uint32_t (*out)[8]) {
+	size_t i = 0;
+
+	for (; i + 8 <= count; i += 8) {
+		const uint8_t *inputs[8];
+		for (int j = 0; j < 8; j++) inputs[j] = data + (i + j) * CHUNK_SIZE;
+
+		hash8_avx2(inputs, CHUNK_SIZE / BLOCK_SIZE, counter + i, true, 0, FLAG_CHUNK_START, FLAG_CHUNK_END, out + i);
+	}
+
+	chunks_portable(data + i * CHUNK_SIZE, count - i, counter + i, out + i);
+}
+
+/* Children are read before their parents are stored, so out can be children */
+static void parents_avx2(const uint32_t (*children)[8], size_t count, uint32_t (*out)[8]) {
+	size_t i = 0;
+
+	for (; i + 8 <= count; i += 8) {
+		const uint8_t *inputs[8];
+		for (int j = 0; j < 8; j++) inputs[j] = reinterpret_cast<const uint8_t *>(children[2 * (i + j)]);
+
+		hash8_avx2(inputs, 1, 0, false, FLAG_PARENT, 0, 0, out + i);
+	}
+
+	parents_portable(children + 2 * i, count - i, out + i);
+}
+
+static bool avx2_supported() {
+	return __builtin_cpu_supports("avx2");
+}
+
+#else
+
+static void chunks_avx2(const uint8_t *data, size_t count, uint64_t counter, uint32_t (*out)[8]) {
+	chunks_portable(data, count, counter, out);
+}
+
+static void parents_avx2(const uint32_t (*children)[8], size_t count, uint32_t (*out)[8]) {
+	parents_portable(children, count, out);
+}
+
+static bool avx2_supported() {
+	return false;
+}
+
+#endif
+
+static const chunks_fn CHUNK_ENGINES[TreeHash::ENGINE_COUNT] = {chunks_portable, chunks_avx2};
+static const parents_fn PARENT_ENGINES[TreeHash::ENGINE_COUNT] = {parents_portable, parents_avx2};
+
+static TreeHash::Engine detect_engine() {
+	if (avx2_supported()) return TreeHash::ENGINE_AVX2;
+	return TreeHash::ENGINE_PORTABLE;
+}
+
+/* Public */
+bool TreeHash::Digest::operator==(const Digest &other) const {
+	return !memcmp(bytes, other.bytes, DIGEST_SIZE);
+}
+
+TreeHash::TreeHash() : first(SEGMENT_SIZE) {}
+
+void TreeHash::update(uint64_t offset, const uint8_t *data, size_t length) {
+	Stats::Scope timing(Stats::PHASE_DIGEST, length);
+
+	if (offset < SEGMENT_SIZE && length) {
+		uint64_t n = std::min((uint64_t) length, SEGMENT_SIZE - offset);
+		memcpy(first.data() + offset, data, n);
+
+		{
+			std::lock_guard<std::mutex> hold(lock);
+			first_covered += n;
+		}
+
+		offset += n;
+		data += n;
+		length -= n;
+	}
+
+	while (length) {
+		uint64_t segment = offset / SEGMENT_SIZE;
+		uint64_t within = offset - segment * SEGMENT_SIZE;
+		uint64_t n = std::min((uint64_t) length, SEGMENT_SIZE - within);
+
+		if (n == SEGMENT_SIZE) store(segment, subtree(data, SEGMENT_SIZE, segment * CHUNKS_PER_SEGMENT));
+		else add_part(segment, within, data, n);
+
+		offset += n;
+		data += n;
+		length -= n;
+	}
+}
+
+bool TreeHash::finish(uint64_t length, Digest &digest) {
+	std::lock_guard<std::mutex> hold(lock);
+	Cv top;
+
+	if (length <= SEGMENT_SIZE) {
+		if (first_covered != length || !segments.empty() || !partial.empty()) return false;
+		top = root(first.data(), length);
+	}
+	else {
+		uint64_t count = (length - 1) / SEGMENT_SIZE + 1;
+		if (first_covered != SEGMENT_SIZE || segments.size() > count) return false;
+
+		segments.resize(count);
+		finished.resize(count);
+		segments[0] = subtree(first.data(), SEGMENT_SIZE, 0);
+		finished[0] = true;
+
+		/* Only the last segment can be short, the rest must have been finished by update() */
+		for (auto &entry : partial) {
+			uint64_t segment = entry.first;
+			if (segment >= count || finished[segment]) return false;
+
+			uint64_t size = std::min(SEGMENT_SIZE, length - segment * SEGMENT_SIZE);
+			if (entry.second.covered != size || !assemble(segment, entry.second, size, segments[segment])) return false;
+			finished[segment] = true;
+		}
+		partial.clear();
+
+		if (std::find(finished.begin(), finished.end(), 0) != finished.end()) return false;
+
+		top = merge(segments.data(), count, true);
+	}
+
+	for (int i = 0; i < 8; i++) {
+		for (int k = 0; k < 4; k++) digest.bytes[4 * i + k] = top.words[i] >> (8 * k);
+	}
+
+	return true;
+}
+
+TreeHash::Digest TreeHash::hash(const uint8_t *data, size_t length) {
+	TreeHash tree;
+	Digest digest;
+
+	tree.update(0, data, length);
+	tree.finish(length, digest);
+	return digest;
+}
+
+std::string TreeHash::hex(const Digest &digest) {
+	static const char DIGITS[] = "0123456789abcdef";
+	std::string out;
+
+	for (uint8_t byte : digest.bytes) {
+		out += DIGITS[byte >> 4];
+		out += DIGITS[byte & 0xf];
+	}
+
+	return out;
+}
+
+const char *TreeHash::name(Type type) {
+	switch (type) {
+		case DIGEST_BLAKE3:
+			return "blake3";
+		default:
+			return "none";
+	}
+}
+
+TreeHash::Engine TreeHash::active() {
+	static const Engine engine = detect_engine();
+	return engine;
+}
+
+bool TreeHash::available(Engine engine) {
+	if (engine == ENGINE_AVX2) return avx2_supported();
+	return engine < ENGINE_COUNT;
+}
+
+const char *TreeHash::engine_name(Engine engine) {
+	switch (engine) {
+		case ENGINE_PORTABLE:
+			return "portable";
+		case ENGINE_AVX2:
+			return "avx2";
+		default:
+			return "unknown";
+	}
+}
+
+bool TreeHash::self_test() {
+	/* From the BLAKE3 test vectors, whose input is the byte pattern 0, 1, ... 250, 0, 1, ... */
+	static const struct {
+		size_t length;
+		const char *digest;
+	} VECTORS[] = {
+		{0, "af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262"},
+		{1, "2d3adedff11b61f14c886e35afa036736dcd87a74d27b5c1510225d0f592e213"},
+		{1023, "10108970eeda3eb932baac1428c7a2163b0e924c9a9e25b35bba72b28f70bd11"},
+		{1024, "42214739f095a406f3fc83deb889744ac00df831c10daa55189b5d121c855af7"},
+		{1025, "d00278ae47eb27b34faecf67b4fe263f82d5412916c1ffd97c8cb7fb814b8444"},
+		{2049, "5f4d72f40d7a5f82b15ca2b2e44b1de3c2ef86c426c95c1af0b6879522563030"},
+		{8193, "bab6c09cb8ce8cf459261398d2e7aef35700bf488116ceb94a36d0f5f1b7bc3b"},
+		{102400, "bc3e3d41a1146b069abffad3c0d44860cf664390afce4d9661f7902e7943e085"}
+	};
+
+	/* The same pattern over three and a bit segments, as b3sum gives it */
+	static const uint64_t TREE_LENGTH = 3 * SEGMENT_SIZE + 1000;
+	static const char *TREE_DIGEST = "e6a0e027cc785a2f599feebf8806b7b195b438865fdb71aff03eae81e40a911e";
+
+	std::vector<uint8_t> data(TREE_LENGTH);
+	for (size_t i = 0; i < data.size(); i++) data[i] = i % 251;
+
+	for (const auto &vector : VECTORS) {
+		if (hex(hash(data.data(), vector.length)) != vector.digest) return false;
+	}
+
+	/* Pieces that split segments and chunks, added last first */
+	TreeHash tree;
+	Digest digest;
+	const uint64_t PIECE = 700001;
+
+	for (uint64_t end = TREE_LENGTH; end; ) {
+		uint64_t start = (end - 1) / PIECE * PIECE;
+		tree.update(start, data.data() + start, end - start);
+		end = start;
+	}
+
+	if (!tree.finish(TREE_LENGTH, digest) || hex(digest) != TREE_DIGEST) return false;
+
+	/* Every other engine must agree with the portable one */
+	const size_t COUNT = 19;
+	uint32_t expected[COUNT][8], actual[COUNT][8];
+	chunks_portable(data.data(), COUNT, 0xFFFFFFFC, expected);
+
+	for (int e = 0; e < ENGINE_COUNT; e++) {
+		if (!available((Engine) e)) continue;
+
+		CHUNK_ENGINES[e](data.data(), COUNT, 0xFFFFFFFC, actual);
+		if (memcmp(expected, actual, sizeof(expected))) return false;
+
+		/* And on the parents of those, run in place as merge() does */
+		uint32_t parents[COUNT][8];
+		memcpy(parents, expected, sizeof(expected));
+		parents_portable(expected, COUNT / 2, parents);
+		PARENT_ENGINES[e](actual, COUNT / 2, actual);
+		if (memcmp(parents, actual, COUNT / 2 * sizeof(parents[0]))) return false;
+	}
+
+	return true;
+}
+
+/* Private */
+void TreeHash::store(uint64_t segment, const Cv &cv) {
+	std::lock_guard<std::mutex> hold(lock);
+
+	if (segments.size() <= segment) {
+		segments.resize(segment + 1);
+		finished.resize(segment + 1);
+	}
+
+	segments[segment] = cv;
+	finished[segment] = true;
+}
+
+void TreeHash::add_part(uint64_t segment, uint64_t within, const uint8_t *data, size_t length) {
+	/* Whole chunks are hashed here, the bytes either side are kept until their neighbours come */
+	uint64_t end = within + length;
+	uint64_t first_chunk = (within + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	uint64_t last_chunk = end / CHUNK_SIZE;
+
+	Partial piece;
+	std::vector<Cv> cvs;
+
+	if (first_chunk < last_chunk) {
+		cvs.resize(last_chunk - first_chunk);
+		CHUNK_ENGINES[active()](data + (first_chunk * CHUNK_SIZE - within), cvs.size(), segment * CHUNKS_PER_SEGMENT + first_chunk, reinterpret_cast<uint32_t (*)[8]>(cvs.data()));
+
+		if (within < first_chunk * CHUNK_SIZE) piece.fragments.push_back({within, std::vector<uint8_t>(data, data + (first_chunk * CHUNK_SIZE - within))});
+		if (last_chunk * CHUNK_SIZE < end) piece.fragments.push_back({last_chunk * CHUNK_SIZE, std::vector<uint8_t>(data + (last_chunk * CHUNK_SIZE - within), data + length)});
+	}
+	else {
+		piece.fragments.push_back({within, std::vector<uint8_t>(data, data + length)});
+	}
+
+	Partial done;
+	bool complete;
+
+	{
+		std::lock_guard<std::mutex> hold(lock);
+		Partial &part = partial[segment];
+
+		if (part.chunks.empty()) {
+			part.chunks.resize(CHUNKS_PER_SEGMENT);
+			part.known.resize(CHUNKS_PER_SEGMENT);
+		}
+
+		for (size_t i = 0; i < cvs.size(); i++) {
+			part.chunks[first_chunk + i] = cvs[i];
+			part.known[first_chunk + i] = true;
+		}
+
+		for (Partial::Fragment &fragment : piece.fragments) part.fragments.push_back(std::move(fragment));
+		part.covered += length;
+
+		/* A full segment can't be the last, short one, so it can be finished now */
+		complete = part.covered == SEGMENT_SIZE;
+		if (complete) {
+			done = std::move(part);
+			partial.erase(segment);
+		}
+	}
+
+	Cv cv;
+	if (complete && assemble(segment, done, SEGMENT_SIZE, cv)) store(segment, cv);
+}
+
+bool TreeHash::assemble(uint64_t segment, Partial &part, uint64_t size, Cv &cv) {
+	uint64_t count = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+
+	for (uint64_t c = 0; c < count; c++) {
+		if (part.known[c]) continue;
+
+		uint8_t chunk[CHUNK_SIZE];
+		uint64_t start = c * CHUNK_SIZE;
+		uint64_t length = std::min((uint64_t) CHUNK_SIZE, size - start);
+		uint64_t got = 0;
+
+		for (const Partial::Fragment &fragment : part.fragments) {
+			uint64_t low = std::max(start, fragment.offset);
+			uint64_t high = std::min(start + length, fragment.offset + fragment.data.size());
+			if (low >= high) continue;
+
+			memcpy(chunk + (low - start), fragment.data.data() + (low - fragment.offset), high - low);
+			got += high - low;
+		}
+
+		if (got != length) return false;
+
+		chunk_cv(chunk, length, segment * CHUNKS_PER_SEGMENT + c, 0, part.chunks[c].words);
+	}
+
+	/* Chunks past the end were never added */
+	if (std::find(part.known.begin() + count, part.known.end(), 1) != part.known.end()) return false;
+
+	cv = merge(part.chunks.data(), count, false);
+	return true;
+}
+
+TreeHash::Cv TreeHash::subtree(const uint8_t *data, uint64_t size, uint64_t counter) {
+	static thread_local std::vector<Cv> cvs;
+	uint64_t whole = size / CHUNK_SIZE;
+	uint64_t count = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+
+	cvs.resize(count);
+	CHUNK_ENGINES[active()](data, whole, counter, reinterpret_cast<uint32_t (*)[8]>(cvs.data()));
+	if (whole < count) chunk_cv(data + whole * CHUNK_SIZE, size - whole * CHUNK_SIZE, counter + whole, 0, cvs[whole].words);
+
+	return merge(cvs.data(), count, false);
+}
+
+TreeHash::Cv TreeHash::merge(const Cv *cvs, size_t count, bool root) {
+	static thread_local std::vector<Cv> level;
+	Cv parent;
+
+	if (count == 1) return cvs[0];
+
+	/* The left subtree is the largest power of two chunks that leaves some for the right */
+	size_t left = 1;
+	while (left * 2 < count) left *= 2;
+
+	/* A full tree is joined a level at a time, many parents at once, up to the last two */
+	if (left * 2 == count) {
+		level.assign(cvs, cvs + count);
+
+		for (; count > 2; count /= 2) {
+			uint32_t (*words)[8] = reinterpret_cast<uint32_t (*)[8]>(level.data());
+			PARENT_ENGINES[active()](words, count / 2, words);
+		}
+
+		parent_cv(level[0].words, level[1].words, root ? FLAG_ROOT : 0, parent.words);
+		return parent;
+	}
+
+	Cv children[2] = {merge(cvs, left, false), merge(cvs + left, count - left, false)};
+
+	parent_cv(children[0].words, children[1].words, root ? FLAG_ROOT : 0, parent.words);
+	return parent;
+}
+
+TreeHash::Cv TreeHash::root(const uint8_t *data, size_t length) {
+	Cv cv;
+
+	if (length <= CHUNK_SIZE) {
+		chunk_cv(data, length, 0, FLAG_ROOT, cv.words);
+		return cv;
+	}
+
+	std::vector<Cv> cvs((length + CHUNK_SIZE - 1) / CHUNK_SIZE);
+	size_t whole = length / CHUNK_SIZE;
+
+	CHUNK_ENGINES[active()](data, whole, 0, reinterpret_cast<uint32_t (*)[8]>(cvs.data()));
+	if (whole < cvs.size()) chunk_cv(data + whole * CHUNK_SIZE, length - whole * CHUNK_SIZE, whole, 0, cvs[whole].words);
+
+	return merge(cvs.data(), cvs.size(), true);
+}
@@ -0,0 +1,115 @@
+/*
+TREEHASH.HPP
+NICK WILSON
+2019
+*/
+
+#ifndef OBJ_TREEHASH
+#define OBJ_TREEHASH
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* BLAKE3 digest of a whole payload, the same one b3sum gives for the file */
+/* BLAKE3 hashes 1 KiB chunks independently and joins them in a binary tree, so each */
+/* segment of SEGMENT_SIZE bytes is hashed as soon as it has all been added, on whichever */
+/* thread added it. Pieces can come from any thread in any order, but each byte only once */
+class TreeHash{
+public:
+	enum Type {
+		DIGEST_NONE = 0,
+		DIGEST_BLAKE3,	/* BLAKE3, 256 bit output, no key */
+		DIGEST_COUNT
+	};
+
+	enum Engine {
+		ENGINE_PORTABLE = 0,	/* One chunk at a time */
+		ENGINE_AVX2,			/* Eight chunks at a time across AVX2 lanes */
+		ENGINE_COUNT
+	};
+
+	static const size_t DIGEST_SIZE = 32;
+
+	/* A power of two number of chunks, and CHUNK_SIZE_DATA_MAX holds a whole number of them */
+	static const uint64_t SEGMENT_SIZE = 0x100000;
+
+	struct Digest {
+		uint8_t bytes[DIGEST_SIZE] = {};
+
+		bool operator==(const Digest &other) const;
+		bool operator!=(const Digest &other) const { return !(*this == other); }
+	};
+
+	TreeHash();
+
+	/* Add length bytes found offset bytes into the payload */
+	void update(uint64_t offset, const uint8_t *data, size_t length);
+
+	/* Digest of the first length bytes, false if any of them were never added */
+	bool finish(uint64_t length, Digest &digest);
+
+	/* All at once, on this thread */
+	static Digest hash(const uint8_t *data, size_t length);
+
+	static std::string hex(const Digest &digest);
+	static const char *name(Type type);
+
+	static bool available(Engine engine);
+	static Engine active();
+	static const char *engine_name(Engine engine);
+
+	/* Check the active engine against the BLAKE3 test vectors, and the others against it */
+	static bool self_test();
+
+private:
+	/* Chaining value, the output of a chunk or a subtree */
+	struct Cv {
+		uint32_t words[8];
+	};
+
+	/* What has been added of a segment that hasn't come in one piece */
+	struct Partial {
+		struct Fragment {
+			uint64_t offset;	/* Within the segment */
+			std::vector<uint8_t> data;
+		};
+
+		uint64_t covered = 0;
+		std::vector<Cv> chunks;			/* Chaining value of each chunk added whole */
+		std::vector<uint8_t> known;		/* Whether chunks has it */
+		std::vector<Fragment> fragments;	/* Pieces of the rest */
+	};
+
+	std::mutex lock;
+
+	/* The first segment is the whole tree if nothing follows it, which only finish() can tell */
+	/* so it is kept as it is */
+	std::vector<uint8_t> first;
+	uint64_t first_covered = 0;
+
+	std::vector<Cv> segments;
+	std::vector<uint8_t> finished;
+	std::map<uint64_t, Partial> partial;
+
+	void store(uint64_t segment, const Cv &cv);
+	void add_part(uint64_t segment, uint64_t within, const uint8_t *data, size_t length);
+
+	/* Chaining value of a segment of size bytes, false if some of it is missing */
+	static bool assemble(uint64_t segment, Partial &part, uint64_t size, Cv &cv);
+
+	/* Chaining value of size bytes of chunks, starting with chunk counter */
+	static Cv subtree(const uint8_t *data, uint64_t size, uint64_t counter);
+
+	/* Join count chaining values in BLAKE3's tree, left subtrees full */
+	static Cv merge(const Cv *cvs, size_t count, bool root);
+
+	/* The whole tree of a payload no longer than one segment */
+	static Cv root(const uint8_t *data, size_t length);
+};
+
+#endif
@@ -0,0 +1,628 @@
+/*
+BENCH.CPP
+NICK WILSON
+2019
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "AsyncIo.hpp"
+#include "Chunk.hpp"
+#include "ChunkWalker.hpp"
+#include "Crc32.hpp"
+#include "FileCopy.hpp"
+#include "FileIndex.hpp"
+#include "MappedPng.hpp"
+#include "PngPack.hpp"
+#include "PngPackReader.hpp"
+#include "PngPackWriter.hpp"
+#include "Probe.hpp"
+#include "ThreadPool.hpp"
+
+/* Benchmarks for the library, printed as one JSON document on stdout */
+/* Every file is generated in a scratch directory and removed afterwards. Files are */
+/* read back while still in the page cache, so these measure the code, not the disk */
+
+/* Bumped whenever a field is added or changes meaning, so old reports can still be compared */
+const int REPORT_VERSION = 1;
+
+/* Buffer sizes for CRC throughput, small ones are run many times over */
+const uint64_t CRC_SIZES[] = {16, 64, 256, 0x400, 0x1000, 0x10000, 0x100000, CHUNK_SIZE_DATA_MAX};
+const uint64_t CRC_BYTES_MIN = 0x4000000;
+
+/* Synthetic carriers for parsing: how many IDAT chunks, and the data length of each */
+struct CarrierShape {
+	uint64_t chunks;
+	uint32_t length;
+};
+
+const CarrierShape CARRIER_SHAPES[] = {{4, 0x800000}, {1000, 0x8000}, {100000, 64}, {1000000, 0}};
+
+/* Payload sizes for insertion and extraction, up to the -m limit */
+const uint64_t PAYLOAD_SIZES[] = {0x400, 0x10000, 0x100000, 0x1000000, 0x10000000, 0x40000000, 0x100000000, 0x400000000};
+
+/* File chunk sizes to compare against CHUNK_SIZE_DATA_MAX, each packing the same payload */
+const uint32_t CHUNK_SIZES[] = {0x10000, 0x40000, 0x100000, 0x400000, CHUNK_SIZE_DATA_MAX, 0x1000000, 0x4000000};
+const uint64_t CHUNK_SIZE_PAYLOAD = 0x10000000;
+
+/* Chunk size runs hold at most this much data at once */
+const uint64_t CHUNK_SIZE_BATCH_MAX = 0x10000000;
+
+/* Each measurement is run this many times and the fastest kept */
+unsigned repeats = 3;
+
+/* Largest payload for insertion and extraction */
+uint64_t max_payload = 0x40000000;
+
+/* Worker threads, 0 picks the hardware concurrency */
+unsigned thread_count = 0;
+
+/* Scratch directories go in here */
+std::string scratch_parent = "/tmp";
+
+/* Stops CRC loops from being optimised away */
+volatile uint32_t crc_sink = 0;
+
+using namespace std;
+
+/* Work to time, false with error set on failure */
+typedef function<bool(string &error)> Work;
+
+void print_usage() {
+	cout << "Usage:" << endl;
+	cout << "\t./png_bench [-j N] [-r N] [-m MiB] [-t DIR]" << endl;
+	cout << "Flags:" << endl;
+	cout << "\th: Show [H]elp" << endl;
+	cout << "\tj: Number of worker threads [default: all cores]" << endl;
+	cout << "\tr: [R]epeat each measurement N times, keeping the fastest [default: 3]" << endl;
+	cout << "\tm: [M]aximum payload size for insertion and extraction, in MiB [default: 1024]" << endl;
+	cout << "\tt: Directory for [T]emporary files [default: /tmp]" << endl;
+	cout << "Results are printed to stdout as JSON, progress to stderr" << endl;
+}
+
+/* Fastest of repeats runs of work, in seconds */
+bool time_best(const Work &work, double &seconds, string &error) {
+	seconds = 0;
+
+	for (unsigned r = 0; r < repeats; r++) {
+		auto start = chrono::steady_clock::now();
+		if (!work(error)) return false;
+		double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+		if (!r || elapsed < seconds) seconds = elapsed;
+	}
+
+	return true;
+}
+
+/* Throughput in decimal megabytes per second */
+string rate(uint64_t bytes, double seconds) {
+	ostringstream out;
+	out << fixed << setprecision(1) << (seconds > 0 ? bytes / seconds / 1e6 : 0.0);
+	return out.str();
+}
+
+string duration(double seconds) {
+	ostringstream out;
+	out << fixed << setprecision(6) << seconds;
+	return out.str();
+}
+
+/* Largest payload size within the -m limit, which is the size of the payload file */
+uint64_t largest_payload() {
+	uint64_t largest = PAYLOAD_SIZES[0];
+
+	for (uint64_t size : PAYLOAD_SIZES) {
+		if (size <= max_payload) largest = size;
+	}
+
+	return largest;
+}
+
+/* Pseudo-random bytes, so compression and caching can't flatter the results */
+void fill_random(uint8_t *data, size_t length, uint64_t &state) {
+	for (size_t i = 0; i < length; i += sizeof(uint64_t)) {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+
+		size_t n = min(sizeof(uint64_t), length - i);
+		memcpy(data + i, &state, n);
+	}
+}
+
+/* A valid 1x1 RGB PNG with the given number of IDAT chunks of length bytes each */
+/* Only the headers are ever checked, so the image data need not decode */
+bool write_carrier(const string &filename, uint64_t chunks, uint32_t length, string &error) {
+	int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		error = "Could not open \"" + filename + "\" for writing!";
+		return false;
+	}
+
+	vector<uint8_t> ihdr_data = {0, 0, 0, 1, 0, 0, 0, 1, 8, 2, 0, 0, 0};
+	vector<uint8_t> idat_data(length);
+	uint64_t state = 0x9E3779B97F4A7C15ULL;
+	fill_random(idat_data.data(), length, state);
+
+	Chunk ihdr(ihdr_data.size(), as_type("IHDR"), ihdr_data);
+	Chunk idat(length, as_type("IDAT"), move(idat_data));
+	Chunk iend(0, as_type("IEND"), vector<uint8_t>());
+
+	bool ok = write_all(fd, PNG_SIGNATURE, sizeof(PNG_SIGNATURE)) && ihdr.write(fd);
+	for (uint64_t i = 0; ok && i < chunks; i++) ok = idat.write(fd);
+	ok = ok && iend.write(fd);
+
+	if (::close(fd) || !ok) {
+		error = "Could not write \"" + filename + "\"";
+		return false;
+	}
+
+	return true;
+}
+
+/* A payload file of length pseudo-random bytes */
+bool write_payload(const string &filename, uint64_t length, string &error) {
+	int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		error = "Could not open \"" + filename + "\" for writing!";
+		return false;
+	}
+
+	vector<uint8_t> block(CHUNK_SIZE_DATA_MAX);
+	uint64_t state = 0x2545F4914F6CDD1DULL;
+	bool ok = true;
+
+	for (uint64_t done = 0; ok && done < length; done += block.size()) {
+		size_t n = min<uint64_t>(block.size(), length - done);
+		fill_random(block.data(), n, state);
+		ok = write_all(fd, block.data(), n);
+	}
+
+	if (::close(fd) || !ok) {
+		error = "Could not write \"" + filename + "\"";
+		return false;
+	}
+
+	return true;
+}
+
+/* CRC throughput of every available engine, and of Chunk::force_crc_update() */
+/* which also covers the type field and runs the active engine */
+bool bench_crc(ostream &report, string &error) {
+	vector<uint8_t> data(CRC_SIZES[sizeof(CRC_SIZES) / sizeof(CRC_SIZES[0]) - 1]);
+	uint64_t state = 1;
+	fill_random(data.data(), data.size(), state);
+
+	bool first = true;
+	report << "\"crc\":[";
+
+	for (uint64_t size : CRC_SIZES) {
+		uint64_t rounds = max<uint64_t>(1, CRC_BYTES_MIN / size);
+		double seconds;
+
+		for (int e = 0; e < Crc32::ENGINE_COUNT; e++) {
+			Crc32::Engine engine = (Crc32::Engine) e;
+			if (!Crc32::available(engine)) continue;
+
+			/* The reference engine is slow enough that fewer rounds still time well */
+			uint64_t n = (engine == Crc32::ENGINE_TABLE) ? max<uint64_t>(1, rounds / 16) : rounds;
+
+			if (!time_best([&](string &error) {
+				uint32_t crc = 0;
+				for (uint64_t i = 0; i < n; i++) crc = Crc32::update_with(engine, crc, data.data(), size);
+				crc_sink = crc;
+				return true;
+			}, seconds, error)) return false;
+
+			report << (first ? "" : ",") << "{\"function\":\"Crc32::update_with\",\"engine\":\"" << Crc32::engine_name(engine) << "\"";
+			report << ",\"bytes\":" << size << ",\"seconds\":" << duration(seconds / n) << ",\"mb_per_s\":" << rate(size * n, seconds) << "}";
+			first = false;
+		}
+
+		Chunk chunk(size, as_type(CHUNK_TYPE_FILE), vector<uint8_t>(data.begin(), data.begin() + size), 0);
+
+		if (!time_best([&](string &error) {
+			for (uint64_t i = 0; i < rounds; i++) chunk.force_crc_update();
+			crc_sink = chunk.crc;
+			return true;
+		}, seconds, error)) return false;
+
+		report << ",{\"function\":\"Chunk::force_crc_update\",\"engine\":\"" << Crc32::engine_name(Crc32::active()) << "\"";
+		report << ",\"bytes\":" << size << ",\"seconds\":" << duration(seconds / rounds) << ",\"mb_per_s\":" << rate(size * rounds, seconds) << "}";
+	}
+
+	report << "]";
+	return true;
+}
+
+/* Chunk parsing of carriers with few large chunks through to many empty ones */
+bool bench_parse(const string &dir, ThreadPool &pool, ostream &report, vector<string> &files, string &error) {
+	bool first = true;
+	report << "\"parse\":[";
+
+	for (const CarrierShape &shape : CARRIER_SHAPES) {
+		string filename = dir + "/carrier_" + to_string(shape.chunks) + "x" + to_string(shape.length) + ".png";
+		files.push_back(filename);
+
+		if (!write_carrier(filename, shape.chunks, shape.length, error)) return false;
+
+		/* IHDR and IEND as well */
+		uint64_t chunks = shape.chunks + 2;
+		uint64_t file_size = 0;
+
+		struct Parser {
+			const char *name;
+			Work work;
+		};
+
+		vector<Parser> parsers = {
+			{"ChunkWalker", [&](string &error) {
+				ChunkWalker walker;
+				ChunkHeader header;
+				uint64_t n = 0;
+
+				if (!walker.open(filename) || !walker.check_signature()) {
+					error = "Could not read \"" + filename + "\"";
+					return false;
+				}
+				while (walker.next(header)) n++;
+
+				file_size = walker.size();
+				return n == chunks;
+			}},
+			{"MappedPng", [&](string &error) {
+				MappedPng png;
+
+				if (!png.open(filename) || !png.parse()) {
+					error = "Could not read \"" + filename + "\"";
+					return false;
+				}
+
+				return png.chunks.size() == chunks;
+			}},
+			{"PngPackReader::enumerate", [&](string &error) {
+				PngPackReader reader;
+				vector<ChunkHeader> headers;
+
+				if (!reader.open(filename, error) || !reader.enumerate(headers, error)) return false;
+				return headers.size() == chunks;
+			}},
+			{"probe_png", [&](string &error) {
+				ProbeResult result;
+				return probe_png(filename, PROBE_VERIFY_NONE, pool, result, error);
+			}},
+			{"probe_png (verify all)", [&](string &error) {
+				ProbeResult result;
+				return probe_png(filename, PROBE_VERIFY_ALL, pool, result, error);
+			}}
+		};
+
+		for (const Parser &parser : parsers) {
+			double seconds;
+
+			if (!time_best(parser.work, seconds, error)) {
+				if (error.empty()) error = string(parser.name) + " found the wrong number of chunks in \"" + filename + "\"";
+				return false;
+			}
+
+			report << (first ? "" : ",") << "{\"parser\":\"" << parser.name << "\",\"chunks\":" << chunks << ",\"chunk_bytes\":" << shape.length;
+			report << ",\"file_bytes\":" << file_size << ",\"seconds\":" << duration(seconds);
+			report << ",\"chunks_per_s\":" << (uint64_t) (seconds > 0 ? chunks / seconds : 0) << "}";
+			first = false;
+		}
+
+		::remove(filename.c_str());
+	}
+
+	report << "]";
+	return true;
+}
+
+/* Insertion and extraction through the descriptor paths, as the CLI runs them */
+/* Every size reads the front of one payload file */
+bool bench_payloads(const string &dir, ThreadPool &pool, ostream &report, vector<string> &files, string &error) {
+	string carrier = dir + "/carrier.png";
+	string payload = dir + "/payload.bin";
+	string packed = dir + "/packed.png";
+	string extracted = dir + "/extracted.bin";
+	files.insert(files.end(), {carrier, payload, packed, extracted});
+
+	AsyncIo::Backend backend = AsyncIo::preferred();
+	uint64_t largest = largest_payload();
+
+	if (!write_carrier(carrier, 1, 0x400, error) || !write_payload(payload, largest, error)) return false;
+
+	int payload_fd = open(payload.c_str(), O_RDONLY);
+	if (payload_fd < 0) {
+		error = "Could not read \"" + payload + "\"";
+		return false;
+	}
+
+	ostringstream insert, extract;
+	bool ok = true;
+
+	for (uint64_t size : PAYLOAD_SIZES) {
+		if (size > largest) break;
+
+		cerr << "Payload of " << size << " bytes..." << endl;
+
+		PngPackWriter writer(pool);
+		writer.io_backend = backend;
+
+		FileIndex index;
+		index.size = size;
+		index.filename = "payload.bin";
+
+		double insert_seconds, extract_seconds;
+
+		ok = time_best([&](string &error) {
+			ChunkWalker walker;
+			if (!walker.open(carrier)) {
+				error = "Could not read \"" + carrier + "\"";
+				return false;
+			}
+
+			int output = open(packed.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+			if (output < 0) {
+				error = "Could not open \"" + packed + "\" for writing!";
+				return false;
+			}
+
+			bool ok = lseek(payload_fd, 0, SEEK_SET) == 0 && writer.write(walker, payload_fd, index, output, error);
+			return !::close(output) && ok;
+		}, insert_seconds, error);
+		if (!ok) break;
+
+		ok = time_best([&](string &error) {
+			PngPackReader reader;
+			reader.io_backend = backend;
+
+			if (!reader.open(packed, error) || !reader.locate(error)) return false;
+
+			int output = open(extracted.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+			if (output < 0) {
+				error = "Could not open \"" + extracted + "\" for writing!";
+				return false;
+			}
+
+			bool ok = reader.extract(output, pool, pool.size(), error);
+			return !::close(output) && ok;
+		}, extract_seconds, error);
+		if (!ok) break;
+
+		const char *comma = (size == PAYLOAD_SIZES[0]) ? "" : ",";
+		insert << comma << "{\"bytes\":" << size << ",\"file_chunks\":" << writer.payload_chunks();
+		insert << ",\"seconds\":" << duration(insert_seconds) << ",\"mb_per_s\":" << rate(size, insert_seconds) << "}";
+		extract << comma << "{\"bytes\":" << size << ",\"file_chunks\":" << writer.payload_chunks();
+		extract << ",\"seconds\":" << duration(extract_seconds) << ",\"mb_per_s\":" << rate(size, extract_seconds) << "}";
+	}
+
+	::close(payload_fd);
+	::remove(packed.c_str());
+	::remove(extracted.c_str());
+
+	if (!ok) return false;
+
+	report << "\"io_backend\":\"" << AsyncIo::backend_name(backend) << "\",";
+	report << "\"insert\":[" << insert.str() << "],\"extract\":[" << extract.str() << "]";
+	return true;
+}
+
+/* The same payload packed as file chunks of each size, then read back and validated */
+/* CHUNK_SIZE_DATA_MAX is part of the format, so the other sizes are written here with */
+/* Chunk and read with ChunkWalker, batching CRCs across the pool as the stream writer does */
+bool bench_chunk_sizes(const string &dir, ThreadPool &pool, ostream &report, vector<string> &files, string &error) {
+	string payload = dir + "/payload.bin";
+	string packed = dir + "/chunks.png";
+	files.push_back(packed);
+
+	uint64_t length = min(CHUNK_SIZE_PAYLOAD, largest_payload());
+
+	int payload_fd = open(payload.c_str(), O_RDONLY);
+	if (payload_fd < 0) {
+		error = "Could not read \"" + payload + "\"";
+		return false;
+	}
+
+	bool first = true;
+	bool ok = true;
+	report << "\"chunk_size\":[";
+
+	for (uint32_t size : CHUNK_SIZES) {
+		if (size > length) break;
+
+		size_t batch = max<uint64_t>(1, min<uint64_t>(pool.size(), CHUNK_SIZE_BATCH_MAX / size));
+		uint64_t count = (length + size - 1) / size;
+		double write_seconds, read_seconds;
+
+		cerr << "File chunks of " << size << " bytes..." << endl;
+
+		ok = time_best([&](string &error) {
+			int output = open(packed.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+			if (output < 0) {
+				error = "Could not open \"" + packed + "\" for writing!";
+				return false;
+			}
+
+			vector<uint8_t> ihdr_data = {0, 0, 0, 1, 0, 0, 0, 1, 8, 2, 0, 0, 0};
+			Chunk ihdr(ihdr_data.size(), as_type("IHDR"), ihdr_data);
+			Chunk iend(0, as_type("IEND"), vector<uint8_t>());
+
+			bool ok = write_all(output, PNG_SIGNATURE, sizeof(PNG_SIGNATURE)) && ihdr.write(output);
+
+			for (uint64_t done = 0; ok && done < length;) {
+				vector<Chunk> chunks;
+
+				while (ok && done < length && chunks.size() < batch) {
+					uint32_t n = min<uint64_t>(size, length - done);
+					vector<uint8_t> data(n);
+
+					ok = pread(payload_fd, data.data(), n, done) == (ssize_t) n;
+					chunks.emplace_back(n, as_type(CHUNK_TYPE_FILE), move(data), 0);
+					done += n;
+				}
+
+				pool.parallel_for(chunks.size(), [&chunks](size_t i) {
+					chunks[i].force_crc_update();
+				});
+
+				for (size_t i = 0; ok && i < chunks.size(); i++) ok = chunks[i].write(output);
+			}
+
+			ok = ok && iend.write(output);
+			if (::close(output) || !ok) {
+				error = "Could not write \"" + packed + "\"";
+				return false;
+			}
+
+			return true;
+		}, write_seconds, error);
+		if (!ok) break;
+
+		ok = time_best([&](string &error) {
+			ChunkWalker walker;
+			if (!walker.open(packed) || !walker.check_signature()) {
+				error = "Could not read \"" + packed + "\"";
+				return false;
+			}
+
+			vector<ChunkHeader> headers;
+			ChunkHeader header;
+			while (walker.next(header)) {
+				if (header.type == as_type(CHUNK_TYPE_FILE)) headers.push_back(header);
+			}
+
+			/* One byte each, so threads never share one */
+			vector<uint8_t> valid(headers.size());
+
+			for (size_t first = 0; first < headers.size(); first += batch) {
+				size_t n = min(batch, headers.size() - first);
+
+				pool.parallel_for(n, [&](size_t i) {
+					const ChunkHeader &header = headers[first + i];
+					vector<uint8_t> data;
+					uint32_t crc;
+
+					if (!walker.load(header, data, crc)) return;
+
+					Chunk chunk(header.length, header.type, move(data), crc);
+					valid[first + i] = chunk.validate();
+				});
+			}
+
+			if (headers.size() != count || find(valid.begin(), valid.end(), 0) != valid.end()) {
+				error = "File chunks of " + to_string(size) + " bytes did not read back!";
+				return false;
+			}
+
+			return true;
+		}, read_seconds, error);
+		if (!ok) break;
+
+		report << (first ? "" : ",") << "{\"chunk_bytes\":" << size << ",\"default\":" << (size == CHUNK_SIZE_DATA_MAX ? "true" : "false");
+		report << ",\"chunks\":" << count << ",\"bytes\":" << length;
+		report << ",\"write_seconds\":" << duration(write_seconds) << ",\"write_mb_per_s\":" << rate(length, write_seconds);
+		report << ",\"read_seconds\":" << duration(read_seconds) << ",\"read_mb_per_s\":" << rate(length, read_seconds) << "}";
+		first = false;
+	}
+
+	::close(payload_fd);
+	::remove(packed.c_str());
+
+	report << "]";
+	return ok;
+}
+
+int main(int argc, char *argv[]) {
+	for (int i = 1; i < argc; i++) {
+		char flag = (argv[i][0] == '-') ? argv[i][1] : '\0';
+		if (!flag || flag == 'h') {
+			print_usage();
+			return 1;
+		}
+
+		/* Accept both "-jN" and "-j N" */
+		const char *arg = argv[i];
+		const char *value = arg[2] ? arg + 2 : ((i + 1 < argc) ? argv[++i] : "");
+		char *end;
+		long n = strtol(value, &end, 10);
+		bool number = *value && !*end && n > 0;
+
+		if (flag == 'j' && number && n <= 4096) thread_count = n;
+		else if (flag == 'r' && number && n <= 1000) repeats = n;
+		else if (flag == 'm' && number) max_payload = (uint64_t) n << 20;
+		else if (flag == 't' && *value) scratch_parent = value;
+		else {
+			cerr << "Invalid argument \'" << arg << "\'" << endl;
+			print_usage();
+			return 1;
+		}
+	}
+
+	if (!thread_count) thread_count = ThreadPool::default_size();
+
+	if (!Crc32::self_test()) {
+		cerr << "CRC engines disagree with the reference!" << endl;
+		return 1;
+	}
+
+	string dir = scratch_parent + "/png_bench.XXXXXX";
+	if (!mkdtemp(&dir[0])) {
+		cerr << "Could not create a scratch directory in \"" << scratch_parent << "\"" << endl;
+		return 1;
+	}
+
+	ThreadPool pool(thread_count);
+	vector<string> files;
+	ostringstream report;
+	string error;
+
+	report << "{\"version\":" << REPORT_VERSION << ",\"threads\":" << thread_count << ",\"repeats\":" << repeats;
+	report << ",\"crc_engine\":\"" << Crc32::engine_name(Crc32::active()) << "\",\"chunk_size_data_max\":" << CHUNK_SIZE_DATA_MAX << ",";
+
+	cerr << "CRC..." << endl;
+	bool ok = bench_crc(report, error);
+
+	if (ok) {
+		cerr << "Parsing..." << endl;
+		report << ",";
+		ok = bench_parse(dir, pool, report, files, error);
+	}
+
+	if (ok) {
+		report << ",";
+		ok = bench_payloads(dir, pool, report, files, error);
+	}
+
+	if (ok) {
+		report << ",";
+		ok = bench_chunk_sizes(dir, pool, report, files, error);
+	}
+
+	report << "}";
+
+	for (const string &file : files) ::remove(file.c_str());
+	rmdir(dir.c_str());
+
+	if (!ok) {
+		cerr << error << endl;
+		return 1;
+	}
+
+	cout << report.str() << endl;
+	return 0;
+}
@@ -1,25 +1,49 @@
-/* 
+/*
 PNG.CPP
 NICK WILSON
 2019
 */
 
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
 #include <iostream>
 #include <fstream>
 #include <iomanip>
+#include <new>
+#include <mutex>
+#include <sstream>
 #include <string>
 #include <vector>
 
-#include <arpa/inet.h>
 #include <sys/stat.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
-#include <utime.h>
-
-#include "Chunk.hpp"
-
-/* PNGs MUST have this as their leading bytes by RFC 2083 */
-const uint8_t PNG_SIGNATURE[] = {0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A};
+#include <unistd.h>
+
+#include "AsyncIo.hpp"
+#include "Cipher.hpp"
+#include "Codec.hpp"
+#include "Crc32.hpp"
+#include "FileCopy.hpp"
+#include "ImageData.hpp"
+#include "MappedPng.hpp"
+#include "PngPack.hpp"
+#include "PngPackReader.hpp"
+#include "PngPackWriter.hpp"
+#include "Probe.hpp"
+#include "ReedSolomon.hpp"
+#include "ShardSet.hpp"
+#include "Stats.hpp"
+#include "ThreadPool.hpp"
+#include "TreeHash.hpp"
 
 /* PNGs MUST report these types in HDR by RFC 2083 */
 const std::string PNG_TYPES_COLOUR[] = {"GREYSCALE", "INVALID", "COLOUR", "PALLET", "GREYSCALE+ALPHA", "INVALID", "COLOUR+ALPHA"};
@@ -27,27 +51,12 @@ const std::string PNG_TYPES_COMPRESSION[] = {"DEFLATE W/ 32K WINDOW"};
 const std::string PNG_TYPES_FILTER[] = {"NONE"};
 const std::string PNG_TYPES_INTERLACE[] = {"NONE", "ADAM7"};
 
-/* PNG writing constants */
-const std::string CHUNK_TYPE_INDEX = "fiDX";
-const std::string CHUNK_TYPE_FILE = "fiLE";
-
-/* By trial and error, this seems to be about the biggest size permitted by most programs */
-/* This seems to contradict the spec which states it may be up to 2^31 - 1 */
-/* Programs should just skip these chunks but they don't. Instead, they crash :D */
-const uint32_t CHUNK_SIZE_DATA_MAX = 0x700000;
+/* Batch mode queues at most this many jobs per worker */
+const unsigned BATCH_JOBS_PER_WORKER = 4;
 
-/* General error checking */
-const uint64_t PNG_MIN_SIZE = 0x39;
-/*
-SIGNATURE: 8
-IHDR: 4 + 4 + N + 4
-	N: 13
-IDAT: 4 + 4 + N + 4
-	N: 0
-IEND: 4 + 4 + N + 4
-	N: 0
-TOTAL: 57 (0x39)
-*/
+/* Chunk buffers each batch job may hold at once */
+/* Batch parallelism comes from running many files, so this stays small to bound memory */
+const unsigned BATCH_JOB_WIDTH = 2;
 
 /* Debug toggle */
 bool print_debug = false;
@@ -55,514 +64,1824 @@ bool print_debug = false;
 /* Program mode */
 uint8_t mode = 0;
 
-using namespace std;
+/* Run the mode over many inputs */
+bool batch_mode = false;
 
-/* Read 4 bytes and swap ordering */
-int read32_i(ifstream &input) {
-	uint32_t x;
-	input.read(reinterpret_cast<char *>(&x), 4);
-	return ntohl(x);
-}
+/* Worker threads for CRC work, 0 picks the hardware concurrency */
+unsigned thread_count = 0;
 
-/* Read 4 bytes */
-int read32(ifstream &input) {
-	uint32_t x;
-	input.read(reinterpret_cast<char *>(&x), 4);
-	return x;
-}
+/* How payload blocks are read and written, chosen once the flags are in */
+AsyncIo::Backend io_backend = AsyncIo::BACKEND_COUNT;
+
+/* How inserted file chunks are compressed */
+Codec::Type payload_codec = Codec::CODEC_NONE;
+
+/* Where inserted chunks go */
+PngPackWriter::Layout payload_layout = PngPackWriter::LAYOUT_AFTER_IHDR;
+
+/* How a single inserted file is cut into chunks */
+PngPackWriter::Chunking payload_chunking = PngPackWriter::CHUNKING_FIXED;
+
+/* Insertion input already holds an earlier version of the target, whose chunks are reused */
+bool payload_delta = false;
+
+/* Parity chunks written for every group of this many file chunks, none if zero */
+unsigned parity_data = 0;
+unsigned parity_count = 0;
+
+/* Written file chunks are sealed with this cipher, under a key from the passphrase */
+/* Read file chunks are opened with the passphrase, whatever they were sealed with */
+Cipher::Type payload_cipher = Cipher::CIPHER_NONE;
+std::string key_filename;
+std::string passphrase;
+
+/* Extract only this file from an archive */
+std::string entry_name;
 
-/* Take pre-defined string type and return four bytes */
-uint32_t as_type(string str) {
-	if (str.length() < 4) return 0;
-	return (str[3] << 24) + (str[2] << 16) + (str[1] << 8) + str[0];
+/* Extract only part of the packed file */
+bool range_set = false;
+uint64_t range_offset = 0;
+uint64_t range_length = 0;
+
+/* How much CRC work probe mode does */
+ProbeVerify probe_verify = PROBE_VERIFY_NONE;
+
+/* Analysis also inflates and unfilters the image data */
+bool deep_verify = false;
+
+/* Report where the time and memory went, on stderr once done */
+bool stats_report = false;
+bool stats_json = false;
+
+using namespace std;
+
+/* What each mode found, for batch reports */
+struct AnalysisResult {
+	uint64_t file_size = 0;
+	uint64_t chunk_count = 0;
+	ImageHeader header;
+	bool has_index = false;
+	bool has_file = false;
+	ImageData::Result image;
+};
+
+struct InsertionResult {
+	uint64_t bytes = 0;
+	uint64_t stored = 0;
+	uint64_t file_chunks = 0;
+	uint64_t reused = 0;
+	uint64_t parity_chunks = 0;
+};
+
+struct ExtractionResult {
+	string filename;
+	uint64_t bytes = 0;
+	uint64_t file_chunks = 0;
+	uint64_t repaired = 0;
+	uint64_t files = 1;
+};
+
+struct VerifyResult {
+	uint64_t bytes = 0;
+	uint64_t file_chunks = 0;
+	uint64_t repaired = 0;
+	TreeHash::Type digest_type = TreeHash::DIGEST_NONE;
+	TreeHash::Digest digest;
+};
+
+/* Take four bytes of type and return them as a string */
+string type_name(uint32_t type) {
+	return string(reinterpret_cast<const char *>(&type), 4);
 }
 
 void print_usage() {
 	cout << "Usage:" << endl;
-	cout << "\tAnalyze:     ./png [-a] [-d] <input>" << endl;
-	cout << "\tInsertion:   ./png  -i  [-d] <input> <target> <output>" << endl;
-	cout << "\tExtraction:  ./png  -e  [-d] <input>" << endl;
+	cout << "\tAnalyze:     ./png [-a] [-d] [-j N] [--deep] <input>" << endl;
+	cout << "\tInsertion:   ./png  -i  [-d] [-j N] [-u IO] [-z] [--tail] [--cdc | --delta] [--parity K:M] [--key FILE [--cipher C]] <input> <target> <output>" << endl;
+	cout << "\tExtraction:  ./png  -e  [-d] [-j N] [-u IO] [--entry NAME] [--range OFF:LEN] [--key FILE] <input> [<output>]" << endl;
+	cout << "\tArchive:     ./png  -r  [-d] [-j N] [-u IO] [-z] [--tail] [--parity K:M] [--key FILE [--cipher C]] <input> <output> <target>..." << endl;
+	cout << "\tUpdate:      ./png  -w  [-d] [-j N] [-u IO] [-z] [--cdc] [--parity K:M] [--key FILE [--cipher C]] <input> <target>..." << endl;
+	cout << "\tStrip:       ./png  -x  [-d] <input>" << endl;
+	cout << "\tProbe:       ./png  -p  [-d] [-v N] <input>" << endl;
+	cout << "\tVerify:      ./png  -k  [-d] [-j N] [--key FILE] <input>" << endl;
+	cout << "\tShard:       ./png  -s  [-d] [-j N] [-u IO] [-z] [--tail] [--cdc] [--parity K:M] [--key FILE [--cipher C]] <target> <input> <output> [<input> <output>]..." << endl;
+	cout << "\tGather:      ./png  -g  [-d] [-j N] [-u IO] [--key FILE] <input>..." << endl;
+	cout << "\tBatch:       ./png  -b  [-a | -i | -e | -p | -k] [-j N] [-u IO] [-v N] [-z] [--deep] [--cdc | --delta] [--parity K:M] [--key FILE [--cipher C]] <source>..." << endl;
 	cout << "Flags:" << endl;
 	cout << "\th: Show [H]elp" << endl;
 	cout << "\td: Enable [D]ebug printouts" << endl;
 	cout << "\ta: [A]nalyze mode" << endl;
 	cout << "\ti: [I]nsertion mode" << endl;
 	cout << "\te: [E]xtraction mode" << endl;
+	cout << "\tp: [P]robe mode, headers only" << endl;
+	cout << "\tr: A[R]chive mode, packs many files and directories into one PNG" << endl;
+	cout << "\tw: [W]rite in place, adding or replacing the packed file at the end of input" << endl;
+	cout << "\tx: E[X]cise the packed file at the end of input, in place" << endl;
+	cout << "\tk: Chec[K] the packed file against its size and BLAKE3 digest without writing it out" << endl;
+	cout << "\ts: [S]hard mode, splits target across every input, each written to the output after it" << endl;
+	cout << "\tg: [G]ather mode, reassembles a file from all of its shards, given in any order" << endl;
+	cout << "\tb: [B]atch mode, one JSON result per line" << endl;
+	cout << "\tj: Number of worker threads for CRC work [default: all cores]" << endl;
+	cout << "\tu: I/O backend for payload blocks: sync, threads or uring [default: uring if available]" << endl;
+	cout << "\tv: Probe [V]erify level: 0 none, 1 IHDR, index and table, 2 all chunks [default: 0]" << endl;
+	cout << "\tz: Compress inserted file chunks with LZ4, storing any that don't shrink as they are" << endl;
+	cout << "\t--deep: Have analysis inflate the image data and undo each scanline's filter, checking it decodes to" << endl;
+	cout << "\t        exactly the scanlines the image header calls for" << endl;
+	cout << "\t--entry NAME: Extract only the file NAME from an archive" << endl;
+	cout << "\t--range OFF:LEN: Extract only LEN bytes starting OFF bytes into the packed file (or the --entry)" << endl;
+	cout << "\t--tail: Put the packed file just before IEND, so -w and -x can change it later" << endl;
+	cout << "\t--cdc: Cut a single file into chunks by content and hash them, so --delta can reuse them later" << endl;
+	cout << "\t--delta: Input holds an earlier version of target packed with --cdc. Its chunks are reused wherever" << endl;
+	cout << "\t         the contents match, and only the changed ones are written" << endl;
+	cout << "\t--parity K:M: Write M Reed-Solomon parity chunks for every K file chunks, so extraction can rebuild" << endl;
+	cout << "\t              up to M damaged chunks in each group [K + M at most 256]" << endl;
+	cout << "\t--key FILE: Encrypt written file chunks, or decrypt read ones, with a key from the passphrase in FILE" << endl;
+	cout << "\t            Filenames, sizes and times are left readable. Not with --cdc or --delta" << endl;
+	cout << "\t--cipher C: Cipher for --key to encrypt with: aes or chacha [default: aes if the CPU has AES instructions]" << endl;
+	cout << "\t--stats[=text|json]: Report time, bytes, allocations and peak memory for each phase of work on stderr" << endl;
+	cout << "Streams:" << endl;
+	cout << "\t-: Read insertion's <input> or <target> from stdin, or write insertion's or extraction's <output> to stdout" << endl;
+	cout << "\t   The payload is then read until it ends, and the index goes after the file chunks" << endl;
+	cout << "Batch sources:" << endl;
+	cout << "\t<directory>: Every .png below it" << endl;
+	cout << "\t@<list>: One job per line of the list file" << endl;
+	cout << "\t-: One job per line of stdin" << endl;
+	cout << "\t<file>: A single input" << endl;
+	cout << "\tJob lines are tab separated: <input> to analyze, probe or verify," << endl;
+	cout << "\t<input> [<output>] to extract, <input> <target> <output> to insert" << endl;
 	return;
 }
 
-int main(int argc, char const *argv[]) {
-	uint8_t chunk_leading_bytes[8];
-	uint32_t chunk_type, chunk_crc, chunk_length;
-	uint64_t png_filesize;
-	string png_filename;
+/* Lowercase hex of a run of bytes */
+string hex_string(const uint8_t *data, size_t length) {
+	ostringstream out;
+	out << hex << setfill('0');
+	for (size_t i = 0; i < length; i++) out << setw(2) << (int) data[i];
+	return out.str();
+}
 
-	vector<uint8_t> chunk_data;
-	vector<Chunk> chunks;
-	vector<string> filenames;
+/* Probe mode report */
+void print_probe(const string &filename, const ProbeResult &probe) {
+	cout << "File: " << filename << " (" << probe.file_size << " bytes)" << endl;
+
+	cout << "Image: " << probe.header.width << "x" << probe.header.height << "px";
+	cout << " | Bit depth: " << (int) probe.header.depth;
+	cout << " | Colour type: " << (int) probe.header.colour;
+	if (probe.header.colour < 7) cout << " [" << PNG_TYPES_COLOUR[probe.header.colour] << "]";
+	cout << " | Interlace method: " << (int) probe.header.interlace;
+	if (probe.header.interlace < 2) cout << " [" << PNG_TYPES_INTERLACE[probe.header.interlace] << "]";
+	cout << endl;
+
+	cout << "Chunks: " << probe.chunks.size() << endl;
+	for (const ChunkSummary &summary : probe.inventory) {
+		cout << "\t" << type_name(summary.type) << ": " << summary.count << " chunk(s), " << summary.bytes << " bytes" << endl;
+	}
 
-	/* Process flags */
-	for (int i = 1; i < argc; i++) {
-		if (argv[i][0] == '-') {
-			switch (argv[i][1]) {
-				case 'a':
-					mode = 0;
-				case 'd':
-					print_debug = true;
-					break;
-				case 'i':
-					mode = 1;
-					break;
-				case 'e':
-					mode = 2;
-					break;
-				case 'h':
-					/* help */
-					print_usage();
-					return 1;
-				case '\0':
-					/* '-' is not a flag */
-					print_usage();
-					return 1;
-				default:
-					/* Other invalid flag */
-					cerr << "Invalid flag \'-" << argv[i][1] << "\'" << endl;
-					print_usage();
-					return 1;
-			}
+	if (print_debug) {
+		for (uint64_t i = 0; i < probe.chunks.size(); i++) {
+			const ChunkHeader &header = probe.chunks[i];
+			cout << "Chunk " << i << " | Type: " << type_name(header.type);
+			cout << " | Offset: " << header.offset << " | Length: " << header.length << " bytes" << endl;
 		}
-		else {
-			filenames.emplace_back(argv[i]);
+	}
+
+	if (probe.has_index) {
+		cout << "Index: chunk " << probe.index_chunk << " at offset " << probe.chunks[probe.index_chunk].offset;
+		cout << " | File: \"" << probe.index.filename << "\" (" << probe.index.size << " bytes)" << endl;
+		/* A sealed digest can only be read with the passphrase */
+		if (probe.index.digest_type != TreeHash::DIGEST_NONE) {
+			cout << "Digest: " << TreeHash::name(probe.index.digest_type) << " ";
+			cout << (probe.index.encrypted() ? "(sealed)" : TreeHash::hex(probe.index.digest)) << endl;
+		}
+		if (probe.index.encrypted()) {
+			const FileIndex::Encryption &encryption = probe.index.encryption;
+			cout << "Encryption: " << Cipher::name(encryption.cipher) << " | Key from " << Cipher::kdf_name(encryption.kdf);
+			cout << ", " << encryption.iterations << " iterations" << endl;
+		}
+		if (probe.index.shard.count) {
+			const FileIndex::Shard &shard = probe.index.shard;
+			cout << "Shard: " << shard.number + 1 << " of " << shard.count << " | Bytes " << shard.offset;
+			cout << " to " << shard.offset + probe.index.size << " of " << shard.total;
+			cout << " | Payload ID: " << hex_string(shard.id, sizeof(shard.id)) << endl;
+		}
+		if (probe.index.parity_scheme != FileIndex::PARITY_NONE) {
+			cout << "Parity: Reed-Solomon, " << probe.index.parity_count << " parity chunks for every " << probe.index.parity_data << " file chunks";
+			cout << " | " << probe.index.parity_groups() * probe.index.parity_count << " parity chunks" << endl;
 		}
 	}
+	else {
+		cout << "Index: none" << endl;
+	}
 
-	/* Analysis mode */
-	if (mode == 0 && filenames.size() != 1) {
-		cerr << "Invalid arguments!" << endl;
-		print_usage();
-		return 1;
+	if (probe.has_file) {
+		cout << "File chunks: " << probe.file_chunk_count << " from chunk " << probe.file_chunk;
+		cout << " at offset " << probe.chunks[probe.file_chunk].offset << " | " << probe.file_bytes << " bytes" << endl;
+	}
+	else {
+		cout << "File chunks: none" << endl;
 	}
+}
 
-	/* Insertion mode */
-	else if (mode == 1 && filenames.size() != 3) {
-		cerr << "Invalid arguments!" << endl;
-		print_usage();
-		return 1;
+/* Quote and escape a string for JSON output */
+string json_string(const string &str) {
+	ostringstream out;
+	out << '"';
+	for (unsigned char c : str) {
+		if (c == '"' || c == '\\') out << '\\' << c;
+		else if (c == '\n') out << "\\n";
+		else if (c == '\t') out << "\\t";
+		else if (c < 0x20) out << "\\u" << hex << setw(4) << setfill('0') << (int) c << dec;
+		else out << c;
 	}
+	out << '"';
+	return out.str();
+}
 
-	/* Extraction mode */
-	else if (mode == 2 && filenames.size() != 1) {
-		cerr << "Invalid arguments!" << endl;
-		print_usage();
-		return 1;
+/* Image data printout */
+void print_header(const ImageHeader &header) {
+	cout << "\nImage data:" << endl;
+	cout << "Height: " << header.height << "px" << endl;
+	cout << "Width: " << header.width << "px" << endl;
+	cout << "Bit depth: " << (int) header.depth << " bits/channel" << endl;
+	cout << "Colour type: " << (int) header.colour << " [" << PNG_TYPES_COLOUR[header.colour] << "]" << endl;
+	cout << "Compression method: " << (int) header.compression << " [" << PNG_TYPES_COMPRESSION[header.compression] << "]" << endl;
+	cout << "Filter method: " << (int) header.filter << " [" << PNG_TYPES_FILTER[header.filter] << "]" << endl;
+	cout << "Interlace method: " << (int) header.interlace << " [" << PNG_TYPES_INTERLACE[header.interlace] << "]" << endl;
+}
+
+/* Hand every regular file below a directory to found(), symlinks are not followed */
+void walk_directory(const string &path, const function<void(const string &)> &found) {
+	DIR *dir = opendir(path.c_str());
+	if (!dir) return;
+
+	while (struct dirent *entry = readdir(dir)) {
+		string name = entry->d_name;
+		if (name == "." || name == "..") continue;
+
+		string full = path + "/" + name;
+		bool is_dir = entry->d_type == DT_DIR;
+		bool is_file = entry->d_type == DT_REG;
+
+		/* Not every filesystem fills in d_type */
+		if (entry->d_type == DT_UNKNOWN) {
+			struct stat st;
+			if (lstat(full.c_str(), &st)) continue;
+			is_dir = S_ISDIR(st.st_mode);
+			is_file = S_ISREG(st.st_mode);
+		}
+
+		if (is_dir) {
+			walk_directory(full, found);
+		}
+		else if (is_file) {
+			found(full);
+		}
 	}
 
-	/* Read file details from first file */
-	struct stat file_A;
-	png_filename = filenames[0];
+	closedir(dir);
+}
 
-	if (stat(png_filename.c_str(), &file_A)) {
-		cerr << "Could not read file details for \"" << png_filename << "\"" << endl;
-		return 1;
+/* Insertion mode */
+/* Carrier and target are streamed straight through to the output */
+/* Any of them can be "-", for stdin or stdout, which puts the index after the file chunks */
+bool insert_file(const string &png_filename, const string &file_filename, const string &out_filename, ThreadPool &pool, unsigned width, InsertionResult &result, string &error) {
+	PngPackWriter writer(pool, width);
+	writer.io_backend = io_backend;
+	writer.codec = payload_codec;
+	writer.layout = payload_layout;
+	writer.chunking = payload_chunking;
+	writer.parity_data = parity_data;
+	writer.parity_count = parity_count;
+	writer.cipher = payload_cipher;
+	writer.passphrase = passphrase;
+
+	bool streamed = png_filename == "-" || file_filename == "-" || out_filename == "-";
+
+	/* Jobs may be coming in on stdin, and their results go out on stdout */
+	if (streamed && batch_mode) {
+		error = "Batch jobs can't use stdin or stdout!";
+		return false;
 	}
 
-	png_filesize = file_A.st_size;
+	if (print_debug) cout << "Writing \"" << file_filename << "\" to " << (out_filename == "-" ? "stdout" : "disk") << "...\n" << endl;
 
-	/* Open first file (PNG) */
-	ifstream input_A(png_filename, ios::binary | ios::in);
+	if (streamed) {
+		if (!writer.write_stream_file(png_filename, file_filename, out_filename, error)) return false;
+	}
+	else if (payload_delta) {
+		if (!writer.write_delta_file(png_filename, file_filename, out_filename, error)) return false;
+	}
+	else if (!writer.write_file(png_filename, file_filename, out_filename, error)) return false;
 
-	if (!input_A.is_open()) {
-		cerr << "Could not read file \"" << png_filename << "\"" << endl;
-		return 1;
+	result.bytes = writer.payload_bytes();
+	result.stored = writer.stored_bytes();
+	result.file_chunks = writer.payload_chunks();
+	result.reused = writer.reused_chunks();
+	result.parity_chunks = writer.parity_chunks();
+
+	/* Debug - Chunk data printout */
+	if (print_debug) {
+		for (const ChunkHeader &header : writer.carrier()) {
+			cout << "Chunk Type: " << type_name(header.type) << " | Length: " << header.length << " bytes" << endl;
+		}
+		print_header(writer.header());
+		cout << "\nFile split across " << result.file_chunks << " file chunks (" << result.bytes << " bytes)" << endl;
+		if (payload_delta) cout << "Reused " << result.reused << " file chunks from the input" << endl;
+		if (payload_codec != Codec::CODEC_NONE) cout << "Compressed with " << Codec::name(payload_codec) << " to " << result.stored << " bytes" << endl;
+		if (result.parity_chunks) cout << "Protected by " << result.parity_chunks << " parity chunks" << endl;
+		if (payload_cipher != Cipher::CIPHER_NONE) cout << "Encrypted with " << Cipher::name(payload_cipher) << endl;
+		cout << "Insertion completed successfully!" << endl;
 	}
 
-	if (png_filesize < PNG_MIN_SIZE) {
-		cerr << "PNG file is too small. Is it corrupted?" << endl;
-		return 1;
+	return true;
+}
+
+/* Shard mode */
+/* pairs holds each carrier followed by the output it is written to */
+bool shard_file(const string &file_filename, const vector<string> &pairs, ThreadPool &pool, unsigned width, InsertionResult &result, string &error) {
+	PngPackWriter writer(pool, width);
+	writer.io_backend = io_backend;
+	writer.codec = payload_codec;
+	writer.layout = payload_layout;
+	writer.chunking = payload_chunking;
+	writer.parity_data = parity_data;
+	writer.parity_count = parity_count;
+	writer.cipher = payload_cipher;
+	writer.passphrase = passphrase;
+
+	vector<string> carriers, outputs;
+	for (size_t i = 0; i + 1 < pairs.size(); i += 2) {
+		carriers.push_back(pairs[i]);
+		outputs.push_back(pairs[i + 1]);
 	}
 
-	input_A.read(reinterpret_cast<char *>(&chunk_leading_bytes), 8);
+	if (print_debug) cout << "Writing \"" << file_filename << "\" across " << carriers.size() << " shards...\n" << endl;
 
-	/* File should lead with [89 50 4E 47 0D 0A 1A 0A] by RFC 2083 */
-	for (int i = 0; i < 8; i++) {
-		if (chunk_leading_bytes[i] != PNG_SIGNATURE[i]) {
-			cerr << "Invalid PNG signature. Is the file corrupted or not a PNG?" << endl;
-			return 1;
+	if (!writer.write_shards(carriers, file_filename, outputs, error)) return false;
+
+	result.bytes = writer.payload_bytes();
+	result.stored = writer.stored_bytes();
+	result.file_chunks = writer.payload_chunks();
+	result.parity_chunks = writer.parity_chunks();
+
+	if (print_debug) {
+		print_header(writer.header());
+		cout << "\nFile split across " << carriers.size() << " shards and " << result.file_chunks << " file chunks (" << result.bytes << " bytes)" << endl;
+		if (payload_codec != Codec::CODEC_NONE) cout << "Compressed with " << Codec::name(payload_codec) << " to " << result.stored << " bytes" << endl;
+		if (result.parity_chunks) cout << "Protected by " << result.parity_chunks << " parity chunks" << endl;
+		if (payload_cipher != Cipher::CIPHER_NONE) cout << "Encrypted with " << Cipher::name(payload_cipher) << endl;
+		cout << "Insertion completed successfully!" << endl;
+	}
+
+	return true;
+}
+
+/* Files are stored under their own names, directories under their own name */
+/* followed by the path within them, in name order */
+bool gather_members(const vector<string> &targets, vector<ArchiveMember> &members, string &error) {
+	Stats::Scope timing(Stats::PHASE_OPEN);
+
+	for (string target : targets) {
+		struct stat target_A;
+
+		while (target.length() > 1 && target.back() == '/') target.pop_back();
+
+		if (stat(target.c_str(), &target_A)) {
+			error = "Could not read file details for \"" + target + "\"";
+			return false;
+		}
+
+		string base = target.substr(target.rfind('/') + 1);
+
+		if (!S_ISDIR(target_A.st_mode)) {
+			members.push_back({target, base});
+			continue;
 		}
+
+		/* "." and the like name nothing, so their contents go in at the top */
+		if (base.empty() || base == "." || base == "..") base.clear();
+		else base += "/";
+
+		vector<ArchiveMember> found;
+		walk_directory(target, [&](const string &path) {
+			found.push_back({path, base + path.substr(target.length() + 1)});
+		});
+
+		sort(found.begin(), found.end(), [](const ArchiveMember &a, const ArchiveMember &b) {
+			return a.name < b.name;
+		});
+		members.insert(members.end(), found.begin(), found.end());
 	}
 
-	if (print_debug) cout << "PNG signature validated!" << endl;
-	if (print_debug) cout << "Filesize: " << png_filesize << " bytes\n" << endl;
+	return true;
+}
 
-	/* Read all of PNG into memory and break it into chunks */
-	while (input_A.tellg() < png_filesize) {
-		/* Read Chunk */
-		chunk_length = read32_i(input_A);
+/* Archive mode */
+bool archive_files(const string &png_filename, const string &out_filename, const vector<string> &targets, ThreadPool &pool, unsigned width, InsertionResult &result, string &error) {
+	vector<ArchiveMember> members;
 
-		/* Confirm it doesn't run past the end of the file */
-		if ((int) input_A.tellg() + chunk_length + sizeof(chunk_crc) >= png_filesize) {
-			cerr << "Reached EOF before all chunks were loaded. Is the PNG corrupted?" << endl;
-			return 1;
+	if (!gather_members(targets, members, error)) return false;
+
+	PngPackWriter writer(pool, width);
+	writer.io_backend = io_backend;
+	writer.codec = payload_codec;
+	writer.layout = payload_layout;
+	writer.parity_data = parity_data;
+	writer.parity_count = parity_count;
+	writer.cipher = payload_cipher;
+	writer.passphrase = passphrase;
+
+	if (print_debug) cout << "Writing " << members.size() << " files to disk...\n" << endl;
+
+	if (!writer.write_archive(png_filename, members, out_filename, error)) return false;
+
+	result.bytes = writer.payload_bytes();
+	result.stored = writer.stored_bytes();
+	result.file_chunks = writer.payload_chunks();
+	result.parity_chunks = writer.parity_chunks();
+
+	if (print_debug) {
+		for (const DirectoryEntry &entry : writer.directory().entries) {
+			cout << "File: " << entry.name << " | " << entry.size << " bytes at offset " << entry.offset;
+			cout << " | " << entry.chunk_count << " file chunks from " << entry.first_chunk << endl;
 		}
+		print_header(writer.header());
+		cout << "\n" << members.size() << " files packed into " << result.file_chunks << " file chunks (" << result.bytes << " bytes)" << endl;
+		if (payload_codec != Codec::CODEC_NONE) cout << "Compressed with " << Codec::name(payload_codec) << " to " << result.stored << " bytes" << endl;
+		if (result.parity_chunks) cout << "Protected by " << result.parity_chunks << " parity chunks" << endl;
+		if (payload_cipher != Cipher::CIPHER_NONE) cout << "Encrypted with " << Cipher::name(payload_cipher) << endl;
+		cout << "Insertion completed successfully!" << endl;
+	}
+
+	return true;
+}
+
+/* Update mode */
+/* The packed file at the end of the PNG is replaced without rewriting the rest */
+/* One regular file is packed as insertion does, anything else as an archive */
+bool update_file(const string &png_filename, const vector<string> &targets, ThreadPool &pool, unsigned width, InsertionResult &result, string &error) {
+	PngPackWriter writer(pool, width);
+	writer.io_backend = io_backend;
+	writer.codec = payload_codec;
+	writer.chunking = payload_chunking;
+	writer.parity_data = parity_data;
+	writer.parity_count = parity_count;
+	writer.cipher = payload_cipher;
+	writer.passphrase = passphrase;
+
+	struct stat target_A;
+	bool single = targets.size() == 1 && !stat(targets[0].c_str(), &target_A) && S_ISREG(target_A.st_mode);
+
+	if (print_debug) cout << "Updating \"" << png_filename << "\" in place...\n" << endl;
+
+	if (single) {
+		if (!writer.update_file(png_filename, targets[0], error)) return false;
+	}
+	else {
+		vector<ArchiveMember> members;
+		if (!gather_members(targets, members, error)) return false;
+		if (!writer.update_archive(png_filename, members, error)) return false;
+	}
+
+	result.bytes = writer.payload_bytes();
+	result.stored = writer.stored_bytes();
+	result.file_chunks = writer.payload_chunks();
+	result.parity_chunks = writer.parity_chunks();
 
-		/* Ensure vector has enough space up front for copy */
-		chunk_data.resize(chunk_length);
-		chunk_type = read32(input_A);
-		input_A.read(reinterpret_cast<char *>(chunk_data.data()), chunk_length); // Copy Chunk Data data (hmm)
-		chunk_crc = read32_i(input_A);
+	if (print_debug) {
+		cout << (single ? "File" : to_string(writer.directory().entries.size()) + " files") << " packed into " << result.file_chunks << " file chunks (" << result.bytes << " bytes)" << endl;
+		if (payload_codec != Codec::CODEC_NONE) cout << "Compressed with " << Codec::name(payload_codec) << " to " << result.stored << " bytes" << endl;
+		if (result.parity_chunks) cout << "Protected by " << result.parity_chunks << " parity chunks" << endl;
+		if (payload_cipher != Cipher::CIPHER_NONE) cout << "Encrypted with " << Cipher::name(payload_cipher) << endl;
+		cout << "Update completed successfully!" << endl;
+	}
+
+	return true;
+}
+
+/* Strip mode */
+bool strip_file(const string &png_filename, ThreadPool &pool, string &error) {
+	PngPackWriter writer(pool);
+
+	if (!writer.strip_file(png_filename, error)) return false;
+
+	if (print_debug) cout << "Packed file removed from \"" << png_filename << "\"" << endl;
+
+	return true;
+}
+
+/* Create or truncate a file to extract into */
+int create_file(const string &path) {
+	Stats::Scope timing(Stats::PHASE_OPEN);
+	return open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+}
+
+/* A file to extract into, or stdout for "-" */
+int open_extracted(const string &path) {
+	return (path == "-") ? STDOUT_FILENO : create_file(path);
+}
+
+/* Close a file extracted into, false if its last writes failed. Stdout is left open */
+bool close_extracted(int fd) {
+	return fd == STDOUT_FILENO || !close(fd);
+}
+
+/* True, with error saying so, if index only holds one shard of its file */
+bool file_shard(const FileIndex &index, const string &png_filename, string &error) {
+	if (!index.shard.count) return false;
 
-		/* Push new Chunk to Chunk vector */
-		chunks.emplace_back(chunk_length, chunk_type, move(chunk_data), chunk_crc);
+	error = "\"" + png_filename + "\" holds shard " + to_string(index.shard.number + 1) + " of " + to_string(index.shard.count);
+	error += ", extract it along with the rest with -g!";
+	return true;
+}
+
+/* Archive extraction */
+/* With --entry, the one file is found through the directory's hash table and only the file */
+/* chunks holding it are read. Otherwise the library extracts every file, under out_filename if given */
+bool extract_archive(PngPackReader &reader, const string &out_filename, ThreadPool &pool, unsigned width, ExtractionResult &result, string &error) {
+	if (!entry_name.empty()) {
+		DirectoryEntry entry;
+
+		if (!reader.lookup(entry_name, entry, error)) return false;
+
+		uint64_t offset = entry.offset;
+		uint64_t length = entry.size;
 
-		/* Ensure data is cleared */
-		chunk_data.clear();
+		if (range_set) {
+			if (range_offset > entry.size || range_length > entry.size - range_offset) {
+				error = "Range is outside the packed file!";
+				return false;
+			}
+			offset += range_offset;
+			length = range_length;
+		}
 
-		/* Debug - Chunk data printout */
 		if (print_debug) {
-			cout << "Chunk Type: " << chunks[chunks.size() - 1].name() << " | Length: " << chunk_length << " bytes" << endl;
+			cout << "Entry located: \"" << entry.name << "\" (" << entry.size << " bytes at offset " << entry.offset << ")" << endl;
+			cout << "File split across " << entry.chunk_count << " file chunks from " << entry.first_chunk << endl;
+		}
+
+		result.filename = out_filename.empty() ? entry.name + "_EX" : out_filename;
+		make_parents(result.filename);
+
+		int output_D = open_extracted(result.filename);
+
+		if (output_D < 0) {
+			error = "Could not extract file \"" + result.filename + "\"";
+			return false;
+		}
+
+		bool ok = reader.extract_range(offset, length, output_D, pool, width, error);
+
+		if (!close_extracted(output_D) && ok) {
+			error = "Could not write extracted file!";
+			ok = false;
+		}
+
+		if (!ok) {
+			if (result.filename != "-") remove(result.filename.c_str());
+			return false;
+		}
+
+		result.bytes = length;
+		result.file_chunks = reader.extracted();
+		result.repaired = reader.repaired();
+
+		if (!range_set && result.filename != "-" && !restore_times(result.filename, entry.time_cr, entry.time_mod) && !batch_mode) {
+			cout << "Operation completed, but could not write file creation/modification time to file." << endl;
 		}
+
+		return true;
 	}
 
-	input_A.close();
-	if (print_debug) cout << "Chunk count: " << chunks.size() << "\n" << endl;
+	if (range_set) {
+		error = "Ranges within an archive need --entry!";
+		return false;
+	}
 
-	if (print_debug) cout << "Validating chunks..." << endl; 
-	for (uint32_t i = 0; i < chunks.size(); i++) {
-		if (!chunks[i].validate()) {
-			cerr << "Chunk " << i << " failed validation!" << endl;
-			return 1;
+	if (out_filename == "-") {
+		error = "Only one file of an archive can go to stdout, chosen with --entry!";
+		return false;
+	}
+
+	FileDirectory directory;
+	if (!reader.extract_archive(out_filename, directory, pool, width, error)) return false;
+
+	if (print_debug) {
+		for (const DirectoryEntry &entry : directory.entries) {
+			cout << "Extracted: \"" << PngPackReader::archive_path(out_filename, entry) << "\" (" << entry.size << " bytes)" << endl;
+		}
+	}
+
+	if (reader.untimed() && !batch_mode) {
+		cout << "Operation completed, but could not write file creation/modification time to file." << endl;
+	}
+
+	result.filename = out_filename.empty() ? "." : out_filename;
+	result.bytes = reader.index().size;
+	result.file_chunks = reader.extracted();
+	result.repaired = reader.repaired();
+	result.files = directory.entries.size();
+
+	return true;
+}
+
+/* Extraction mode */
+/* Only the index and file chunks are read, every other chunk is skipped over */
+/* The stored filename with "_EX" appended is used unless out_filename is given */
+bool extract_file(const string &png_filename, string out_filename, ThreadPool &pool, unsigned width, ExtractionResult &result, string &error) {
+	PngPackReader reader;
+	reader.io_backend = io_backend;
+	reader.passphrase = passphrase;
+
+	/* Results go out on stdout */
+	if (out_filename == "-" && batch_mode) {
+		error = "Batch jobs can't use stdin or stdout!";
+		return false;
+	}
+
+	if (!reader.open(png_filename, error) || !reader.find_index(error)) return false;
+
+	if (reader.archive()) {
+		if (print_debug) cout << "Archive directory located: " << reader.directory_chunk() << endl;
+		return extract_archive(reader, out_filename, pool, width, result, error);
+	}
+
+	if (!entry_name.empty()) {
+		error = "No archive directory present!";
+		return false;
+	}
+
+	/* A shard alone is only part of the file */
+	if (file_shard(reader.index(), png_filename, error)) return false;
+
+	/* A range only needs the index, its offset table leads to the chunks */
+	if (!range_set && !reader.locate(error)) return false;
+
+	const FileIndex &file_index = reader.index();
+
+	if (print_debug && range_set) {
+		cout << "Index chunk located: " << reader.index_chunk() << endl;
+		cout << "Filename located: \"" << file_index.filename << "\"" << endl;
+		cout << "Offset table: " << (file_index.chunks.empty() ? "absent" : to_string(file_index.chunks.size()) + " file chunks") << endl;
+		cout << "Range: " << range_length << " bytes from offset " << range_offset << endl;
+	}
+	else if (print_debug) {
+		cout << "Chunks walked: " << reader.walked() << "\n" << endl;
+		cout << "Index chunk located: " << reader.index_chunk() << endl;
+		cout << "Filename located: \"" << file_index.filename << "\"" << endl;
+		cout << "File data chunk located: " << reader.payload_chunk() << endl;
+		cout << "File split across " << reader.payload().size() << " file chunks" << endl;
+	}
+
+	/* Avoid overwriting an existing file */
+	if (out_filename.empty()) out_filename = file_index.filename + "_EX";
+	result.filename = out_filename;
+
+	int output_D = open_extracted(out_filename);
+
+	if (output_D < 0) {
+		error = "Could not extract file \"" + out_filename + "\"";
+		return false;
+	}
+
+	/* Dump data chunk data into file */
+	bool ok = range_set ? reader.extract_range(range_offset, range_length, output_D, pool, width, error) : reader.extract(output_D, pool, width, error);
+
+	if (!close_extracted(output_D) && ok) {
+		error = "Could not write extracted file!";
+		ok = false;
+	}
+
+	if (!ok) {
+		/* Don't leave a partial file behind, though what went to stdout is gone */
+		if (out_filename != "-") remove(out_filename.c_str());
+		return false;
+	}
+
+	if (range_set) result.bytes = range_length;
+	else result.bytes = file_index.size;
+	result.file_chunks = reader.extracted();
+	result.repaired = reader.repaired();
+
+	/* Part of a file doesn't get the original's times, and neither does stdout */
+	if (range_set || out_filename == "-") return true;
+
+	/* Write creation and modification time to file */
+	if (!restore_times(out_filename, file_index.time_cr, file_index.time_mod) && !batch_mode) {
+		cout << "Operation completed, but could not write file creation/modification time to file." << endl;
+	}
+
+	return true;
+}
+
+/* Gather mode */
+/* Every shard is extracted straight into its place in the one output, all at once */
+bool gather_files(const vector<string> &png_filenames, ThreadPool &pool, unsigned width, ExtractionResult &result, string &error) {
+	ShardSet shards;
+	shards.io_backend = io_backend;
+	shards.passphrase = passphrase;
+
+	if (!shards.open(png_filenames, error)) return false;
+
+	const FileIndex &file_index = shards.index();
+
+	if (print_debug) {
+		cout << "Filename located: \"" << file_index.filename << "\" (" << file_index.size << " bytes)" << endl;
+		for (size_t n = 0; n < shards.count(); n++) {
+			const FileIndex &part = shards.shard(n).index();
+			cout << "Shard " << n + 1 << ": \"" << shards.filename(n) << "\" | Bytes " << part.shard.offset;
+			cout << " to " << part.shard.offset + part.size << endl;
+		}
+		cout << endl;
+	}
+
+	/* Avoid overwriting an existing file */
+	string out_filename = file_index.filename + "_EX";
+	result.filename = out_filename;
+
+	int output_D = create_file(out_filename);
+
+	if (output_D < 0) {
+		error = "Could not extract file \"" + out_filename + "\"";
+		return false;
+	}
+
+	bool ok = shards.extract(output_D, pool, width, error);
+
+	if (close(output_D) && ok) {
+		error = "Could not write extracted file!";
+		ok = false;
+	}
+
+	if (!ok) {
+		/* Don't leave a partial file behind */
+		remove(out_filename.c_str());
+		return false;
+	}
+
+	result.bytes = file_index.size;
+	result.file_chunks = shards.extracted();
+	result.repaired = shards.repaired();
+
+	if (!restore_times(out_filename, file_index.time_cr, file_index.time_mod)) {
+		cout << "Operation completed, but could not write file creation/modification time to file." << endl;
+	}
+
+	if (print_debug) {
+		cout << "Reassembled " << result.bytes << " bytes from " << shards.count() << " shards (" << result.file_chunks << " file chunks)" << endl;
+		cout << "Extraction completed successfully!" << endl;
+	}
+
+	return true;
+}
+
+/* Verify mode */
+/* Reads and checks the whole payload the way extraction does, but nothing is written */
+/* Files packed before digests were recorded only have their CRCs and size checked */
+bool verify_file(const string &png_filename, ThreadPool &pool, unsigned width, VerifyResult &result, string &error) {
+	PngPackReader reader;
+	reader.passphrase = passphrase;
+
+	if (!reader.open(png_filename, error) || !reader.verify(pool, width, error)) return false;
+
+	const FileIndex &file_index = reader.index();
+
+	result.bytes = file_index.size;
+	result.file_chunks = reader.extracted();
+	result.repaired = reader.repaired();
+	result.digest_type = file_index.digest_type;
+	result.digest = file_index.digest;
+
+	if (batch_mode) return true;
+
+	if (print_debug) {
+		cout << "Index chunk located: " << reader.index_chunk() << endl;
+		cout << "Filename located: \"" << file_index.filename << "\"" << endl;
+		cout << "File chunks checked: " << result.file_chunks << " (" << result.bytes << " bytes)" << endl;
+	}
+
+	if (result.repaired) cout << "Rebuilt " << result.repaired << " damaged file chunks from parity, the file itself is unchanged" << endl;
+
+	/* Same layout as b3sum, so the two can be compared directly */
+	if (result.digest_type != TreeHash::DIGEST_NONE) cout << TreeHash::hex(result.digest) << "  " << file_index.filename << endl;
+	else cout << "No digest recorded, only chunk CRCs and the size were checked" << endl;
+
+	cout << "Verification completed successfully!" << endl;
+
+	return true;
+}
+
+/* Deep check of the image data, which is every IDAT chunk in a row taken as one zlib stream */
+/* Each chunk is read in place from the mapping as the decoder gets to it */
+bool verify_image(const vector<ChunkView> &chunks, const ImageHeader &header, ImageData::Result &result, string &error) {
+	size_t first = 0;
+	size_t end = 0;
+	uint64_t compressed = 0;
+
+	for (size_t i = 0; i < chunks.size(); i++) {
+		if (chunks[i].name() != "IDAT") continue;
+
+		if (end && end != i) {
+			error = "IDAT chunks are not consecutive!";
+			return false;
+		}
+
+		if (!end) first = i;
+		end = i + 1;
+		compressed += chunks[i].length;
+	}
+
+	if (!end) {
+		error = "No IDAT chunks, so there is no image data!";
+		return false;
+	}
+
+	size_t next = first;
+	Inflate::Source source = [&chunks, &next, end](const uint8_t *&data, size_t &length) {
+		if (next == end) return false;
+		data = chunks[next].data;
+		length = chunks[next].length;
+		next++;
+		return true;
+	};
+
+	if (!ImageData::verify(header, source, compressed, result, error)) return false;
+
+	if (print_debug) {
+		cout << "Image data inflated from " << result.compressed << " to " << result.filtered << " bytes in ";
+		cout << (end - first) << " IDAT chunk(s), " << result.scanlines << " scanline(s) all unfiltered!" << endl;
+	}
+
+	return true;
+}
+
+/* Analysis mode */
+/* Works from a read-only mapping of the PNG */
+/* Chunks are views into it, so nothing is copied out of the page cache */
+bool analyze_file(const string &png_filename, ThreadPool &pool, AnalysisResult &result, string &error) {
+	MappedPng png_map;
+
+	/* Read file details */
+	struct stat file_A;
+	bool found;
+	{
+		Stats::Scope timing(Stats::PHASE_OPEN);
+		found = !stat(png_filename.c_str(), &file_A);
+	}
+
+	if (!found) {
+		error = "Could not read file details for \"" + png_filename + "\"";
+		return false;
+	}
+
+	if (!png_map.open(png_filename)) {
+		error = "Could not read file \"" + png_filename + "\"";
+		return false;
+	}
+
+	result.file_size = png_map.size();
+
+	if (png_map.size() < PNG_MIN_SIZE) {
+		error = "PNG file is too small. Is it corrupted?";
+		return false;
+	}
+
+	/* File should lead with [89 50 4E 47 0D 0A 1A 0A] by RFC 2083 */
+	bool signature_ok;
+	{
+		Stats::Scope timing(Stats::PHASE_SIGNATURE, sizeof(PNG_SIGNATURE));
+		signature_ok = !memcmp(png_map.data(), PNG_SIGNATURE, sizeof(PNG_SIGNATURE));
+	}
+
+	if (!signature_ok) {
+		error = "Invalid PNG signature. Is the file corrupted or not a PNG?";
+		return false;
+	}
+
+	if (print_debug) cout << "PNG signature validated!" << endl;
+	if (print_debug) cout << "Filesize: " << png_map.size() << " bytes\n" << endl;
+
+	if (!png_map.parse()) {
+		error = "Reached EOF before all chunks were loaded. Is the PNG corrupted?";
+		return false;
+	}
+
+	vector<ChunkView> &chunks = png_map.chunks;
+	result.chunk_count = chunks.size();
+
+	/* Debug - Chunk data printout */
+	if (print_debug) {
+		for (uint32_t i = 0; i < chunks.size(); i++) {
+			cout << "Chunk Type: " << chunks[i].name() << " | Length: " << chunks[i].length << " bytes" << endl;
+		}
+		cout << "Chunk count: " << chunks.size() << "\n" << endl;
+	}
+
+	if (print_debug) cout << "Validating chunks..." << endl;
+
+	/* Chunks are independent, so validate them all at once and report the first failure */
+	vector<uint8_t> chunk_valid(chunks.size());
+	pool.parallel_for(chunks.size(), [&chunks, &chunk_valid](size_t i) {
+		chunk_valid[i] = chunks[i].validate();
+	});
+
+	for (size_t i = 0; i < chunks.size(); i++) {
+		if (!chunk_valid[i]) {
+			error = "Chunk " + to_string(i) + " failed validation!";
+			return false;
 		}
 	}
 	if (print_debug) cout << "Chunks all validated!" << endl;
 
-	uint32_t idx_pos = 0;
-	uint32_t dat_pos = 0;
+	size_t idx_pos = 0;
+	size_t dat_pos = 0;
 
 	/* Look for index chunk, if present */
-	for (int i = 0; i < chunks.size(); i++) {
+	for (size_t i = 0; i < chunks.size(); i++) {
 		if (chunks[i].name() == CHUNK_TYPE_INDEX) {
 			idx_pos = i;
 			break;
 		}
 	}
 
-	/* Search for data chunk, which must come after index chunk */
-	for (int i = idx_pos; i < chunks.size(); i++) {
+	/* Search for data chunk, which comes after index chunk, or before it if the payload was streamed */
+	for (size_t i = idx_pos; i < chunks.size(); i++) {
 		if (chunks[i].name() == CHUNK_TYPE_FILE) {
 			dat_pos = i;
 			break;
 		}
 	}
 
-	/* Extraction Mode */
-	if (mode == 2) {
+	for (size_t i = 1; !dat_pos && i < idx_pos; i++) {
+		if (chunks[i].name() == CHUNK_TYPE_FILE) dat_pos = i;
+	}
 
-		if (print_debug) cout << endl;
+	result.has_index = idx_pos;
+	result.has_file = dat_pos;
 
-		/* Index position still 0, which is impossible as IHDR must be first */
-		if (!idx_pos) {
-			cerr << "No index chunk present!" << endl;
-			return 1;
-		}
+	/* First chunk MUST be of type IHDR by RFC 2083 */
+	/* IHDR chunk MUST have 13 bytes of data */
+	if (chunks[0].name() != "IHDR" || chunks[0].length != IMAGE_HEADER_SIZE) {
+		error = "Invalid leading chunk!";
+		return false;
+	}
 
-		if (print_debug) cout << "Index chunk located: " << idx_pos << endl;
+	result.header.parse(chunks[0].data);
+	if (!result.header.check(error)) return false;
 
-		uint32_t file_time_cr, file_time_mod;
-		string out_filename;
+	if (print_debug) print_header(result.header);
 
-		/* Error checking */
-		if (chunks[idx_pos].length <= 2 * sizeof(uint32_t) + sizeof(uint64_t)) {
-			cerr << "Empty filename!" << endl;
-			return 1;
-		}
+	if (deep_verify && !verify_image(chunks, result.header, result.image, error)) return false;
 
-		/* Build filename */
-		for (int i = (2 * sizeof(uint32_t) + sizeof(uint64_t)); i < chunks[idx_pos].length; i++) {
-			out_filename += chunks[idx_pos].data.data()[i];
-		}
+	/* Since there is no writing to be done, terminate here */
+	if (print_debug) {
+		cout << endl;
+		cout << "Index chunk" << ((idx_pos) ? " DOES " : " DOES NOT ") << "exist!" << endl;
+		cout << "File chunks" << ((dat_pos) ? " DO " : " DO NOT ") << "exist!" << endl;
+		cout << "You WILL" << ((idx_pos && dat_pos) ? " NOT " : " ") << "be able to insert a file into this image!" << endl;
+	}
 
-		if (print_debug) cout << "Filename located: \"" << out_filename << "\"" << endl;
+	return true;
+}
 
-		/* Extract file creation and modification time */
-		memcpy(&file_time_cr, chunks[idx_pos].data.data(), sizeof(uint32_t));
-		memcpy(&file_time_mod, chunks[idx_pos].data.data() + sizeof(uint32_t), sizeof(uint32_t));
+/* Image fields shared by the analysis and probe reports */
+void json_header(ostream &line, const ImageHeader &header) {
+	line << ",\"width\":" << header.width << ",\"height\":" << header.height;
+	line << ",\"depth\":" << (int) header.depth << ",\"colour\":" << (int) header.colour;
+	line << ",\"interlace\":" << (int) header.interlace;
+}
 
-		/* Data chunk was not found */
-		if (!dat_pos) {
-			cerr << "No file data chunk present!" << endl;
-			return 1;
+/* Run one batch job and return its result as a single JSON line */
+/* Any failure, thrown or returned, is confined to the job's own line */
+string run_job(const vector<string> &fields, ThreadPool &pool) {
+	static const char *MODE_NAMES[] = {"analyze", "insert", "extract", "probe", "archive", "update", "strip", "verify", "shard", "gather"};
+	ostringstream line;
+	string error;
+	bool ok = false;
+
+	line << "{\"input\":" << json_string(fields[0]) << ",\"mode\":\"" << MODE_NAMES[mode] << "\"";
+
+	try {
+		if (mode == 0 && fields.size() == 1) {
+			AnalysisResult result;
+			ok = analyze_file(fields[0], pool, result, error);
+			if (ok) {
+				line << ",\"size\":" << result.file_size << ",\"chunks\":" << result.chunk_count;
+				json_header(line, result.header);
+				line << ",\"index\":" << (result.has_index ? "true" : "false");
+				line << ",\"file\":" << (result.has_file ? "true" : "false");
+				if (deep_verify) line << ",\"image_bytes\":" << result.image.filtered << ",\"scanlines\":" << result.image.scanlines;
+			}
+		}
+		else if (mode == 1 && fields.size() == 3) {
+			InsertionResult result;
+			ok = insert_file(fields[0], fields[1], fields[2], pool, BATCH_JOB_WIDTH, result, error);
+			line << ",\"target\":" << json_string(fields[1]) << ",\"output\":" << json_string(fields[2]);
+			if (ok) line << ",\"bytes\":" << result.bytes << ",\"file_chunks\":" << result.file_chunks;
+			if (ok && payload_codec != Codec::CODEC_NONE) line << ",\"stored\":" << result.stored;
+			if (ok && payload_delta) line << ",\"reused\":" << result.reused;
+			if (ok && result.parity_chunks) line << ",\"parity_chunks\":" << result.parity_chunks;
+		}
+		else if (mode == 2 && fields.size() <= 2) {
+			ExtractionResult result;
+			ok = extract_file(fields[0], (fields.size() == 2) ? fields[1] : "", pool, BATCH_JOB_WIDTH, result, error);
+			if (ok) {
+				line << ",\"output\":" << json_string(result.filename) << ",\"files\":" << result.files;
+				line << ",\"bytes\":" << result.bytes << ",\"file_chunks\":" << result.file_chunks;
+				if (result.repaired) line << ",\"repaired\":" << result.repaired;
+			}
 		}
+		else if (mode == 3 && fields.size() == 1) {
+			ProbeResult result;
+			ok = probe_png(fields[0], probe_verify, pool, result, error);
+			if (ok) {
+				line << ",\"size\":" << result.file_size << ",\"chunks\":" << result.chunks.size();
+				json_header(line, result.header);
+				line << ",\"inventory\":{";
+				for (size_t i = 0; i < result.inventory.size(); i++) {
+					const ChunkSummary &summary = result.inventory[i];
+					line << (i ? "," : "") << json_string(type_name(summary.type));
+					line << ":{\"count\":" << summary.count << ",\"bytes\":" << summary.bytes << "}";
+				}
+				line << "}";
+				if (result.has_index) {
+					line << ",\"index\":{\"chunk\":" << result.index_chunk << ",\"filename\":" << json_string(result.index.filename);
+					line << ",\"size\":" << result.index.size;
+					if (result.index.digest_type != TreeHash::DIGEST_NONE && !result.index.encrypted()) line << ",\"digest\":\"" << TreeHash::hex(result.index.digest) << "\"";
+					if (result.index.encrypted()) {
+						line << ",\"encryption\":{\"cipher\":\"" << Cipher::name(result.index.encryption.cipher) << "\"";
+						line << ",\"kdf\":\"" << Cipher::kdf_name(result.index.encryption.kdf) << "\",\"iterations\":" << result.index.encryption.iterations << "}";
+					}
+					if (result.index.shard.count) {
+						line << ",\"shard\":{\"number\":" << result.index.shard.number << ",\"count\":" << result.index.shard.count;
+						line << ",\"id\":\"" << hex_string(result.index.shard.id, sizeof(result.index.shard.id)) << "\"";
+						line << ",\"offset\":" << result.index.shard.offset << ",\"total\":" << result.index.shard.total << "}";
+					}
+					line << "}";
+				}
+				if (result.has_file) {
+					line << ",\"file\":{\"chunk\":" << result.file_chunk << ",\"chunks\":" << result.file_chunk_count;
+					line << ",\"bytes\":" << result.file_bytes << "}";
+				}
+			}
+		}
+		else if (mode == 7 && fields.size() == 1) {
+			VerifyResult result;
+			ok = verify_file(fields[0], pool, BATCH_JOB_WIDTH, result, error);
+			if (ok) {
+				line << ",\"bytes\":" << result.bytes << ",\"file_chunks\":" << result.file_chunks;
+				if (result.repaired) line << ",\"repaired\":" << result.repaired;
+				if (result.digest_type != TreeHash::DIGEST_NONE) line << ",\"digest\":\"" << TreeHash::hex(result.digest) << "\"";
+				else line << ",\"digest\":null";
+			}
+		}
+		else {
+			error = "Invalid arguments!";
+		}
+	}
+	catch (const exception &e) {
+		ok = false;
+		error = e.what();
+	}
 
-		if (print_debug) cout << "File data chunk located: " << dat_pos << endl;
+	line << ",\"ok\":" << (ok ? "true" : "false");
+	if (!ok) line << ",\"error\":" << json_string(error);
+	line << "}";
 
-		/* Count how many chunks the file is split across */
-		uint32_t file_chunk_count = dat_pos;
-		while (chunks[file_chunk_count].name() == CHUNK_TYPE_FILE) {
-			file_chunk_count++;
-			if (file_chunk_count + 1 == chunks.size()) break;
+	return line.str();
+}
+
+/* Batch mode */
+/* Jobs go onto the work-stealing pool as sources are read, and each result line */
+/* is printed as soon as its job finishes, so output order is completion order */
+/* Only a few jobs per worker are queued at once, so any size of manifest streams through */
+bool run_batch(const vector<string> &sources, ThreadPool &pool) {
+	mutex state_lock;
+	condition_variable slot_free;
+	size_t in_flight = 0;
+	size_t failed = 0;
+	const size_t max_in_flight = BATCH_JOBS_PER_WORKER * pool.size();
+
+	auto submit = [&](const vector<string> &fields) {
+		{
+			unique_lock<mutex> guard(state_lock);
+			slot_free.wait(guard, [&] { return in_flight < max_in_flight; });
+			in_flight++;
 		}
-		file_chunk_count -= dat_pos;
 
-		if (print_debug) cout << "File split across " << file_chunk_count << " file chunks" << endl;
+		pool.submit([&, fields] {
+			string line = run_job(fields, pool);
+
+			lock_guard<mutex> guard(state_lock);
+			cout << line << "\n" << flush;
+			if (line.find(",\"ok\":true") == string::npos) failed++;
+			in_flight--;
+			slot_free.notify_one();
+		});
+	};
+
+	/* One job per line, blank lines and '#' comments are skipped */
+	auto submit_lines = [&](istream &input) {
+		string line;
+		while (getline(input, line)) {
+			if (!line.empty() && line.back() == '\r') line.pop_back();
+			if (line.empty() || line[0] == '#') continue;
+
+			vector<string> fields;
+			size_t start = 0, end;
+			while ((end = line.find('\t', start)) != string::npos) {
+				fields.push_back(line.substr(start, end - start));
+				start = end + 1;
+			}
+			fields.push_back(line.substr(start));
 
-		/* Avoid overwriting an existing file */
-		out_filename += "_EX";
+			submit(fields);
+		}
+	};
 
-		ofstream output_D(out_filename, ios::binary | ios::out);
+	for (const string &source : sources) {
+		struct stat st;
 
-		if (!output_D.is_open()) {
-			cerr << "Could not extract file \"" << out_filename << "\"" << endl;
-			return 1;
+		if (source == "-") {
+			submit_lines(cin);
 		}
-
-		/* Dump data chunk data into file */
-		for (uint32_t i = 0; i < file_chunk_count; i++) {
-			output_D.write(reinterpret_cast<const char *>(chunks[dat_pos+i].data.data()), chunks[dat_pos+i].data.size());
+		else if (source[0] == '@') {
+			ifstream list(source.substr(1));
+			if (!list.is_open()) {
+				cerr << "Could not read file \"" << source.substr(1) << "\"" << endl;
+				/* Workers may already be counting their own failures */
+				lock_guard<mutex> guard(state_lock);
+				failed++;
+				continue;
+			}
+			submit_lines(list);
+		}
+		else if (!stat(source.c_str(), &st) && S_ISDIR(st.st_mode)) {
+			walk_directory(source, [&submit](const string &path) {
+				string name = path.substr(path.rfind('/') + 1);
+				if (name.length() <= 4 || strcasecmp(name.c_str() + name.length() - 4, ".png")) return;
+				submit({path});
+			});
 		}
+		else {
+			submit({source});
+		}
+	}
+
+	pool.wait();
 
-		output_D.close();
+	return !failed;
+}
 
-		/* Write creation and modification time to file */
-		struct utimbuf out_time;
-		out_time.actime = file_time_cr;
-		out_time.modtime = file_time_mod;
+/* Allocations are counted against the phase that made them when --stats is on */
+/* Everything else in the program allocates through these, so they stay as thin as malloc */
+static void *counted_alloc(size_t size) {
+	if (Stats::enabled()) Stats::allocated(size);
+	return malloc(size ? size : 1);
+}
 
-		if (utime(out_filename.c_str(), &out_time)) {
-			cout << "Operation completed, but could not write file creation/modification time to file." << endl;
+void *operator new(size_t size) {
+	void *p = counted_alloc(size);
+	if (!p) throw bad_alloc();
+	return p;
+}
+
+void *operator new[](size_t size) {
+	void *p = counted_alloc(size);
+	if (!p) throw bad_alloc();
+	return p;
+}
+
+void *operator new(size_t size, const nothrow_t &) noexcept {
+	return counted_alloc(size);
+}
+
+void *operator new[](size_t size, const nothrow_t &) noexcept {
+	return counted_alloc(size);
+}
+
+/* Out of line, or GCC sees free() meet new and warns they are mismatched */
+__attribute__((noinline)) static void release(void *p) {
+	free(p);
+}
+
+void operator delete(void *p) noexcept {
+	release(p);
+}
+
+void operator delete[](void *p) noexcept {
+	release(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+	release(p);
+}
+
+void operator delete[](void *p, size_t) noexcept {
+	release(p);
+}
+
+/* Stats report, as a table or as one JSON object */
+/* Phase times are summed over every thread and leave out time spent in phases nested within */
+void print_stats(unsigned threads) {
+	double wall = Stats::wall_nanoseconds() / 1e9;
+	double busy = 0;
+	int busiest = 0;
+
+	for (int p = 0; p < Stats::PHASE_COUNT; p++) {
+		double seconds = Stats::totals((Stats::Phase) p).nanoseconds / 1e9;
+		busy += seconds;
+		if (seconds > Stats::totals((Stats::Phase) busiest).nanoseconds / 1e9) busiest = p;
+	}
+
+	Stats::Totals other = Stats::unattributed();
+
+	if (stats_json) {
+		ostringstream out;
+		out << "{\"wall_seconds\":" << wall << ",\"threads\":" << threads << ",\"peak_rss\":" << Stats::peak_rss() << ",\"phases\":[";
+
+		for (int p = 0; p < Stats::PHASE_COUNT; p++) {
+			Stats::Totals totals = Stats::totals((Stats::Phase) p);
+			double seconds = totals.nanoseconds / 1e9;
+
+			out << (p ? "," : "") << "{\"phase\":\"" << Stats::name((Stats::Phase) p) << "\"";
+			out << ",\"calls\":" << totals.calls << ",\"seconds\":" << seconds << ",\"bytes\":" << totals.bytes;
+			out << ",\"mb_per_s\":" << ((seconds > 0) ? totals.bytes / seconds / 1e6 : 0);
+			out << ",\"allocations\":" << totals.allocations << ",\"allocated_bytes\":" << totals.allocated_bytes;
+			out << ",\"peak_rss\":" << totals.peak_rss << "}";
 		}
 
-		return 0;
+		out << "],\"unattributed\":{\"allocations\":" << other.allocations << ",\"allocated_bytes\":" << other.allocated_bytes << "}}";
+		cerr << out.str() << endl;
+		return;
 	}
 
-	/* First chunk MUST be of type IHDR by RFC 2083 */
-	/* IHDR chunk MUST have 13 bytes of data */
-	if (chunks[0].name() != "IHDR" || chunks[0].data.size() != 13) {
-		cerr << "Invalid leading chunk!" << endl;
-		return 1;
+	ostringstream out;
+	out << fixed << setprecision(3);
+	out << "\n" << left << setw(10) << "Phase" << right << setw(12) << "Time (s)" << setw(10) << "Calls" << setw(16) << "Bytes";
+	out << setw(12) << "MB/s" << setw(12) << "Allocs" << setw(16) << "Alloc bytes" << setw(12) << "RSS (MiB)" << endl;
+
+	for (int p = 0; p < Stats::PHASE_COUNT; p++) {
+		Stats::Totals totals = Stats::totals((Stats::Phase) p);
+		double seconds = totals.nanoseconds / 1e9;
+
+		out << left << setw(10) << Stats::name((Stats::Phase) p) << right << setw(12) << seconds << setw(10) << totals.calls << setw(16) << totals.bytes;
+		out << setw(12) << setprecision(1) << ((seconds > 0) ? totals.bytes / seconds / 1e6 : 0) << setprecision(3);
+		out << setw(12) << totals.allocations << setw(16) << totals.allocated_bytes << setw(12) << setprecision(1) << totals.peak_rss / 1048576.0 << setprecision(3) << endl;
 	}
 
-	uint32_t width, height;
-	uint8_t depth, colour, compression, filter, interlace;
+	out << left << setw(10) << "other" << right << setw(12) << "" << setw(10) << "" << setw(16) << "" << setw(12) << "";
+	out << setw(12) << other.allocations << setw(16) << other.allocated_bytes << endl;
 
-	width =  (chunks[0].data[0] << 24) + (chunks[0].data[1] << 16) + (chunks[0].data[2] << 8) + (chunks[0].data[3]);
-	height = (chunks[0].data[4] << 24) + (chunks[0].data[5] << 16) + (chunks[0].data[6] << 8) + (chunks[0].data[7]);
-	depth =         chunks[0].data[8];
-	colour =        chunks[0].data[9];
-	compression =   chunks[0].data[10];
-	filter =        chunks[0].data[11];
-	interlace =     chunks[0].data[12];
+	out << "\nWall time: " << wall << " s on " << threads << " threads, " << busy << " s spent in phases" << endl;
+	out << "Most time: " << Stats::name((Stats::Phase) busiest) << " (" << setprecision(1) << ((busy > 0) ? 100 * Stats::totals((Stats::Phase) busiest).nanoseconds / 1e9 / busy : 0) << "%)" << endl;
+	out << "Peak RSS: " << Stats::peak_rss() / 1048576.0 << " MiB" << endl;
+	cerr << out.str();
+}
 
-	/* error checking */
-	if (!width) { //width is 0, not valid
-		cerr << "Invalid image width!" << endl;
-		return 1;
+int main(int argc, char const *argv[]) {
+	vector<string> filenames;
+
+	/* Process flags */
+	for (int i = 1; i < argc; i++) {
+		/* A lone '-' is stdin or stdout, or batch mode's stdin source */
+		if (argv[i][0] == '-' && argv[i][1]) {
+			switch (argv[i][1]) {
+				case 'a':
+					mode = 0;
+				case 'd':
+					print_debug = true;
+					break;
+				case 'i':
+					mode = 1;
+					break;
+				case 'e':
+					mode = 2;
+					break;
+				case 'p':
+					mode = 3;
+					break;
+				case 'r':
+					mode = 4;
+					break;
+				case 'w':
+					mode = 5;
+					break;
+				case 'x':
+					mode = 6;
+					break;
+				case 'k':
+					mode = 7;
+					break;
+				case 's':
+					mode = 8;
+					break;
+				case 'g':
+					mode = 9;
+					break;
+				case 'b':
+					batch_mode = true;
+					break;
+				case 'z':
+					payload_codec = Codec::CODEC_LZ4;
+					break;
+				case 'j':
+				case 'v': {
+					/* Accept both "-jN" and "-j N" */
+					char flag = argv[i][1];
+					const char *count = argv[i][2] ? argv[i] + 2 : ((i + 1 < argc) ? argv[++i] : "");
+					char *end;
+					long n = strtol(count, &end, 10);
+
+					if (flag == 'j' && (!*count || *end || n < 1 || n > 4096)) {
+						cerr << "Invalid thread count \'" << count << "\'" << endl;
+						print_usage();
+						return 1;
+					}
+					if (flag == 'v' && (!*count || *end || n < 0 || n >= PROBE_VERIFY_COUNT)) {
+						cerr << "Invalid verify level \'" << count << "\'" << endl;
+						print_usage();
+						return 1;
+					}
+
+					if (flag == 'j') thread_count = n;
+					else probe_verify = (ProbeVerify) n;
+					break;
+				}
+				case 'u': {
+					const char *name = argv[i][2] ? argv[i] + 2 : ((i + 1 < argc) ? argv[++i] : "");
+
+					for (int b = 0; b < AsyncIo::BACKEND_COUNT; b++) {
+						if (!strcmp(name, AsyncIo::backend_name((AsyncIo::Backend) b))) io_backend = (AsyncIo::Backend) b;
+					}
+
+					if (io_backend == AsyncIo::BACKEND_COUNT) {
+						cerr << "Invalid I/O backend \'" << name << "\'" << endl;
+						print_usage();
+						return 1;
+					}
+					break;
+				}
+				case 'h':
+					/* help */
+					print_usage();
+					return 1;
+				case '-': {
+					/* Long options, "--entry NAME", "--range OFF:LEN", "--parity K:M", "--key FILE" */
+					/* and "--cipher C", or with '=' */
+					const char *value = nullptr;
+					bool entry = !strncmp(argv[i], "--entry", 7);
+					bool parity = !strncmp(argv[i], "--parity", 8);
+					bool key = !strncmp(argv[i], "--key", 5);
+					bool cipher = !strncmp(argv[i], "--cipher", 8);
+
+					if (!strcmp(argv[i], "--tail")) {
+						payload_layout = PngPackWriter::LAYOUT_BEFORE_IEND;
+						break;
+					}
+					else if (!strcmp(argv[i], "--cdc")) {
+						payload_chunking = PngPackWriter::CHUNKING_CONTENT;
+						break;
+					}
+					else if (!strcmp(argv[i], "--delta")) {
+						payload_delta = true;
+						break;
+					}
+					else if (!strcmp(argv[i], "--deep")) {
+						deep_verify = true;
+						break;
+					}
+					else if (!strcmp(argv[i], "--stats") || !strcmp(argv[i], "--stats=text") || !strcmp(argv[i], "--stats=json")) {
+						stats_report = true;
+						stats_json = !strcmp(argv[i], "--stats=json");
+						break;
+					}
+					else if (!strcmp(argv[i], "--entry")) {
+						entry_name = (i + 1 < argc) ? argv[++i] : "";
+					}
+					else if (!strncmp(argv[i], "--entry=", 8)) {
+						entry_name = argv[i] + 8;
+					}
+					else if (!strcmp(argv[i], "--range") || !strcmp(argv[i], "--parity") || !strcmp(argv[i], "--key") || !strcmp(argv[i], "--cipher")) {
+						value = (i + 1 < argc) ? argv[++i] : "";
+					}
+					else if (!strncmp(argv[i], "--range=", 8)) {
+						value = argv[i] + 8;
+					}
+					else if (!strncmp(argv[i], "--parity=", 9)) {
+						value = argv[i] + 9;
+					}
+					else if (!strncmp(argv[i], "--key=", 6)) {
+						value = argv[i] + 6;
+					}
+					else if (!strncmp(argv[i], "--cipher=", 9)) {
+						value = argv[i] + 9;
+					}
+					else {
+						cerr << "Invalid flag \'" << argv[i] << "\'" << endl;
+						print_usage();
+						return 1;
+					}
+
+					if (entry) {
+						if (entry_name.empty()) {
+							cerr << "Invalid entry name" << endl;
+							print_usage();
+							return 1;
+						}
+						break;
+					}
+
+					if (!value) {
+						cerr << "Invalid flag \'" << argv[i] << "\'" << endl;
+						print_usage();
+						return 1;
+					}
+
+					/* "--parity K:M", both at least one and K + M at most the shards a group can hold */
+					if (parity) {
+						char *end;
+						unsigned long data = strtoul(value, &end, 10);
+						const char *count = (*end == ':') ? end + 1 : "";
+						unsigned long parity = strtoul(count, &end, 10);
+
+						if (!isdigit(value[0]) || !isdigit(count[0]) || *end || !data || !parity || data + parity > ReedSolomon::MAX_SHARDS) {
+							cerr << "Invalid parity \'" << value << "\'" << endl;
+							print_usage();
+							return 1;
+						}
+
+						parity_data = data;
+						parity_count = parity;
+						break;
+					}
+
+					if (key) {
+						key_filename = value;
+
+						if (key_filename.empty()) {
+							cerr << "Invalid key file" << endl;
+							print_usage();
+							return 1;
+						}
+						break;
+					}
+
+					if (cipher) {
+						if (!strcmp(value, "aes")) payload_cipher = Cipher::CIPHER_AES_256_GCM;
+						else if (!strcmp(value, "chacha")) payload_cipher = Cipher::CIPHER_CHACHA20_POLY1305;
+						else {
+							cerr << "Invalid cipher \'" << value << "\'" << endl;
+							print_usage();
+							return 1;
+						}
+						break;
+					}
+
+					char *end;
+					errno = 0;
+					range_offset = strtoull(value, &end, 10);
+					const char *length = (*end == ':') ? end + 1 : "";
+					range_length = strtoull(length, &end, 10);
+
+					if (!isdigit(value[0]) || !isdigit(length[0]) || *end || errno == ERANGE) {
+						cerr << "Invalid range \'" << value << "\'" << endl;
+						print_usage();
+						return 1;
+					}
+
+					range_set = true;
+					break;
+				}
+				default:
+					/* Other invalid flag */
+					cerr << "Invalid flag \'-" << argv[i][1] << "\'" << endl;
+					print_usage();
+					return 1;
+			}
+		}
+		else {
+			filenames.emplace_back(argv[i]);
+		}
 	}
-	if (!height) { //height is 0, not valid
-		cerr << "Invalid image height!" << endl;
+
+	/* Batch mode */
+	if (batch_mode && filenames.empty()) {
+		cerr << "Invalid arguments!" << endl;
+		print_usage();
 		return 1;
 	}
-	if (!(depth == 1 || depth == 2 || depth == 4 || depth == 8 || depth == 16)) {
-		cerr << "Invalid bit depth!" << endl;
+
+	/* Analysis mode */
+	else if (!batch_mode && mode == 0 && filenames.size() != 1) {
+		cerr << "Invalid arguments!" << endl;
+		print_usage();
 		return 1;
 	}
-	if (!(colour == 0 || colour == 2 || colour == 3 || colour == 4 || colour == 6)) {
-		cerr << "Invalid colour type!" << endl;
+
+	/* Insertion mode */
+	else if (!batch_mode && mode == 1 && filenames.size() != 3) {
+		cerr << "Invalid arguments!" << endl;
+		print_usage();
 		return 1;
 	}
-	if (compression) { //zero is the only valid option
-		cerr << "Invalid compression method!" << endl;
+
+	/* Extraction mode */
+	else if (!batch_mode && mode == 2 && filenames.size() != 1 && filenames.size() != 2) {
+		cerr << "Invalid arguments!" << endl;
+		print_usage();
 		return 1;
 	}
-	if (filter) { //zero is the only valid option
-		cerr << "Invalid filter method!" << endl;
+
+	/* Probe mode */
+	else if (!batch_mode && mode == 3 && filenames.size() != 1) {
+		cerr << "Invalid arguments!" << endl;
+		print_usage();
 		return 1;
 	}
-	if (interlace > 1) { //zero and one are the only valid options
-		cerr << "Invalid interlace method!" << endl;
+
+	/* Archive mode */
+	else if (mode == 4 && (batch_mode || filenames.size() < 3)) {
+		cerr << "Invalid arguments!" << endl;
+		print_usage();
 		return 1;
 	}
 
-	/* debug */
-	if (print_debug) {
-		cout << "\nImage data:" << endl;
-		cout << "Height: " << height << "px" << endl;
-		cout << "Width: " << width << "px" << endl;
-		cout << "Bit depth: " << (int) depth << " bits/channel" << endl;
-		cout << "Colour type: " << (int) colour << " [" << PNG_TYPES_COLOUR[colour] << "]" << endl;
-		cout << "Compression method: " << (int) compression << " [" << PNG_TYPES_COMPRESSION[compression] << "]" << endl;
-		cout << "Filter method: " << (int) filter << " [" << PNG_TYPES_FILTER[filter] << "]" << endl;
-		cout << "Interlace method: " << (int) interlace << " [" << PNG_TYPES_INTERLACE[interlace] << "]" << endl;
+	/* Update mode */
+	else if (mode == 5 && (batch_mode || filenames.size() < 2)) {
+		cerr << "Invalid arguments!" << endl;
+		print_usage();
+		return 1;
 	}
 
-	/* Analysis mode */
-	/* Since there is no writing to be done, terminate here */
-	if (mode == 0) {
-		if (print_debug) {
-			cout << endl;
-			cout << "Index chunk" << ((idx_pos) ? " DOES " : " DOES NOT ") << "exist!" << endl;
-			cout << "File chunks" << ((dat_pos) ? " DO " : " DO NOT ") << "exist!" << endl;
-			cout << "You WILL" << ((idx_pos && dat_pos) ? " NOT " : " ") << "be able to insert a file into this image!" << endl;
-		}
-		return 0;
+	/* Strip mode */
+	else if (mode == 6 && (batch_mode || filenames.size() != 1)) {
+		cerr << "Invalid arguments!" << endl;
+		print_usage();
+		return 1;
 	}
 
-	if (idx_pos && dat_pos) {
-		cerr << "Index and file data already exist in input file." << endl;
+	/* Verify mode */
+	else if (!batch_mode && mode == 7 && filenames.size() != 1) {
+		cerr << "Invalid arguments!" << endl;
+		print_usage();
 		return 1;
 	}
-	else if (dat_pos) {
-		cerr << "File data already exists in input file." << endl;
+
+	/* Shard mode */
+	else if (mode == 8 && (batch_mode || filenames.size() < 3 || filenames.size() % 2 == 0)) {
+		cerr << "Invalid arguments!" << endl;
+		print_usage();
 		return 1;
 	}
-	else if (idx_pos) {
-		cerr << "Index already exists in input file." << endl;
+
+	/* Gather mode */
+	else if (mode == 9 && (batch_mode || filenames.empty())) {
+		cerr << "Invalid arguments!" << endl;
+		print_usage();
 		return 1;
 	}
 
-	/* Process target file */
-	string file_filename = filenames[1];
+	/* Layouts only apply to a fresh output, updates always go at the end */
+	else if (payload_layout != PngPackWriter::LAYOUT_AFTER_IHDR && mode != 1 && mode != 4 && mode != 8) {
+		cerr << "Invalid arguments!" << endl;
+		print_usage();
+		return 1;
+	}
 
-	/*  This should never be triggered. 
-		No modern FS supports filenames this long.
-		This is here to enforce a sane limit to the length of filenames 
-		so that the index chunk doesn't overflow the 32 bit length value. */
-	if (file_filename.length() > 0xFF) {
-		cerr << "Somehow you've exceeed the maximum filename size. Congratulations." << endl;
-		cerr << "Unfortunately, this filename is too long to encode." << endl;
+	/* Content chunking only applies to a single file, and a delta keeps the old file's place */
+	else if ((payload_chunking != PngPackWriter::CHUNKING_FIXED && mode != 1 && mode != 5 && mode != 8)
+		|| (payload_delta && (mode != 1 || payload_chunking != PngPackWriter::CHUNKING_FIXED || payload_layout != PngPackWriter::LAYOUT_AFTER_IHDR))) {
+		cerr << "Invalid arguments!" << endl;
+		print_usage();
 		return 1;
 	}
 
-	if (print_debug) cout << "\nOpening target file \"" << file_filename << "\"" << endl;
+	/* Compression only applies to what is written */
+	else if (payload_codec != Codec::CODEC_NONE && mode != 1 && mode != 4 && mode != 5 && mode != 8) {
+		cerr << "Invalid arguments!" << endl;
+		print_usage();
+		return 1;
+	}
 
-	/* Extract file metadata */
-	struct stat file_B;
-	if (stat(file_filename.c_str(), &file_B)) {
-		cerr << "Could not read file details for \"" << file_filename << "\"" << endl;
+	/* Only insertion reads from stdin, and only insertion and extraction write to stdout */
+	else if (!batch_mode && count(filenames.begin(), filenames.end(), "-") && mode != 1 && !(mode == 2 && filenames[0] != "-")) {
+		cerr << "Invalid arguments!" << endl;
+		print_usage();
 		return 1;
 	}
 
-	/* Grab filesize, file creation and modification times */
-	uint64_t file_filesize = file_B.st_size;
+	/* A stream is read once, in order, so it can't be cut by content or compared */
+	else if (!batch_mode && mode == 1 && count(filenames.begin(), filenames.end(), "-")
+		&& (payload_chunking != PngPackWriter::CHUNKING_FIXED || payload_delta)) {
+		cerr << "Invalid arguments!" << endl;
+		print_usage();
+		return 1;
+	}
 
-	/* 	These may need to be a larger type, time_t is not consistant
-		across operating systems and appears to range from 32 to 64
-		bytes (less relevant, but it can also be int or float). */
-	uint32_t file_time_cr  = file_B.st_ctime;
-	uint32_t file_time_mod = file_B.st_mtime;
+	/* Parity is written along with fresh file chunks, which a delta doesn't get */
+	else if (parity_count && ((mode != 1 && mode != 4 && mode != 5 && mode != 8) || payload_delta)) {
+		cerr << "Invalid arguments!" << endl;
+		print_usage();
+		return 1;
+	}
 
-	if (print_debug) cout << "Filesize: " << file_filesize << " bytes" << endl;
+	/* Nor does a stream, as parity is worked out over file chunks that have already gone out */
+	else if (parity_count && !batch_mode && count(filenames.begin(), filenames.end(), "-")) {
+		cerr << "Parity isn't supported when streaming through stdin or stdout!" << endl;
+		return 1;
+	}
 
-	uint32_t required_chunks = ceil(file_filesize / (float) CHUNK_SIZE_DATA_MAX);
+	/* Only analysis looks at the image data */
+	else if (deep_verify && mode != 0) {
+		cerr << "Invalid arguments!" << endl;
+		print_usage();
+		return 1;
+	}
 
-	/* Test if file exceeds size limit for a single chunk */
-	if (file_filesize > CHUNK_SIZE_DATA_MAX && print_debug) {
-		cout << "File \"" << file_filename << "\" will span multiple chunks due to size." << endl;
-		cout << "Chunks required: " << required_chunks << endl;
+	/* Ranges and entries only apply to extraction */
+	else if ((range_set || !entry_name.empty()) && mode != 2) {
+		cerr << "Invalid arguments!" << endl;
+		print_usage();
+		return 1;
 	}
 
-	/* Open file stream to read data */
-	ifstream input_B(file_filename, ios::binary | ios::in);
-	if (!input_B.is_open()) {
-		cerr << "Could not read file \"" << file_filename << "\"" << endl;
+	/* Keys apply to whatever reads or writes file chunks. Content chunking's block hashes */
+	/* would give away what encryption hides, and a cipher needs a key to use */
+	else if ((!key_filename.empty() && (mode == 0 || mode == 3 || mode == 6 || payload_chunking != PngPackWriter::CHUNKING_FIXED || payload_delta))
+		|| (payload_cipher != Cipher::CIPHER_NONE && (key_filename.empty() || (mode != 1 && mode != 4 && mode != 5 && mode != 8)))) {
+		cerr << "Invalid arguments!" << endl;
+		print_usage();
 		return 1;
 	}
 
-	//For now, assume only one data chunk required
-	vector<uint8_t> file_data;
+	/* The passphrase is the whole key file, less one trailing newline */
+	if (!key_filename.empty()) {
+		ifstream key_file(key_filename, ios::binary);
+		passphrase.assign(istreambuf_iterator<char>(key_file), istreambuf_iterator<char>());
 
-	/* Hard 4 GB cap.
-		This can be extended without any real issue but keep in mind 
-		every additional bit will require at least 1 more bit of memory. */
-	if (file_filesize > 0xFFFFFFFF) {
-		cerr << "File too large to be loaded into memory!" << endl;
-		return 1;
+		if (!key_file.good() && !key_file.eof()) passphrase.clear();
+		if (!passphrase.empty() && passphrase.back() == '\n') passphrase.pop_back();
+		if (!passphrase.empty() && passphrase.back() == '\r') passphrase.pop_back();
+
+		if (passphrase.empty()) {
+			cerr << "Could not read a passphrase from key file \"" << key_filename << "\"" << endl;
+			return 1;
+		}
+
+		/* Writes encrypt whenever there is a key */
+		if (payload_cipher == Cipher::CIPHER_NONE && (mode == 1 || mode == 4 || mode == 5 || mode == 8)) payload_cipher = Cipher::preferred();
 	}
 
-	uint64_t data_remaining = file_filesize;
-	uint32_t chunks_created = 0;
+	/* Debug printouts from many jobs would only interleave with the results */
+	if (batch_mode) print_debug = false;
 
-	/* Read in as much as possible in the biggest chunk size */
-	while (data_remaining > CHUNK_SIZE_DATA_MAX) {
-		if (print_debug) cout << "Creating chunk " << chunks_created << "... ";
-		data_remaining -= CHUNK_SIZE_DATA_MAX; //decrease remaining data by chunk size
-		chunks_created++; //increment chunk count
+	/* Printouts go to stderr when stdout carries the output */
+	if (!batch_mode && filenames.back() == "-" && (mode == 1 || mode == 2)) cout.rdbuf(cerr.rdbuf());
 
-		file_data.resize(CHUNK_SIZE_DATA_MAX); //this is a complete chunk so max size
-		input_B.read(reinterpret_cast<char *>(file_data.data()), CHUNK_SIZE_DATA_MAX);    
+	if (!thread_count) thread_count = ThreadPool::default_size();
 
-		Chunk file(file_data.size(), as_type(CHUNK_TYPE_FILE), move(file_data), 0);
-		file.force_crc_update(); // looking for why this loop is slow? it's probably this
-		chunks.insert(chunks.begin() + chunks_created, file);
+	/* A kernel without io_uring gets the blocking threads instead */
+	if (io_backend == AsyncIo::BACKEND_COUNT || !AsyncIo::available(io_backend)) io_backend = AsyncIo::preferred();
 
-		file_data.clear();
+	/* Probing a single file without full verification has no CRC work to share out */
+	if (!batch_mode && mode == 3 && probe_verify < PROBE_VERIFY_ALL) thread_count = 1;
 
-		if (print_debug) cout << "done!" << endl;
-	}
+	/* Before the pool, so every thread sees it */
+	if (stats_report) Stats::enable(true);
+
+	ThreadPool pool(thread_count);
 
-	/* Dump whatever is left into a smaller chunk */
-	if (data_remaining) { //don't add an empty chunk though
-		if (print_debug) cout << "Creating chunk " << chunks_created << "... ";
-		chunks_created++;
+	if (print_debug) {
+		cout << "CRC engine: " << Crc32::engine_name(Crc32::active()) << endl;
+		cout << "Worker threads: " << pool.size() << endl;
+		cout << "I/O backend: " << AsyncIo::backend_name(io_backend) << endl;
+		if (!Crc32::self_test()) {
+			cerr << "CRC engine self-test failed!" << endl;
+			return 1;
+		}
+		cout << "CRC engine self-test passed!" << endl;
+		cout << "Digest engine: " << TreeHash::engine_name(TreeHash::active()) << endl;
+		if (!TreeHash::self_test()) {
+			cerr << "Digest engine self-test failed!" << endl;
+			return 1;
+		}
+		cout << "Digest engine self-test passed!" << endl;
+		cout << "Parity engine: " << ReedSolomon::engine_name(ReedSolomon::active()) << endl;
+		if (!ReedSolomon::self_test()) {
+			cerr << "Parity engine self-test failed!" << endl;
+			return 1;
+		}
+		cout << "Parity engine self-test passed!" << endl;
+		cout << "Cipher engines: " << Cipher::engine_name(Cipher::active(Cipher::CIPHER_AES_256_GCM)) << " (AES-GCM), ";
+		cout << Cipher::engine_name(Cipher::active(Cipher::CIPHER_CHACHA20_POLY1305)) << " (ChaCha20-Poly1305)" << endl;
+		if (!Cipher::self_test()) {
+			cerr << "Cipher engine self-test failed!" << endl;
+			return 1;
+		}
+		cout << "Cipher engine self-test passed!" << endl;
+		cout << "Unfilter engine: " << ImageData::engine_name(ImageData::active()) << endl;
+		if (!ImageData::self_test()) {
+			cerr << "Image data self-test failed!" << endl;
+			return 1;
+		}
+		cout << "Image data self-test passed!\n" << endl;
+	}
 
-		file_data.resize(data_remaining);
-		input_B.read(reinterpret_cast<char *>(file_data.data()), data_remaining);    
+	string error;
+	bool ok;
 
-		Chunk file(file_data.size(), as_type(CHUNK_TYPE_FILE), move(file_data), 0);
-		file.force_crc_update();
-		chunks.insert(chunks.begin() + chunks_created, file);
-		if (print_debug) cout << "done!" << endl;
+	/* Batch mode */
+	if (batch_mode) {
+		ok = run_batch(filenames, pool);
+		if (stats_report) print_stats(pool.size());
+		return ok ? 0 : 1;
 	}
 
-	input_B.close();
+	/* Probe mode */
+	/* Jumps from header to header, so no image data is read unless asked to verify it */
+	if (mode == 3) {
+		ProbeResult probe;
 
-	/* Create index chunk */
-	vector<uint8_t> idx_data;
+		if (!probe_png(filenames[0], probe_verify, pool, probe, error)) {
+			cerr << error << " in \"" << filenames[0] << "\"" << endl;
+			return 1;
+		}
+
+		print_probe(filenames[0], probe);
+		if (stats_report) print_stats(pool.size());
+		return 0;
+	}
 
-	/* Populate index chunk */
-	idx_data.resize(sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint64_t) + file_filename.length());
-	memcpy(idx_data.data(), &file_time_cr, sizeof(uint32_t));
-	memcpy(idx_data.data() + sizeof(uint32_t), &file_time_mod, sizeof(uint32_t));
-	memcpy(idx_data.data() + 2 * sizeof(uint32_t), &file_filesize, sizeof(uint64_t));
-	memcpy(idx_data.data() + 4 * sizeof(uint32_t), file_filename.c_str(), file_filename.length());
+	/* Insertion mode */
+	else if (mode == 1) {
+		InsertionResult result;
+		ok = insert_file(filenames[0], filenames[1], filenames[2], pool, pool.size(), result, error);
+	}
 
-	Chunk index(idx_data.size(), as_type(CHUNK_TYPE_INDEX), move(idx_data), 0);
-	index.force_crc_update();
+	/* Archive mode */
+	else if (mode == 4) {
+		InsertionResult result;
+		vector<string> targets(filenames.begin() + 2, filenames.end());
+		ok = archive_files(filenames[0], filenames[1], targets, pool, pool.size(), result, error);
+	}
 
-	ofstream output_C(filenames[2], ios::binary | ios::out);
+	/* Update mode */
+	else if (mode == 5) {
+		InsertionResult result;
+		vector<string> targets(filenames.begin() + 1, filenames.end());
+		ok = update_file(filenames[0], targets, pool, pool.size(), result, error);
+	}
 
-	if (!output_C.is_open()) {
-		cerr << "Could not open \"" << filenames[2] << "\" for writing!" << endl;
-		return 1;
+	/* Strip mode */
+	else if (mode == 6) {
+		ok = strip_file(filenames[0], pool, error);
 	}
 
-	/* Figure out where to insert chunks */
-	/* IHRD known to be leading chunk from above */
-	chunks.insert(chunks.begin() + 1, index);
+	/* Extraction mode */
+	else if (mode == 2) {
+		ExtractionResult result;
+		ok = extract_file(filenames[0], (filenames.size() == 2) ? filenames[1] : "", pool, pool.size(), result, error);
+		if (ok && result.repaired) cout << "Rebuilt " << result.repaired << " damaged file chunks from parity" << endl;
+	}
 
-	vector<uint8_t> tmp;
+	/* Verify mode */
+	else if (mode == 7) {
+		VerifyResult result;
+		ok = verify_file(filenames[0], pool, pool.size(), result, error);
+	}
 
-	if (print_debug) cout << "Writing file to disk..." << endl;
+	/* Shard mode */
+	else if (mode == 8) {
+		InsertionResult result;
+		vector<string> pairs(filenames.begin() + 1, filenames.end());
+		ok = shard_file(filenames[0], pairs, pool, pool.size(), result, error);
+	}
 
-	output_C.write(reinterpret_cast<const char *>(PNG_SIGNATURE), 8);
+	/* Gather mode */
+	else if (mode == 9) {
+		ExtractionResult result;
+		ok = gather_files(filenames, pool, pool.size(), result, error);
+		if (ok && result.repaired) cout << "Rebuilt " << result.repaired << " damaged file chunks from parity" << endl;
+	}
 
-	for (uint32_t i = 0; i < chunks.size(); i++) {
-		tmp = chunks[i].pack();
-		output_C.write(reinterpret_cast<char *>(tmp.data()), tmp.size());
+	/* Analysis mode */
+	else {
+		AnalysisResult result;
+		ok = analyze_file(filenames[0], pool, result, error);
 	}
 
-	output_C.close();
+	if (!ok) {
+		cerr << error << endl;
+		return 1;
+	}
 
-	if (print_debug) cout << "Insertion completed successfully!" << endl;
+	if (stats_report) print_stats(pool.size());
 
 	return 0;
 }
 
-/* TODO: 
-	-Single instance of CRC table
-	-Don't load large files, copy in chunks
-	-Consider type for 'chunks' - would a linked list be more appropriate?
-*/
-
 /*
 PROPOSED:
 
@@ -0,0 +1,58 @@
+#!/bin/sh
+# Round-trips a sparse 9 GiB file through insertion and extraction, with data just under 4 GiB, at 5 GiB
+# and past 8 GiB, checks --range across the 4 GiB boundary and that peak RSS stays under RSS_LIMIT MiB
+# Needs about 20 GB free under TMPDIR, as the PNG and the extracted file are written out in full
+# Usage: ./test_large.sh [png binary], or make test-large
+
+PNG=${1:-./png}
+RSS_LIMIT=${RSS_LIMIT:-256}
+
+case $PNG in
+	/*) ;;
+	*) PNG=$(pwd)/$PNG ;;
+esac
+
+DIR=$(mktemp -d "${TMPDIR:-/tmp}/png_large.XXXXXX") || exit 1
+trap 'rm -rf "$DIR"' EXIT INT TERM
+cd "$DIR" || exit 1
+
+fail() {
+	echo "FAIL: $1" >&2
+	exit 1
+}
+
+# Checks the "Peak RSS: X MiB" line --stats leaves in the given file
+check_rss() {
+	rss=$(sed -n 's/^Peak RSS: \([0-9.]*\) MiB$/\1/p' "$1")
+	[ -n "$rss" ] || fail "$2 printed no peak RSS"
+	awk -v rss="$rss" -v limit="$RSS_LIMIT" 'BEGIN { exit !(rss < limit) }' || fail "$2 peak RSS $rss MiB over $RSS_LIMIT MiB"
+	echo "$2: peak RSS $rss MiB"
+}
+
+# A 1x1 RGBA carrier
+printf '\211PNG\r\n\032\n\000\000\000\rIHDR\000\000\000\001\000\000\000\001\010\006\000\000\000\037\025\304\211' > carrier.png
+printf '\000\000\000\nIDAT\170\234\143\000\001\000\000\005\000\001\015\012\055\264' >> carrier.png
+printf '\000\000\000\000IEND\256\102\140\202' >> carrier.png
+
+# 1 MiB of data across the 4 GiB mark, at 5 GiB and 1 MiB past 8 GiB, with holes everywhere else
+truncate -s 9G big.bin || fail "could not create sparse file"
+for kib in 4193792 5242880 8389632; do
+	dd if=/dev/urandom of=big.bin bs=1024 count=1024 seek=$kib conv=notrunc 2> /dev/null || fail "could not write data at $kib KiB"
+done
+
+"$PNG" -i --stats carrier.png big.bin packed.png > /dev/null 2> insert.log || fail "insertion: $(cat insert.log)"
+check_rss insert.log insertion
+
+"$PNG" -e --stats packed.png extracted.bin > /dev/null 2> extract.log || fail "extraction: $(cat extract.log)"
+check_rss extract.log extraction
+cmp big.bin extracted.bin || fail "extracted file differs"
+echo "round trip: ok"
+rm -f extracted.bin
+
+# 512 KiB either side of the 4 GiB mark
+"$PNG" -e --range 4294443008:1048576 packed.png range.bin > /dev/null 2>&1 || fail "range extraction"
+dd if=big.bin of=expected.bin bs=1024 skip=4193792 count=1024 2> /dev/null
+cmp expected.bin range.bin || fail "range across 4 GiB differs"
+echo "range across 4 GiB: ok"
+
+echo "PASS"